@@ -1,7 +1,17 @@
 #ifndef ADC_H
 #define ADC_H
 
+#define AVERAGE_SAMPLES 10
+
+// the conversions in the order the sequence runs them
+#define ADC_EXTERNAL_TEMP 0
+#define ADC_INTERNAL_TEMP 1
+#define ADC_INTERNAL_VREF 2
+#define ADC_CONVERSIONS 3
+
 extern ADC_HandleTypeDef hadc;
-void adc_poll();
+void adc_start();
+void adc_done();
+void adc_warm_save();
 
 #endif
@@ -0,0 +1,19 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+// work for the main loop, set from interrupts, the main loop sleeps while there's none
+#define EVENT_TICK     (1 << 0) // every EVENT_TICK_MS, from SysTick
+#define EVENT_ADC_DONE (1 << 1) // a full adc sequence has been converted
+#define EVENT_CAPTURE  (1 << 2) // new input capture
+#define EVENT_FLASH    (1 << 3) // a flash record is waiting or being written
+#define EVENT_UART     (1 << 4) // the uart tx ring needs a restart
+#define EVENT_I2C_ACTION (1 << 6) // a page3 save or an address commit was written
+
+#define EVENT_TICK_MS 100
+
+void event_set(uint32_t event);
+uint32_t event_take();
+void event_dispatch();
+void event_wait();
+
+#endif
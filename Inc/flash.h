@@ -1,8 +1,76 @@
 #ifndef FLASH_H
 #define FLASH_H
 
-extern uint32_t tcxo_calibration[];
+/* RWFLASH holds an append-only log of records, the newest valid record of each type wins
+ * its two pages take turns: when a new record doesn't fit, the other page is erased, gets a page header
+ * with the next sequence and then the newest of every type, the old page is left alone until the next turn
+ * so a reset at any point leaves every record in one page or the other
+ *
+ * page: struct flash_page_header, then records
+ * record: struct flash_record_header, then length bytes of data padded to a half-word
+ */
+struct flash_page_header {
+  uint8_t type;     // FLASH_PAGE_TYPE
+  uint8_t sequence; // one more than the page it took over from, the newer page's records win
+  uint8_t version;  // FLASH_LOG_VERSION
+  uint8_t crc8;     // over the header bytes before it, written last
+};
 
-void write_flash_data();
+struct flash_record_header {
+  uint8_t type;    // FLASH_RECORD_FIRST + the record index, 0xff is the end of the log
+  uint8_t length;  // data bytes
+  uint8_t version; // FLASH_LOG_VERSION
+  uint8_t crc8;    // over the header bytes before it and the data, written last
+};
+
+#define FLASH_LOG_VERSION 1
+#define FLASH_RECORD_FIRST 0xa0
+#define FLASH_PAGE_TYPE 0x9f
+
+// record indexes
+#define FLASH_RECORD_CALIBRATION 0
+#define FLASH_RECORD_CONFIG 1
+#define FLASH_RECORD_STATS 2
+#define FLASH_RECORDS 3
+
+// same layout as page3 bytes 0-19, which is how the pre-log firmware stored it
+struct flash_calibration {
+  uint32_t tcxo_a;
+  uint32_t tcxo_b;
+  uint32_t tcxo_c;
+  uint32_t tcxo_d;
+  uint8_t max_calibration_temp;
+  int8_t min_calibration_temp;
+  uint8_t rmse_fit;
+  uint8_t reserved;
+};
+
+struct flash_config {
+  uint16_t source_HZ_ch1;
+  uint8_t uart_stream;
+  uint8_t extra_inputs;
+  uint8_t i2c_address; // 0 in records from before it was added, I2C_DEFAULT_ADDRESS
+  uint8_t reserved;
+};
+
+// the page stats fields, see I2C_PAGE_STATS_FIELDS
+struct flash_stats {
+  uint32_t uptime_s;
+  uint32_t missed_edges;
+  uint16_t internal_temp_min;
+  uint16_t internal_temp_max;
+  int16_t tempco_residual;
+  uint8_t reserved[2];
+};
+
+extern struct flash_calibration flash_calibration;
+extern struct flash_config flash_config;
+extern struct flash_stats flash_stats;
+
+void flash_start();
+uint8_t flash_loaded(uint8_t record);
+void flash_save_request();
+void flash_save_record(uint8_t record);
+uint8_t flash_poll();
 
 #endif
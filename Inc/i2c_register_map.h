@@ -0,0 +1,268 @@
+#ifndef I2C_REGISTER_MAP_H
+#define I2C_REGISTER_MAP_H
+
+/* The register map shared by the firmware (Inc/i2c_slave.h) and the clients (clients/i2c_registers.h)
+ *
+ * Each page is described once as a field list:
+ *   X(page struct, type, name, array dimension, byte offset, access)
+ * The list generates the page struct, compile-time checks that every field sits at its documented
+ * offset, and the per-byte write permissions, as a table (clients/i2c_sim.c) or the bitmasks the firmware's write
+ * dispatcher uses.
+ *
+ * access: RO - read only, RW - the byte is stored, ACTION - the firmware acts on the write but doesn't store it
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* v2 pages are 32 bytes, v3 pages can be up to I2C_REGISTER_PAGE_SIZE_MAX (max_page_size on the info page)
+ * v3 was meant to have a 64 byte captures page with a batch of 7. This firmware only does part of that: the larger
+ * page, its copy in current_page_data and the longer capture ring need 64 bytes more of RAM at least, and with the
+ * 0x2c0 stack the STM32F030F4's 4K has 24 bytes left. So every page is 32 bytes, with I2C_CAPTURE_BATCH captures.
+ * The captures page is laid out the same for any batch (see I2C_PAGE_CAPTURES_FIELDS) and the info page has its
+ * max_page_size and capture_batch, so the clients read a board built with a larger batch, `make captures-test`
+ * runs them against sim boards with a batch of 7. Every trailer has its page's length, so clients built for
+ * another size report the mismatch instead of misreading the page
+ */
+#define I2C_REGISTER_PAGE_SIZE 32
+#define I2C_REGISTER_PAGE_SIZE_MAX 32
+
+// writing to this offset selects the page, on every page
+#define I2C_REGISTER_OFFSET_PAGE 31
+
+#define I2C_REGISTER_PAGE1 0
+#define I2C_REGISTER_PAGE2 1
+#define I2C_REGISTER_PAGE3 2
+#define I2C_REGISTER_PAGE4 3
+#define I2C_REGISTER_PAGE_INFO 4     // v3+
+#define I2C_REGISTER_PAGE_CAPTURES 5 // v3+
+#define I2C_REGISTER_PAGE_LATCH 6    // v3+
+#define I2C_REGISTER_PAGE_STATS 7    // v3+
+#define I2C_REGISTER_PAGES 8
+
+// page1 layout version, stays at 2 so v2 clients keep working
+#define I2C_REGISTER_VERSION 2
+// protocol version, v3 clients find this on the info page
+#define I2C_PROTOCOL_VERSION 3
+
+// the TIM3 inputs, page1 and the latch page have a field per channel
+#define I2C_INPUT_CHANNELS 3
+// every input, i2c_capture.channel and the uart stream count the TIM3 ones first
+#define I2C_CAPTURE_CHANNELS 4
+#define I2C_CHANNEL_TIM14 3
+#define I2C_CAPTURE_BATCH 3
+
+/* 7 bit slave address, changed with the info page's new_i2c_address and i2c_address_commit
+ * 0x04 is in the range the i2c spec reserves for high speed master codes, but it's what every board shipped with
+ */
+#define I2C_DEFAULT_ADDRESS 0x04
+#define I2C_ADDRESS_MIN 0x04
+#define I2C_ADDRESS_MAX 0x77
+
+// general call (address 0) second byte: every board latches its counters at the general call address match
+// 0x04 and 0x06 are reserved by the i2c spec
+#define I2C_GENERAL_CALL_LATCH 0x4c
+
+// i2c_registers_info.reset_flags
+#define I2C_RESET_OPTION_BYTES (1 << 1)
+#define I2C_RESET_PIN (1 << 2)
+#define I2C_RESET_POWER (1 << 3)    // power on or brownout
+#define I2C_RESET_SOFTWARE (1 << 4)
+#define I2C_RESET_IWDG (1 << 5)
+#define I2C_RESET_WWDG (1 << 6)
+#define I2C_RESET_LOW_POWER (1 << 7)
+
+// i2c_registers_info.boot_state, whether the counters carried over from before the reset
+#define I2C_BOOT_COLD 0        // power on, counters start from zero or the stats checkpoint
+#define I2C_BOOT_WARM 1        // counters, page sequence and adc averages continue from before the reset
+#define I2C_BOOT_STATE_LOST 2  // reset without power loss, but the saved state failed its check or was in a reset loop
+
+// i2c_registers_info.extra_inputs, capture inputs beyond the TIM3 ones, off by default
+#define I2C_EXTRA_INPUT_TIM14 (1 << 0) // PA4, TIM14 channel 1
+
+// i2c_registers_info.i2c_address_status, the result of the last i2c_address_commit
+#define I2C_ADDRESS_STATUS_NONE 0
+#define I2C_ADDRESS_STATUS_OK 1         // saved to flash, the board answers on the new address
+#define I2C_ADDRESS_STATUS_BAD_KEY 2    // the commit byte wasn't ~new_i2c_address
+#define I2C_ADDRESS_STATUS_INVALID 3    // new_i2c_address is outside I2C_ADDRESS_MIN-I2C_ADDRESS_MAX
+#define I2C_ADDRESS_STATUS_BUSY 4       // the config record is being written, the board is still on the old address
+#define I2C_ADDRESS_STATUS_SAVE_FAIL 5  // the flash write failed, the board stays on the old address
+
+#define SAVE_STATUS_NONE 0
+#define SAVE_STATUS_OK 1
+#define SAVE_STATUS_ERASE_FAIL 2
+#define SAVE_STATUS_WRITE_FAIL 3
+#define SAVE_STATUS_BUSY 4       // the save runs in the background, re-select page3 to see the result
+
+#define I2C_ACCESS_RO 0
+#define I2C_ACCESS_RW 1
+#define I2C_ACCESS_ACTION 2
+
+#define I2C_PAGE1_FIELDS(X, page) \
+  X(page, uint32_t, milliseconds_now,     ,                     0,  RO) \
+  X(page, uint32_t, milliseconds_irq_ch1, ,                     4,  RO) \
+  X(page, uint16_t, tim3_at_irq,          [I2C_INPUT_CHANNELS], 8,  RO) \
+  X(page, uint16_t, tim1_at_irq,          [I2C_INPUT_CHANNELS], 14, RO) \
+  X(page, uint16_t, tim3_at_cap,          [I2C_INPUT_CHANNELS], 20, RO) \
+  X(page, uint16_t, source_HZ_ch1,        ,                     26, RW) \
+  X(page, uint8_t,  ch2_count,            ,                     28, RO) \
+  X(page, uint8_t,  ch4_count,            ,                     29, RO) \
+  X(page, uint8_t,  version,              ,                     30, RO) \
+  X(page, uint8_t,  page_offset,          ,                     31, RO)
+
+#define I2C_PAGE2_FIELDS(X, page) \
+  X(page, uint32_t, last_adc_ms,   ,     0,  RO) \
+  X(page, uint16_t, internal_temp, ,     4,  RO) \
+  X(page, uint16_t, internal_vref, ,     6,  RO) \
+  X(page, uint16_t, external_temp, ,     8,  RO) \
+  X(page, uint16_t, ts_cal1,       ,     10, RO) /* internal_temp value at 30C+/-5C @3.3V+/-10mV */ \
+  X(page, uint16_t, ts_cal2,       ,     12, RO) /* internal_temp value at 110C+/-5C @3.3V+/-10mV */ \
+  X(page, uint16_t, vrefint_cal,   ,     14, RO) /* internal_vref value at 30C+/-5C @3.3V+/-10mV */ \
+  X(page, uint8_t,  reserved,      [15], 16, RO) \
+  X(page, uint8_t,  page_offset,   ,     31, RO)
+
+/* tcxo_X variables are floats stored as:
+ * byte 1: negative sign (1 bit), exponent bits 7-1
+ * byte 2: exponent bit 0, mantissa bits 23-17
+ * byte 3: mantissa bits 16-8
+ * byte 4: mantissa bits 7-0
+ * they describe the expected frequency error in ppm:
+ * ppm = tcxo_a + tcxo_b * (F - tcxo_c) + tcxo_d * pow(F - tcxo_c, 2)
+ * where F is the temperature from the internal_temp sensor in Fahrenheit
+ */
+#define I2C_PAGE3_FIELDS(X, page) \
+  X(page, uint32_t, tcxo_a,               ,     0,  RW) \
+  X(page, uint32_t, tcxo_b,               ,     4,  RW) \
+  X(page, uint32_t, tcxo_c,               ,     8,  RW) \
+  X(page, uint32_t, tcxo_d,               ,     12, RW) \
+  X(page, uint8_t,  max_calibration_temp, ,     16, RW) /* F */ \
+  X(page, int8_t,   min_calibration_temp, ,     17, RW) /* F */ \
+  X(page, uint8_t,  rmse_fit,             ,     18, RW) /* ppb */ \
+  X(page, uint8_t,  save,                 ,     19, ACTION) /* 1=save new values to flash */ \
+  X(page, uint8_t,  save_status,          ,     20, RO) /* see SAVE_STATUS_X */ \
+  X(page, uint8_t,  reserved,             [10], 21, RO) \
+  X(page, uint8_t,  page_offset,          ,     31, RO)
+
+#define I2C_PAGE4_FIELDS(X, page) \
+  X(page, uint16_t, tim3,        ,     0,  RO) \
+  X(page, uint16_t, tim1,        ,     2,  RO) \
+  X(page, uint8_t,  reserved,    [27], 4,  RO) \
+  X(page, uint8_t,  page_offset, ,     31, RO)
+
+// a v2 firmware answers page selects it doesn't know with page1, so page_offset tells the two apart
+#define I2C_PAGE_INFO_FIELDS(X, page) \
+  X(page, uint8_t,  protocol_version,   ,     0,  RO) /* I2C_PROTOCOL_VERSION */ \
+  X(page, uint8_t,  max_page_size,      ,     1,  RO) /* I2C_REGISTER_PAGE_SIZE_MAX */ \
+  X(page, uint8_t,  trailer_size,       ,     2,  RO) /* sizeof(struct i2c_page_trailer) */ \
+  X(page, uint8_t,  capture_batch,      ,     3,  RO) /* I2C_CAPTURE_BATCH */ \
+  X(page, uint8_t,  uart_stream,        ,     4,  RW) /* UART_STREAM_X, see uart_stream_format.h */ \
+  X(page, uint8_t,  reset_flags,        ,     5,  RO) /* RCC_CSR bits 31-24 at boot, I2C_RESET_X */ \
+  X(page, uint8_t,  boot_state,         ,     6,  RO) /* I2C_BOOT_X */ \
+  X(page, uint8_t,  warm_restarts,      ,     7,  RO) /* I2C_BOOT_WARM boots since the last cold boot, stops at 255 */ \
+  X(page, uint32_t, boot_us,            ,     8,  RO) /* from HAL_Init to the capture timers running */ \
+  X(page, uint8_t,  extra_inputs,       ,     12, RW) /* I2C_EXTRA_INPUT_X, saved with page3's save */ \
+  X(page, uint8_t,  capture_channels,   ,     13, RO) /* I2C_CAPTURE_CHANNELS */ \
+  X(page, uint8_t,  i2c_address,        ,     14, RO) /* 7 bit address the board answers on */ \
+  X(page, uint8_t,  new_i2c_address,    ,     15, RW) /* staged, only used by i2c_address_commit */ \
+  X(page, uint8_t,  i2c_address_commit, ,     16, ACTION) /* write ~new_i2c_address to switch to it and save it */ \
+  X(page, uint8_t,  i2c_address_status, ,     17, RO) /* I2C_ADDRESS_STATUS_X */ \
+  X(page, uint8_t,  reserved,           [13], 18, RO) \
+  X(page, uint8_t,  page_offset,        ,     31, RO)
+
+struct i2c_capture {
+  uint16_t tim3_at_cap;
+  uint16_t tim1_at_irq;
+  uint16_t tim3_at_irq;
+  uint8_t channel;      // 0-based input channel, below I2C_CAPTURE_CHANNELS
+  uint8_t reserved;
+};
+
+/* captures is a ring buffer, the newest entry is at (capture_count-1) % I2C_CAPTURE_BATCH
+ * with another batch capture_count follows the ring and page_offset is the page's last byte, the page being
+ * I2C_CAPTURE_BATCH*8+8 bytes long
+ */
+#define I2C_PAGE_CAPTURES_FIELDS(X, page) \
+  X(page, struct i2c_capture, captures,      [I2C_CAPTURE_BATCH], 0,  RO) \
+  X(page, uint32_t,           capture_count, ,                    24, RO) \
+  X(page, uint8_t,            reserved,      [3],                 28, RO) \
+  X(page, uint8_t,            page_offset,   ,                    31, RO)
+
+// counters and the last captures, all taken at the address match of the last I2C_GENERAL_CALL_LATCH
+#define I2C_PAGE_LATCH_FIELDS(X, page) \
+  X(page, uint16_t, tim3,        ,                     0,  RO) \
+  X(page, uint16_t, tim1,        ,                     2,  RO) \
+  X(page, uint16_t, tim3_at_irq, [I2C_INPUT_CHANNELS], 4,  RO) \
+  X(page, uint16_t, tim1_at_irq, [I2C_INPUT_CHANNELS], 10, RO) \
+  X(page, uint16_t, tim3_at_cap, [I2C_INPUT_CHANNELS], 16, RO) \
+  X(page, uint16_t, latch_count, ,                     22, RO) /* incremented every latch */ \
+  X(page, uint8_t,  ch2_count,   ,                     24, RO) \
+  X(page, uint8_t,  ch4_count,   ,                     25, RO) \
+  X(page, uint8_t,  reserved,    [5],                  26, RO) \
+  X(page, uint8_t,  page_offset, ,                     31, RO)
+
+/* long-term statistics, checkpointed to flash every few hours and restored at boot
+ * everything but tempco_residual covers all boots up to the last checkpoint plus the current boot
+ */
+#define I2C_PAGE_STATS_FIELDS(X, page) \
+  X(page, uint32_t, uptime_s,            ,     0,  RO) \
+  X(page, uint32_t, missed_edges,        ,     4,  RO) /* input capture overflows, all channels */ \
+  X(page, uint16_t, internal_temp_min,   ,     8,  RO) /* raw, same units as page2 internal_temp */ \
+  X(page, uint16_t, internal_temp_max,   ,     10, RO) \
+  X(page, int16_t,  tempco_residual,     ,     12, RW) /* ppb, written by the host's tempco model */ \
+  X(page, uint8_t,  reserved1,           [2],  14, RO) \
+  X(page, uint32_t, checkpoint_uptime_s, ,     16, RO) /* uptime_s in the newest flash checkpoint */ \
+  X(page, uint8_t,  reserved,            [11], 20, RO) \
+  X(page, uint8_t,  page_offset,         ,     31, RO)
+
+// X(page number, page struct, field list, page size)
+#define I2C_PAGES(X) \
+  X(I2C_REGISTER_PAGE1,         i2c_registers_type,          I2C_PAGE1_FIELDS,         I2C_REGISTER_PAGE_SIZE) \
+  X(I2C_REGISTER_PAGE2,         i2c_registers_type_page2,    I2C_PAGE2_FIELDS,         I2C_REGISTER_PAGE_SIZE) \
+  X(I2C_REGISTER_PAGE3,         i2c_registers_type_page3,    I2C_PAGE3_FIELDS,         I2C_REGISTER_PAGE_SIZE) \
+  X(I2C_REGISTER_PAGE4,         i2c_registers_type_page4,    I2C_PAGE4_FIELDS,         I2C_REGISTER_PAGE_SIZE) \
+  X(I2C_REGISTER_PAGE_INFO,     i2c_registers_type_info,     I2C_PAGE_INFO_FIELDS,     I2C_REGISTER_PAGE_SIZE) \
+  X(I2C_REGISTER_PAGE_CAPTURES, i2c_registers_type_captures, I2C_PAGE_CAPTURES_FIELDS, I2C_REGISTER_PAGE_SIZE_MAX) \
+  X(I2C_REGISTER_PAGE_LATCH,    i2c_registers_type_latch,    I2C_PAGE_LATCH_FIELDS,    I2C_REGISTER_PAGE_SIZE) \
+  X(I2C_REGISTER_PAGE_STATS,    i2c_registers_type_stats,    I2C_PAGE_STATS_FIELDS,    I2C_REGISTER_PAGE_SIZE)
+
+#define I2C_FIELD_DECLARE(page, type, name, dim, offset, access) type name dim;
+#define I2C_FIELD_CHECK(page, type, name, dim, offset, access) \
+  _Static_assert(offsetof(struct page, name) == (offset), #page "." #name " is not at offset " #offset);
+#define I2C_FIELD_ACCESS(page, type, name, dim, offset, access) \
+  [(offset) ... (offset) + sizeof(type dim) - 1] = I2C_ACCESS_##access,
+#define I2C_FIELD_MASK(wanted, type, name, dim, offset, access) \
+  | (I2C_ACCESS_##access == I2C_ACCESS_##wanted ? ((1ULL << sizeof(type dim)) - 1) << (offset) : 0)
+
+#define I2C_PAGE_DECLARE(number, page, fields, size) \
+  struct page { fields(I2C_FIELD_DECLARE, page) };
+#define I2C_PAGE_CHECK(number, page, fields, size) \
+  _Static_assert(sizeof(struct page) == (size), #page " is not " #size " bytes"); \
+  _Static_assert((size) <= I2C_REGISTER_PAGE_SIZE_MAX, #page " is too large"); \
+  fields(I2C_FIELD_CHECK, page)
+
+// per-byte access table for a page: I2C_PAGE_ACCESS_TABLE(page3_access, I2C_PAGE3_FIELDS, I2C_REGISTER_PAGE_SIZE)
+#define I2C_PAGE_ACCESS_TABLE(table, fields, size) \
+  const uint8_t table[size] = { fields(I2C_FIELD_ACCESS, unused) }
+// the bytes of a page up to 32 bytes with one access, bit n for byte n: I2C_PAGE_ACCESS_MASK(I2C_PAGE3_FIELDS, RW)
+#define I2C_PAGE_ACCESS_MASK(fields, access) \
+  ((uint32_t)(0 fields(I2C_FIELD_MASK, access)))
+
+I2C_PAGES(I2C_PAGE_DECLARE)
+I2C_PAGES(I2C_PAGE_CHECK)
+
+_Static_assert(sizeof(struct i2c_capture) == 8, "i2c_capture is not 8 bytes");
+
+/* v3: every page read is followed by this trailer, v2 clients stop reading before it
+ * crc8 is the SMBus PEC over the page data and the trailer bytes before it
+ */
+struct i2c_page_trailer {
+  uint32_t sequence;    // incremented every time a page is latched
+  uint8_t page;
+  uint8_t length;       // page bytes before the trailer
+  uint8_t version;      // I2C_PROTOCOL_VERSION
+  uint8_t crc8;
+};
+
+_Static_assert(sizeof(struct i2c_page_trailer) == 8, "i2c_page_trailer is not 8 bytes");
+
+#endif
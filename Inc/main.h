@@ -41,7 +41,14 @@
 
 /* Private define ------------------------------------------------------------*/
 
+#define DATA_READY_Pin GPIO_PIN_5
+#define DATA_READY_GPIO_Port GPIOA
+
 /* USER CODE BEGIN Private defines */
+// code that has to keep running while flash is being erased or programmed
+#define RAMFUNC __attribute__((section(".RamFunc")))
+// and the read only tables that code reads, copied to ram with it
+#define RAMDATA __attribute__((section(".RamData")))
 
 /* USER CODE END Private defines */
 
@@ -0,0 +1,8 @@
+#ifndef STATS_H
+#define STATS_H
+
+void stats_start();
+void stats_poll();
+void stats_warm_save();
+
+#endif
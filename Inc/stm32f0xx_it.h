@@ -51,10 +51,13 @@ void SVC_Handler(void);
 void PendSV_Handler(void);
 void SysTick_Handler(void);
 void ADC1_IRQHandler(void);
+void DMA1_Channel2_3_IRQHandler(void);
 void TIM1_BRK_UP_TRG_COM_IRQHandler(void);
 void TIM3_IRQHandler(void);
 void I2C1_IRQHandler(void);
 void USART1_IRQHandler(void);
+// not in the .ioc, see MX_TIM14_Init
+void TIM14_IRQHandler(void);
 
 #ifdef __cplusplus
 }
@@ -4,10 +4,20 @@
 //extern RTC_HandleTypeDef hrtc;
 extern TIM_HandleTypeDef htim1;
 extern TIM_HandleTypeDef htim3;
+extern TIM_HandleTypeDef htim14;
 
 #define DEFAULT_SOURCE_HZ 50
 
 void print_timer_status();
 void timer_start();
+void timer_warm_save();
+void timer_irq();
+void timer_tim1_irq();
+void timer_tim14_irq();
+void timer_poll();
+uint32_t timer_ms(uint16_t tim1, uint16_t tim3);
+uint32_t timer_now_ms();
+
+extern volatile uint32_t timer_missed_edges;
 
 #endif
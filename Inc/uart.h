@@ -4,6 +4,16 @@
 extern UART_HandleTypeDef huart1;
 #define UART_NAME huart1
 
+/* tx ring, writes that don't fit are dropped and counted in uart_tx_dropped
+ * sized for the most one main loop pass can queue: print_timer_status's 59 byte line, a batch of
+ * I2C_CAPTURE_BATCH (3) capture frames and an adc frame of UART_STREAM_FRAME_MAX (19) bytes each,
+ * 59 + 4 * 19 = 135, and the ring keeps one byte free
+ */
+#define UART_TX_BUFFER_SIZE 136
+extern volatile uint32_t uart_tx_dropped;
+
+uint8_t write_uart_buffer(const uint8_t *data, uint16_t length);
+void uart_tx_poll();
 void write_uart_s(const char *s);
 void write_uart_u(uint32_t i);
 void write_uart_i(int32_t i);
@@ -0,0 +1,9 @@
+#ifndef UART_STREAM_H
+#define UART_STREAM_H
+
+#include "uart_stream_format.h"
+
+void uart_stream_poll();
+void uart_stream_adc();
+
+#endif
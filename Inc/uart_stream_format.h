@@ -0,0 +1,62 @@
+#ifndef UART_STREAM_FORMAT_H
+#define UART_STREAM_FORMAT_H
+
+/* binary capture stream, shared by the firmware (Src/uart_stream.c) and clients/uart-stream.c
+ *
+ * every message is one of the structs below followed by a crc8 (SMBus PEC) of the message bytes,
+ * COBS encoded and ended with a 0x00 byte
+ * header.sequence counts every message the firmware tried to send, a gap means messages were lost
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* the uart's one rate, for the stream and the debug prints (print_timer_status) alike
+ * "make UART_BAUD=115200" builds firmware for a plain serial console, clients/uart-stream -b follows it
+ */
+#ifndef UART_STREAM_BAUD
+#define UART_STREAM_BAUD 1000000
+#endif
+
+// i2c_registers_info.uart_stream
+#define UART_STREAM_OFF 0
+#define UART_STREAM_ON 1
+
+#define UART_STREAM_CAPTURE 1
+#define UART_STREAM_ADC 2
+
+struct uart_stream_header {
+  uint8_t type;     // UART_STREAM_X
+  uint8_t sequence;
+};
+
+struct uart_stream_capture {
+  struct uart_stream_header header;
+  uint8_t channel;        // 0-based input channel
+  uint8_t reserved;
+  uint32_t capture_count; // i2c_registers_captures.capture_count after this capture, a gap means captures were overwritten
+  uint16_t tim3_at_cap;
+  uint16_t tim1_at_irq;
+  uint16_t tim3_at_irq;
+  uint16_t reserved2;
+};
+
+// same values as page2
+struct uart_stream_adc {
+  struct uart_stream_header header;
+  uint8_t reserved[2];
+  uint32_t last_adc_ms;
+  uint16_t internal_temp;
+  uint16_t internal_vref;
+  uint16_t external_temp;
+  uint16_t tx_dropped;    // frames the firmware's tx ring had no room for, low 16 bits
+};
+
+_Static_assert(sizeof(struct uart_stream_capture) == 16, "uart_stream_capture is not 16 bytes");
+_Static_assert(sizeof(struct uart_stream_adc) == 16, "uart_stream_adc is not 16 bytes");
+
+#define UART_STREAM_MESSAGE_MAX 16
+// message, crc8, one COBS overhead byte (messages are under 254 bytes), 0x00
+#define UART_STREAM_FRAME_MAX (UART_STREAM_MESSAGE_MAX + 3)
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef WARM_H
+#define WARM_H
+
+#include "adc.h"
+
+/* counters and filter state kept in .noinit ram across a reset without power loss (watchdog, software, pin)
+ * warm_save takes a snapshot every EVENT_TICK, so the counters resume up to EVENT_TICK_MS behind
+ * (longer if the main loop hung until the watchdog): capture_count and the ch2/ch4 counts can go back after a
+ * warm restart, the page sequence skips WARM_SEQUENCE_GAP forward instead so it never repeats one the host saw
+ * each module saves its part with X_warm_save and restores it in its start function when warm_restored()
+ */
+struct warm_state {
+  uint32_t magic;             // WARM_MAGIC
+  // timer.c
+  uint32_t capture_count;
+  uint8_t ch2_count;
+  uint8_t ch4_count;
+  // i2c_slave.c
+  uint16_t source_HZ_ch1;
+  uint32_t page_sequence;
+  uint16_t latch_count;
+  // adc.c
+  int8_t adc_index;
+  uint8_t restarts;           // warm restarts since the last cold boot, stops at 255
+  uint16_t samples[ADC_CONVERSIONS][AVERAGE_SAMPLES];
+  // stats.c
+  uint32_t uptime_s;
+  uint32_t missed_edges;
+  uint16_t internal_temp_min;
+  uint16_t internal_temp_max;
+  int16_t tempco_residual;
+  uint8_t unsaved_boots;      // warm boots since the last warm_save
+  uint8_t crc8;               // over everything before it
+};
+
+extern struct warm_state warm_state;
+
+void warm_start(uint8_t reset_flags);
+uint8_t warm_boot_state();
+uint8_t warm_restored();
+void warm_save();
+
+#endif
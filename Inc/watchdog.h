@@ -0,0 +1,7 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+void watchdog_start();
+void watchdog_feed();
+
+#endif
@@ -1,14 +1,14 @@
 #include "stm32f0xx_hal.h"
 #include <stdint.h>
+#include <string.h>
 #include "adc.h"
 #include "i2c_slave.h"
+#include "timer.h"
 #include "uart.h"
+#include "events.h"
+#include "warm.h"
 
-#define AVERAGE_SAMPLES 10
-
-static uint16_t external_temps[AVERAGE_SAMPLES];
-static uint16_t internal_temps[AVERAGE_SAMPLES];
-static uint16_t internal_vrefs[AVERAGE_SAMPLES];
+static uint16_t samples[ADC_CONVERSIONS][AVERAGE_SAMPLES];
 static int8_t adc_index = -1;
 
 static uint16_t avg(uint16_t *values, uint8_t index) {
@@ -19,33 +19,60 @@ static uint16_t avg(uint16_t *values, uint8_t index) {
   return sum / (index+1);
 }
 
-void adc_poll() {
+static uint8_t conversion;
+static uint8_t calibrated = 0;
+
+// starts the external temp, internal temp, internal vref sequence, adc_done runs after EVENT_ADC_DONE
+void adc_start() {
+  // calibration waits for the first reading so it doesn't hold up boot
+  if(!calibrated) {
+    HAL_ADCEx_Calibration_Start(&hadc);
+    calibrated = 1;
+
+    // after a warm restart the averages carry on instead of starting over from one reading
+    if(warm_restored()) {
+      memcpy(samples, warm_state.samples, sizeof(samples));
+      adc_index = warm_state.adc_index;
+    }
+  }
+
   if(adc_index < (AVERAGE_SAMPLES-1)) {
     adc_index++;
   } else {
-    for(uint8_t i = 0; i < (AVERAGE_SAMPLES-1); i++) {
-      external_temps[i] = external_temps[i+1];
-      internal_temps[i] = internal_temps[i+1];
-      internal_vrefs[i] = internal_vrefs[i+1];
+    for(uint8_t i = 0; i < ADC_CONVERSIONS; i++) {
+      memmove(samples[i], samples[i] + 1, (AVERAGE_SAMPLES-1) * sizeof(samples[i][0]));
     }
   }
 
-  HAL_ADC_Start(&hadc);
-  if(HAL_ADC_PollForConversion(&hadc, 10) == HAL_OK) {
-    external_temps[adc_index] = HAL_ADC_GetValue(&hadc);
-  }
-  if(HAL_ADC_PollForConversion(&hadc, 10) == HAL_OK) {
-    internal_temps[adc_index] = HAL_ADC_GetValue(&hadc);
+  conversion = 0;
+  HAL_ADC_Start_IT(&hadc);
+}
+
+void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef *hadc) {
+  uint16_t value = HAL_ADC_GetValue(hadc);
+
+  if(conversion < ADC_CONVERSIONS) {
+    samples[conversion][adc_index] = value;
   }
-  if(HAL_ADC_PollForConversion(&hadc, 10) == HAL_OK) {
-    internal_vrefs[adc_index] = HAL_ADC_GetValue(&hadc);
+  if(conversion == ADC_INTERNAL_VREF) {
+    event_set(EVENT_ADC_DONE);
   }
+  conversion++;
+}
+
+void adc_done() {
   HAL_ADC_Stop(&hadc);
 
   if(!i2c_read_active()) {
-    i2c_registers_page2.external_temp = avg(external_temps, adc_index);
-    i2c_registers_page2.internal_temp = avg(internal_temps, adc_index);
-    i2c_registers_page2.internal_vref = avg(internal_vrefs, adc_index);
-    i2c_registers_page2.last_adc_ms = HAL_GetTick();
+    i2c_registers_page2.external_temp = avg(samples[ADC_EXTERNAL_TEMP], adc_index);
+    i2c_registers_page2.internal_temp = avg(samples[ADC_INTERNAL_TEMP], adc_index);
+    i2c_registers_page2.internal_vref = avg(samples[ADC_INTERNAL_VREF], adc_index);
+    i2c_registers_page2.last_adc_ms = timer_now_ms();
   }
 }
+
+// warm_save runs before adc_start, so every entry up to adc_index is a finished reading
+void adc_warm_save() {
+  memcpy(warm_state.samples, samples, sizeof(samples));
+  warm_state.adc_index = adc_index;
+}
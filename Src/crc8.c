@@ -0,0 +1,19 @@
+#include <stdint.h>
+
+#include "main.h"
+#include "crc8.h"
+
+// nibble table instead of a 256 byte table to save flash, in ram for the i2c irq's page fills
+static RAMDATA const uint8_t crc8_table[16] = {
+  0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15,
+  0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d
+};
+
+RAMFUNC uint8_t crc8(uint8_t crc, const uint8_t *data, uint8_t len) {
+  for(uint8_t i = 0; i < len; i++) {
+    crc ^= data[i];
+    crc = (crc << 4) ^ crc8_table[crc >> 4];
+    crc = (crc << 4) ^ crc8_table[crc >> 4];
+  }
+  return crc;
+}
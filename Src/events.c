@@ -0,0 +1,75 @@
+#include "stm32f0xx_hal.h"
+#include "main.h"
+
+#include "events.h"
+#include "adc.h"
+#include "stats.h"
+#include "timer.h"
+#include "flash.h"
+#include "uart.h"
+#include "uart_stream.h"
+#include "warm.h"
+#include "i2c_slave.h"
+
+static volatile uint32_t events = 0;
+
+// safe from any interrupt priority, in ram since the capture interrupt uses it during flash saves
+RAMFUNC void event_set(uint32_t event) {
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_irq();
+  events |= event;
+  __set_PRIMASK(primask);
+}
+
+// returns and clears the pending events
+uint32_t event_take() {
+  uint32_t pending;
+
+  __disable_irq();
+  pending = events;
+  events = 0;
+  __enable_irq();
+
+  return pending;
+}
+
+// run the work for the pending events, called from the main loop
+void event_dispatch() {
+  uint32_t pending = event_take();
+
+  if(pending & EVENT_CAPTURE) {
+    uart_stream_poll();
+  }
+  if(pending & EVENT_TICK) {
+    warm_save();
+    timer_poll();
+    adc_start();
+    stats_poll();
+  }
+  if(pending & EVENT_ADC_DONE) {
+    adc_done();
+    uart_stream_adc();
+  }
+  if(pending & EVENT_UART) {
+    uart_tx_poll();
+  }
+  if(pending & EVENT_I2C_ACTION) {
+    i2c_slave_poll();
+  }
+  // one flash step per pass, so the other events get a turn during a save
+  if((pending & EVENT_FLASH) && flash_poll()) {
+    event_set(EVENT_FLASH);
+  }
+}
+
+/* sleep until an interrupt, unless an event is already pending
+ * an interrupt between the check and the WFI still wakes it up, because it stays pending while irqs are off
+ */
+void event_wait() {
+  __disable_irq();
+  if(!events) {
+    __WFI();
+  }
+  __enable_irq();
+}
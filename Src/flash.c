@@ -1,40 +1,393 @@
 #include "stm32f0xx_hal.h"
+#include "main.h"
+
+#include <string.h>
 
 #include "flash.h"
 #include "i2c_slave.h"
+#include "crc8.h"
+#include "events.h"
+
+// from the linker script, the two rwflash pages take turns holding the record log
+extern const uint8_t start_rwflash[];
+#define LOG_PAGES 2
+#define LOG_SIZE 1024 // the F030's erase page, the linker script checks RWFLASH is LOG_PAGES of them
+#define LOG_PAGE(page) (start_rwflash + (page) * LOG_SIZE)
+// the last 1K of flash, where the single page log and the calibration-only firmware before it lived
+#define LEGACY_PAGE (LOG_PAGES - 1)
+
+struct flash_calibration flash_calibration;
+struct flash_config flash_config;
+struct flash_stats flash_stats;
+
+struct flash_record {
+  void *data;
+  uint8_t length;
+};
+
+static const struct flash_record records[FLASH_RECORDS] = {
+  [FLASH_RECORD_CALIBRATION] = {&flash_calibration, sizeof(flash_calibration)},
+  [FLASH_RECORD_CONFIG] = {&flash_config, sizeof(flash_config)},
+  [FLASH_RECORD_STATS] = {&flash_stats, sizeof(flash_stats)},
+};
+
+_Static_assert(sizeof(struct flash_calibration) == 20, "flash_calibration is not 20 bytes");
+_Static_assert(sizeof(struct flash_config) % 2 == 0, "flash_config is not half-word sized");
+_Static_assert(sizeof(struct flash_stats) <= sizeof(struct flash_calibration), "flash_stats is larger than RECORD_MAX_LENGTH");
+_Static_assert(offsetof(struct flash_calibration, reserved) == offsetof(struct i2c_registers_type_page3, save),
+    "flash_calibration doesn't have page3's layout up to save");
+
+#define RECORD_MAX_LENGTH sizeof(struct flash_calibration)
+#define RECORD_HALFWORDS(length) ((sizeof(struct flash_record_header) + (length) + 1) / 2)
+
+// 16 system entries and the F030x6's irqs up to USART1 (irq 27), the startup table's last 4 are reserved
+#define VECTOR_COUNT 44
+
+// copy of the vector table, the linker script puts it at the start of ram
+static uint32_t ram_vectors[VECTOR_COUNT] __attribute__((section(".ram_vector")));
+
+// save steps, run from the main loop
+#define FLASH_STATE_IDLE 0
+#define FLASH_STATE_ERASE 1
+#define FLASH_STATE_PAGE 2
+#define FLASH_STATE_PROGRAM 3
+
+static volatile uint8_t records_dirty = 0; // bit per record index, waiting to be appended
+static uint8_t records_loaded = 0;         // bit per record index, has a valid copy in the log
+static uint8_t log_page;                   // the page being appended to
+static uint8_t log_sequence;               // its page header's sequence
+static uint16_t log_end;                   // offset of the first free byte in log_page
+static uint8_t state = FLASH_STATE_IDLE;
+static uint8_t write_record;
+static uint8_t write_halfwords;
+static uint8_t program_step_index;
+static uint16_t write_buffer[RECORD_HALFWORDS(RECORD_MAX_LENGTH)];
+static uint16_t page_buffer[sizeof(struct flash_page_header) / 2];
+
+static uint8_t record_crc(const struct flash_record_header *header, const uint8_t *data) {
+  uint8_t crc = crc8(0, (const uint8_t *)header, offsetof(struct flash_record_header, crc8));
+  return crc8(crc, data, header->length);
+}
+
+static uint8_t page_crc(const struct flash_page_header *header) {
+  return crc8(0, (const uint8_t *)header, offsetof(struct flash_page_header, crc8));
+}
+
+// returns 1 and the sequence if the page starts with a page header
+static uint8_t page_valid(uint8_t page, uint8_t *sequence) {
+  const struct flash_page_header *header = (const struct flash_page_header *)LOG_PAGE(page);
+
+  if(header->type != FLASH_PAGE_TYPE || header->version != FLASH_LOG_VERSION || header->crc8 != page_crc(header)) {
+    return 0;
+  }
+  *sequence = header->sequence;
+  return 1;
+}
+
+/* the pre-log firmware wrote the 20 calibration bytes at the start of the page and left the rest erased
+ * a log page can look like that too, a page header or a short record and nothing after it, so those have to fail their crc
+ */
+static uint8_t legacy_calibration() {
+  const uint8_t *page = LOG_PAGE(LEGACY_PAGE);
+  const struct flash_record_header *header = (const struct flash_record_header *)page;
+  uint8_t erased = 0xff, sequence;
+
+  for(uint16_t i = 0; i < LOG_SIZE; i++) {
+    if(i < sizeof(flash_calibration)) {
+      erased &= page[i];
+    } else if(page[i] != 0xff) {
+      return 0;
+    }
+  }
+  if(erased == 0xff || page_valid(LEGACY_PAGE, &sequence)) {
+    return 0;
+  }
+  if(header->version == FLASH_LOG_VERSION && (uint8_t)(header->type - FLASH_RECORD_FIRST) < FLASH_RECORDS &&
+      header->length <= sizeof(flash_calibration) - sizeof(*header) && header->crc8 == record_crc(header, page + sizeof(*header))) {
+    return 0;
+  }
+  memcpy(&flash_calibration, page, sizeof(flash_calibration));
+  records_loaded = 1 << FLASH_RECORD_CALIBRATION;
+  return 1;
+}
+
+// one pass over a page's records, later records replace earlier ones, returns the offset of the first free byte
+static uint16_t page_scan(uint8_t page, uint16_t offset) {
+  const uint8_t *start = LOG_PAGE(page);
+
+  while(offset + sizeof(struct flash_record_header) <= LOG_SIZE) {
+    const struct flash_record_header *header = (const struct flash_record_header *)(start + offset);
+    const uint8_t *data = start + offset + sizeof(struct flash_record_header);
+    uint16_t record_size = RECORD_HALFWORDS(header->length) * 2;
+    uint8_t index = header->type - FLASH_RECORD_FIRST;
+
+    if(header->type == 0xff) { // erased
+      break;
+    }
+    if(offset + record_size > LOG_SIZE) { // garbage, the next save moves to the other page
+      offset = LOG_SIZE;
+      break;
+    }
+    // a record torn by a reset has no crc yet, skip it
+    if(index < FLASH_RECORDS && header->version == FLASH_LOG_VERSION && header->crc8 == record_crc(header, data)) {
+      uint8_t length = header->length < records[index].length ? header->length : records[index].length;
+
+      memset(records[index].data, '\0', records[index].length);
+      memcpy(records[index].data, data, length);
+      records_loaded |= 1 << index;
+    }
+    offset += record_size;
+  }
+
+  return offset;
+}
 
-// stored in rwflash section
-uint32_t tcxo_calibration[5] __attribute__((section(".rwflash")));
-
-void write_flash_data() {
-  uint32_t addr = (uint32_t)tcxo_calibration; // assumption: tcxo_calibration starts at top of page
-  FLASH_EraseInitTypeDef eraseRWFlash = {
-    .TypeErase = FLASH_TYPEERASE_PAGES,
-    .PageAddress = addr,
-    .NbPages = 1
-  };
-  uint32_t PageError;
-  HAL_StatusTypeDef status;
-  uint16_t *d = (uint16_t *)&i2c_registers_page3;
-
-  HAL_FLASH_Unlock();
-  status = HAL_FLASHEx_Erase(&eraseRWFlash, &PageError);
-  if(status != HAL_OK) {
-    i2c_registers_page3.save_status = SAVE_STATUS_ERASE_FAIL;
-    HAL_FLASH_Lock();
+/* the older page first, so the newer page's records win
+ * records only the older page has were cut off by a reset during a page change, they get written again
+ */
+static void log_scan() {
+  uint8_t sequences[LOG_PAGES];
+  uint8_t valid = 0, older_loaded;
+
+  for(uint8_t page = 0; page < LOG_PAGES; page++) {
+    valid |= page_valid(page, &sequences[page]) << page;
+  }
+
+  // the single page log goes under everything, until a page change uses its page
+  if(!(valid & (1 << LEGACY_PAGE)) && !legacy_calibration()) {
+    page_scan(LEGACY_PAGE, 0);
+  }
+
+  if(valid == 0) { // the first save starts page 0
+    log_page = LEGACY_PAGE;
+    log_end = LOG_SIZE;
     return;
   }
+  if(valid == (1 << 0 | 1 << 1)) {
+    log_page = (int8_t)(sequences[1] - sequences[0]) > 0;
+    page_scan(!log_page, sizeof(struct flash_page_header));
+  } else {
+    log_page = valid >> 1;
+  }
+  log_sequence = sequences[log_page];
+
+  older_loaded = records_loaded;
+  records_loaded = 0;
+  log_end = page_scan(log_page, sizeof(struct flash_page_header));
+  records_dirty = older_loaded & ~records_loaded;
+  records_loaded |= older_loaded;
+}
+
+/* the cpu stalls on any flash read while an erase or program is running
+ * serving the vectors from ram lets the ram resident interrupt handlers (RAMFUNC) run during the save
+ */
+void flash_start() {
+  memcpy(ram_vectors, (const void *)FLASH_BASE, sizeof(ram_vectors));
+  __HAL_SYSCFG_REMAPMEMORY_SRAM();
+
+  log_scan();
+  if(records_dirty) {
+    event_set(EVENT_FLASH);
+  }
+}
 
-  for(uint8_t i = 0; i < 10; i++) {
-    status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, addr + i*2, d[i]);
-    if(status != HAL_OK) {
-      i2c_registers_page3.save_status = SAVE_STATUS_WRITE_FAIL;
-      HAL_FLASH_Lock();
-      return;
+uint8_t flash_loaded(uint8_t record) {
+  return (records_loaded >> record) & 1;
+}
+
+// queue a record to be appended from the RAM copy, safe to call from irqs
+void flash_save_record(uint8_t record) {
+  __disable_irq();
+  records_dirty |= 1 << record;
+  __enable_irq();
+  event_set(EVENT_FLASH);
+}
+
+// called from the main loop when page3's save is written, the flash work happens later in flash_poll
+void flash_save_request() {
+  memcpy(&flash_calibration, &i2c_registers_page3, offsetof(struct flash_calibration, reserved));
+  flash_config.source_HZ_ch1 = i2c_registers.source_HZ_ch1;
+  flash_config.uart_stream = i2c_registers_info.uart_stream;
+  flash_config.extra_inputs = i2c_registers_info.extra_inputs;
+  flash_save_record(FLASH_RECORD_CALIBRATION);
+  flash_save_record(FLASH_RECORD_CONFIG);
+  i2c_registers_page3.save_status = SAVE_STATUS_BUSY;
+}
+
+/* the end of write_record's save, written or not
+ * write_buffer still holds the record's snapshot, so the address is the one that was (or wasn't) written
+ */
+static void save_done(uint8_t status) {
+  const struct flash_config *config = (const struct flash_config *)((uint8_t *)write_buffer + sizeof(struct flash_record_header));
+
+  if(write_record == FLASH_RECORD_CALIBRATION) {
+    i2c_registers_page3.save_status = status;
+  } else if(write_record == FLASH_RECORD_CONFIG) {
+    i2c_slave_address_saved(config->i2c_address, status == SAVE_STATUS_OK);
+  }
+  state = FLASH_STATE_IDLE;
+}
+
+// snapshot the next dirty record into write_buffer, returns 0 if there's nothing to write
+static uint8_t next_record() {
+  struct flash_record_header *header = (struct flash_record_header *)write_buffer;
+  uint8_t *data = (uint8_t *)write_buffer + sizeof(struct flash_record_header);
+
+  for(write_record = 0; write_record < FLASH_RECORDS; write_record++) {
+    if(records_dirty & (1 << write_record)) {
+      break;
     }
   }
+  if(write_record >= FLASH_RECORDS) {
+    return 0;
+  }
+
+  header->type = FLASH_RECORD_FIRST + write_record;
+  header->length = records[write_record].length;
+  header->version = FLASH_LOG_VERSION;
+  __disable_irq();
+  memcpy(data, records[write_record].data, header->length);
+  records_dirty &= ~(1 << write_record);
+  __enable_irq();
+  header->crc8 = record_crc(header, data);
+
+  write_halfwords = RECORD_HALFWORDS(header->length);
+  program_step_index = 0;
+  return 1;
+}
+
+/* the irqs with handlers in flash, masked in the nvic during an operation
+ * taking one would stall the core on the handler's first fetch, and keep the ram resident irqs out with it
+ */
+#define FLASH_RESIDENT_IRQS (1 << TIM1_BRK_UP_TRG_COM_IRQn | 1 << DMA1_Channel2_3_IRQn | 1 << ADC1_IRQn | 1 << USART1_IRQn)
+
+/* erase the page at address (FLASH_CR_PER) or program a half-word (FLASH_CR_PG), then wait for BSY to clear
+ * the cpu stalls on any fetch from flash until the operation is done, so this runs from ram and isn't inlined
+ * into the steps, and the ram resident irqs keep running while it waits
+ * returns 0 on a PGERR (the half-word wasn't erased) or a WRPRTERR
+ */
+static RAMFUNC __attribute__((noinline)) uint8_t flash_operation(uint32_t operation, uint32_t address, uint16_t data) {
+  uint32_t errors;
+
+  NVIC->ICER[0] = FLASH_RESIDENT_IRQS;
+  if(FLASH->CR & FLASH_CR_LOCK) {
+    FLASH->KEYR = FLASH_KEY1;
+    FLASH->KEYR = FLASH_KEY2;
+  }
+  FLASH->CR = operation;
+  if(operation == FLASH_CR_PER) {
+    FLASH->AR = address;
+    FLASH->CR = FLASH_CR_PER | FLASH_CR_STRT;
+  } else {
+    *(__IO uint16_t *)(uintptr_t)address = data;
+  }
+  while(FLASH->SR & FLASH_SR_BSY) {
+  }
+  NVIC->ISER[0] = FLASH_RESIDENT_IRQS;
+
+  errors = FLASH->SR & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR);
+  FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+  FLASH->CR = FLASH_CR_LOCK;
+  return errors == 0;
+}
+
+// a record doesn't fit, erase the other page
+static void erase_step() {
+  struct flash_page_header *header = (struct flash_page_header *)page_buffer;
 
-  HAL_FLASH_Lock();
+  if(!flash_operation(FLASH_CR_PER, (uint32_t)LOG_PAGE(!log_page), 0)) {
+    save_done(SAVE_STATUS_ERASE_FAIL);
+    return;
+  }
+
+  header->type = FLASH_PAGE_TYPE;
+  header->sequence = log_sequence + 1;
+  header->version = FLASH_LOG_VERSION;
+  header->crc8 = page_crc(header);
+  program_step_index = 0;
+  state = FLASH_STATE_PAGE;
+}
+
+/* the page header, its newer sequence makes the erased page the log
+ * the old page still has everything until the records that follow are written
+ */
+static void page_step() {
+  if(!flash_operation(FLASH_CR_PG, (uint32_t)LOG_PAGE(!log_page) + program_step_index*2, page_buffer[program_step_index])) {
+    save_done(SAVE_STATUS_WRITE_FAIL); // the record still doesn't fit, the next save tries the other page again
+    return;
+  }
+
+  program_step_index++;
+  if(program_step_index < sizeof(page_buffer) / 2) {
+    return;
+  }
+
+  // everything else that was in the log goes in after this record
+  log_page = !log_page;
+  log_sequence++;
+  log_end = sizeof(struct flash_page_header);
+  __disable_irq();
+  records_dirty |= records_loaded & ~(1 << write_record);
+  __enable_irq();
+  records_loaded = 0;
+  program_step_index = 0;
+  state = FLASH_STATE_PROGRAM;
+}
+
+/* header type and length first, then the data, then the half-word with the crc
+ * so a record cut short by a reset never has a valid crc
+ */
+static void program_step() {
+  uint8_t halfword;
+  uint32_t addr;
+
+  if(program_step_index == 0) {
+    halfword = 0;
+  } else if(program_step_index == write_halfwords - 1) {
+    halfword = 1;
+  } else {
+    halfword = program_step_index + 1;
+  }
+  addr = (uint32_t)LOG_PAGE(log_page) + log_end + halfword*2;
+
+  if(!flash_operation(FLASH_CR_PG, addr, write_buffer[halfword])) {
+    log_end = LOG_SIZE; // don't trust the rest of the page, the next save moves to the other one
+    save_done(SAVE_STATUS_WRITE_FAIL);
+    return;
+  }
+
+  program_step_index++;
+  if(program_step_index >= write_halfwords) {
+    log_end += write_halfwords * 2;
+    records_loaded |= 1 << write_record;
+    save_done(SAVE_STATUS_OK);
+  }
+}
+
+// one flash operation per call, returns 1 while there's more to do
+uint8_t flash_poll() {
+  switch(state) {
+    case FLASH_STATE_IDLE:
+      if(!next_record()) {
+        return 0;
+      }
+      if(log_end + write_halfwords * 2 > LOG_SIZE) {
+        state = FLASH_STATE_ERASE;
+      } else {
+        state = FLASH_STATE_PROGRAM;
+      }
+      break;
+    case FLASH_STATE_ERASE:
+      erase_step();
+      break;
+    case FLASH_STATE_PAGE:
+      page_step();
+      break;
+    case FLASH_STATE_PROGRAM:
+      program_step();
+      break;
+  }
 
-  i2c_registers_page3.save_status = SAVE_STATUS_OK;
+  // a save queues several records, the next one starts on the next pass
+  return state != FLASH_STATE_IDLE || records_dirty != 0;
 }
@@ -1,184 +1,412 @@
 #include "stm32f0xx_hal.h"
+#include "main.h"
 #include <string.h>
 
 #include "i2c_slave.h"
 #include "uart.h"
 #include "timer.h"
 #include "flash.h"
+#include "crc8.h"
+#include "warm.h"
+#include "events.h"
 
 struct i2c_registers_type i2c_registers;
 struct i2c_registers_type_page2 i2c_registers_page2;
 struct i2c_registers_type_page3 i2c_registers_page3;
 struct i2c_registers_type_page4 i2c_registers_page4;
+struct i2c_registers_type_info i2c_registers_info;
+struct i2c_registers_type_captures i2c_registers_captures;
+struct i2c_registers_type_latch i2c_registers_latch;
+struct i2c_registers_type_stats i2c_registers_stats;
 
-static void *current_page = &i2c_registers;
-static uint8_t current_page_data[I2C_REGISTER_PAGE_SIZE];
+// added to the restored page sequence after a warm restart, more page fills than the snapshot can be behind by
+#define WARM_SEQUENCE_GAP 0x10000
 
-static void i2c_data_xmt(I2C_HandleTypeDef *hi2c);
+// taken at every general call address match, published on I2C_GENERAL_CALL_LATCH
+static struct i2c_registers_type_latch latch_pending;
 
-static uint8_t i2c_transfer_position;
-static enum {STATE_WAITING, STATE_GET_ADDR, STATE_GET_DATA, STATE_SEND_DATA, STATE_DROP_DATA} i2c_transfer_state;
-static uint8_t i2c_data;
+struct i2c_page {
+  void *data;
+  uint32_t writable;     // bit n set: byte n is I2C_ACCESS_RW
+  uint32_t actions;      // bit n set: byte n is I2C_ACCESS_ACTION
+  void (*action)(uint8_t position, uint8_t data);
+};
 
-// addresses from the STM32F030 datasheet
-uint16_t *ts_cal1 = (uint16_t *)0x1ffff7b8;
-uint16_t *ts_cal2 = (uint16_t *)0x1ffff7c2;
-uint16_t *vrefint_cal = (uint16_t *)0x1ffff7ba;
+// every page is this size, so the page table doesn't keep one per page
+#define PAGE_SIZE I2C_REGISTER_PAGE_SIZE_MAX
+_Static_assert(I2C_REGISTER_PAGE_SIZE == PAGE_SIZE, "the pages are not all the same size");
 
-void i2c_slave_start() {
-  memset(&i2c_registers, '\0', sizeof(i2c_registers));
+static RAMDATA const struct i2c_page pages[I2C_REGISTER_PAGES];
+static const struct i2c_page *current_page;
+static uint8_t current_page_data[PAGE_SIZE + sizeof(struct i2c_page_trailer)] __attribute__((aligned(4)));
+static uint32_t page_sequence;
+
+static void change_page(uint8_t data);
 
-  memset(&i2c_registers_page2, '\0', sizeof(i2c_registers_page2));
+static uint8_t i2c_transfer_position; // register offset on a write, byte of current_page_data on a read
+static enum {STATE_WAITING, STATE_GET_ADDR, STATE_GET_DATA, STATE_SEND_DATA, STATE_DROP_DATA, STATE_GET_GENERAL_CALL} i2c_transfer_state;
+static uint8_t address_saving = 0;  // committed address, waiting for its config record to be written
+static uint8_t address_pending = 0; // saved address, switched to at the stop of the transfer that was running
 
-  memset(&i2c_registers_page3, '\0', sizeof(i2c_registers_page3));
+// addresses from the STM32F030 datasheet
+uint16_t *const ts_cal1 = (uint16_t *)0x1ffff7b8;
+uint16_t *const ts_cal2 = (uint16_t *)0x1ffff7c2;
+uint16_t *const vrefint_cal = (uint16_t *)0x1ffff7ba;
+
+// OA1 can only be changed while OA1EN is clear, the rest of the peripheral keeps running
+static RAMFUNC void set_own_address(uint8_t address) {
+  hi2c1.Instance->OAR1 &= ~I2C_OAR1_OA1EN;
+  hi2c1.Instance->OAR1 = I2C_OAR1_OA1EN | (address << 1);
+  hi2c1.Init.OwnAddress1 = address << 1;
+  i2c_registers_info.i2c_address = address;
+  i2c_registers_info.new_i2c_address = address;
+}
 
-  memset(&i2c_registers_page4, '\0', sizeof(i2c_registers_page4));
+// the pages start as the startup code zeroed them, timer_start runs first and the capture irq already writes page1 and captures
+void i2c_slave_start() {
+  uint8_t address = I2C_DEFAULT_ADDRESS;
+
+  // every page's last byte is its number, so a v2 client can tell which page it got
+  for(uint8_t page = 0; page < I2C_REGISTER_PAGES; page++) {
+    ((uint8_t *)pages[page].data)[I2C_REGISTER_OFFSET_PAGE] = page;
+  }
 
-  i2c_registers.page_offset = I2C_REGISTER_PAGE1;
   i2c_registers.source_HZ_ch1 = DEFAULT_SOURCE_HZ;
+  if(flash_loaded(FLASH_RECORD_CONFIG)) {
+    if(flash_config.source_HZ_ch1 > 0) {
+      i2c_registers.source_HZ_ch1 = flash_config.source_HZ_ch1;
+    }
+    if(flash_config.i2c_address >= I2C_ADDRESS_MIN && flash_config.i2c_address <= I2C_ADDRESS_MAX) {
+      address = flash_config.i2c_address;
+    }
+    i2c_registers_info.uart_stream = flash_config.uart_stream;
+    i2c_registers_info.extra_inputs = flash_config.extra_inputs;
+  }
+  // a host write that wasn't saved to flash survives a warm restart too
+  if(warm_restored()) {
+    i2c_registers.source_HZ_ch1 = warm_state.source_HZ_ch1;
+    page_sequence = warm_state.page_sequence + WARM_SEQUENCE_GAP;
+  }
   i2c_registers.version = I2C_REGISTER_VERSION;
-  memcpy(current_page_data, current_page, I2C_REGISTER_PAGE_SIZE);
 
-  i2c_registers_page2.page_offset = I2C_REGISTER_PAGE2;
   i2c_registers_page2.ts_cal1 = *ts_cal1;
   i2c_registers_page2.ts_cal2 = *ts_cal2;
   i2c_registers_page2.vrefint_cal = *vrefint_cal;
 
-  i2c_registers_page3.page_offset = I2C_REGISTER_PAGE3;
-  i2c_registers_page3.tcxo_a = tcxo_calibration[0];
-  i2c_registers_page3.tcxo_b = tcxo_calibration[1];
-  i2c_registers_page3.tcxo_c = tcxo_calibration[2];
-  i2c_registers_page3.tcxo_d = tcxo_calibration[3];
-  i2c_registers_page3.max_calibration_temp = tcxo_calibration[4] & 0xff;
-  i2c_registers_page3.min_calibration_temp = (tcxo_calibration[4] >> 8) & 0xff;
-  i2c_registers_page3.rmse_fit = (tcxo_calibration[4] >> 16) & 0xff;
+  // the calibration record has page3's layout up to save, as flash_save_request copies it
+  memcpy(&i2c_registers_page3, &flash_calibration, offsetof(struct flash_calibration, reserved));
+
+  i2c_registers_info.protocol_version = I2C_PROTOCOL_VERSION;
+  i2c_registers_info.max_page_size = I2C_REGISTER_PAGE_SIZE_MAX;
+  i2c_registers_info.trailer_size = sizeof(struct i2c_page_trailer);
+  i2c_registers_info.capture_batch = I2C_CAPTURE_BATCH;
+  i2c_registers_info.capture_channels = I2C_CAPTURE_CHANNELS;
+  set_own_address(address);
+  i2c_registers_info.boot_state = warm_boot_state();
+  i2c_registers_info.warm_restarts = warm_state.restarts;
+
+  if(warm_restored()) {
+    i2c_registers_latch.latch_count = warm_state.latch_count;
+  }
+
+  change_page(I2C_REGISTER_PAGE1);
 
-  i2c_registers_page4.page_offset = I2C_REGISTER_PAGE4;
+  __HAL_I2C_ENABLE_IT(&hi2c1, I2C_IT_ADDRI | I2C_IT_RXI | I2C_IT_TXI | I2C_IT_STOPI | I2C_IT_NACKI | I2C_IT_ERRI);
+}
 
-  HAL_I2C_EnableListen_IT(&hi2c1);
+void i2c_slave_warm_save() {
+  warm_state.source_HZ_ch1 = i2c_registers.source_HZ_ch1;
+  warm_state.page_sequence = page_sequence;
+  warm_state.latch_count = i2c_registers_latch.latch_count;
 }
 
 uint8_t i2c_read_active() {
   return (i2c_transfer_state == STATE_SEND_DATA) || (i2c_transfer_state == STATE_GET_ADDR);
 }
 
-void HAL_I2C_AddrCallback(I2C_HandleTypeDef *hi2c, uint8_t TransferDirection, uint16_t AddrMatchCode) {
-  if(TransferDirection == I2C_DIRECTION_TRANSMIT) { // master transmit
-    i2c_transfer_state = STATE_GET_ADDR;
-    HAL_I2C_Slave_Sequential_Receive_IT(hi2c, &i2c_data, 1, I2C_FIRST_FRAME);
+/* memcpy without the flash resident libc one, the volatile destinations keep the compiler from making it a call again
+ * a word at a time when it can, change_page copies with interrupts off
+ * out of line, its five copies inlined into i2c_slave_irq and change_page cost 40 bytes more of ram code
+ */
+static RAMFUNC __attribute__((noinline)) void ram_copy(void *destination, const void *source, uint8_t size) {
+  if((((uintptr_t)destination | (uintptr_t)source | size) & 3) == 0) {
+    volatile uint32_t *to = destination;
+    const uint32_t *from = source;
+
+    for(size /= 4; size > 0; size--) {
+      *to++ = *from++;
+    }
   } else {
-    i2c_transfer_state = STATE_SEND_DATA;
-    i2c_data_xmt(hi2c);
+    volatile uint8_t *to = destination;
+    const uint8_t *from = source;
+
+    while(size--) {
+      *to++ = *from++;
+    }
   }
 }
 
-static void change_page(uint8_t data) {
-  switch(data) {
-    case I2C_REGISTER_PAGE2:
-      current_page = &i2c_registers_page2;
-      break;
-    case I2C_REGISTER_PAGE3:
-      current_page = &i2c_registers_page3;
-      break;
-    case I2C_REGISTER_PAGE4:
-      i2c_registers_page4.tim3 = __HAL_TIM_GET_COUNTER(&htim3);
-      i2c_registers_page4.tim1 = __HAL_TIM_GET_COUNTER(&htim1);
-      current_page = &i2c_registers_page4;
-      break;
-    default:
-    case I2C_REGISTER_PAGE1:
-      i2c_registers.milliseconds_now = HAL_GetTick();
-      current_page = &i2c_registers;
-      break;
+/* every board on the bus sees the general call address at the same clock edge, so sample the counters here
+ * in ram like the rest of the i2c path, so flash wait states don't add jitter to the sample
+ */
+static RAMFUNC void latch_counters() {
+  uint16_t tim1_before;
+
+  // re-read tim1 in case tim3 wrapped between the reads
+  tim1_before = __HAL_TIM_GET_COUNTER(&htim1);
+  latch_pending.tim3 = __HAL_TIM_GET_COUNTER(&htim3);
+  latch_pending.tim1 = __HAL_TIM_GET_COUNTER(&htim1);
+  if(latch_pending.tim1 != tim1_before && latch_pending.tim3 > 0x8000) {
+    latch_pending.tim1 = tim1_before;
   }
 
-  __disable_irq(); // copy with interrupts off to prevent the page's data from changing during read
-  memcpy(current_page_data, current_page, I2C_REGISTER_PAGE_SIZE);
+  __disable_irq(); // the capture interrupt can preempt this one
+  ram_copy(latch_pending.tim3_at_irq, i2c_registers.tim3_at_irq, sizeof(latch_pending.tim3_at_irq));
+  ram_copy(latch_pending.tim1_at_irq, i2c_registers.tim1_at_irq, sizeof(latch_pending.tim1_at_irq));
+  ram_copy(latch_pending.tim3_at_cap, i2c_registers.tim3_at_cap, sizeof(latch_pending.tim3_at_cap));
+  latch_pending.ch2_count = i2c_registers.ch2_count;
+  latch_pending.ch4_count = i2c_registers.ch4_count;
   __enable_irq();
 }
 
-static void i2c_data_rcv(uint8_t position, uint8_t data) {
-  if(position == I2C_REGISTER_OFFSET_PAGE) {
-    change_page(data);
+static RAMFUNC void general_call_rcv(uint8_t command) {
+  if(command == I2C_GENERAL_CALL_LATCH) {
+    latch_pending.latch_count = i2c_registers_latch.latch_count + 1;
+    latch_pending.page_offset = I2C_REGISTER_PAGE_LATCH;
+    ram_copy(&i2c_registers_latch, &latch_pending, sizeof(i2c_registers_latch));
+  }
+}
+
+static RAMFUNC void latch_page1() {
+  i2c_registers.milliseconds_now = timer_now_ms();
+}
+
+static RAMFUNC void latch_page4() {
+  i2c_registers_page4.tim3 = __HAL_TIM_GET_COUNTER(&htim3);
+  i2c_registers_page4.tim1 = __HAL_TIM_GET_COUNTER(&htim1);
+}
+
+/* the page actions only mark the request, i2c_slave_poll does the flash side of it from the main loop
+ * the status goes busy right away, so a host polling it during a flash erase doesn't see the last request's
+ */
+static volatile uint8_t save_pending = 0;
+static volatile uint8_t commit_pending = 0;
+static volatile uint8_t commit_key;
+
+static RAMFUNC void page3_action(uint8_t position, uint8_t data) {
+  // the only action field on page3 is save
+  if(data) {
+    i2c_registers_page3.save_status = SAVE_STATUS_BUSY;
+    save_pending = 1;
+    event_set(EVENT_I2C_ACTION);
+  }
+}
+
+// the only action field on the info page is i2c_address_commit
+static RAMFUNC void info_action(uint8_t position, uint8_t data) {
+  commit_key = data;
+  i2c_registers_info.i2c_address_status = I2C_ADDRESS_STATUS_BUSY;
+  commit_pending = 1;
+  event_set(EVENT_I2C_ACTION);
+}
+
+// the key keeps a stray write from moving the board somewhere the host won't look for it
+static void address_commit(uint8_t key) {
+  uint8_t address = i2c_registers_info.new_i2c_address;
+
+  if(key != (uint8_t)~address) {
+    i2c_registers_info.i2c_address_status = I2C_ADDRESS_STATUS_BAD_KEY;
     return;
   }
-  if(position >= I2C_REGISTER_PAGE_SIZE) { // 0-based index
+  if(address < I2C_ADDRESS_MIN || address > I2C_ADDRESS_MAX) {
+    i2c_registers_info.i2c_address_status = I2C_ADDRESS_STATUS_INVALID;
     return;
   }
+  flash_config.i2c_address = address;
+  flash_save_record(FLASH_RECORD_CONFIG);
+  address_saving = address;
+}
 
-  if(current_page == &i2c_registers) {
-    uint8_t *p = (uint8_t *)&i2c_registers;
-
-    switch(position) {
-      case I2C_REGISTER_OFFSET_HZ_HI:
-      case I2C_REGISTER_OFFSET_HZ_LO:
-        p[position] = data;
-        break;
-    }
+// called from the main loop on EVENT_I2C_ACTION, the flag is cleared before the key is read so a newer commit runs again
+void i2c_slave_poll() {
+  if(save_pending) {
+    save_pending = 0;
+    flash_save_request();
+  }
+  if(commit_pending) {
+    commit_pending = 0;
+    address_commit(commit_key);
+  }
+}
 
+/* called from flash_poll when a config record holding address has been written, or has failed
+ * the board only moves once the address survives a reset, so the host polls the old address until the status isn't busy
+ */
+void i2c_slave_address_saved(uint8_t address, uint8_t saved) {
+  if(!address_saving || address != address_saving) { // no commit waiting, an older config record, or one from page3's save
     return;
-  } 
+  }
+  address_saving = 0;
 
-  if(current_page == &i2c_registers_page3) {
-    uint8_t *p = (uint8_t *)&i2c_registers_page3;
+  if(!saved) {
+    flash_config.i2c_address = i2c_registers_info.i2c_address;
+    i2c_registers_info.i2c_address_status = I2C_ADDRESS_STATUS_SAVE_FAIL;
+    return;
+  }
 
-    if(position < 19) {
-      p[position] = data;
-    } else if(position == 19 && data) {
-      write_flash_data();
-    }
+  __disable_irq();
+  i2c_registers_info.i2c_address_status = I2C_ADDRESS_STATUS_OK;
+  if(i2c_transfer_state == STATE_WAITING) {
+    set_own_address(address);
+  } else { // don't pull the address out from under a transfer in progress
+    address_pending = address;
   }
+  __enable_irq();
 }
 
-static void i2c_data_xmt(I2C_HandleTypeDef *hi2c) {
-  HAL_I2C_Slave_Sequential_Transmit_IT(hi2c, current_page_data, I2C_REGISTER_PAGE_SIZE, I2C_FIRST_FRAME);
+// the per-byte tables would take 32 bytes of RAM each, a page's permissions fit in two words
+#define PAGE_ACCESS(fields) I2C_PAGE_ACCESS_MASK(fields, RW), I2C_PAGE_ACCESS_MASK(fields, ACTION)
+
+static RAMDATA const struct i2c_page pages[I2C_REGISTER_PAGES] = {
+  [I2C_REGISTER_PAGE1] = {&i2c_registers, PAGE_ACCESS(I2C_PAGE1_FIELDS), NULL},
+  [I2C_REGISTER_PAGE2] = {&i2c_registers_page2, 0, 0, NULL},
+  [I2C_REGISTER_PAGE3] = {&i2c_registers_page3, PAGE_ACCESS(I2C_PAGE3_FIELDS), page3_action},
+  [I2C_REGISTER_PAGE4] = {&i2c_registers_page4, 0, 0, NULL},
+  [I2C_REGISTER_PAGE_INFO] = {&i2c_registers_info, PAGE_ACCESS(I2C_PAGE_INFO_FIELDS), info_action},
+  [I2C_REGISTER_PAGE_CAPTURES] = {&i2c_registers_captures, 0, 0, NULL},
+  [I2C_REGISTER_PAGE_LATCH] = {&i2c_registers_latch, 0, 0, NULL},
+  [I2C_REGISTER_PAGE_STATS] = {&i2c_registers_stats, PAGE_ACCESS(I2C_PAGE_STATS_FIELDS), NULL},
+};
+
+static RAMFUNC void change_page(uint8_t data) {
+  struct i2c_page_trailer *trailer;
+
+  if(data >= I2C_REGISTER_PAGES) {
+    data = I2C_REGISTER_PAGE1;
+  }
+  current_page = &pages[data];
+  // the counters on these pages are read just before the copy
+  if(data == I2C_REGISTER_PAGE1) {
+    latch_page1();
+  } else if(data == I2C_REGISTER_PAGE4) {
+    latch_page4();
+  }
+
+  __disable_irq(); // copy with interrupts off to prevent the page's data from changing during read
+  ram_copy(current_page_data, current_page->data, PAGE_SIZE);
+  __enable_irq();
+
+  // the trailer is only sent to v3 clients that read past the end of the page
+  trailer = (struct i2c_page_trailer *)(current_page_data + PAGE_SIZE);
+  trailer->sequence = ++page_sequence;
+  trailer->page = data;
+  trailer->length = PAGE_SIZE;
+  trailer->version = I2C_PROTOCOL_VERSION;
+  trailer->crc8 = crc8(0, current_page_data, PAGE_SIZE + sizeof(struct i2c_page_trailer) - 1);
 }
 
-void HAL_I2C_SlaveTxCpltCallback(I2C_HandleTypeDef *hi2c) {
-  if(i2c_transfer_state == STATE_DROP_DATA) { // encountered a stop/error condition
+static RAMFUNC void i2c_data_rcv(uint8_t position, uint8_t data) {
+  uint32_t bit;
+
+  if(position == I2C_REGISTER_OFFSET_PAGE) {
+    change_page(data);
+    return;
+  }
+  if(position >= PAGE_SIZE) { // past the masks
     return;
   }
 
-  i2c_data = 0;
-  HAL_I2C_Slave_Sequential_Transmit_IT(hi2c, &i2c_data, 1, I2C_NEXT_FRAME);
+  bit = 1U << position;
+  if(current_page->writable & bit) {
+    ((uint8_t *)current_page->data)[position] = data;
+  } else if(current_page->actions & bit) {
+    current_page->action(position, data);
+  }
 }
 
-void HAL_I2C_SlaveRxCpltCallback(I2C_HandleTypeDef *hi2c) {
+static RAMFUNC void i2c_byte_rcv(uint8_t data) {
   switch(i2c_transfer_state) {
     case STATE_GET_ADDR:
-      i2c_transfer_position = i2c_data;
+      i2c_transfer_position = data;
       i2c_transfer_state = STATE_GET_DATA;
-      HAL_I2C_Slave_Sequential_Receive_IT(hi2c, &i2c_data, 1, I2C_LAST_FRAME);
       break;
     case STATE_GET_DATA:
-      i2c_data_rcv(i2c_transfer_position, i2c_data);
+      i2c_data_rcv(i2c_transfer_position, data);
       i2c_transfer_position++;
-      HAL_I2C_Slave_Sequential_Receive_IT(hi2c, &i2c_data, 1, I2C_LAST_FRAME);
+      break;
+    case STATE_GET_GENERAL_CALL:
+      general_call_rcv(data);
+      i2c_transfer_state = STATE_WAITING;
       break;
     default:
-      HAL_I2C_Slave_Sequential_Receive_IT(hi2c, &i2c_data, 1, I2C_LAST_FRAME);
       break;
   }
 
-  if(i2c_transfer_position > sizeof(struct i2c_registers_type)) {
+  if(i2c_transfer_position > I2C_REGISTER_PAGE_SIZE_MAX) {
     i2c_transfer_state = STATE_DROP_DATA;
   }
 }
 
-void HAL_I2C_ListenCpltCallback(I2C_HandleTypeDef *hi2c) {
-  HAL_I2C_EnableListen_IT(hi2c);
+static RAMFUNC void i2c_addr_match(uint8_t direction, uint8_t address) {
+  if(address == 0) { // general call
+    latch_counters();
+    i2c_transfer_state = STATE_GET_GENERAL_CALL;
+  } else if(direction == I2C_DIRECTION_TRANSMIT) { // master transmit
+    i2c_transfer_state = STATE_GET_ADDR;
+  } else {
+    i2c_transfer_state = STATE_SEND_DATA;
+    i2c_transfer_position = 0;
+  }
 }
 
-void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c) {
-  i2c_transfer_state = STATE_DROP_DATA;
+// the page and its trailer, then zeros for as long as the master keeps reading
+static RAMFUNC uint8_t i2c_byte_xmt() {
+  if(i2c_transfer_state != STATE_SEND_DATA || i2c_transfer_position >= PAGE_SIZE + sizeof(struct i2c_page_trailer)) {
+    return 0;
+  }
+  return current_page_data[i2c_transfer_position++];
+}
 
-  if(hi2c->ErrorCode != HAL_I2C_ERROR_AF) {
-    HAL_I2C_EnableListen_IT(hi2c);
+// the stop, the address can change now that the transfer on the old one is over
+static RAMFUNC void i2c_stop() {
+  i2c_transfer_state = STATE_WAITING;
+  if(address_pending) {
+    set_own_address(address_pending);
+    address_pending = 0;
   }
 }
 
-void HAL_I2C_AbortCpltCallback(I2C_HandleTypeDef *hi2c) {
-  i2c_transfer_state = STATE_DROP_DATA;
+/* I2C1's interrupt, a byte or bus event at a time straight off the peripheral's registers
+ * all of it is in ram along with the tables it reads, so a flash erase or program doesn't hold the clock stretched
+ */
+RAMFUNC void i2c_slave_irq() {
+  uint32_t isr = hi2c1.Instance->ISR;
+
+  if(isr & (I2C_FLAG_BERR | I2C_FLAG_ARLO | I2C_FLAG_OVR)) { // encountered an error condition, drop the rest of the transfer
+    __HAL_I2C_CLEAR_FLAG(&hi2c1, I2C_FLAG_BERR | I2C_FLAG_ARLO | I2C_FLAG_OVR);
+    i2c_transfer_state = STATE_DROP_DATA;
+  }
+  // ahead of the address, a write's last byte (the page select) lands before the repeated start's read
+  if(isr & I2C_FLAG_RXNE) {
+    i2c_byte_rcv(hi2c1.Instance->RXDR);
+  }
+  // and the last transfer's stop, when the irq ran late enough for the next one's address to be in too
+  if(isr & I2C_FLAG_STOPF) {
+    __HAL_I2C_CLEAR_FLAG(&hi2c1, I2C_FLAG_STOPF);
+    i2c_stop();
+  }
+  if(isr & I2C_FLAG_ADDR) {
+    i2c_addr_match(I2C_GET_DIR(&hi2c1), I2C_GET_ADDR_MATCH(&hi2c1));
+    // a byte loaded for the last read that the master nacked would go out first, flush it
+    __HAL_I2C_CLEAR_FLAG(&hi2c1, I2C_FLAG_TXE);
+    __HAL_I2C_CLEAR_FLAG(&hi2c1, I2C_FLAG_ADDR);
+  }
+  if(isr & I2C_FLAG_TXIS) {
+    hi2c1.Instance->TXDR = i2c_byte_xmt();
+  }
+  if(isr & I2C_FLAG_AF) { // the master nacks the last byte it reads
+    __HAL_I2C_CLEAR_FLAG(&hi2c1, I2C_FLAG_AF);
+  }
 }
 
 void i2c_show_data() {
@@ -39,6 +39,12 @@
 #include "timer.h"
 #include "i2c_slave.h"
 #include "adc.h"
+#include "flash.h"
+#include "stats.h"
+#include "uart_stream.h"
+#include "events.h"
+#include "warm.h"
+#include "watchdog.h"
 /* USER CODE END Includes */
 
 /* Private variables ---------------------------------------------------------*/
@@ -50,9 +56,11 @@ TIM_HandleTypeDef htim1;
 TIM_HandleTypeDef htim3;
 
 UART_HandleTypeDef huart1;
+DMA_HandleTypeDef hdma_usart1_tx;
 
 /* USER CODE BEGIN PV */
 /* Private variables ---------------------------------------------------------*/
+TIM_HandleTypeDef htim14;
 
 /* USER CODE END PV */
 
@@ -60,6 +68,7 @@ UART_HandleTypeDef huart1;
 void SystemClock_Config(void);
 void Error_Handler(void);
 static void MX_GPIO_Init(void);
+static void MX_DMA_Init(void);
 static void MX_TIM1_Init(void);
 static void MX_TIM3_Init(void);
 static void MX_USART1_UART_Init(void);
@@ -68,16 +77,34 @@ static void MX_ADC_Init(void);
 
 /* USER CODE BEGIN PFP */
 /* Private function prototypes -----------------------------------------------*/
+// not inlined, so the init functions' init structs aren't on main's stack under the main loop for good
+#define INIT __attribute__((noinline))
+INIT void SystemClock_Config(void);
+static INIT void MX_GPIO_Init(void);
+static INIT void MX_DMA_Init(void);
+static INIT void MX_TIM1_Init(void);
+static INIT void MX_TIM3_Init(void);
+static INIT void MX_TIM14_Init(void);
+static INIT void MX_USART1_UART_Init(void);
+static INIT void MX_I2C1_Init(void);
+static INIT void MX_ADC_Init(void);
 
 /* USER CODE END PFP */
 
 /* USER CODE BEGIN 0 */
+// reset cause and time from HAL_Init to the timers running, for the info page
+static void publish_boot(uint32_t boot_us) {
+  i2c_registers_info.boot_us = boot_us;
+  i2c_registers_info.reset_flags = RCC->CSR >> 24;
+  __HAL_RCC_CLEAR_RESET_FLAGS();
+}
 /* USER CODE END 0 */
 
 int main(void)
 {
 
   /* USER CODE BEGIN 1 */
+  uint32_t boot_us;
 
   /* USER CODE END 1 */
 
@@ -91,16 +118,28 @@ int main(void)
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
+  MX_DMA_Init();
   MX_TIM1_Init();
   MX_TIM3_Init();
+
+  /* USER CODE BEGIN 2 */
+  // captures first, the rest of the init runs with the timers already going
+  // warm_start only checks the .noinit snapshot, timer_start needs to know if the capture counters carry on
+  warm_start(RCC->CSR >> 24);
+  timer_start();
+  MX_TIM14_Init();
+  boot_us = HAL_GetTick() * 1000 + (SysTick->LOAD - SysTick->VAL) / (SystemCoreClock / 1000000);
+
+  // the calls for these aren't generated (see the .ioc function list), so they run after timer_start
   MX_USART1_UART_Init();
   MX_I2C1_Init();
   MX_ADC_Init();
 
-  /* USER CODE BEGIN 2 */
-  HAL_ADCEx_Calibration_Start(&hadc);
+  flash_start();
   i2c_slave_start();
-  timer_start();
+  publish_boot(boot_us);
+  stats_start();
+  watchdog_start();
   /* USER CODE END 2 */
 
   /* Infinite loop */
@@ -115,8 +154,11 @@ int main(void)
     print_timer_status();
     i2c_show_data();
      */
-    adc_poll();
-    HAL_Delay(100);
+    watchdog_feed();
+    event_dispatch();
+
+    // sleep until the next interrupt, SysTick wakes it at least every 1ms
+    event_wait();
   }
   /* USER CODE END 3 */
 
@@ -177,7 +219,7 @@ void SystemClock_Config(void)
   HAL_SYSTICK_CLKSourceConfig(SYSTICK_CLKSOURCE_HCLK);
 
   /* SysTick_IRQn interrupt configuration */
-  HAL_NVIC_SetPriority(SysTick_IRQn, 0, 0);
+  HAL_NVIC_SetPriority(SysTick_IRQn, 3, 0);
 }
 
 /* ADC init function */
@@ -245,7 +287,7 @@ static void MX_I2C1_Init(void)
   hi2c1.Init.DualAddressMode = I2C_DUALADDRESS_DISABLE;
   hi2c1.Init.OwnAddress2 = 0;
   hi2c1.Init.OwnAddress2Masks = I2C_OA2_NOMASK;
-  hi2c1.Init.GeneralCallMode = I2C_GENERALCALL_DISABLE;
+  hi2c1.Init.GeneralCallMode = I2C_GENERALCALL_ENABLE;
   hi2c1.Init.NoStretchMode = I2C_NOSTRETCH_DISABLE;
   if (HAL_I2C_Init(&hi2c1) != HAL_OK)
   {
@@ -359,7 +401,7 @@ static void MX_USART1_UART_Init(void)
 {
 
   huart1.Instance = USART1;
-  huart1.Init.BaudRate = 115200;
+  huart1.Init.BaudRate = UART_STREAM_BAUD;
   huart1.Init.WordLength = UART_WORDLENGTH_8B;
   huart1.Init.StopBits = UART_STOPBITS_1;
   huart1.Init.Parity = UART_PARITY_NONE;
@@ -375,6 +417,21 @@ static void MX_USART1_UART_Init(void)
 
 }
 
+/** 
+  * Enable DMA controller clock
+  */
+static void MX_DMA_Init(void) 
+{
+  /* DMA controller clock enable */
+  __HAL_RCC_DMA1_CLK_ENABLE();
+
+  /* DMA interrupt init */
+  /* DMA1_Channel2_3_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel2_3_IRQn, 3, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel2_3_IRQn);
+
+}
+
 /** Configure pins as 
         * Analog 
         * Input 
@@ -385,14 +442,71 @@ static void MX_USART1_UART_Init(void)
 static void MX_GPIO_Init(void)
 {
 
+  GPIO_InitTypeDef GPIO_InitStruct;
+
   /* GPIO Ports Clock Enable */
   __HAL_RCC_GPIOF_CLK_ENABLE();
   __HAL_RCC_GPIOA_CLK_ENABLE();
   __HAL_RCC_GPIOB_CLK_ENABLE();
 
+  /*Configure GPIO pin Output Level */
+  HAL_GPIO_WritePin(DATA_READY_GPIO_Port, DATA_READY_Pin, GPIO_PIN_RESET);
+
+  /*Configure GPIO pin : DATA_READY_Pin */
+  GPIO_InitStruct.Pin = DATA_READY_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+  HAL_GPIO_Init(DATA_READY_GPIO_Port, &GPIO_InitStruct);
+
 }
 
 /* USER CODE BEGIN 4 */
+/* TIM14 init function, by hand because the .ioc has no PA4 capture
+ * same time base and input filter as TIM3, so a TIM14 capture is as late as a TIM3 one
+ * timer_poll starts it when i2c_registers_info.extra_inputs asks for it
+ */
+static void MX_TIM14_Init(void)
+{
+  GPIO_InitTypeDef GPIO_InitStruct;
+  TIM_IC_InitTypeDef sConfigIC;
+
+  __HAL_RCC_TIM14_CLK_ENABLE();
+
+  /**TIM14 GPIO Configuration
+  PA4     ------> TIM14_CH1
+  */
+  GPIO_InitStruct.Pin = GPIO_PIN_4;
+  GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+  GPIO_InitStruct.Alternate = GPIO_AF4_TIM14;
+  HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
+  htim14.Instance = TIM14;
+  htim14.Init.Prescaler = 0;
+  htim14.Init.CounterMode = TIM_COUNTERMODE_UP;
+  htim14.Init.Period = 65535;
+  htim14.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+  htim14.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+  if (HAL_TIM_IC_Init(&htim14) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  sConfigIC.ICPolarity = TIM_INPUTCHANNELPOLARITY_RISING;
+  sConfigIC.ICSelection = TIM_ICSELECTION_DIRECTTI;
+  sConfigIC.ICPrescaler = TIM_ICPSC_DIV1;
+  sConfigIC.ICFilter = 3;
+  if (HAL_TIM_IC_ConfigChannel(&htim14, &sConfigIC, TIM_CHANNEL_1) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  // same priority as TIM3, so neither capture irq can interrupt the other in add_capture
+  HAL_NVIC_SetPriority(TIM14_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(TIM14_IRQn);
+}
 
 /* USER CODE END 4 */
 
@@ -405,6 +519,8 @@ void Error_Handler(void)
 {
   /* USER CODE BEGIN Error_Handler */
   /* User can add his own implementation to report the HAL error return state */
+  // restart right away instead of waiting for the watchdog, warm_start keeps the counters
+  NVIC_SystemReset();
   while(1) 
   {
   }
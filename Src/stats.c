@@ -0,0 +1,87 @@
+#include "stm32f0xx_hal.h"
+
+#include "stats.h"
+#include "flash.h"
+#include "timer.h"
+#include "i2c_slave.h"
+#include "warm.h"
+
+/* each checkpoint is a 20 byte log record, about 40 fit in a 1K log page
+ * one every 4 hours changes page about once a week, each page is erased every other change, well inside the 1k cycle flash endurance
+ */
+#define CHECKPOINT_S (4*60*60)
+
+static uint32_t uptime_ms; // last whole second counted, in timer_now_ms() time
+static uint32_t next_checkpoint_s;
+static uint32_t boot_missed_edges; // from the flash checkpoint
+
+// restore the totals from the last checkpoint, or from before a warm restart, called after i2c_slave_start
+void stats_start() {
+  if(flash_loaded(FLASH_RECORD_STATS)) {
+    i2c_registers_stats.uptime_s = flash_stats.uptime_s;
+    i2c_registers_stats.missed_edges = boot_missed_edges = flash_stats.missed_edges;
+    i2c_registers_stats.internal_temp_min = flash_stats.internal_temp_min;
+    i2c_registers_stats.internal_temp_max = flash_stats.internal_temp_max;
+    i2c_registers_stats.tempco_residual = flash_stats.tempco_residual;
+    i2c_registers_stats.checkpoint_uptime_s = flash_stats.uptime_s;
+  } else {
+    i2c_registers_stats.internal_temp_min = 0xffff;
+  }
+  // newer than the checkpoint, checkpoint_uptime_s still shows what's in flash
+  if(warm_restored()) {
+    i2c_registers_stats.uptime_s = warm_state.uptime_s;
+    i2c_registers_stats.missed_edges = boot_missed_edges = warm_state.missed_edges;
+    i2c_registers_stats.internal_temp_min = warm_state.internal_temp_min;
+    i2c_registers_stats.internal_temp_max = warm_state.internal_temp_max;
+    i2c_registers_stats.tempco_residual = warm_state.tempco_residual;
+  }
+
+  uptime_ms = timer_now_ms();
+  next_checkpoint_s = i2c_registers_stats.uptime_s + CHECKPOINT_S;
+}
+
+void stats_warm_save() {
+  warm_state.uptime_s = i2c_registers_stats.uptime_s;
+  warm_state.missed_edges = i2c_registers_stats.missed_edges;
+  warm_state.internal_temp_min = i2c_registers_stats.internal_temp_min;
+  warm_state.internal_temp_max = i2c_registers_stats.internal_temp_max;
+  warm_state.tempco_residual = i2c_registers_stats.tempco_residual;
+}
+
+static void checkpoint() {
+  flash_stats.uptime_s = i2c_registers_stats.uptime_s;
+  flash_stats.missed_edges = i2c_registers_stats.missed_edges;
+  flash_stats.internal_temp_min = i2c_registers_stats.internal_temp_min;
+  flash_stats.internal_temp_max = i2c_registers_stats.internal_temp_max;
+  flash_stats.tempco_residual = i2c_registers_stats.tempco_residual;
+  flash_save_record(FLASH_RECORD_STATS);
+
+  i2c_registers_stats.checkpoint_uptime_s = flash_stats.uptime_s;
+  next_checkpoint_s = flash_stats.uptime_s + CHECKPOINT_S;
+}
+
+// called from the main loop on EVENT_TICK
+void stats_poll() {
+  uint32_t now = timer_now_ms();
+  uint16_t internal_temp = i2c_registers_page2.internal_temp;
+
+  while(now - uptime_ms >= 1000) {
+    uptime_ms += 1000;
+    i2c_registers_stats.uptime_s++;
+  }
+
+  i2c_registers_stats.missed_edges = boot_missed_edges + timer_missed_edges;
+
+  if(i2c_registers_page2.last_adc_ms != 0) {
+    if(internal_temp < i2c_registers_stats.internal_temp_min) {
+      i2c_registers_stats.internal_temp_min = internal_temp;
+    }
+    if(internal_temp > i2c_registers_stats.internal_temp_max) {
+      i2c_registers_stats.internal_temp_max = internal_temp;
+    }
+  }
+
+  if(i2c_registers_stats.uptime_s >= next_checkpoint_s) {
+    checkpoint();
+  }
+}
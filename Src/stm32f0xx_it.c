@@ -36,6 +36,35 @@
 #include "stm32f0xx_it.h"
 
 /* USER CODE BEGIN 0 */
+#include "main.h"
+#include "timer.h"
+#include "events.h"
+#include "i2c_slave.h"
+
+extern __IO uint32_t uwTick; // stm32f0xx_hal.c
+
+static uint8_t tick_countdown = EVENT_TICK_MS;
+
+// the hal versions run from flash, these keep the tick going during a flash save
+RAMFUNC void HAL_IncTick(void)
+{
+  uwTick++;
+  tick_countdown--;
+  if(tick_countdown == 0) {
+    tick_countdown = EVENT_TICK_MS;
+    event_set(EVENT_TICK);
+  }
+}
+
+RAMFUNC uint32_t HAL_GetTick(void)
+{
+  return uwTick;
+}
+
+// these keep running during a flash save, the generated definitions below get RAMFUNC from the declarations
+RAMFUNC void SysTick_Handler(void);
+RAMFUNC void TIM3_IRQHandler(void);
+RAMFUNC void I2C1_IRQHandler(void);
 
 /* USER CODE END 0 */
 
@@ -44,6 +73,7 @@ extern ADC_HandleTypeDef hadc;
 extern I2C_HandleTypeDef hi2c1;
 extern TIM_HandleTypeDef htim1;
 extern TIM_HandleTypeDef htim3;
+extern DMA_HandleTypeDef hdma_usart1_tx;
 extern UART_HandleTypeDef huart1;
 
 /******************************************************************************/
@@ -69,7 +99,8 @@ void NMI_Handler(void)
 void HardFault_Handler(void)
 {
   /* USER CODE BEGIN HardFault_IRQn 0 */
-
+  // don't spin until the watchdog bites, a software reset recovers sooner with the same warm state
+  NVIC_SystemReset();
   /* USER CODE END HardFault_IRQn 0 */
   while (1)
   {
@@ -111,7 +142,10 @@ void PendSV_Handler(void)
 void SysTick_Handler(void)
 {
   /* USER CODE BEGIN SysTick_IRQn 0 */
-
+  // SysTick is at the lowest priority, timestamps come from timer_ms so it only drives EVENT_TICK and the HAL timeouts
+  // HAL_SYSTICK_IRQHandler only calls the empty HAL_SYSTICK_Callback from flash
+  HAL_IncTick();
+  return;
   /* USER CODE END SysTick_IRQn 0 */
   HAL_IncTick();
   HAL_SYSTICK_IRQHandler();
@@ -141,13 +175,29 @@ void ADC1_IRQHandler(void)
   /* USER CODE END ADC1_IRQn 1 */
 }
 
+/**
+* @brief This function handles DMA1 channel 2 and 3 interrupts.
+*/
+void DMA1_Channel2_3_IRQHandler(void)
+{
+  /* USER CODE BEGIN DMA1_Channel2_3_IRQn 0 */
+
+  /* USER CODE END DMA1_Channel2_3_IRQn 0 */
+  HAL_DMA_IRQHandler(&hdma_usart1_tx);
+  /* USER CODE BEGIN DMA1_Channel2_3_IRQn 1 */
+
+  /* USER CODE END DMA1_Channel2_3_IRQn 1 */
+}
+
 /**
 * @brief This function handles TIM1 break, update, trigger and commutation interrupts.
 */
 void TIM1_BRK_UP_TRG_COM_IRQHandler(void)
 {
   /* USER CODE BEGIN TIM1_BRK_UP_TRG_COM_IRQn 0 */
-
+  // the wrap count and UIF change together, HAL_TIM_IRQHandler clears UIF before its callback
+  timer_tim1_irq();
+  return;
   /* USER CODE END TIM1_BRK_UP_TRG_COM_IRQn 0 */
   HAL_TIM_IRQHandler(&htim1);
   /* USER CODE BEGIN TIM1_BRK_UP_TRG_COM_IRQn 1 */
@@ -161,7 +211,9 @@ void TIM1_BRK_UP_TRG_COM_IRQHandler(void)
 void TIM3_IRQHandler(void)
 {
   /* USER CODE BEGIN TIM3_IRQn 0 */
-
+  // straight to the capture code in ram, HAL_TIM_IRQHandler is in flash
+  timer_irq();
+  return;
   /* USER CODE END TIM3_IRQn 0 */
   HAL_TIM_IRQHandler(&htim3);
   /* USER CODE BEGIN TIM3_IRQn 1 */
@@ -175,7 +227,9 @@ void TIM3_IRQHandler(void)
 void I2C1_IRQHandler(void)
 {
   /* USER CODE BEGIN I2C1_IRQn 0 */
-
+  // i2c_slave.c runs the peripheral on its registers from ram, the HAL's slave functions aren't used
+  i2c_slave_irq();
+  return;
   /* USER CODE END I2C1_IRQn 0 */
   if (hi2c1.Instance->ISR & (I2C_FLAG_BERR | I2C_FLAG_ARLO | I2C_FLAG_OVR)) {
     HAL_I2C_ER_IRQHandler(&hi2c1);
@@ -202,6 +256,13 @@ void USART1_IRQHandler(void)
 }
 
 /* USER CODE BEGIN 1 */
+/**
+* @brief This function handles TIM14 global interrupt.
+*/
+RAMFUNC void TIM14_IRQHandler(void)
+{
+  timer_tim14_irq();
+}
 
 /* USER CODE END 1 */
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
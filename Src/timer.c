@@ -1,4 +1,5 @@
 #include "stm32f0xx_hal.h"
+#include "main.h"
 
 #include <stdlib.h>
 #include <math.h>
@@ -6,84 +7,276 @@
 #include "timer.h"
 #include "uart.h"
 #include "i2c_slave.h"
+#include "events.h"
+#include "warm.h"
 
-// TIM3 input capture 
-void HAL_TIM_IC_CaptureCallback(TIM_HandleTypeDef *htim) {
+// capture overflows since boot, for the stats page
+volatile uint32_t timer_missed_edges = 0;
+
+/* the millisecond clock is the TIM1:TIM3 count divided down, so page1's ms and cycle fields share a time base
+ * the 32 bit count wraps every 2^32 cycles = WRAP_MS ms + WRAP_CYCLES cycles, the TIM1 update irq adds that up
+ */
+#define CYCLES_PER_MS 48000
+#define WRAP_MS 89478
+#define WRAP_CYCLES 23296
+
+static volatile uint32_t wrap_ms, wrap_cycles; // at the last TIM1 wrap, wrap_cycles < CYCLES_PER_MS
+
+static uint8_t next_capture = 0; // capture_count % I2C_CAPTURE_BATCH
+
+/* TIM14 runs on the same clock as TIM3 but starts counting later, so TIM3 = TIM14 + tim14_offset
+ * set each time TIM14 starts, its captures go on the page already converted to TIM3 counts
+ */
+static uint16_t tim14_offset;
+static uint8_t tim14_running = 0;
+#define OFFSET_SAMPLES 4
+
+// keep a history of captures for the v3 captures page
+RAMFUNC static void add_capture(uint8_t channel, uint16_t tim3_at_cap, uint16_t tim1_at_irq, uint16_t tim3_at_irq) {
+  struct i2c_capture *capture = &i2c_registers_captures.captures[next_capture];
+
+  capture->tim3_at_cap = tim3_at_cap;
+  capture->tim1_at_irq = tim1_at_irq;
+  capture->tim3_at_irq = tim3_at_irq;
+  capture->channel = channel;
+  i2c_registers_captures.capture_count++;
+  event_set(EVENT_CAPTURE);
+
+  next_capture++;
+  if(next_capture >= I2C_CAPTURE_BATCH) {
+    next_capture = 0;
+  }
+}
+
+/* ms since timer_start at a TIM1:TIM3 reading, the caller keeps the TIM1 irq from running in the middle
+ * divides by CYCLES_PER_MS without the flash resident libgcc divide, which a loop of subtractions also turns into
+ * 699 / 2^25 is just under 1 / 48000: the first estimate is at most 8 low, which leaves under 2^19 cycles,
+ * and the second one on those is at most 1 low
+ */
+RAMFUNC uint32_t timer_ms(uint16_t tim1, uint16_t tim3) {
+  uint32_t count = ((uint32_t)tim1 << 16) | tim3;
+  uint32_t ms = wrap_ms, cycles = wrap_cycles, estimate;
+
+  if(__HAL_TIM_GET_FLAG(&htim1, TIM_FLAG_UPDATE) && tim1 < 0x8000) { // wrapped, the TIM1 irq hasn't counted it yet
+    ms += WRAP_MS;
+    cycles += WRAP_CYCLES;
+  }
+  estimate = ((count >> 15) * 699) >> 10;
+  cycles += count - estimate * CYCLES_PER_MS;
+  ms += estimate;
+
+  estimate = (cycles * 699) >> 25;
+  cycles -= estimate * CYCLES_PER_MS;
+  ms += estimate;
+  if(cycles >= CYCLES_PER_MS) {
+    ms++;
+  }
+  return ms;
+}
+
+// replaces HAL_GetTick for timestamps, it's on the same clock as the captures
+RAMFUNC uint32_t timer_now_ms() {
+  uint16_t tim1, tim3;
+  uint32_t ms;
+
+  __disable_irq();
+  do { // a TIM3 wrap between the reads would pair the new TIM1 with the old TIM3
+    tim1 = __HAL_TIM_GET_COUNTER(&htim1);
+    tim3 = __HAL_TIM_GET_COUNTER(&htim3);
+  } while(tim1 != __HAL_TIM_GET_COUNTER(&htim1));
+  ms = timer_ms(tim1, tim3);
+  __enable_irq();
+
+  return ms;
+}
+
+/* TIM1 update, once every 2^32 cycles
+ * UIF is cleared in the same irq-disabled section that moves wrap_ms on: timer_ms counts the wrap itself while
+ * UIF is set, a capture between the two would get a timestamp WRAP_MS low (HAL_TIM_IRQHandler clears UIF first)
+ * it runs from flash, masked during a flash operation, timer_ms counts a wrap that's still pending
+ */
+void timer_tim1_irq() {
+  uint32_t ms = wrap_ms + WRAP_MS, cycles = wrap_cycles + WRAP_CYCLES;
+
+  if(!__HAL_TIM_GET_FLAG(&htim1, TIM_FLAG_UPDATE)) {
+    return;
+  }
+  if(cycles >= CYCLES_PER_MS) {
+    cycles -= CYCLES_PER_MS;
+    ms++;
+  }
+  __disable_irq(); // the capture irq reads both and the flag
+  __HAL_TIM_CLEAR_FLAG(&htim1, TIM_FLAG_UPDATE);
+  wrap_ms = ms;
+  wrap_cycles = cycles;
+  __enable_irq();
+}
+
+/* TIM3 and TIM14 input capture, everything on this path runs from ram so captures aren't delayed by a flash save
+ * the capture register is read before the counters: an edge captured after the TIM3 read would give
+ * tim3_at_cap > tim3_at_irq, which the host takes as TIM3 having wrapped between the capture and the irq
+ */
+RAMFUNC void HAL_TIM_IC_CaptureCallback(TIM_HandleTypeDef *htim) {
   static uint8_t counts_ch1 = DEFAULT_SOURCE_HZ;
-  uint16_t tim3_at_irq, tim1_at_irq;
-  uint32_t milliseconds_irq;
+  uint16_t tim3_at_cap, tim3_at_irq, tim1_at_irq;
+  uint32_t overflow_flag;
+  uint8_t channel, edges = 1;
 
-  // get the timer values first, to lower the chance of tim3 wrapping
+  // figure out where the input capture came from
+  if(htim == &htim14) {
+    tim3_at_cap = htim14.Instance->CCR1 + tim14_offset;
+    overflow_flag = TIM_FLAG_CC1OF;
+    channel = I2C_CHANNEL_TIM14;
+  } else if(htim->Channel == HAL_TIM_ACTIVE_CHANNEL_1) {
+    tim3_at_cap = htim3.Instance->CCR1;
+    overflow_flag = TIM_FLAG_CC1OF;
+    channel = 0;
+  } else if(htim->Channel == HAL_TIM_ACTIVE_CHANNEL_2) {
+    tim3_at_cap = htim3.Instance->CCR2;
+    overflow_flag = TIM_FLAG_CC2OF;
+    channel = 1;
+  } else {
+    tim3_at_cap = htim3.Instance->CCR4;
+    overflow_flag = TIM_FLAG_CC4OF;
+    channel = 2;
+  }
+  // then the timer values, to lower the chance of tim3 wrapping
   tim3_at_irq = __HAL_TIM_GET_COUNTER(&htim3);
   tim1_at_irq = __HAL_TIM_GET_COUNTER(&htim1);
-  milliseconds_irq = HAL_GetTick();
 
-  // figure out where the input capture came from
-  if(htim->Channel == HAL_TIM_ACTIVE_CHANNEL_1) {
-    counts_ch1--;
-    if(counts_ch1 == 0) {
-      i2c_registers.tim3_at_irq[0] = tim3_at_irq;
-      i2c_registers.tim1_at_irq[0] = tim1_at_irq;
-      i2c_registers.milliseconds_irq_ch1 = milliseconds_irq;
-      i2c_registers.tim3_at_cap[0] = HAL_TIM_ReadCapturedValue(&htim3, TIM_CHANNEL_1);
-
-      if(i2c_registers.source_HZ_ch1 > 0) {
-	counts_ch1 = i2c_registers.source_HZ_ch1;
-      } else {
-	counts_ch1 = i2c_registers.source_HZ_ch1 = DEFAULT_SOURCE_HZ;
-      }
-    }
-    if(__HAL_TIM_GET_FLAG(htim, TIM_FLAG_CC1OF)) { // there was an overflow event
-      // don't consider this as the normal counts_ch1, as it shouldn't happen at low frequencies
-      __HAL_TIM_CLEAR_FLAG(htim, TIM_FLAG_CC1OF);
+  // channel 1 only keeps every source_HZ_ch1th edge, the others keep them all
+  if(channel != 0 || --counts_ch1 == 0) {
+    if(channel < I2C_INPUT_CHANNELS) { // TIM14 is only on the captures page and the uart stream
+      i2c_registers.tim3_at_irq[channel] = tim3_at_irq;
+      i2c_registers.tim1_at_irq[channel] = tim1_at_irq;
+      i2c_registers.tim3_at_cap[channel] = tim3_at_cap;
     }
-  } else if(htim->Channel == HAL_TIM_ACTIVE_CHANNEL_2) {
-    i2c_registers.tim3_at_irq[1] = tim3_at_irq;
-    i2c_registers.tim1_at_irq[1] = tim1_at_irq;
-    i2c_registers.tim3_at_cap[1] = HAL_TIM_ReadCapturedValue(&htim3, TIM_CHANNEL_2);
-    i2c_registers.ch2_count++;
-    if(__HAL_TIM_GET_FLAG(htim, TIM_FLAG_CC2OF)) { // there was an overflow event
-      i2c_registers.ch2_count++;
-      __HAL_TIM_CLEAR_FLAG(htim, TIM_FLAG_CC2OF);
+    add_capture(channel, tim3_at_cap, tim1_at_irq, tim3_at_irq);
+  }
+  if(__HAL_TIM_GET_FLAG(htim, overflow_flag)) { // there was an overflow event
+    // channel 1 doesn't count it towards counts_ch1, as it shouldn't happen at low frequencies
+    edges++;
+    timer_missed_edges++;
+    __HAL_TIM_CLEAR_FLAG(htim, overflow_flag);
+  }
+
+  if(channel == 1) {
+    i2c_registers.ch2_count += edges;
+  } else if(channel == 2) {
+    i2c_registers.ch4_count += edges;
+  } else if(channel == 0 && counts_ch1 == 0) {
+    i2c_registers.milliseconds_irq_ch1 = timer_ms(tim1_at_irq, tim3_at_irq);
+    // each toggle tells the host there's a new page1 channel 1 capture
+    DATA_READY_GPIO_Port->ODR ^= DATA_READY_Pin;
+
+    if(i2c_registers.source_HZ_ch1 > 0) {
+      counts_ch1 = i2c_registers.source_HZ_ch1;
+    } else {
+      counts_ch1 = i2c_registers.source_HZ_ch1 = DEFAULT_SOURCE_HZ;
     }
-  } else if(htim->Channel == HAL_TIM_ACTIVE_CHANNEL_4) {
-    i2c_registers.tim3_at_irq[2] = tim3_at_irq;
-    i2c_registers.tim1_at_irq[2] = tim1_at_irq;
-    i2c_registers.tim3_at_cap[2] = HAL_TIM_ReadCapturedValue(&htim3, TIM_CHANNEL_4);
-    i2c_registers.ch4_count++;
-    if(__HAL_TIM_GET_FLAG(htim, TIM_FLAG_CC4OF)) { // there was an overflow event
-      i2c_registers.ch4_count++;
-      __HAL_TIM_CLEAR_FLAG(htim, TIM_FLAG_CC4OF);
+  }
+}
+
+/* a TIM3 read between two TIM14 reads lands about halfway between them
+ * the sample with the closest TIM14 reads has the least room for a bus stall
+ */
+static void tim14_calibrate() {
+  uint16_t before, tim3, after, spread, best_spread = 0xffff;
+
+  for(uint8_t i = 0; i < OFFSET_SAMPLES; i++) {
+    __disable_irq();
+    before = __HAL_TIM_GET_COUNTER(&htim14);
+    tim3 = __HAL_TIM_GET_COUNTER(&htim3);
+    after = __HAL_TIM_GET_COUNTER(&htim14);
+    __enable_irq();
+
+    spread = after - before;
+    if(spread < best_spread) {
+      best_spread = spread;
+      tim14_offset = tim3 - (uint16_t)(before + spread / 2);
     }
   }
 }
 
+// follows i2c_registers_info.extra_inputs, called every tick
+void timer_poll() {
+  uint8_t want = (i2c_registers_info.extra_inputs & I2C_EXTRA_INPUT_TIM14) != 0;
+
+  if(want == tim14_running) {
+    return;
+  }
+  if(want) {
+    // a stopped TIM14 keeps its count, so the offset is only good for this run
+    __HAL_TIM_CLEAR_FLAG(&htim14, TIM_FLAG_CC1 | TIM_FLAG_CC1OF);
+    HAL_TIM_IC_Start_IT(&htim14, TIM_CHANNEL_1);
+    tim14_calibrate();
+  } else {
+    HAL_TIM_IC_Stop_IT(&htim14, TIM_CHANNEL_1);
+  }
+  tim14_running = want;
+}
+
+// the input capture part of HAL_TIM_IRQHandler, which runs from flash
+static RAMFUNC void capture_irq(TIM_HandleTypeDef *htim, uint32_t it, uint32_t channel) {
+  if(__HAL_TIM_GET_FLAG(htim, it) && __HAL_TIM_GET_IT_SOURCE(htim, it)) {
+    __HAL_TIM_CLEAR_IT(htim, it);
+    htim->Channel = channel;
+    HAL_TIM_IC_CaptureCallback(htim);
+    htim->Channel = HAL_TIM_ACTIVE_CHANNEL_CLEARED;
+  }
+}
+
+RAMFUNC void timer_irq() {
+  capture_irq(&htim3, TIM_IT_CC1, HAL_TIM_ACTIVE_CHANNEL_1);
+  capture_irq(&htim3, TIM_IT_CC2, HAL_TIM_ACTIVE_CHANNEL_2);
+  capture_irq(&htim3, TIM_IT_CC4, HAL_TIM_ACTIVE_CHANNEL_4);
+}
+
+// PA4 input capture, the same fields as a TIM3 capture but only on the captures page and the uart stream
+RAMFUNC void timer_tim14_irq() {
+  capture_irq(&htim14, TIM_IT_CC1, HAL_TIM_ACTIVE_CHANNEL_1);
+}
+
 void timer_start() {
-  HAL_TIM_Base_Start(&htim1);
+  // the capture counters carry on after a warm restart, the ring position follows capture_count
+  if(warm_restored()) {
+    i2c_registers_captures.capture_count = warm_state.capture_count;
+    next_capture = warm_state.capture_count % I2C_CAPTURE_BATCH;
+    i2c_registers.ch2_count = warm_state.ch2_count;
+    i2c_registers.ch4_count = warm_state.ch4_count;
+  }
+
+  __HAL_TIM_CLEAR_FLAG(&htim1, TIM_FLAG_UPDATE); // set by the init's update event, it isn't a wrap
+  HAL_TIM_Base_Start_IT(&htim1);
   HAL_TIM_Base_Start(&htim3);
   HAL_TIM_IC_Start_IT(&htim3, TIM_CHANNEL_1);
   HAL_TIM_IC_Start_IT(&htim3, TIM_CHANNEL_2);
   HAL_TIM_IC_Start_IT(&htim3, TIM_CHANNEL_4);
 }
 
+void timer_warm_save() {
+  warm_state.capture_count = i2c_registers_captures.capture_count;
+  warm_state.ch2_count = i2c_registers.ch2_count;
+  warm_state.ch4_count = i2c_registers.ch4_count;
+}
+
+// the uart writes only queue, so this doesn't hold up the main loop
 void print_timer_status() {
-#if 0
   static uint32_t last_irq = 0;
 
-  if(i2c_registers.milliseconds_irq != last_irq) {
+  if(i2c_registers.milliseconds_irq_ch1 != last_irq) {
     write_uart_s("cap 3=");
-    write_uart_u(i2c_registers.tim3_at_cap);
+    write_uart_u(i2c_registers.tim3_at_cap[0]);
     write_uart_s(" 1=");
-    write_uart_u(i2c_registers.tim1_at_irq);
+    write_uart_u(i2c_registers.tim1_at_irq[0]);
     write_uart_s(" (3@");
-    write_uart_u(i2c_registers.tim3_at_irq);
+    write_uart_u(i2c_registers.tim3_at_irq[0]);
     write_uart_s(") ms=");
-    write_uart_u(i2c_registers.milliseconds_irq);
+    write_uart_u(i2c_registers.milliseconds_irq_ch1);
     write_uart_s(" now=");
-    write_uart_u(HAL_GetTick());
+    write_uart_u(timer_now_ms());
     write_uart_s("\n");
 
-    last_irq = i2c_registers.milliseconds_irq;
+    last_irq = i2c_registers.milliseconds_irq_ch1;
   }
-#endif
 }
@@ -4,9 +4,83 @@
 #include <stdlib.h>
 
 #include "uart.h"
+#include "events.h"
+
+// bytes waiting for the tx dma, tx_tail up to tx_head
+static uint8_t tx_buffer[UART_TX_BUFFER_SIZE];
+static volatile uint16_t tx_head = 0;    // next byte written
+static volatile uint16_t tx_tail = 0;    // next byte sent
+static volatile uint16_t tx_sending = 0; // bytes in the current dma transfer
+volatile uint32_t uart_tx_dropped = 0;   // writes that didn't fit
+
+// the ring isn't a power of 2 in size, and the M0 has no divide instruction for a %
+static inline uint16_t wrap(uint16_t position) {
+  return position >= UART_TX_BUFFER_SIZE ? position - UART_TX_BUFFER_SIZE : position;
+}
+
+// send the next contiguous run of the ring, call with irqs disabled or from the uart irq
+static void tx_start() {
+  uint16_t length;
+
+  if(tx_sending || tx_head == tx_tail) {
+    return;
+  }
+
+  if(tx_head > tx_tail) {
+    length = tx_head - tx_tail;
+  } else {
+    length = UART_TX_BUFFER_SIZE - tx_tail; // up to the wrap, the rest goes in the next transfer
+  }
+  // uart_tx_poll tries again from the main loop if the hal is busy
+  if(HAL_UART_Transmit_DMA(&UART_NAME, &tx_buffer[tx_tail], length) == HAL_OK) {
+    tx_sending = length;
+  } else {
+    event_set(EVENT_UART);
+  }
+}
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {
+  tx_tail = wrap(tx_tail + tx_sending);
+  tx_sending = 0;
+  tx_start();
+}
+
+// queue the whole buffer or none of it, safe to call from irqs or with irqs disabled
+uint8_t write_uart_buffer(const uint8_t *data, uint16_t length) {
+  uint32_t primask = __get_PRIMASK();
+  uint16_t used, space, first;
+
+  __disable_irq();
+  used = wrap(tx_head + UART_TX_BUFFER_SIZE - tx_tail);
+  space = UART_TX_BUFFER_SIZE - 1 - used;
+  if(length > space) {
+    uart_tx_dropped++;
+    __set_PRIMASK(primask);
+    return 0;
+  }
+
+  first = UART_TX_BUFFER_SIZE - tx_head;
+  if(first > length) {
+    first = length;
+  }
+  memcpy(&tx_buffer[tx_head], data, first);
+  memcpy(tx_buffer, data + first, length - first);
+  tx_head = wrap(tx_head + length);
+
+  tx_start();
+  __set_PRIMASK(primask);
+  return 1;
+}
+
+// restart a transfer that couldn't start earlier, called from the main loop on EVENT_UART
+void uart_tx_poll() {
+  __disable_irq();
+  tx_start();
+  __enable_irq();
+}
 
 void write_uart_s(const char *s) {
-  HAL_UART_Transmit(&UART_NAME, (uint8_t *)s, strlen(s), 500);
+  write_uart_buffer((const uint8_t *)s, strlen(s));
 }
 
 void write_uart_u(uint32_t i) {
@@ -58,3 +132,11 @@ char uart_rx_data() {
   start = (start + 1) % sizeof(uartBuffer);
   return uartBuffer[start];
 }
+
+// the hal aborts tx dma on a dma error
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {
+  if(huart->gState == HAL_UART_STATE_READY && tx_sending) {
+    tx_sending = 0; // send the same run again
+    tx_start();
+  }
+}
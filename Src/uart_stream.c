@@ -0,0 +1,112 @@
+#include "stm32f0xx_hal.h"
+
+#include <string.h>
+
+#include "uart_stream.h"
+#include "uart.h"
+#include "i2c_slave.h"
+#include "crc8.h"
+
+// pushes every capture and adc reading out the uart while i2c_registers_info.uart_stream is on
+
+static uint8_t sequence = 0;
+static uint32_t streamed_count = 0; // captures page capture_count already sent
+
+// the bytes a frame adds to its message: crc8, the COBS overhead byte and the 0x00
+#define FRAME_OVERHEAD (UART_STREAM_FRAME_MAX - UART_STREAM_MESSAGE_MAX)
+
+// a debug line and a pass's frames, see uart.h
+#define DEBUG_LINE_MAX 59
+_Static_assert(UART_TX_BUFFER_SIZE - 1 >= DEBUG_LINE_MAX + (I2C_CAPTURE_BATCH + 1) * UART_STREAM_FRAME_MAX,
+    "the uart tx ring can't hold a debug line and a pass's frames");
+
+/* frame = COBS(message + crc8) + 0x00, built in place so the main loop's stack doesn't hold a second copy
+ * the message needs FRAME_OVERHEAD bytes of room after it
+ */
+static void send_message(void *message, uint8_t length) {
+  uint8_t *frame = message;
+  uint8_t next = length + 2; // where the code byte after this one is, the 0x00 to start with
+
+  ((struct uart_stream_header *)message)->sequence = sequence++;
+  frame[length] = crc8(0, frame, length);
+  frame[length + 2] = 0;
+
+  // from the end: every byte moves up one and every 0x00 becomes the distance to the next one,
+  // messages are short enough for one block
+  for(uint8_t i = length + 1; i-- > 0;) {
+    if(frame[i] == 0) {
+      frame[i + 1] = next - (i + 1);
+      next = i + 1;
+    } else {
+      frame[i + 1] = frame[i];
+    }
+  }
+  frame[0] = next;
+
+  // a full tx ring drops the frame, the sequence gap shows it on the host
+  write_uart_buffer(frame, length + FRAME_OVERHEAD);
+}
+
+static void send_capture(uint32_t count) {
+  struct {
+    struct uart_stream_capture message;
+    uint8_t room[FRAME_OVERHEAD];
+  } frame;
+  struct uart_stream_capture *message = &frame.message;
+  const struct i2c_capture *capture = &i2c_registers_captures.captures[(count - 1) % I2C_CAPTURE_BATCH];
+
+  message->header.type = UART_STREAM_CAPTURE;
+  message->reserved = 0;
+  message->reserved2 = 0;
+  message->capture_count = count;
+  __disable_irq();
+  message->channel = capture->channel;
+  message->tim3_at_cap = capture->tim3_at_cap;
+  message->tim1_at_irq = capture->tim1_at_irq;
+  message->tim3_at_irq = capture->tim3_at_irq;
+  __enable_irq();
+
+  send_message(message, sizeof(*message));
+}
+
+// send the captures that arrived since the last call, called from the main loop on EVENT_CAPTURE
+void uart_stream_poll() {
+  uint32_t count = i2c_registers_captures.capture_count;
+
+  if(i2c_registers_info.uart_stream != UART_STREAM_ON) {
+    streamed_count = count;
+    return;
+  }
+
+  // older captures have already been overwritten in the ring
+  if(count - streamed_count > I2C_CAPTURE_BATCH) {
+    streamed_count = count - I2C_CAPTURE_BATCH;
+  }
+  while(streamed_count != count) {
+    streamed_count++;
+    send_capture(streamed_count);
+  }
+}
+
+// called after adc_done
+void uart_stream_adc() {
+  struct {
+    struct uart_stream_adc message;
+    uint8_t room[FRAME_OVERHEAD];
+  } frame;
+  struct uart_stream_adc *message = &frame.message;
+
+  if(i2c_registers_info.uart_stream != UART_STREAM_ON) {
+    return;
+  }
+
+  message->header.type = UART_STREAM_ADC;
+  memset(message->reserved, '\0', sizeof(message->reserved));
+  message->last_adc_ms = i2c_registers_page2.last_adc_ms;
+  message->internal_temp = i2c_registers_page2.internal_temp;
+  message->internal_vref = i2c_registers_page2.internal_vref;
+  message->external_temp = i2c_registers_page2.external_temp;
+  message->tx_dropped = uart_tx_dropped;
+
+  send_message(message, sizeof(*message));
+}
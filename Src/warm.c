@@ -0,0 +1,75 @@
+#include "stm32f0xx_hal.h"
+
+#include <stddef.h>
+
+#include "warm.h"
+#include "timer.h"
+#include "i2c_slave.h"
+#include "adc.h"
+#include "stats.h"
+#include "crc8.h"
+
+// the size is in the magic, so a firmware with a different layout doesn't take the old snapshot
+#define WARM_MAGIC (0x57a40000 | sizeof(struct warm_state))
+
+_Static_assert(sizeof(struct warm_state) < 256, "warm_state is too large for crc8");
+
+// warm boots in a row that didn't get as far as a warm_save, a reset loop, before the snapshot is dropped
+#define WARM_MAX_UNSAVED_BOOTS 3
+
+// the startup code doesn't zero or copy this section, see the linker script
+struct warm_state warm_state __attribute__((section(".noinit")));
+
+static uint8_t boot_state = I2C_BOOT_COLD;
+
+static uint8_t warm_crc() {
+  return crc8(0, (const uint8_t *)&warm_state, offsetof(struct warm_state, crc8));
+}
+
+// reset_flags is RCC_CSR bits 31-24 (I2C_RESET_X), called before timer_start
+void warm_start(uint8_t reset_flags) {
+  if(reset_flags & I2C_RESET_POWER) { // ram didn't survive
+    boot_state = I2C_BOOT_COLD;
+  } else if(warm_state.magic == WARM_MAGIC && warm_state.crc8 == warm_crc()) {
+    boot_state = I2C_BOOT_WARM;
+  } else {
+    boot_state = I2C_BOOT_STATE_LOST;
+  }
+  // something in the snapshot, or in the first tick after it, keeps faulting, so start over without it
+  if(boot_state == I2C_BOOT_WARM && warm_state.unsaved_boots >= WARM_MAX_UNSAVED_BOOTS) {
+    boot_state = I2C_BOOT_STATE_LOST;
+  }
+
+  if(boot_state == I2C_BOOT_WARM) {
+    if(warm_state.restarts < 255) {
+      warm_state.restarts++;
+    }
+    warm_state.unsaved_boots++;
+    warm_state.crc8 = warm_crc(); // a second reset before the next snapshot still finds it valid
+  } else {
+    warm_state.magic = 0; // until the first warm_save
+    warm_state.restarts = 0;
+    warm_state.unsaved_boots = 0;
+  }
+}
+
+// I2C_BOOT_X, for the info page
+uint8_t warm_boot_state() {
+  return boot_state;
+}
+
+uint8_t warm_restored() {
+  return boot_state == I2C_BOOT_WARM;
+}
+
+// called from the main loop on EVENT_TICK
+void warm_save() {
+  timer_warm_save();
+  i2c_slave_warm_save();
+  adc_warm_save();
+  stats_warm_save();
+
+  warm_state.unsaved_boots = 0;
+  warm_state.magic = WARM_MAGIC;
+  warm_state.crc8 = warm_crc();
+}
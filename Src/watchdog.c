@@ -0,0 +1,33 @@
+#include "stm32f0xx_hal.h"
+
+#include "watchdog.h"
+
+/* the IWDG counts the LSI, 40kHz nominal but anywhere from 30 to 50kHz
+ * /8 with a reload of 1250 is 250ms nominal and 200ms with the fastest LSI
+ * the longest main loop pass is a flash page erase, 40ms at most
+ */
+#define IWDG_KEY_START 0xcccc
+#define IWDG_KEY_UNLOCK 0x5555
+#define IWDG_KEY_REFRESH 0xaaaa
+#define IWDG_PRESCALER_8 IWDG_PR_PR_0
+#define IWDG_RELOAD 1250
+
+// once started it can't be stopped until the next reset
+void watchdog_start() {
+  // hold the count while a debugger has the core halted
+  __HAL_RCC_DBGMCU_CLK_ENABLE();
+  __HAL_DBGMCU_FREEZE_IWDG();
+
+  IWDG->KR = IWDG_KEY_START; // starts the LSI too
+  IWDG->KR = IWDG_KEY_UNLOCK;
+  IWDG->PR = IWDG_PRESCALER_8;
+  IWDG->RLR = IWDG_RELOAD;
+  while(IWDG->SR != 0) { // the new values take a few LSI cycles to reach the counter
+  }
+  IWDG->KR = IWDG_KEY_REFRESH;
+}
+
+// once per main loop pass, a stuck main loop resets the chip and warm_start picks up where it left off
+void watchdog_feed() {
+  IWDG->KR = IWDG_KEY_REFRESH;
+}
@@ -0,0 +1,626 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "armv6m.h"
+
+/* instruction timings are the cortex-m0 TRM ones for zero wait state memory:
+ * 1 cycle, loads and stores 2, LDM/STM/PUSH/POP 1+N, POP with pc 3+N, taken branches and BX 3, BL 4, MSR/MRS/barriers 4
+ * the flash wait state is charged on data reads from flash (literal pools, const tables) and on branches into flash,
+ * sequential fetches are assumed to be covered by the prefetch buffer
+ */
+
+#define SP 13
+#define LR 14
+#define PC 15
+
+static void fault(struct armv6m *cpu, const char *format, ...) {
+  va_list ap;
+
+  if(cpu->error[0]) { // keep the first one
+    return;
+  }
+  va_start(ap, format);
+  vsnprintf(cpu->error, sizeof(cpu->error), format, ap);
+  va_end(ap);
+}
+
+uint8_t *armv6m_map(struct armv6m *cpu, uint32_t base, uint32_t size, uint8_t wait_states) {
+  struct armv6m_region *region;
+
+  if(cpu->region_count >= ARMV6M_REGIONS) {
+    fprintf(stderr, "armv6m: too many regions\n");
+    exit(1);
+  }
+  region = &cpu->regions[cpu->region_count++];
+  region->base = base;
+  region->size = size;
+  region->wait_states = wait_states;
+  region->write = NULL;
+  region->data = calloc(size, 1);
+  if(region->data == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  return region->data;
+}
+
+static struct armv6m_region *find_region(struct armv6m *cpu, uint32_t address, uint8_t size) {
+  for(uint8_t i = 0; i < cpu->region_count; i++) {
+    struct armv6m_region *region = &cpu->regions[i];
+
+    if(address >= region->base && address - region->base < region->size && region->size - (address - region->base) >= size) {
+      return region;
+    }
+  }
+  return NULL;
+}
+
+static uint8_t *locate(struct armv6m *cpu, uint32_t address, uint8_t size, const char *what, struct armv6m_region **found) {
+  struct armv6m_region *region;
+
+  if(address % size) { // a hardfault on the m0
+    fault(cpu, "unaligned %u byte %s at %08x", size, what, address);
+    return NULL;
+  }
+  region = find_region(cpu, address, size);
+  if(region == NULL) {
+    fault(cpu, "%u byte %s of unmapped %08x", size, what, address);
+    return NULL;
+  }
+  if(found != NULL) {
+    *found = region;
+  }
+  return region->data + (address - region->base);
+}
+
+uint32_t armv6m_read(struct armv6m *cpu, uint32_t address, uint8_t size) {
+  uint8_t *p = locate(cpu, address, size, "read", NULL);
+  uint32_t value = 0;
+
+  if(p == NULL) {
+    return 0;
+  }
+  for(uint8_t i = 0; i < size; i++) {
+    value |= (uint32_t)p[i] << (8 * i);
+  }
+  return value;
+}
+
+void armv6m_write(struct armv6m *cpu, uint32_t address, uint32_t value, uint8_t size) {
+  uint8_t *p = locate(cpu, address, size, "write", NULL);
+
+  if(p == NULL) {
+    return;
+  }
+  for(uint8_t i = 0; i < size; i++) {
+    p[i] = value >> (8 * i);
+  }
+}
+
+static uint32_t load(struct armv6m *cpu, uint32_t address, uint8_t size) {
+  struct armv6m_region *region;
+
+  if(locate(cpu, address, size, "read", &region) == NULL) {
+    return 0;
+  }
+  cpu->cycles += region->wait_states;
+  return armv6m_read(cpu, address, size);
+}
+
+static void store(struct armv6m *cpu, uint32_t address, uint32_t value, uint8_t size) {
+  struct armv6m_region *region;
+
+  if(locate(cpu, address, size, "write", &region) == NULL) {
+    return;
+  }
+  cpu->cycles += region->wait_states;
+  if(region->write != NULL) {
+    value = region->write(address, armv6m_read(cpu, address, size), value);
+  }
+  armv6m_write(cpu, address, value, size);
+}
+
+// new pc for a branch, charging the pipeline refill from the target
+static uint32_t branch(struct armv6m *cpu, uint32_t target) {
+  struct armv6m_region *region = find_region(cpu, target & ~1, 2);
+
+  if(region != NULL) {
+    cpu->cycles += region->wait_states;
+  }
+  return target & ~1;
+}
+
+static void set_nz(struct armv6m *cpu, uint32_t result) {
+  cpu->n = result >> 31;
+  cpu->z = result == 0;
+}
+
+static uint32_t add_with_carry(struct armv6m *cpu, uint32_t x, uint32_t y, uint8_t carry, uint8_t set_flags) {
+  uint64_t unsigned_sum = (uint64_t)x + y + carry;
+  int64_t signed_sum = (int64_t)(int32_t)x + (int32_t)y + carry;
+  uint32_t result = unsigned_sum;
+
+  if(set_flags) {
+    set_nz(cpu, result);
+    cpu->c = unsigned_sum != result;
+    cpu->v = (int64_t)(int32_t)result != signed_sum;
+  }
+  return result;
+}
+
+#define SHIFT_LSL 0
+#define SHIFT_LSR 1
+#define SHIFT_ASR 2
+#define SHIFT_ROR 3
+
+// shift by a register amount, 0 leaves the carry alone
+static uint32_t shift(struct armv6m *cpu, uint8_t type, uint32_t x, uint32_t amount) {
+  if(amount == 0) {
+    return x;
+  }
+  switch(type) {
+    case SHIFT_LSL:
+      cpu->c = amount <= 32 ? (x >> (32 - amount)) & 1 : 0;
+      return amount < 32 ? x << amount : 0;
+    case SHIFT_LSR:
+      cpu->c = amount <= 32 ? (x >> (amount - 1)) & 1 : 0;
+      return amount < 32 ? x >> amount : 0;
+    case SHIFT_ASR:
+      if(amount >= 32) {
+        cpu->c = x >> 31;
+        return (x >> 31) ? 0xffffffff : 0;
+      }
+      cpu->c = (x >> (amount - 1)) & 1;
+      return (uint32_t)((int32_t)x >> amount);
+    default:
+      amount %= 32;
+      if(amount) {
+        x = (x >> amount) | (x << (32 - amount));
+      }
+      cpu->c = x >> 31;
+      return x;
+  }
+}
+
+static uint8_t condition(struct armv6m *cpu, uint8_t cond) {
+  uint8_t result;
+
+  switch(cond >> 1) {
+    case 0: result = cpu->z; break;
+    case 1: result = cpu->c; break;
+    case 2: result = cpu->n; break;
+    case 3: result = cpu->v; break;
+    case 4: result = cpu->c && !cpu->z; break;
+    case 5: result = cpu->n == cpu->v; break;
+    case 6: result = !cpu->z && cpu->n == cpu->v; break;
+    default: result = 1; break;
+  }
+  return (cond & 1) ? !result : result;
+}
+
+// a register as an operand, the pc reads as the instruction address + 4
+static uint32_t reg(struct armv6m *cpu, uint32_t pc, uint8_t n) {
+  return n == PC ? pc + 4 : cpu->r[n];
+}
+
+static void data_processing(struct armv6m *cpu, uint16_t op) {
+  uint32_t *r = cpu->r;
+  uint8_t rdn = op & 7;
+  uint32_t m = r[(op >> 3) & 7];
+  uint32_t result;
+
+  switch((op >> 6) & 0xf) {
+    case 0x0: result = r[rdn] &= m; break;
+    case 0x1: result = r[rdn] ^= m; break;
+    case 0x2: result = r[rdn] = shift(cpu, SHIFT_LSL, r[rdn], m & 0xff); break;
+    case 0x3: result = r[rdn] = shift(cpu, SHIFT_LSR, r[rdn], m & 0xff); break;
+    case 0x4: result = r[rdn] = shift(cpu, SHIFT_ASR, r[rdn], m & 0xff); break;
+    case 0x5: r[rdn] = add_with_carry(cpu, r[rdn], m, cpu->c, 1); return;
+    case 0x6: r[rdn] = add_with_carry(cpu, r[rdn], ~m, cpu->c, 1); return;
+    case 0x7: result = r[rdn] = shift(cpu, SHIFT_ROR, r[rdn], m & 0xff); break;
+    case 0x8: result = r[rdn] & m; break;
+    case 0x9: r[rdn] = add_with_carry(cpu, ~m, 0, 1, 1); return;
+    case 0xa: add_with_carry(cpu, r[rdn], ~m, 1, 1); return;
+    case 0xb: add_with_carry(cpu, r[rdn], m, 0, 1); return;
+    case 0xc: result = r[rdn] |= m; break;
+    case 0xd: result = r[rdn] *= m; break; // the stm32f0 has the single cycle multiplier
+    case 0xe: result = r[rdn] &= ~m; break;
+    default: result = r[rdn] = ~m; break;
+  }
+  set_nz(cpu, result);
+}
+
+static uint32_t load_store_register(struct armv6m *cpu, uint16_t op, uint32_t next) {
+  uint32_t *r = cpu->r;
+  uint8_t rt = op & 7;
+  uint32_t address = r[(op >> 3) & 7] + r[(op >> 6) & 7];
+
+  cpu->cycles++;
+  switch((op >> 9) & 7) {
+    case 0: store(cpu, address, r[rt], 4); break;
+    case 1: store(cpu, address, r[rt], 2); break;
+    case 2: store(cpu, address, r[rt], 1); break;
+    case 3: r[rt] = (int8_t)load(cpu, address, 1); break;
+    case 4: r[rt] = load(cpu, address, 4); break;
+    case 5: r[rt] = load(cpu, address, 2); break;
+    case 6: r[rt] = load(cpu, address, 1); break;
+    default: r[rt] = (int16_t)load(cpu, address, 2); break;
+  }
+  return next;
+}
+
+static uint32_t special_data(struct armv6m *cpu, uint32_t pc, uint16_t op, uint32_t next) {
+  uint32_t *r = cpu->r;
+  uint8_t rd = ((op >> 4) & 8) | (op & 7);
+  uint8_t rm = (op >> 3) & 0xf;
+  uint32_t result;
+
+  switch((op >> 8) & 3) {
+    case 0: // ADD, no flags
+      result = reg(cpu, pc, rd) + reg(cpu, pc, rm);
+      if(rd == PC) {
+        cpu->cycles += 2;
+        return branch(cpu, result);
+      }
+      r[rd] = result;
+      break;
+    case 1:
+      add_with_carry(cpu, reg(cpu, pc, rd), ~reg(cpu, pc, rm), 1, 1);
+      break;
+    case 2: // MOV, no flags
+      result = reg(cpu, pc, rm);
+      if(rd == PC) {
+        cpu->cycles += 2;
+        return branch(cpu, result);
+      }
+      r[rd] = result;
+      break;
+    default: // BX, BLX
+      result = reg(cpu, pc, rm);
+      if(!(result & 1)) {
+        fault(cpu, "bx to arm state %08x", result);
+        return next;
+      }
+      if(op & 0x80) {
+        r[LR] = next | 1;
+      }
+      cpu->cycles += 2;
+      return branch(cpu, result);
+  }
+  return next;
+}
+
+static uint32_t misc(struct armv6m *cpu, uint16_t op, uint32_t next) {
+  uint32_t *r = cpu->r;
+  uint8_t rd = op & 7;
+  uint32_t m = r[(op >> 3) & 7];
+  uint32_t list, address;
+
+  switch((op >> 8) & 0xf) {
+    case 0x0:
+      if(op & 0x80) {
+        r[SP] -= (op & 0x7f) * 4;
+      } else {
+        r[SP] += (op & 0x7f) * 4;
+      }
+      break;
+    case 0x2:
+      switch((op >> 6) & 3) {
+        case 0: r[rd] = (int16_t)m; break;
+        case 1: r[rd] = (int8_t)m; break;
+        case 2: r[rd] = (uint16_t)m; break;
+        default: r[rd] = (uint8_t)m; break;
+      }
+      break;
+    case 0x4:
+    case 0x5: // PUSH, lowest register at the lowest address
+      list = (op & 0xff) | ((op & 0x100) ? 1 << LR : 0);
+      address = r[SP] - 4 * __builtin_popcount(list);
+      r[SP] = address;
+      for(uint8_t i = 0; i < 16; i++) {
+        if(list & (1 << i)) {
+          store(cpu, address, r[i], 4);
+          address += 4;
+          cpu->cycles++;
+        }
+      }
+      break;
+    case 0x6:
+      if((op & 0xffef) != 0xb662) {
+        fault(cpu, "undefined instruction %04x", op);
+        break;
+      }
+      cpu->primask = (op >> 4) & 1; // CPSID i, CPSIE i
+      break;
+    case 0xa:
+      switch((op >> 6) & 3) {
+        case 0: r[rd] = __builtin_bswap32(m); break;
+        case 1: r[rd] = ((m & 0x00ff00ff) << 8) | ((m >> 8) & 0x00ff00ff); break;
+        case 3: r[rd] = (int16_t)__builtin_bswap16(m); break;
+        default: fault(cpu, "undefined instruction %04x", op); break;
+      }
+      break;
+    case 0xc:
+    case 0xd: // POP
+      list = (op & 0xff) | ((op & 0x100) ? 1 << PC : 0);
+      address = r[SP];
+      r[SP] += 4 * __builtin_popcount(list);
+      for(uint8_t i = 0; i < 16; i++) {
+        if(list & (1 << i)) {
+          uint32_t value = load(cpu, address, 4);
+
+          address += 4;
+          cpu->cycles++;
+          if(i == PC) {
+            if(!(value & 1)) {
+              fault(cpu, "pop to arm state %08x", value);
+              return next;
+            }
+            cpu->cycles += 2;
+            return branch(cpu, value);
+          }
+          r[i] = value;
+        }
+      }
+      break;
+    case 0xe:
+      fault(cpu, "bkpt");
+      break;
+    case 0xf: // NOP, YIELD, WFE, WFI, SEV all fall through, there's nothing to wait for
+      if(op & 0xf) {
+        fault(cpu, "undefined instruction %04x", op);
+      }
+      break;
+    default:
+      fault(cpu, "undefined instruction %04x", op);
+      break;
+  }
+  return next;
+}
+
+static uint32_t execute32(struct armv6m *cpu, uint32_t pc, uint16_t hw1, uint16_t hw2) {
+  uint32_t *r = cpu->r;
+  uint32_t next = pc + 4;
+
+  if((hw1 & 0xf800) == 0xf000 && (hw2 & 0xd000) == 0xd000) { // BL
+    uint32_t s = (hw1 >> 10) & 1;
+    uint32_t i1 = !(((hw2 >> 13) & 1) ^ s);
+    uint32_t i2 = !(((hw2 >> 11) & 1) ^ s);
+    uint32_t offset = (s << 24) | (i1 << 23) | (i2 << 22) | ((hw1 & 0x3ff) << 12) | ((hw2 & 0x7ff) << 1);
+
+    if(s) {
+      offset |= 0xfe000000;
+    }
+    r[LR] = next | 1;
+    cpu->cycles += 3;
+    return branch(cpu, pc + 4 + offset);
+  }
+
+  cpu->cycles += 3;
+  if((hw1 & 0xfff0) == 0xf380 && (hw2 & 0xff00) == 0x8800) { // MSR
+    uint8_t sysm = hw2 & 0xff;
+
+    if(sysm == 16) {
+      cpu->primask = r[hw1 & 0xf] & 1;
+    } else if(sysm == 8 || sysm == 9) {
+      r[SP] = r[hw1 & 0xf] & ~3;
+    }
+    return next;
+  }
+  if(hw1 == 0xf3ef && (hw2 & 0xf000) == 0x8000) { // MRS
+    uint8_t sysm = hw2 & 0xff;
+    uint32_t value = 0;
+
+    if(sysm == 16) {
+      value = cpu->primask;
+    } else if(sysm == 8 || sysm == 9) {
+      value = r[SP];
+    } else if(sysm < 8) {
+      value = (cpu->n << 31) | (cpu->z << 30) | (cpu->c << 29) | (cpu->v << 28);
+    }
+    r[(hw2 >> 8) & 0xf] = value;
+    return next;
+  }
+  if(hw1 == 0xf3bf && (hw2 & 0xff00) == 0x8f00) { // DSB, DMB, ISB
+    return next;
+  }
+
+  fault(cpu, "undefined instruction %04x %04x", hw1, hw2);
+  return next;
+}
+
+static uint32_t execute(struct armv6m *cpu, uint32_t pc, uint16_t op) {
+  uint32_t *r = cpu->r;
+  uint32_t next = pc + 2;
+  uint8_t rd = op & 7;
+  uint8_t rn = (op >> 3) & 7;
+  uint8_t rt8 = (op >> 8) & 7;
+  uint32_t imm5 = (op >> 6) & 0x1f;
+  uint32_t imm8 = op & 0xff;
+  uint32_t list, address, offset;
+
+  cpu->cycles++;
+  switch(op >> 11) {
+    case 0x00: // LSLS, MOVS
+      r[rd] = shift(cpu, SHIFT_LSL, r[rn], imm5);
+      set_nz(cpu, r[rd]);
+      break;
+    case 0x01:
+      r[rd] = shift(cpu, SHIFT_LSR, r[rn], imm5 ? imm5 : 32);
+      set_nz(cpu, r[rd]);
+      break;
+    case 0x02:
+      r[rd] = shift(cpu, SHIFT_ASR, r[rn], imm5 ? imm5 : 32);
+      set_nz(cpu, r[rd]);
+      break;
+    case 0x03: { // ADDS/SUBS register or imm3
+      uint32_t operand = (op & 0x400) ? (op >> 6) & 7 : r[(op >> 6) & 7];
+
+      if(op & 0x200) {
+        r[rd] = add_with_carry(cpu, r[rn], ~operand, 1, 1);
+      } else {
+        r[rd] = add_with_carry(cpu, r[rn], operand, 0, 1);
+      }
+      break;
+    }
+    case 0x04:
+      r[rt8] = imm8;
+      set_nz(cpu, imm8);
+      break;
+    case 0x05:
+      add_with_carry(cpu, r[rt8], ~imm8, 1, 1);
+      break;
+    case 0x06:
+      r[rt8] = add_with_carry(cpu, r[rt8], imm8, 0, 1);
+      break;
+    case 0x07:
+      r[rt8] = add_with_carry(cpu, r[rt8], ~imm8, 1, 1);
+      break;
+    case 0x08:
+      if(op & 0x400) {
+        return special_data(cpu, pc, op, next);
+      }
+      data_processing(cpu, op);
+      break;
+    case 0x09: // LDR literal
+      cpu->cycles++;
+      r[rt8] = load(cpu, ((pc + 4) & ~3) + imm8 * 4, 4);
+      break;
+    case 0x0a:
+    case 0x0b:
+      return load_store_register(cpu, op, next);
+    case 0x0c:
+      cpu->cycles++;
+      store(cpu, r[rn] + imm5 * 4, r[rd], 4);
+      break;
+    case 0x0d:
+      cpu->cycles++;
+      r[rd] = load(cpu, r[rn] + imm5 * 4, 4);
+      break;
+    case 0x0e:
+      cpu->cycles++;
+      store(cpu, r[rn] + imm5, r[rd], 1);
+      break;
+    case 0x0f:
+      cpu->cycles++;
+      r[rd] = load(cpu, r[rn] + imm5, 1);
+      break;
+    case 0x10:
+      cpu->cycles++;
+      store(cpu, r[rn] + imm5 * 2, r[rd], 2);
+      break;
+    case 0x11:
+      cpu->cycles++;
+      r[rd] = load(cpu, r[rn] + imm5 * 2, 2);
+      break;
+    case 0x12:
+      cpu->cycles++;
+      store(cpu, r[SP] + imm8 * 4, r[rt8], 4);
+      break;
+    case 0x13:
+      cpu->cycles++;
+      r[rt8] = load(cpu, r[SP] + imm8 * 4, 4);
+      break;
+    case 0x14: // ADR
+      r[rt8] = ((pc + 4) & ~3) + imm8 * 4;
+      break;
+    case 0x15:
+      r[rt8] = r[SP] + imm8 * 4;
+      break;
+    case 0x16:
+    case 0x17:
+      return misc(cpu, op, next);
+    case 0x18: // STM, always writes back
+      list = imm8;
+      address = r[rt8];
+      for(uint8_t i = 0; i < 8; i++) {
+        if(list & (1 << i)) {
+          store(cpu, address, r[i], 4);
+          address += 4;
+          cpu->cycles++;
+        }
+      }
+      r[rt8] = address;
+      break;
+    case 0x19: // LDM, writes back unless the base is in the list
+      list = imm8;
+      address = r[rt8];
+      for(uint8_t i = 0; i < 8; i++) {
+        if(list & (1 << i)) {
+          r[i] = load(cpu, address, 4);
+          address += 4;
+          cpu->cycles++;
+        }
+      }
+      if(!(list & (1 << rt8))) {
+        r[rt8] = address;
+      }
+      break;
+    case 0x1a:
+    case 0x1b: { // B<cond>, UDF, SVC
+      uint8_t cond = (op >> 8) & 0xf;
+
+      if(cond >= 0xe) {
+        fault(cpu, cond == 0xe ? "udf" : "svc");
+        break;
+      }
+      if(condition(cpu, cond)) {
+        cpu->cycles += 2;
+        return branch(cpu, pc + 4 + (int32_t)(int8_t)imm8 * 2);
+      }
+      break;
+    }
+    case 0x1c: // B
+      offset = (op & 0x7ff) << 1;
+      if(offset & 0x800) {
+        offset |= 0xfffff000;
+      }
+      cpu->cycles += 2;
+      return branch(cpu, pc + 4 + offset);
+    case 0x1e:
+    case 0x1f:
+      return execute32(cpu, pc, op, armv6m_read(cpu, pc + 2, 2));
+    default:
+      fault(cpu, "undefined instruction %04x", op);
+      break;
+  }
+  return next;
+}
+
+int armv6m_call(struct armv6m *cpu, uint32_t function, const uint32_t *args, uint8_t arg_count, uint32_t sp, uint64_t max_cycles) {
+  uint64_t limit = cpu->cycles + max_cycles;
+
+  cpu->error[0] = '\0';
+  for(uint8_t i = 0; i < arg_count && i < 4; i++) {
+    cpu->r[i] = args[i];
+  }
+  cpu->r[SP] = sp;
+  cpu->r[LR] = ARMV6M_RETURN | 1;
+  cpu->r[PC] = function & ~1;
+  cpu->min_sp = sp;
+
+  while(cpu->r[PC] != ARMV6M_RETURN) {
+    uint32_t pc = cpu->r[PC];
+    uint16_t op = armv6m_read(cpu, pc, 2);
+
+    if(!cpu->error[0]) {
+      cpu->r[PC] = execute(cpu, pc, op);
+    }
+    if(cpu->r[SP] < cpu->min_sp) {
+      cpu->min_sp = cpu->r[SP];
+    }
+    if(cpu->error[0]) {
+      size_t length = strlen(cpu->error);
+
+      snprintf(cpu->error + length, sizeof(cpu->error) - length, ", pc %08x", pc);
+      return -1;
+    }
+    if(cpu->cycles > limit) {
+      fault(cpu, "still running after %llu cycles, pc %08x", (unsigned long long)max_cycles, pc);
+      return -1;
+    }
+  }
+  return 0;
+}
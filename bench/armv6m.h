@@ -0,0 +1,43 @@
+#ifndef ARMV6M_H
+#define ARMV6M_H
+
+#include <stdint.h>
+
+/* a cortex-m0 for timing firmware functions on the host
+ * runs ARMv6-M thumb code with the cortex-m0 TRM cycle counts, no exceptions or interrupts
+ */
+
+#define ARMV6M_REGIONS 8
+
+// calls return here, lr holds it with the thumb bit set
+#define ARMV6M_RETURN 0xfffff000
+
+struct armv6m_region {
+  uint32_t base;
+  uint32_t size;
+  uint8_t *data;
+  uint8_t wait_states; // added to every data access, and to every branch into the region
+  // for registers that aren't plain memory, returns what a firmware store leaves in the register
+  uint32_t (*write)(uint32_t address, uint32_t old, uint32_t value);
+};
+
+struct armv6m {
+  uint32_t r[16];
+  uint8_t n, z, c, v;
+  uint8_t primask;
+  uint64_t cycles;
+  uint32_t min_sp;    // deepest stack seen by armv6m_call
+  struct armv6m_region regions[ARMV6M_REGIONS];
+  uint8_t region_count;
+  char error[160];    // why execution stopped, empty while it's fine
+};
+
+uint8_t *armv6m_map(struct armv6m *cpu, uint32_t base, uint32_t size, uint8_t wait_states);
+// these don't count cycles or call the region's write hook
+uint32_t armv6m_read(struct armv6m *cpu, uint32_t address, uint8_t size);
+void armv6m_write(struct armv6m *cpu, uint32_t address, uint32_t value, uint8_t size);
+
+// runs the function until it returns, 0 on success or -1 with cpu->error set
+int armv6m_call(struct armv6m *cpu, uint32_t function, const uint32_t *args, uint8_t arg_count, uint32_t sp, uint64_t max_cycles);
+
+#endif
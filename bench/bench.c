@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <elf.h>
+
+#include "armv6m.h"
+#include "i2c_register_map.h"
+
+// times the firmware's interrupt and i2c hot paths in the firmware elf, and checks them against a budgets file
+
+#define FLASH_START 0x08000000
+#define FLASH_SIZE 0x4000
+#define SYSTEM_MEMORY_START 0x1ffff000
+#define RAM_START 0x20000000
+#define RAM_SIZE 0x1000
+
+#define TIM3_BASE 0x40000400
+#define TIM14_BASE 0x40002000
+#define I2C1_BASE 0x40005400
+#define ADC1_BASE 0x40012400
+#define TIM1_BASE 0x40012c00
+#define TIMx_SR 0x10
+#define I2C_ISR 0x18
+#define I2C_RXDR 0x24
+
+// TIMx_SR bits
+#define CC1IF (1 << 1)
+#define CC2IF (1 << 2)
+#define CC4IF (1 << 4)
+#define CC1OF (1 << 9)
+
+// I2C_ISR bits, ADDCODE (23:17) is the 7 bit address
+#define TXIS (1 << 1)
+#define RXNE (1 << 2)
+#define ADDR (1 << 3)
+#define STOPF (1 << 5)
+#define DIR (1 << 16)
+#define ADDCODE(address) ((address) << 17)
+
+// a benchmark that doesn't return in this many cycles is stuck, usually on a HAL timeout
+#define MAX_CYCLES 1000000
+
+// budgets get this much room over the measured worst case with -u
+#define HEADROOM_PERCENT 25
+
+static struct armv6m cpu;
+static uint8_t *flash, *ram;
+static uint8_t ram_snapshot[RAM_SIZE];
+static uint32_t stack_top;
+
+struct symbol {
+  char *name;
+  uint32_t value;
+  uint32_t size;
+};
+
+static struct symbol *symbols;
+static uint32_t symbol_count;
+
+struct result {
+  const char *name;
+  uint32_t calls;
+  uint64_t min, max, total;
+  uint32_t stack;
+  uint32_t budget_cycles, budget_stack; // 0 is no budget
+};
+
+#define MAX_RESULTS 32
+static struct result results[MAX_RESULTS];
+static uint8_t result_count;
+
+static void *read_file(const char *filename, size_t *length) {
+  FILE *f = fopen(filename, "rb");
+  uint8_t *data;
+  long size;
+
+  if(f == NULL) {
+    perror(filename);
+    exit(1);
+  }
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  data = malloc(size);
+  if(data == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  if(fread(data, 1, size, f) != (size_t)size) {
+    perror("fread");
+    exit(1);
+  }
+  fclose(f);
+  *length = size;
+  return data;
+}
+
+static void load_elf(const char *filename) {
+  size_t length;
+  uint8_t *elf = read_file(filename, &length);
+  Elf32_Ehdr *header = (Elf32_Ehdr *)elf;
+  Elf32_Shdr *sections;
+
+  if(length < sizeof(*header) || memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 ||
+      header->e_ident[EI_CLASS] != ELFCLASS32 || header->e_machine != EM_ARM) {
+    fprintf(stderr, "%s: not an arm elf\n", filename);
+    exit(1);
+  }
+
+  // initialized data is loaded at its flash address (p_paddr) and copied to ram like the startup code does
+  for(uint16_t i = 0; i < header->e_phnum; i++) {
+    Elf32_Phdr *segment = (Elf32_Phdr *)(elf + header->e_phoff + i * header->e_phentsize);
+
+    if(segment->p_type != PT_LOAD || segment->p_filesz == 0) {
+      continue;
+    }
+    if(segment->p_offset + segment->p_filesz > length) {
+      fprintf(stderr, "%s: truncated\n", filename);
+      exit(1);
+    }
+    for(uint32_t j = 0; j < segment->p_filesz; j++) {
+      armv6m_write(&cpu, segment->p_paddr + j, elf[segment->p_offset + j], 1);
+      if(segment->p_vaddr != segment->p_paddr) {
+        armv6m_write(&cpu, segment->p_vaddr + j, elf[segment->p_offset + j], 1);
+      }
+    }
+    if(cpu.error[0]) {
+      fprintf(stderr, "%s: segment at %08x doesn't fit the stm32f030f4: %s\n", filename, segment->p_vaddr, cpu.error);
+      exit(1);
+    }
+  }
+
+  sections = (Elf32_Shdr *)(elf + header->e_shoff);
+  for(uint16_t i = 0; i < header->e_shnum; i++) {
+    Elf32_Shdr *strtab;
+    Elf32_Sym *elf_symbols;
+
+    if(sections[i].sh_type != SHT_SYMTAB) {
+      continue;
+    }
+    strtab = &sections[sections[i].sh_link];
+    elf_symbols = (Elf32_Sym *)(elf + sections[i].sh_offset);
+    symbol_count = sections[i].sh_size / sizeof(Elf32_Sym);
+    symbols = calloc(symbol_count, sizeof(*symbols));
+    if(symbols == NULL) {
+      perror("calloc");
+      exit(1);
+    }
+    for(uint32_t j = 0; j < symbol_count; j++) {
+      symbols[j].name = strdup((char *)elf + strtab->sh_offset + elf_symbols[j].st_name);
+      symbols[j].value = elf_symbols[j].st_value;
+      symbols[j].size = elf_symbols[j].st_size;
+    }
+  }
+  if(symbols == NULL) {
+    fprintf(stderr, "%s: no symbol table, was it stripped?\n", filename);
+    exit(1);
+  }
+  free(elf);
+}
+
+// statics are local symbols, they're found too unless the compiler inlined them away
+static struct symbol *find_symbol(const char *name) {
+  for(uint32_t i = 0; i < symbol_count; i++) {
+    if(strcmp(symbols[i].name, name) == 0) {
+      return &symbols[i];
+    }
+  }
+  return NULL;
+}
+
+static uint32_t symbol(const char *name) {
+  struct symbol *s = find_symbol(name);
+
+  if(s == NULL) {
+    fprintf(stderr, "symbol %s not found\n", name);
+    exit(1);
+  }
+  return s->value;
+}
+
+// sets a firmware variable, the write is sized from the symbol
+static void poke(const char *name, uint32_t value) {
+  struct symbol *s = find_symbol(name);
+
+  if(s == NULL) {
+    fprintf(stderr, "symbol %s not found\n", name);
+    exit(1);
+  }
+  armv6m_write(&cpu, s->value, value, s->size >= 4 ? 4 : s->size == 2 ? 2 : 1);
+}
+
+// an uncounted call, for setting up state
+static void setup_call(const char *name, const uint32_t *args, uint8_t arg_count) {
+  if(armv6m_call(&cpu, symbol(name), args, arg_count, stack_top, MAX_CYCLES) < 0) {
+    fprintf(stderr, "%s: %s\n", name, cpu.error);
+    exit(1);
+  }
+}
+
+// TIMx_SR flags are cleared by writing 0, writing 1 leaves them alone
+static uint32_t apb_write(uint32_t address, uint32_t old, uint32_t value) {
+  if(address == TIM3_BASE + TIMx_SR || address == TIM1_BASE + TIMx_SR || address == TIM14_BASE + TIMx_SR) {
+    return old & value;
+  }
+  return value;
+}
+
+static void map_memory() {
+  struct armv6m_region *apb;
+
+  flash = armv6m_map(&cpu, FLASH_START, FLASH_SIZE, 1); // 1 wait state at 48MHz
+  memset(flash, 0xff, FLASH_SIZE);
+  armv6m_map(&cpu, SYSTEM_MEMORY_START, 0x1000, 1);
+  ram = armv6m_map(&cpu, RAM_START, RAM_SIZE, 0);
+  armv6m_map(&cpu, 0x40000000, 0x18000, 0); // APB
+  apb = &cpu.regions[cpu.region_count - 1];
+  apb->write = apb_write;
+  armv6m_map(&cpu, 0x40020000, 0x4000, 0);  // AHB: DMA, RCC, flash interface, CRC
+  armv6m_map(&cpu, 0x48000000, 0x1800, 0);  // GPIO
+  armv6m_map(&cpu, 0xe000e000, 0x1000, 0);  // NVIC, SysTick, SCB
+}
+
+// the firmware's own init, with the handles pointed at the peripherals the way the MX_*_Init functions do
+// i2c_slave_start sets the own address
+static void setup() {
+  poke("htim1", TIM1_BASE);
+  poke("htim3", TIM3_BASE);
+  poke("htim14", TIM14_BASE);
+  poke("hi2c1", I2C1_BASE);
+  poke("hadc", ADC1_BASE);
+
+  setup_call("timer_start", NULL, 0);
+  setup_call("flash_start", NULL, 0);
+  setup_call("i2c_slave_start", NULL, 0);
+
+  memcpy(ram_snapshot, ram, RAM_SIZE);
+}
+
+static struct result *new_result(const char *name) {
+  struct result *result;
+
+  if(result_count >= MAX_RESULTS) {
+    fprintf(stderr, "too many benchmarks\n");
+    exit(1);
+  }
+  result = &results[result_count++];
+  result->name = name;
+  result->min = UINT64_MAX;
+  return result;
+}
+
+// one counted call, the deepest stack is from the call's entry
+static void measure(struct result *result, const char *function, const uint32_t *args, uint8_t arg_count) {
+  uint64_t start = cpu.cycles;
+  uint64_t cycles;
+
+  if(armv6m_call(&cpu, symbol(function), args, arg_count, stack_top, MAX_CYCLES) < 0) {
+    fprintf(stderr, "%s: %s: %s\n", result->name, function, cpu.error);
+    exit(1);
+  }
+  cycles = cpu.cycles - start;
+  result->calls++;
+  result->total += cycles;
+  if(cycles < result->min) {
+    result->min = cycles;
+  }
+  if(cycles > result->max) {
+    result->max = cycles;
+  }
+  if(stack_top - cpu.min_sp > result->stack) {
+    result->stack = stack_top - cpu.min_sp;
+  }
+}
+
+static void restore_ram() {
+  memcpy(ram, ram_snapshot, RAM_SIZE);
+}
+
+// TIM3_IRQHandler with the capture flags in sr, enough calls for counts_ch1 to reach zero
+static void bench_tim3(const char *name, uint32_t sr, uint32_t calls) {
+  struct result *result = new_result(name);
+
+  restore_ram();
+  for(uint32_t i = 0; i < calls; i++) {
+    armv6m_write(&cpu, TIM3_BASE + TIMx_SR, sr, 4);
+    measure(result, "TIM3_IRQHandler", NULL, 0);
+  }
+}
+
+// the PA4 capture, timer_poll doesn't run so the offset is 0, which doesn't change the timing
+static void bench_tim14() {
+  struct result *result = new_result("tim14_ch1");
+
+  restore_ram();
+  for(uint32_t i = 0; i < 10; i++) {
+    armv6m_write(&cpu, TIM14_BASE + TIMx_SR, CC1IF, 4);
+    measure(result, "TIM14_IRQHandler", NULL, 0);
+  }
+}
+
+static void bench_systick() {
+  struct result *result = new_result("systick");
+
+  restore_ram();
+  for(uint32_t i = 0; i < 200; i++) { // covers a tick_countdown reload
+    measure(result, "SysTick_Handler", NULL, 0);
+  }
+}
+
+// I2C1_IRQHandler with isr in I2C_ISR and rxdr in I2C_RXDR, counted in result or uncounted for setting up state with NULL
+static void i2c_event(struct result *result, uint32_t isr, uint32_t rxdr) {
+  armv6m_write(&cpu, I2C1_BASE + I2C_RXDR, rxdr, 4);
+  armv6m_write(&cpu, I2C1_BASE + I2C_ISR, isr, 4);
+  if(result == NULL) {
+    setup_call("I2C1_IRQHandler", NULL, 0);
+  } else {
+    measure(result, "I2C1_IRQHandler", NULL, 0);
+  }
+}
+
+// the address match for a write and a read, then a byte of the page going out and the stop
+static void bench_i2c_addr() {
+  struct result *write = new_result("i2c_addr_write");
+  struct result *read = new_result("i2c_addr_read");
+  struct result *byte = new_result("i2c_read");
+  struct result *stop = new_result("i2c_stop");
+
+  for(uint32_t i = 0; i < 10; i++) {
+    restore_ram();
+    i2c_event(write, ADDR | ADDCODE(I2C_DEFAULT_ADDRESS), 0);
+    restore_ram();
+    i2c_event(read, ADDR | DIR | ADDCODE(I2C_DEFAULT_ADDRESS), 0);
+    i2c_event(byte, TXIS | DIR, 0);
+    i2c_event(stop, STOPF, 0);
+  }
+}
+
+// the register byte after the address: a page select and a write to page1's source_HZ_ch1
+static void bench_i2c_rx() {
+  struct result *select = new_result("i2c_page_select");
+  struct result *write = new_result("i2c_write");
+
+  for(uint32_t page = 0; page < I2C_REGISTER_PAGES; page++) {
+    restore_ram();
+    i2c_event(NULL, ADDR | ADDCODE(I2C_DEFAULT_ADDRESS), 0);
+    i2c_event(NULL, RXNE, I2C_REGISTER_OFFSET_PAGE);
+    i2c_event(select, RXNE, page);
+  }
+
+  for(uint32_t i = 0; i < 10; i++) {
+    restore_ram();
+    i2c_event(NULL, ADDR | ADDCODE(I2C_DEFAULT_ADDRESS), 0);
+    i2c_event(NULL, RXNE, 26); // source_HZ_ch1
+    i2c_event(write, RXNE, 50);
+  }
+}
+
+// change_page and i2c_data_rcv on their own, when -Os kept them out of line
+static void bench_i2c_statics() {
+  if(find_symbol("change_page") != NULL) {
+    struct result *result = new_result("change_page");
+
+    for(uint32_t page = 0; page < I2C_REGISTER_PAGES; page++) {
+      restore_ram();
+      measure(result, "change_page", &page, 1);
+    }
+  }
+  if(find_symbol("i2c_data_rcv") != NULL) {
+    struct result *result = new_result("i2c_data_rcv");
+
+    for(uint32_t page = 0; page < I2C_REGISTER_PAGES; page++) {
+      uint32_t args[] = {I2C_REGISTER_OFFSET_PAGE, page};
+
+      restore_ram();
+      measure(result, "i2c_data_rcv", args, 2);
+    }
+  }
+}
+
+// the adc conversion interrupt for each of the 3 conversions, and the averaging after the last one
+static void bench_adc() {
+  struct result *conversion = new_result("adc_conversion");
+  struct result *done = new_result("adc_done");
+  uint32_t hadc = symbol("hadc");
+
+  restore_ram();
+  poke("adc_index", 9); // a full history, the longest average
+  for(uint32_t i = 0; i < 10; i++) {
+    poke("conversion", i % 3);
+    measure(conversion, "HAL_ADC_ConvCpltCallback", &hadc, 1);
+  }
+  for(uint32_t i = 0; i < 10; i++) {
+    measure(done, "adc_done", NULL, 0);
+  }
+}
+
+static void read_budgets(const char *filename) {
+  FILE *f = fopen(filename, "r");
+  char line[128], name[64];
+  uint32_t cycles, stack;
+
+  if(f == NULL) {
+    perror(filename);
+    exit(1);
+  }
+  while(fgets(line, sizeof(line), f) != NULL) {
+    if(line[0] == '#' || sscanf(line, "%63s %u %u", name, &cycles, &stack) != 3) {
+      continue;
+    }
+    for(uint8_t i = 0; i < result_count; i++) {
+      if(strcmp(results[i].name, name) == 0) {
+        results[i].budget_cycles = cycles;
+        results[i].budget_stack = stack;
+      }
+    }
+  }
+  fclose(f);
+}
+
+static void write_budgets(const char *filename) {
+  FILE *f = fopen(filename, "w");
+
+  if(f == NULL) {
+    perror(filename);
+    exit(1);
+  }
+  fprintf(f, "# worst case cycles and stack bytes per call, make bench fails when one is over\n");
+  fprintf(f, "# regenerate with %d%% headroom: build/bench -u build/input-capture-i2c.elf bench/budgets\n", HEADROOM_PERCENT);
+  for(uint8_t i = 0; i < result_count; i++) {
+    fprintf(f, "%-18s %6u %4u\n", results[i].name,
+        (uint32_t)(results[i].max * (100 + HEADROOM_PERCENT) / 100),
+        results[i].stack * (100 + HEADROOM_PERCENT) / 100);
+  }
+  fclose(f);
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [-u] firmware.elf budgets\n"
+      "  -u  rewrite the budgets from this run\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  uint8_t update = 0, over = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "uh")) != -1) {
+    switch(opt) {
+      case 'u': update = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  if(argc - optind != 2) {
+    usage(argv[0]);
+  }
+
+  map_memory();
+  load_elf(argv[optind]);
+  stack_top = symbol("_estack");
+  setup();
+
+  bench_tim3("tim3_ch1", CC1IF, 100);
+  bench_tim3("tim3_ch1_overflow", CC1IF | CC1OF, 100);
+  bench_tim3("tim3_ch2", CC2IF, 10);
+  bench_tim3("tim3_ch4", CC4IF, 10);
+  bench_tim14();
+  bench_systick();
+  bench_i2c_addr();
+  bench_i2c_rx();
+  bench_i2c_statics();
+  bench_adc();
+
+  if(update) {
+    write_budgets(argv[optind + 1]);
+  }
+  read_budgets(argv[optind + 1]);
+
+  printf("%-18s %5s %6s %6s %6s %5s  %s\n", "", "calls", "min", "avg", "max", "stack", "budget");
+  for(uint8_t i = 0; i < result_count; i++) {
+    struct result *r = &results[i];
+    const char *status = "";
+
+    if(r->budget_cycles == 0) {
+      status = "no budget";
+    } else if(r->max > r->budget_cycles || r->stack > r->budget_stack) {
+      status = "OVER";
+      over = 1;
+    }
+    printf("%-18s %5u %6llu %6llu %6llu %5u  %u/%u %s\n", r->name, r->calls,
+        (unsigned long long)r->min, (unsigned long long)(r->total / r->calls), (unsigned long long)r->max,
+        r->stack, r->budget_cycles, r->budget_stack, status);
+  }
+  printf("cycles at 48MHz from the cortex-m0 timings with 1 flash wait state, interrupt entry (16) and exit (12) not included\n");
+
+  return over;
+}
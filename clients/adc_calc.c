@@ -32,6 +32,15 @@ void adc_print() {
   printf("%.5f ", last_vref());
 }
 
+// in C, from the factory calibration points at 30C and 110C
+float adc_internal_temp(const struct i2c_registers_type_page2 *i2c_registers_page2, float vref) {
+  float temp_voltage = i2c_registers_page2->internal_temp/4096.0*vref;
+  float v_30C = i2c_registers_page2->ts_cal1/4096.0*3.3;
+  float v_110C = i2c_registers_page2->ts_cal2/4096.0*3.3;
+
+  return (temp_voltage - v_30C) * (110 - 30) / (v_110C-v_30C) + 30.0;
+}
+
 void add_adc_data(const struct i2c_registers_type *i2c_registers, const struct i2c_registers_type_page2 *i2c_registers_page2) {
   if(i2c_registers_page2->last_adc_ms == last_adc) {
     return;
@@ -52,11 +61,7 @@ void add_adc_data(const struct i2c_registers_type *i2c_registers, const struct i
 
   float vref = last_vref();
 
-  float temp_voltage = i2c_registers_page2->internal_temp/4096.0*vref;
-  float v_30C = i2c_registers_page2->ts_cal1/4096.0*3.3;
-  float v_110C = i2c_registers_page2->ts_cal2/4096.0*3.3;
-
-  temps[adc_index] = (temp_voltage - v_30C) * (110 - 30) / (v_110C-v_30C) + 30.0;
+  temps[adc_index] = adc_internal_temp(i2c_registers_page2, vref);
 
   float ext_temp_voltage = i2c_registers_page2->external_temp/4096.0*vref;
   ext_temps[adc_index] = (ext_temp_voltage - 0.750) * 100.0 + 25.0; 
@@ -3,6 +3,7 @@
 
 void add_adc_data(const struct i2c_registers_type *i2c_registers, const struct i2c_registers_type_page2 *i2c_registers_page2);
 float last_temp();
+float adc_internal_temp(const struct i2c_registers_type_page2 *i2c_registers_page2, float vref);
 float last_vref();
 void adc_print();
 void adc_header();
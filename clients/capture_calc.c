@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "i2c_registers.h"
+#include "tcxo_calibration.h"
+#include "capture_calc.h"
+
+// the per second capture arithmetic, shared by input-capture-i2c and input-capture-multi
+
+// seconds between two ch1 captures gap_ms apart, 0 when that's too long to bridge
+uint8_t gap_seconds(uint32_t gap_ms) {
+  return gap_ms < 1500 ? 1 : (gap_ms > MAX_GAP_SECONDS * 1000 + 500 ? 0 : (gap_ms + 500) / 1000);
+}
+
+// seconds: since previous_cycles, up to MAX_GAP_SECONDS
+uint8_t cycles_wrap(uint32_t *this_cycles, uint32_t previous_cycles, int32_t *diff, const struct i2c_registers_type *i2c_registers, uint8_t counter, uint8_t seconds) {
+  uint8_t wrap = 0;
+  // allow for +/-500ppm over 1s, the tighter GAP_DRIFT_CYCLES over a gap keeps a wrap from looking like drift
+  int32_t wrap_limit = seconds == 1 ? 41535 : 65536 - seconds * GAP_DRIFT_CYCLES;
+  *diff = *this_cycles - previous_cycles - EXPECTED_FREQ * seconds;
+
+  if(i2c_registers->tim3_at_cap[counter] > i2c_registers->tim3_at_irq[counter]) {
+    if(*diff > wrap_limit) {
+      wrap = 1;
+      *this_cycles -= 65536;
+      *diff -= 65536;
+    }
+  } else if(i2c_registers->tim3_at_cap[counter] > 65300) { // check for wrap if it's close
+    if(*diff > wrap_limit) {
+      wrap = 2;
+      *this_cycles -= 65536;
+      *diff -= 65536;
+    }
+  }
+
+  return wrap;
+}
+
+// the cycles_wrap results of the INPUT_CHANNELS counters as status_flags bits
+uint8_t wrap_status(const uint8_t *wrap) {
+  return (wrap[0] & STATUS_CH1_WRAPS) | ((wrap[1] << 2) & STATUS_CH2_WRAPS) | ((wrap[2] << 4) & STATUS_CH3_WRAPS);
+}
+
+// modifies this_cycles
+void combine_tim1_tim3(uint32_t *this_cycles, const struct i2c_registers_type *i2c_registers) {
+  for(uint8_t i = 0; i < INPUT_CHANNELS; i++) {
+    this_cycles[i] = ((uint32_t)i2c_registers->tim1_at_irq[i]) << 16;
+    this_cycles[i] += i2c_registers->tim3_at_cap[i];
+  }
+}
+
+uint32_t calculate_sleep_ms(uint32_t milliseconds_now, uint32_t milliseconds_irq) {
+  uint32_t sleep_ms = 1000 + AIM_AFTER_MS - (milliseconds_now - milliseconds_irq);
+  if(sleep_ms > 1000+AIM_AFTER_MS) {
+    sleep_ms = 1000+AIM_AFTER_MS;
+  } else if(sleep_ms < 1) {
+    sleep_ms = 1;
+  }
+  return sleep_ms;
+}
+
+// modifies sleep_ms
+// at 500ppm, this estimates the next update within 0.5ms
+void adjust_sleep_ms(uint32_t *sleep_ms, const uint32_t *this_cycles) {
+  int32_t aiming_cycles = EXPECTED_FREQ / 1000 * AIM_AFTER_MS;
+  uint32_t estimated_cycles_after_sleep = this_cycles[0] + EXPECTED_FREQ + aiming_cycles;
+  int32_t negative_margin = aiming_cycles - EXPECTED_FREQ;
+
+  for(uint8_t i = 0; i < INPUT_CHANNELS; i++) {
+    uint32_t estimated_cycles = this_cycles[i] + EXPECTED_FREQ;
+    int32_t diff_cycles = estimated_cycles-estimated_cycles_after_sleep;
+
+    if(diff_cycles < negative_margin) { // if we're looking at the wrong edge, adjust it forward 1 second
+      diff_cycles += EXPECTED_FREQ;
+    }
+    if(abs(diff_cycles) < aiming_cycles) {
+      // if it's expected within the +/-AIM_AFTER_MS window, move the window forward
+      estimated_cycles_after_sleep += aiming_cycles;
+      *sleep_ms += AIM_AFTER_MS;
+      // TODO: should this restart the window calculation?
+    }
+  }
+}
+
+// in ppb units, from the board's temperature in C
+double tempcomp(float temp_c) {
+  float temp_f = temp_c*9.0/5.0+32.0;
+  return (TCXO_A + TCXO_B * (temp_f - TCXO_C) + TCXO_D * pow(temp_f - TCXO_C, 2)) * 1000.0;
+}
@@ -0,0 +1,28 @@
+#ifndef CAPTURE_CALC_H
+#define CAPTURE_CALC_H
+
+// a board's ch1 offset is kept for this many seconds, the 64s ppm is over all but the newest
+#define AVERAGING_CYCLES 65
+// read this long after the ch1 capture
+#define AIM_AFTER_MS 5
+// captures missed (bus errors, a late poll) up to this long ago are spread over the seconds in between
+// instead of restarting the average, with the tcxo assumed within GAP_DRIFT_CYCLES a second (100ppm)
+#define MAX_GAP_SECONDS 5
+#define GAP_DRIFT_CYCLES 4800
+
+// status_flags bitfields
+#define STATUS_CH1_WRAPS       0b11
+#define STATUS_CH2_WRAPS     0b1100
+#define STATUS_CH3_WRAPS   0b110000
+#define STATUS_CH2_FAILED 0b1000000
+#define STATUS_GAP       0b10000000
+
+uint8_t gap_seconds(uint32_t gap_ms);
+uint8_t cycles_wrap(uint32_t *this_cycles, uint32_t previous_cycles, int32_t *diff, const struct i2c_registers_type *i2c_registers, uint8_t counter, uint8_t seconds);
+void combine_tim1_tim3(uint32_t *this_cycles, const struct i2c_registers_type *i2c_registers);
+uint32_t calculate_sleep_ms(uint32_t milliseconds_now, uint32_t milliseconds_irq);
+void adjust_sleep_ms(uint32_t *sleep_ms, const uint32_t *this_cycles);
+uint8_t wrap_status(const uint8_t *wrap);
+double tempcomp(float temp_c);
+
+#endif
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "i2c.h"
+#include "i2c_registers.h"
+
+// poll the v3 captures page and print every capture on every input, including the TIM14 one (PA4)
+
+#define DEFAULT_POLL_MS 100
+
+static double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// same 32 bit counter reconstruction as page1
+static uint32_t capture_cycles(const struct i2c_capture *capture) {
+  uint32_t cycles = ((uint32_t)capture->tim1_at_irq) << 16 | capture->tim3_at_cap;
+
+  if(capture->tim3_at_cap > capture->tim3_at_irq) { // tim3 wrapped between the capture and the irq
+    cycles -= 65536;
+  }
+  return cycles;
+}
+
+// call with the bus locked
+static void set_extra_inputs(int fd, uint8_t extra_inputs) {
+  write_i2c_register(fd, I2C_REGISTER_OFFSET_PAGE, I2C_REGISTER_PAGE_INFO);
+  write_i2c_register(fd, offsetof(struct i2c_registers_type_info, extra_inputs), extra_inputs);
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [-b bus] [-a address] [-e] [-p poll_ms]\n"
+      "  -b  i2c bus (%s), -a board address (0x%x)\n"
+      "  -e  turn the PA4 input on first, page3's save keeps it on across resets\n"
+      "  -p  how often to read the captures page (%u ms), it holds the board's last capture_batch captures\n", name, I2C_DEFAULT_BUS, I2C_ADDR, DEFAULT_POLL_MS);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  struct i2c_registers_type_info info;
+  // the board's captures page, which has its own size and batch when built with other headers
+  struct i2c_capture captures[I2C_CLIENT_PAGE_SIZE_MAX / sizeof(struct i2c_capture)];
+  uint8_t *page = (uint8_t *)captures, page_size, batch;
+  uint32_t capture_count;
+  const char *bus = I2C_DEFAULT_BUS;
+  uint16_t addr = I2C_ADDR;
+  uint32_t poll_ms = DEFAULT_POLL_MS, last_count = 0;
+  uint8_t enable = 0, has_count = 0;
+  int fd, opt, status, version;
+
+  while((opt = getopt(argc, argv, "b:a:ep:")) != -1) {
+    switch(opt) {
+      case 'b': bus = optarg; break;
+      case 'a': addr = strtoul(optarg, NULL, 0); break;
+      case 'e': enable = 1; break;
+      case 'p': poll_ms = strtoul(optarg, NULL, 0); break;
+      default: usage(argv[0]);
+    }
+  }
+
+  fd = open_i2c(bus, addr);
+
+  lock_i2c(fd);
+  version = i2c_protocol_version(fd);
+  if(version < 0) {
+    printf("firmware version probe failed\n");
+    exit(1);
+  }
+  if(version < I2C_PROTOCOL_VERSION) {
+    printf("firmware has no captures page, v%d\n", version);
+    exit(1);
+  }
+  i2c_captures_layout(fd, &page_size, &batch);
+  if(read_i2c_page(fd, I2C_REGISTER_PAGE_INFO, &info, sizeof(info)) < 0) {
+    printf("info page read failed\n");
+    exit(1);
+  }
+  if(enable) {
+    set_extra_inputs(fd, info.extra_inputs | I2C_EXTRA_INPUT_TIM14);
+  }
+  unlock_i2c(fd);
+
+  // older v3 firmware has zeros here and only the TIM3 inputs
+  printf("inputs: %u, extra %02x, batch %u\n", info.capture_channels ? info.capture_channels : I2C_INPUT_CHANNELS,
+      info.extra_inputs | (enable ? I2C_EXTRA_INPUT_TIM14 : 0), batch);
+
+  while(1) {
+    lock_i2c(fd);
+    status = read_i2c_page(fd, I2C_REGISTER_PAGE_CAPTURES, page, page_size);
+    unlock_i2c(fd);
+    // the ring holds batch captures, the next poll catches up or reports what was lost
+    if(status < 0) {
+      usleep(poll_ms * 1000);
+      continue;
+    }
+
+    if(page[page_size - 1] != I2C_REGISTER_PAGE_CAPTURES) {
+      printf("got wrong page offset: %u != %u\n", page[page_size - 1], I2C_REGISTER_PAGE_CAPTURES);
+      exit(1);
+    }
+    memcpy(&capture_count, &captures[batch], sizeof(capture_count));
+
+    if(has_count && (int32_t)(capture_count - last_count) < 0) {
+      printf("capture count went back from %u to %u, the board reset\n", last_count, capture_count);
+      has_count = 0;
+    }
+    if(!has_count || capture_count - last_count > batch) {
+      if(has_count) {
+        printf("lost %u captures\n", capture_count - last_count - batch);
+      }
+      last_count = capture_count - (capture_count < batch ? capture_count : batch);
+      has_count = 1;
+    }
+    // oldest first, the newest capture is at (capture_count-1) % batch
+    while(last_count != capture_count) {
+      const struct i2c_capture *capture = &captures[last_count % batch];
+
+      last_count++;
+      printf("%.3f capture ch%u %u %u\n", now(), capture->channel + 1, last_count, capture_cycles(capture));
+    }
+    fflush(stdout);
+
+    usleep(poll_ms * 1000);
+  }
+}
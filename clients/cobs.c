@@ -0,0 +1,43 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "cobs.h"
+
+// every 0x00 is replaced by the distance to the next one, returns the frame length including the ending 0x00
+size_t cobs_encode(const uint8_t *data, size_t length, uint8_t *frame) {
+  size_t code_index = 0, out = 1;
+
+  for(size_t i = 0; i < length; i++) {
+    if(data[i] == 0) {
+      frame[code_index] = out - code_index;
+      code_index = out++;
+    } else {
+      frame[out++] = data[i];
+    }
+  }
+  frame[code_index] = out - code_index;
+  frame[out++] = 0;
+
+  return out;
+}
+
+// frame without its ending 0x00, returns the decoded length, 0 if the frame is malformed
+size_t cobs_decode(const uint8_t *frame, size_t length, uint8_t *out) {
+  size_t in = 0, out_len = 0;
+
+  while(in < length) {
+    uint8_t code = frame[in++];
+
+    if(code == 0 || in + code - 1 > length) {
+      return 0;
+    }
+    for(uint8_t i = 1; i < code; i++) {
+      out[out_len++] = frame[in++];
+    }
+    if(code < 0xff && in < length) {
+      out[out_len++] = 0;
+    }
+  }
+
+  return out_len;
+}
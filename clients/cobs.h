@@ -0,0 +1,8 @@
+#ifndef COBS_H
+#define COBS_H
+
+// the uart frames' COBS, for messages under 254 bytes (one block), see Inc/uart_stream_format.h
+size_t cobs_encode(const uint8_t *data, size_t length, uint8_t *frame);
+size_t cobs_decode(const uint8_t *frame, size_t length, uint8_t *out);
+
+#endif
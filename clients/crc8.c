@@ -0,0 +1,18 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "crc8.h"
+
+uint8_t crc8(uint8_t crc, const uint8_t *data, size_t len) {
+  for(size_t i = 0; i < len; i++) {
+    crc ^= data[i];
+    for(uint8_t bit = 0; bit < 8; bit++) {
+      if(crc & 0x80) {
+        crc = (crc << 1) ^ 0x07;
+      } else {
+        crc = crc << 1;
+      }
+    }
+  }
+  return crc;
+}
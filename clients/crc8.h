@@ -0,0 +1,7 @@
+#ifndef CRC8_H
+#define CRC8_H
+
+// SMBus PEC: CRC-8, polynomial x^8+x^2+x+1, initial value 0
+uint8_t crc8(uint8_t crc, const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <linux/gpio.h>
+
+#include "data_ready.h"
+
+// the firmware toggles its DATA_READY pin (PA5) on every new channel 1 capture
+
+// "mock" or "mock:period_ms" stands in for the line with a timer
+#define MOCK_LINE "mock"
+#define MOCK_DEFAULT_PERIOD_MS 1000
+// input-capture-multi has one line per board, mock or not
+#define DATA_READY_MAX_FDS 64
+
+static uint8_t mock[DATA_READY_MAX_FDS];
+
+static int open_mock(const char *line) {
+  struct itimerspec period;
+  long period_ms = MOCK_DEFAULT_PERIOD_MS;
+  int fd;
+
+  if(line[strlen(MOCK_LINE)] == ':') {
+    period_ms = strtol(line + strlen(MOCK_LINE) + 1, NULL, 10);
+  }
+  if(period_ms < 1) {
+    fprintf(stderr, "invalid mock period: %s\n", line);
+    exit(1);
+  }
+
+  fd = timerfd_create(CLOCK_MONOTONIC, 0);
+  if(fd < 0) {
+    perror("timerfd_create");
+    exit(1);
+  }
+  if(fd >= DATA_READY_MAX_FDS) {
+    fprintf(stderr, "mock data ready fd %d out of range\n", fd);
+    exit(1);
+  }
+
+  period.it_interval.tv_sec = period_ms / 1000;
+  period.it_interval.tv_nsec = (period_ms % 1000) * 1000000;
+  period.it_value = period.it_interval;
+  if(timerfd_settime(fd, 0, &period, NULL) < 0) {
+    perror("timerfd_settime");
+    exit(1);
+  }
+
+  mock[fd] = 1;
+  return fd;
+}
+
+// line is "/dev/gpiochipN:offset"
+int open_data_ready(const char *line) {
+  struct gpioevent_request req;
+  char chip[64];
+  const char *sep;
+  int chip_fd;
+
+  if(strncmp(line, MOCK_LINE, strlen(MOCK_LINE)) == 0) {
+    return open_mock(line);
+  }
+
+  sep = strrchr(line, ':');
+  if(sep == NULL || (size_t)(sep - line) >= sizeof(chip)) {
+    fprintf(stderr, "data ready line should be /dev/gpiochipN:offset, got %s\n", line);
+    exit(1);
+  }
+  memcpy(chip, line, sep - line);
+  chip[sep - line] = '\0';
+
+  chip_fd = open(chip, O_RDONLY);
+  if(chip_fd < 0) {
+    perror(chip);
+    exit(1);
+  }
+
+  memset(&req, '\0', sizeof(req));
+  req.lineoffset = strtoul(sep + 1, NULL, 10);
+  req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+  req.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+  strncpy(req.consumer_label, "input-capture data ready", sizeof(req.consumer_label) - 1);
+  if(ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &req) < 0) {
+    perror("GPIO_GET_LINEEVENT_IOCTL");
+    exit(1);
+  }
+  close(chip_fd);
+
+  return req.fd;
+}
+
+// returns 1 on a new data edge, 0 on timeout
+int wait_data_ready(int fd, int timeout_ms) {
+  struct pollfd pfd;
+  int status;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  status = poll(&pfd, 1, timeout_ms);
+  if(status < 0) {
+    perror("poll data ready");
+    exit(1);
+  }
+  if(status == 0) {
+    return 0;
+  }
+
+  // drain every queued edge so a slow reader doesn't wake up early next time
+  do {
+    if(fd < DATA_READY_MAX_FDS && mock[fd]) {
+      uint64_t expirations;
+      if(read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        perror("read mock data ready");
+        exit(1);
+      }
+    } else {
+      struct gpioevent_data event;
+      if(read(fd, &event, sizeof(event)) != sizeof(event)) {
+        perror("read data ready event");
+        exit(1);
+      }
+    }
+  } while(poll(&pfd, 1, 0) > 0);
+
+  return 1;
+}
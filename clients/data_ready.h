@@ -0,0 +1,7 @@
+#ifndef DATA_READY_H
+#define DATA_READY_H
+
+int open_data_ready(const char *line);
+int wait_data_ready(int fd, int timeout_ms);
+
+#endif
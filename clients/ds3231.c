@@ -38,10 +38,13 @@
 #define DS3231_OUT_8KHZ (DS3231_CTRL_RS1|DS3231_CTRL_RS2)
 
 int main(int argc, char **argv) {
+  const char *bus = I2C_DEFAULT_BUS;
+  uint16_t addr = I2C_ADDR;
   int fd;
   uint8_t ctrl;
 
-  fd = open_i2c(I2C_ADDR); 
+  i2c_options(&argc, &argv, &bus, &addr);
+  fd = open_i2c(bus, addr);
 
   if(argc == 1) {
     printf("commands: setsqw, gettemp, getadj, setadj\n");
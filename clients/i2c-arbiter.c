@@ -0,0 +1,488 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "i2c.h"
+#include "i2c_arbiter.h"
+#include "i2c_registers.h"
+#include "i2c_latency.h"
+
+/* owns the bus for every client on the machine (-b arbiter on theirs), one transfer at a time:
+ *  - the pending request with the lowest I2C_ARBITER_PRIORITY_X goes first, oldest first within a priority
+ *  - a request still waiting at its deadline is answered with I2C_ERROR_TRANSIENT instead of going out late
+ *  - housekeeping waits while it would overlap the PPS window, where the capture and cross-timestamp reads go
+ *  - a page4 select and read is the cross-timestamp and goes out at timing priority whatever the client asked for
+ *  - a lock keeps everything but timing transfers off the bus, those go between the lock holder's transfers
+ *    and the holder's page select is put back after them; a housekeeping holder's transfers still wait out the window
+ * tools still opening the bus directly are kept out with the same flock lock_i2c takes
+ */
+
+#define MAX_CLIENTS 32
+// around the top of the system clock's second, the clients' reads aim a few ms after the PPS edges
+#define DEFAULT_WINDOW_START_MS -2
+#define DEFAULT_WINDOW_END_MS 20
+#define DEFAULT_BUS_HZ 100000
+#define DEFAULT_STATS_S 10
+// ioctl and scheduling on top of the bits on the wire, for guessing how long a housekeeping transfer takes
+#define TRANSFER_OVERHEAD_US 200
+#define NO_PAGE 0xff
+#define STATS_TEMPFILE "/run/.i2c-arbiter"
+#define STATS_FILE "/run/i2c-arbiter"
+
+struct client {
+  int fd;              // -1 for a free slot
+  uint8_t pending;
+  uint8_t deferred;    // this request already counted as deferred
+  uint64_t received_us;
+  size_t length;
+  uint8_t message[I2C_ARBITER_MESSAGE_MAX];
+};
+
+// per priority: totals since start, queue delay over the current stats interval
+struct priority_stats {
+  uint32_t requests;
+  uint32_t expired;
+  uint32_t deferred;
+  uint32_t failed;
+  uint32_t interval_requests;
+  uint64_t interval_queue_us;
+  uint32_t interval_max_queue_us;
+};
+
+static struct client clients[MAX_CLIENTS];
+static struct priority_stats stats[I2C_ARBITER_PRIORITIES];
+static const char *priority_names[I2C_ARBITER_PRIORITIES] = {"timing", "normal", "housekeeping"};
+static int lock_owner = -1;
+static uint8_t lock_pages[128]; // per address, the page the lock holder last selected, NO_PAGE if it hasn't
+static int addr_fds[128];
+static const char *bus = I2C_DEFAULT_BUS;
+static int64_t window_start_ns = DEFAULT_WINDOW_START_MS * 1000000LL, window_end_ns = DEFAULT_WINDOW_END_MS * 1000000LL;
+static uint32_t bus_hz = DEFAULT_BUS_HZ;
+
+static uint64_t now_us() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int64_t realtime_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// ns until [t, t+duration] no longer overlaps a PPS window, 0 if it doesn't now
+static int64_t window_wait_ns(int64_t t, int64_t duration) {
+  int64_t second = t - t % 1000000000LL;
+
+  for(int64_t s = second - 1000000000LL; s <= second + 1000000000LL; s += 1000000000LL) {
+    if(t < s + window_end_ns && t + duration > s + window_start_ns) {
+      return s + window_end_ns - t;
+    }
+  }
+  return 0;
+}
+
+// the addresses share the bus, so the first fd opened (the general call one) is the one that's locked
+static int addr_fd(uint16_t addr) {
+  if(addr_fds[addr & 0x7f] < 0) {
+    addr_fds[addr & 0x7f] = open_i2c(bus, addr & 0x7f);
+  }
+  return addr_fds[addr & 0x7f];
+}
+
+static uint8_t request_priority(const struct client *c) {
+  const struct i2c_arbiter_request *request = (const struct i2c_arbiter_request *)c->message;
+  const uint8_t *write = c->message + sizeof(*request);
+
+  if(request->type == I2C_ARBITER_TRANSFER && request->count > 0 && request->lengths[0].write_len == 2 &&
+      request->lengths[0].read_len > 0 && write[0] == I2C_REGISTER_OFFSET_PAGE && write[1] == I2C_REGISTER_PAGE4) {
+    return I2C_ARBITER_PRIORITY_TIMING;
+  }
+  return request->priority < I2C_ARBITER_PRIORITIES ? request->priority : I2C_ARBITER_PRIORITY_HOUSEKEEPING;
+}
+
+// bits on the wire at bus_hz: address, data bytes and acks, plus the start and stop
+static int64_t request_duration_ns(const struct client *c) {
+  const struct i2c_arbiter_request *request = (const struct i2c_arbiter_request *)c->message;
+  uint32_t bits = 0;
+
+  for(uint8_t i = 0; i < request->count && i < I2C_ARBITER_MAX_TRANSFERS; i++) {
+    bits += (request->lengths[i].write_len + 1 + request->lengths[i].read_len + 1) * 9 + 2;
+  }
+  return bits * 1000000000LL / bus_hz + TRANSFER_OVERHEAD_US * 1000LL;
+}
+
+// the page a write leaves selected on the board, NO_PAGE if it doesn't reach the page register
+static uint8_t selected_page(const uint8_t *write, size_t write_len) {
+  for(size_t i = 1; i < write_len; i++) {
+    if(write[0] + i - 1 == I2C_REGISTER_OFFSET_PAGE) {
+      return write[i];
+    }
+  }
+  return NO_PAGE;
+}
+
+static void close_client(int i) {
+  if(lock_owner == i) {
+    unlock_i2c(addr_fd(0));
+    lock_owner = -1;
+  }
+  close(clients[i].fd);
+  clients[i].fd = -1;
+  clients[i].pending = 0;
+}
+
+static void reply(int i, struct i2c_arbiter_reply *header, const uint8_t *data, size_t len) {
+  uint8_t message[I2C_ARBITER_MESSAGE_MAX];
+
+  memcpy(message, header, sizeof(*header));
+  memcpy(message + sizeof(*header), data, len);
+  clients[i].pending = 0;
+  if(send(clients[i].fd, message, sizeof(*header) + len, MSG_NOSIGNAL) < 0) {
+    close_client(i);
+  }
+}
+
+static void reply_status(int i, int32_t status) {
+  struct i2c_arbiter_reply header;
+
+  memset(&header, '\0', sizeof(header));
+  header.status = status;
+  reply(i, &header, NULL, 0);
+}
+
+static void serve(int i, uint8_t priority) {
+  const struct i2c_arbiter_request *request = (const struct i2c_arbiter_request *)clients[i].message;
+  const uint8_t *write = clients[i].message + sizeof(*request);
+  struct i2c_transfer transfers[I2C_ARBITER_MAX_TRANSFERS];
+  uint8_t read_data[I2C_ARBITER_MESSAGE_MAX];
+  struct i2c_arbiter_reply header;
+  size_t write_len = 0, read_len = 0;
+  uint32_t queued_us = now_us() - clients[i].received_us;
+  struct priority_stats *s = &stats[priority];
+
+  s->requests++;
+  s->interval_requests++;
+  s->interval_queue_us += queued_us;
+  if(queued_us > s->interval_max_queue_us) {
+    s->interval_max_queue_us = queued_us;
+  }
+
+  if(request->type == I2C_ARBITER_LOCK) {
+    lock_i2c(addr_fd(0));
+    lock_owner = i;
+    memset(lock_pages, NO_PAGE, sizeof(lock_pages));
+    reply_status(i, I2C_OK);
+    return;
+  }
+  if(request->type == I2C_ARBITER_UNLOCK) {
+    if(lock_owner == i) {
+      unlock_i2c(addr_fd(0));
+      lock_owner = -1;
+    }
+    reply_status(i, I2C_OK);
+    return;
+  }
+
+  if(request->type != I2C_ARBITER_TRANSFER || request->count > I2C_ARBITER_MAX_TRANSFERS) {
+    reply_status(i, I2C_ERROR_FATAL);
+    return;
+  }
+  for(uint8_t t = 0; t < request->count; t++) {
+    transfers[t].write = write + write_len;
+    transfers[t].write_len = request->lengths[t].write_len;
+    transfers[t].read = read_data + read_len;
+    transfers[t].read_len = request->lengths[t].read_len;
+    write_len += transfers[t].write_len;
+    read_len += transfers[t].read_len;
+  }
+  if(sizeof(*request) + write_len != clients[i].length || sizeof(header) + read_len > sizeof(read_data)) {
+    reply_status(i, I2C_ERROR_FATAL);
+    return;
+  }
+
+  memset(&header, '\0', sizeof(header));
+  header.queued_us = queued_us;
+  if(lock_owner < 0) {
+    lock_i2c(addr_fd(0));
+  }
+  header.bus_start_ns = realtime_ns();
+  header.status = transfer_i2c_once(addr_fd(request->addr), transfers, request->count);
+  header.bus_end_ns = realtime_ns();
+  for(uint8_t t = 0; t < request->count; t++) {
+    uint8_t page = selected_page(transfers[t].write, transfers[t].write_len);
+
+    if(page == NO_PAGE || request->addr == 0) {
+      continue;
+    }
+    if(lock_owner == i) {
+      lock_pages[request->addr & 0x7f] = page;
+    } else if(lock_owner >= 0 && lock_pages[request->addr & 0x7f] != NO_PAGE && lock_pages[request->addr & 0x7f] != page) {
+      // a timing transfer between the holder's, which may rely on the page it selected
+      uint8_t restore[2] = {I2C_REGISTER_OFFSET_PAGE, lock_pages[request->addr & 0x7f]};
+      struct i2c_transfer select = {restore, sizeof(restore), NULL, 0};
+
+      transfer_i2c_once(addr_fd(request->addr), &select, 1);
+      break;
+    }
+  }
+  if(lock_owner < 0) {
+    unlock_i2c(addr_fd(0));
+  }
+  if(header.status != I2C_OK) {
+    s->failed++;
+    read_len = 0;
+  }
+  reply(i, &header, read_data, read_len);
+}
+
+/* answers expired requests, and returns the client to serve next (-1 for none)
+ * wait_ns is set to how long until a deferred or deadline request needs another look
+ */
+static int pick(int64_t *wait_ns) {
+  uint64_t now = now_us();
+  int64_t realtime = realtime_ns();
+  int best = -1;
+  uint8_t best_priority = I2C_ARBITER_PRIORITIES;
+
+  for(int i = 0; i < MAX_CLIENTS; i++) {
+    const struct i2c_arbiter_request *request = (const struct i2c_arbiter_request *)clients[i].message;
+    uint8_t priority;
+    int64_t window_ns;
+
+    if(clients[i].fd < 0 || !clients[i].pending) {
+      continue;
+    }
+    priority = request_priority(&clients[i]);
+
+    if(request->deadline_us && now - clients[i].received_us > request->deadline_us) {
+      stats[priority].expired++;
+      reply_status(i, I2C_ERROR_TRANSIENT);
+      continue;
+    }
+    if(request->deadline_us) {
+      int64_t left_ns = (clients[i].received_us + request->deadline_us - now) * 1000LL;
+
+      *wait_ns = left_ns < *wait_ns ? left_ns : *wait_ns;
+    }
+    // an unlock only ever frees the bus, nothing to hold it back for
+    if(request->type == I2C_ARBITER_UNLOCK) {
+      return i;
+    }
+    // only the lock holder's sequence goes out until it unlocks, timing transfers go between its transfers
+    if(lock_owner >= 0 && lock_owner != i && (priority != I2C_ARBITER_PRIORITY_TIMING || request->type != I2C_ARBITER_TRANSFER)) {
+      continue;
+    }
+    // a housekeeping lock holder's transfers are checked one at a time like anyone else's, holding the lock is no way in
+    if(priority == I2C_ARBITER_PRIORITY_HOUSEKEEPING && (window_ns = window_wait_ns(realtime, request_duration_ns(&clients[i]))) > 0) {
+      if(!clients[i].deferred) {
+        clients[i].deferred = 1;
+        stats[priority].deferred++;
+      }
+      *wait_ns = window_ns < *wait_ns ? window_ns : *wait_ns;
+      continue;
+    }
+
+    if(priority < best_priority || (priority == best_priority && clients[i].received_us < clients[best].received_us)) {
+      best = i;
+      best_priority = priority;
+    }
+  }
+
+  return best;
+}
+
+static void write_stats(uint32_t interval_s) {
+  FILE *f;
+
+  printf("%lu", time(NULL));
+  for(uint8_t p = 0; p < I2C_ARBITER_PRIORITIES; p++) {
+    struct priority_stats *s = &stats[p];
+
+    printf(" %s %u %.0f/%u us", priority_names[p], s->interval_requests,
+        s->interval_requests ? (double)s->interval_queue_us / s->interval_requests : 0.0, s->interval_max_queue_us);
+  }
+  printf("\n");
+  i2c_latency_summary(stdout, "");
+  fflush(stdout);
+
+  f = fopen(STATS_TEMPFILE, "w");
+  if(f == NULL) {
+    perror("fopen " STATS_TEMPFILE);
+  } else {
+    fprintf(f, "# priority requests expired deferred failed, then queue delay over the last %us: mean_us max_us\n", interval_s);
+    for(uint8_t p = 0; p < I2C_ARBITER_PRIORITIES; p++) {
+      struct priority_stats *s = &stats[p];
+
+      fprintf(f, "%s %u %u %u %u %.0f %u\n", priority_names[p], s->requests, s->expired, s->deferred, s->failed,
+          s->interval_requests ? (double)s->interval_queue_us / s->interval_requests : 0.0, s->interval_max_queue_us);
+    }
+    fprintf(f, "# op count p50 p90 p99 p99.9 max, us on the bus since the start\n");
+    i2c_latency_write(f);
+    fclose(f);
+    rename(STATS_TEMPFILE, STATS_FILE);
+  }
+
+  for(uint8_t p = 0; p < I2C_ARBITER_PRIORITIES; p++) {
+    stats[p].interval_requests = 0;
+    stats[p].interval_queue_us = 0;
+    stats[p].interval_max_queue_us = 0;
+  }
+}
+
+static int listen_socket(const char *path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  memset(&addr, '\0', sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if(fd < 0) {
+    perror("socket");
+    exit(1);
+  }
+  unlink(path); // left over from an arbiter that didn't exit cleanly
+  if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, MAX_CLIENTS) < 0) {
+    fprintf(stderr, "listen on %s failed: ", path);
+    perror(NULL);
+    exit(1);
+  }
+  return fd;
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [-b bus] [-s socket] [-w start_ms,end_ms] [-f bus_hz] [-i stats_s]\n"
+      "  -b  the bus to own (%s), any -b a client takes but arbiter\n"
+      "  -s  socket for the clients (%s)\n"
+      "  -w  PPS window housekeeping stays out of, around the top of the system clock's second (%d,%d)\n"
+      "  -f  bus clock for estimating transfer times (%u)\n"
+      "  -i  seconds between queue delay summaries, also written to %s (%u)\n",
+      name, I2C_DEFAULT_BUS, I2C_ARBITER_SOCKET, DEFAULT_WINDOW_START_MS, DEFAULT_WINDOW_END_MS, DEFAULT_BUS_HZ,
+      STATS_FILE, DEFAULT_STATS_S);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const char *socket_path = I2C_ARBITER_SOCKET;
+  struct pollfd fds[MAX_CLIENTS + 1];
+  uint32_t stats_s = DEFAULT_STATS_S;
+  uint64_t next_stats;
+  int listen_fd, opt, start_ms, end_ms;
+
+  while((opt = getopt(argc, argv, "b:s:w:f:i:")) != -1) {
+    switch(opt) {
+      case 'b': bus = optarg; break;
+      case 's': socket_path = optarg; break;
+      case 'w':
+        if(sscanf(optarg, "%d,%d", &start_ms, &end_ms) != 2 || start_ms >= end_ms || end_ms - start_ms >= 1000) {
+          usage(argv[0]);
+        }
+        window_start_ns = start_ms * 1000000LL;
+        window_end_ns = end_ms * 1000000LL;
+        break;
+      case 'f': bus_hz = strtoul(optarg, NULL, 0); break;
+      case 'i': stats_s = strtoul(optarg, NULL, 0); break;
+      default: usage(argv[0]);
+    }
+  }
+  if(bus_hz == 0 || stats_s == 0) {
+    usage(argv[0]);
+  }
+
+  for(uint8_t i = 0; i < sizeof(addr_fds) / sizeof(addr_fds[0]); i++) {
+    addr_fds[i] = -1;
+  }
+  addr_fd(0);
+  for(int i = 0; i < MAX_CLIENTS; i++) {
+    clients[i].fd = -1;
+  }
+  listen_fd = listen_socket(socket_path);
+  signal(SIGPIPE, SIG_IGN);
+  next_stats = now_us() + stats_s * 1000000ULL;
+
+  while(1) {
+    int64_t wait_ns = (next_stats - now_us()) * 1000LL;
+    int best, nfds = 1, timeout_ms;
+
+    best = pick(&wait_ns);
+    if(best >= 0) {
+      serve(best, request_priority(&clients[best]));
+      wait_ns = 0; // see what came in during the transfer before picking the next one
+    }
+
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    for(int i = 0; i < MAX_CLIENTS; i++) {
+      // a client with a request waiting can't send another
+      if(clients[i].fd >= 0 && !clients[i].pending) {
+        fds[nfds].fd = clients[i].fd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+      }
+    }
+    timeout_ms = wait_ns <= 0 ? 0 : (wait_ns + 999999) / 1000000;
+    if(poll(fds, nfds, timeout_ms) < 0 && errno != EINTR) {
+      perror("poll");
+      exit(1);
+    }
+
+    if(fds[0].revents & POLLIN) {
+      int fd = accept(listen_fd, NULL, NULL), i;
+
+      for(i = 0; i < MAX_CLIENTS && clients[i].fd >= 0; i++)
+        ;
+      if(fd >= 0 && i == MAX_CLIENTS) {
+        fprintf(stderr, "more than %u clients\n", MAX_CLIENTS);
+        close(fd);
+      } else if(fd >= 0) {
+        clients[i].fd = fd;
+        clients[i].pending = 0;
+      }
+    }
+    for(int n = 1; n < nfds; n++) {
+      int i;
+      ssize_t len;
+
+      if(!fds[n].revents) {
+        continue;
+      }
+      for(i = 0; clients[i].fd != fds[n].fd; i++)
+        ;
+      len = recv(clients[i].fd, clients[i].message, sizeof(clients[i].message), MSG_DONTWAIT);
+      if(len <= 0) {
+        if(len == 0 || (errno != EAGAIN && errno != EINTR)) {
+          close_client(i);
+        }
+        continue;
+      }
+      if((size_t)len < sizeof(struct i2c_arbiter_request)) {
+        close_client(i);
+        continue;
+      }
+      clients[i].length = len;
+      clients[i].received_us = now_us();
+      clients[i].pending = 1;
+      clients[i].deferred = 0;
+    }
+
+    if(now_us() >= next_stats) {
+      write_stats(stats_s);
+      next_stats += stats_s * 1000000ULL;
+    }
+  }
+}
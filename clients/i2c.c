@@ -2,17 +2,38 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
 #include <stdint.h>
 #include <sys/types.h>
-#include <sys/stat.h>
 #include <sys/file.h>
-#include <fcntl.h>
-#include <sys/ioctl.h>
-#include <linux/i2c-dev.h>
+#include <time.h>
 
 #include "i2c.h"
+#include "i2c_latency.h"
+
+// the transport behind every open fd, and the address transfers on it go to
+static struct {
+  const struct i2c_transport *transport;
+  uint16_t addr;
+} buses[I2C_MAX_FDS];
+
+static struct i2c_fault_counts faults;
+static const char *error_names[I2C_ERROR_CLASSES] = {"ok", "transient", "nack", "bus", "corrupt", "fatal"};
+
+static const struct i2c_transport *transports[] = {
+  &i2c_record_transport,
+  &i2c_replay_transport,
+  &i2c_sim_transport,
+  &i2c_arbiter_transport,
+};
 
 int lock_i2c(int fd) {
+  if(fd >= 0 && fd < I2C_MAX_FDS && buses[fd].transport != NULL && buses[fd].transport->lock != NULL) {
+    buses[fd].transport->lock(fd, 1);
+    return fd;
+  }
+
   if(flock(fd, LOCK_EX) < 0) {
     perror("flock failed");
     exit(1);
@@ -22,6 +43,11 @@ int lock_i2c(int fd) {
 }
 
 int unlock_i2c(int fd) {
+  if(fd >= 0 && fd < I2C_MAX_FDS && buses[fd].transport != NULL && buses[fd].transport->lock != NULL) {
+    buses[fd].transport->lock(fd, 0);
+    return fd;
+  }
+
   if(flock(fd, LOCK_UN) < 0) {
     perror("flock failed");
     exit(1);
@@ -31,9 +57,7 @@ int unlock_i2c(int fd) {
 }
 
 uint8_t read_i2c_register(int fd, uint8_t reg) {
-  write_i2c(fd, &reg, 1);
-
-  read_i2c(fd, &reg, 1);
+  write_read_i2c(fd, &reg, 1, &reg, 1);
   return reg;
 }
 
@@ -46,60 +70,172 @@ void write_i2c_register(int fd, uint8_t reg, uint8_t val) {
   write_i2c(fd, &data, 2);
 }
 
-void write_i2c(int fd, void *buffer, ssize_t len) {
-  ssize_t status;
-
-  status = write(fd, buffer, len);
-  if(status < 0) {
-    perror("write to i2c failed");
-
-    // is this from an interrupt on the stm32 side and the pi not supporting clock stretching?
-    // happens on roughly 1/200000 requests
-    if(errno == EIO) {
-      usleep(100);
-      status = write(fd, buffer, len);
-      if(status < 0) {
-        perror("write to i2c failed again");
-        exit(1);
-      }
-    } else {
-      exit(1);
-    }
+const struct i2c_fault_counts *i2c_faults() {
+  return &faults;
+}
+
+void i2c_count_fault(int error) {
+  if(error > I2C_OK && error < I2C_ERROR_CLASSES) {
+    faults.errors[error]++;
   }
-  if(status != len) {
-    fprintf(stderr,"write not %zu bytes: %zu\n", len, status);
-    exit(1);
+}
+
+const char *i2c_error_name(int error) {
+  if(error >= I2C_OK && error < I2C_ERROR_CLASSES) {
+    return error_names[error];
   }
+  return "??";
 }
 
-void read_i2c(int fd, void *buffer, ssize_t len) {
-  ssize_t status;
+// for the transports, errno after a failed read, write or ioctl
+int i2c_errno_class(int err) {
+  switch(err) {
+    case EIO:
+    case EAGAIN:    // lost arbitration
+    case EINTR:
+      return I2C_ERROR_TRANSIENT;
+    case ENXIO:
+    case EREMOTEIO: // which of the two a nack is depends on the adapter driver
+      return I2C_ERROR_NACK;
+    case ETIMEDOUT:
+    case EBUSY:
+      return I2C_ERROR_BUS;
+  }
+  return I2C_ERROR_FATAL;
+}
 
-  status = read(fd, buffer, len);
-  if(status < 0) {
-    perror("read to i2c failed");
+static const struct i2c_transport *fd_transport(int fd) {
+  if(fd < 0 || fd >= I2C_MAX_FDS || buses[fd].transport == NULL) {
+    fprintf(stderr, "fd %d is not an open i2c bus\n", fd);
     exit(1);
   }
-  if(status != len) {
-    fprintf(stderr,"read not %zu bytes: %zu\n", len, status);
-    exit(1);
+  return buses[fd].transport;
+}
+
+// one try, counted and timed, and a stuck bus recovered before returning, for the arbiter that leaves the retries to its clients
+int transfer_i2c_once(int fd, const struct i2c_transfer *transfers, int count) {
+  const struct i2c_transport *transport = fd_transport(fd);
+  uint64_t start;
+  int status;
+
+  faults.transfers++;
+  start = i2c_latency_now();
+  status = transport->transfer(fd, buses[fd].addr, transfers, count);
+  if(status == I2C_OK) {
+    i2c_latency_add(i2c_latency_op(transfers, count), i2c_latency_now() - start);
   }
+  i2c_count_fault(status);
+  if(status == I2C_ERROR_BUS && transport->recover != NULL && transport->recover(fd, buses[fd].addr)) {
+    faults.recoveries++;
+  }
+
+  return status;
 }
 
-int open_i2c(uint16_t i2c_addr) {
-  int fd;
+/* a page select or register write is safe to repeat, so a failed transfer is sent again whole
+ * returns I2C_OK or the class of the last failure once the tries run out
+ */
+int try_transfer_i2c(int fd, const struct i2c_transfer *transfers, int count) {
+  int status;
+
+  for(uint8_t tries = 1; ; tries++) {
+    status = transfer_i2c_once(fd, transfers, count);
+    if(status == I2C_OK) {
+      return I2C_OK;
+    }
+    if(status == I2C_ERROR_FATAL || tries == I2C_TRIES) {
+      faults.failed++;
+      return status;
+    }
+    faults.retries++;
+    usleep(I2C_BACKOFF_US << (tries - 1));
+  }
+}
+
+// 0 and when the last transfer on fd was on the bus, if the transport knows better than the caller's clock
+int i2c_bus_time(int fd, struct timespec *start, struct timespec *end) {
+  const struct i2c_transport *transport = fd_transport(fd);
 
-  fd = open("/dev/i2c-1", O_RDWR);
-  if (fd < 0) {
-    perror("open /dev/i2c-1 failed");
+  return transport->bus_time != NULL ? transport->bus_time(fd, start, end) : -1;
+}
+
+// for the clients that have nothing to lose by exiting
+void transfer_i2c(int fd, const struct i2c_transfer *transfers, int count) {
+  int status = try_transfer_i2c(fd, transfers, count);
+
+  if(status != I2C_OK) {
+    fprintf(stderr, "i2c 0x%02x: %s error after %u tries\n", buses[fd].addr, i2c_error_name(status), I2C_TRIES);
     exit(1);
   }
+}
+
+void write_i2c(int fd, void *buffer, ssize_t len) {
+  struct i2c_transfer transfer = {buffer, len, NULL, 0};
+
+  transfer_i2c(fd, &transfer, 1);
+}
+
+void read_i2c(int fd, void *buffer, ssize_t len) {
+  struct i2c_transfer transfer = {NULL, 0, buffer, len};
+
+  transfer_i2c(fd, &transfer, 1);
+}
+
+// register or page select and the read after it with a repeated start, nothing else gets on the bus in between
+void write_read_i2c(int fd, const void *write, uint16_t write_len, void *read, uint16_t read_len) {
+  struct i2c_transfer transfer = {write, write_len, read, read_len};
+
+  transfer_i2c(fd, &transfer, 1);
+}
+
+// picks the transport by the bus name's prefix, path is what follows it
+const struct i2c_transport *i2c_find_transport(const char *bus, const char **path) {
+  for(size_t i = 0; i < sizeof(transports) / sizeof(transports[0]); i++) {
+    size_t prefix_len = strlen(transports[i]->prefix);
+
+    if(strncmp(bus, transports[i]->prefix, prefix_len) == 0 && (bus[prefix_len] == ':' || bus[prefix_len] == '\0')) {
+      *path = bus[prefix_len] == ':' ? bus + prefix_len + 1 : bus + prefix_len;
+      return transports[i];
+    }
+  }
+
+  *path = bus;
+  return &i2c_dev_transport;
+}
+
+int open_i2c(const char *bus, uint16_t i2c_addr) {
+  const struct i2c_transport *transport;
+  const char *path;
+  int fd;
 
-  if (ioctl(fd, I2C_SLAVE, i2c_addr) < 0) {
-    perror("ioctl i2c slave addr failed");
+  transport = i2c_find_transport(bus, &path);
+  fd = transport->open(path, i2c_addr);
+  if(fd < 0 || fd >= I2C_MAX_FDS) {
+    fprintf(stderr, "%s: fd %d out of range\n", bus, fd);
     exit(1);
   }
 
+  buses[fd].transport = transport;
+  buses[fd].addr = i2c_addr;
+
   return fd;
 }
 
+// -b bus and -a address ahead of a client's own arguments, those are shifted down to start at argv[1]
+void i2c_options(int *argc, char ***argv, const char **bus, uint16_t *i2c_addr) {
+  int opt;
+
+  while((opt = getopt(*argc, *argv, "+b:a:")) != -1) {
+    switch(opt) {
+      case 'b': *bus = optarg; break;
+      case 'a': *i2c_addr = strtoul(optarg, NULL, 0); break;
+      default:
+        fprintf(stderr, "usage: %s [-b %s] [-a 0x%x] ...\n", (*argv)[0], *bus, *i2c_addr);
+        exit(1);
+    }
+  }
+
+  (*argv)[optind - 1] = (*argv)[0];
+  *argv += optind - 1;
+  *argc -= optind - 1;
+}
@@ -1,9 +1,82 @@
 #ifndef I2C_H
 #define I2C_H
 
+struct timespec;
+
 void write_i2c(int fd, void *buffer, ssize_t len);
 void read_i2c(int fd, void *buffer, ssize_t len);
-int open_i2c(uint16_t i2c_addr);
+
+// a write and/or a read, a list of these goes out as one I2C_RDWR with repeated starts in between and one stop at the end
+struct i2c_transfer {
+  const void *write;
+  uint16_t write_len;
+  void *read;
+  uint16_t read_len;
+};
+void transfer_i2c(int fd, const struct i2c_transfer *transfers, int count);
+int try_transfer_i2c(int fd, const struct i2c_transfer *transfers, int count);
+int transfer_i2c_once(int fd, const struct i2c_transfer *transfers, int count);
+int i2c_bus_time(int fd, struct timespec *start, struct timespec *end);
+void write_read_i2c(int fd, const void *write, uint16_t write_len, void *read, uint16_t read_len);
+// per board state (address, protocol version) is kept in arrays indexed by fd
+#define I2C_MAX_FDS 64
+#define I2C_DEFAULT_BUS "/dev/i2c-1"
+
+/* what's behind a bus, picked by the prefix of its name:
+ *   /dev/i2c-N[,recover=/dev/gpiochipM:scl:sda]  linux i2c-dev (i2c_dev.c), with gpio lines for bus recovery
+ *   record:FILE:bus              any other bus, with every transfer written to FILE
+ *   replay:FILE                  answers from a recorded session instead of a board (i2c_replay.c)
+ *   sim or sim:option=value,...  an in-process model of the board (i2c_sim.c)
+ *   arbiter or arbiter:option=value,...  through the i2c-arbiter daemon that owns the bus (i2c_arbiter.c)
+ * open returns an fd that lock_i2c can flock, below I2C_MAX_FDS, and exits on errors like the rest of this code
+ * transfer returns I2C_OK or an I2C_ERROR_X class, try_transfer_i2c does the retries
+ * recover (NULL if there's nothing to do) frees a bus left stuck by a slave, after an I2C_ERROR_BUS, 0 if it had no way to
+ * lock (NULL to flock the fd) takes or releases the bus for a sequence of transfers
+ * bus_time (NULL if the client's own clock reads are as good as it gets) is when the last transfer was on the wire
+ */
+struct i2c_transport {
+  const char *prefix;
+  int (*open)(const char *path, uint16_t i2c_addr);
+  int (*transfer)(int fd, uint16_t i2c_addr, const struct i2c_transfer *transfers, int count);
+  int (*recover)(int fd, uint16_t i2c_addr);
+  void (*lock)(int fd, int locked);
+  int (*bus_time)(int fd, struct timespec *start, struct timespec *end);
+};
+extern const struct i2c_transport i2c_dev_transport;
+extern const struct i2c_transport i2c_record_transport;
+extern const struct i2c_transport i2c_replay_transport;
+extern const struct i2c_transport i2c_sim_transport;
+extern const struct i2c_transport i2c_arbiter_transport;
+const struct i2c_transport *i2c_find_transport(const char *bus, const char **path);
+
+// what went wrong with a transfer, decides whether it's tried again
+#define I2C_OK 0
+#define I2C_ERROR_TRANSIENT 1 // EIO (the pi's clock stretching bug), lost arbitration, short transfer
+#define I2C_ERROR_NACK 2      // no ack, the board is resetting or moved
+#define I2C_ERROR_BUS 3       // timed out with the bus held low, recovered before the next try
+#define I2C_ERROR_CORRUPT 4   // the transfer went through but the page failed its checks, counted by i2c_registers.c
+#define I2C_ERROR_FATAL 5     // not the bus (bad fd, adapter gone, unsupported), never retried
+#define I2C_ERROR_CLASSES 6
+
+// a transfer that failed is tried this many times in all, backing off from I2C_BACKOFF_US and doubling
+#define I2C_TRIES 4
+#define I2C_BACKOFF_US 100
+
+// process-wide, for the daemons to export
+struct i2c_fault_counts {
+  uint32_t transfers;
+  uint32_t errors[I2C_ERROR_CLASSES];
+  uint32_t retries;
+  uint32_t recoveries;
+  uint32_t failed;     // out of tries
+};
+const struct i2c_fault_counts *i2c_faults();
+void i2c_count_fault(int error);
+int i2c_errno_class(int err);
+const char *i2c_error_name(int error);
+
+int open_i2c(const char *bus, uint16_t i2c_addr);
+void i2c_options(int *argc, char ***argv, const char **bus, uint16_t *i2c_addr);
 int unlock_i2c(int fd);
 int lock_i2c(int fd);
 void write_i2c_register(int fd, uint8_t reg, uint8_t val);
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "i2c.h"
+#include "i2c_arbiter.h"
+
+/* arbiter or arbiter:priority=timing|normal|housekeeping,deadline=MS,socket=PATH - the bus through i2c-arbiter
+ * every open in a process shares one connection (each fd a dup of it), so a lock on one covers transfers on the others
+ * like it does with flock on a real bus
+ */
+
+static int connection = -1;
+static uint8_t priority = I2C_ARBITER_PRIORITY_NORMAL;
+static uint32_t deadline_us = 0;
+static struct {
+  struct timespec start, end;
+  uint8_t valid;
+} last_bus_time[I2C_MAX_FDS];
+
+static const char *priority_names[I2C_ARBITER_PRIORITIES] = {"timing", "normal", "housekeeping"};
+
+static void parse_options(const char *path, char *socket_path, size_t socket_path_len) {
+  char *options = strdup(path), *option, *save = NULL;
+
+  snprintf(socket_path, socket_path_len, "%s", I2C_ARBITER_SOCKET);
+  for(option = strtok_r(options, ",", &save); option != NULL; option = strtok_r(NULL, ",", &save)) {
+    if(strncmp(option, "priority=", 9) == 0) {
+      for(priority = 0; priority < I2C_ARBITER_PRIORITIES && strcmp(option + 9, priority_names[priority]) != 0; priority++)
+        ;
+      if(priority == I2C_ARBITER_PRIORITIES) {
+        fprintf(stderr, "arbiter: priority is timing, normal or housekeeping, not %s\n", option + 9);
+        exit(1);
+      }
+    } else if(strncmp(option, "deadline=", 9) == 0) {
+      deadline_us = strtoul(option + 9, NULL, 10) * 1000;
+    } else if(strncmp(option, "socket=", 7) == 0) {
+      snprintf(socket_path, socket_path_len, "%s", option + 7);
+    } else {
+      fprintf(stderr, "arbiter: unknown option %s, options are priority=X,deadline=MS,socket=PATH\n", option);
+      exit(1);
+    }
+  }
+  free(options);
+}
+
+static int arbiter_open(const char *path, uint16_t i2c_addr) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if(connection < 0) {
+    memset(&addr, '\0', sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    parse_options(path, addr.sun_path, sizeof(addr.sun_path));
+
+    connection = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if(connection < 0) {
+      perror("socket");
+      exit(1);
+    }
+    if(connect(connection, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      fprintf(stderr, "connect %s failed: ", addr.sun_path);
+      perror(NULL);
+      exit(1);
+    }
+  }
+
+  fd = dup(connection);
+  if(fd < 0) {
+    perror("dup");
+    exit(1);
+  }
+  return fd;
+}
+
+// sends request with write_data after it and waits for the reply, read_data gets what came after the reply header
+static int exchange(int fd, struct i2c_arbiter_request *request, const uint8_t *write_data, size_t write_len,
+    struct i2c_arbiter_reply *reply, uint8_t *read_data, size_t read_len) {
+  uint8_t message[I2C_ARBITER_MESSAGE_MAX];
+  ssize_t status;
+
+  request->priority = priority;
+  memcpy(message, request, sizeof(*request));
+  if(write_len) {
+    memcpy(message + sizeof(*request), write_data, write_len);
+  }
+  if(send(fd, message, sizeof(*request) + write_len, 0) < 0) {
+    perror("arbiter send failed");
+    return I2C_ERROR_FATAL;
+  }
+
+  status = recv(fd, message, sizeof(message), 0);
+  if(status < (ssize_t)sizeof(*reply)) {
+    if(status < 0) {
+      perror("arbiter recv failed");
+    } else {
+      fprintf(stderr, "arbiter closed the connection\n");
+    }
+    return I2C_ERROR_FATAL;
+  }
+  memcpy(reply, message, sizeof(*reply));
+  if(reply->status == I2C_OK && status != (ssize_t)(sizeof(*reply) + read_len)) {
+    fprintf(stderr, "arbiter reply is %zd bytes, expected %zu\n", status, sizeof(*reply) + read_len);
+    return I2C_ERROR_FATAL;
+  }
+  if(reply->status == I2C_OK && read_len) {
+    memcpy(read_data, message + sizeof(*reply), read_len);
+  }
+  return reply->status;
+}
+
+static int arbiter_transfer(int fd, uint16_t i2c_addr, const struct i2c_transfer *transfers, int count) {
+  struct i2c_arbiter_request request;
+  struct i2c_arbiter_reply reply;
+  uint8_t write_data[I2C_ARBITER_MESSAGE_MAX], read_data[I2C_ARBITER_MESSAGE_MAX];
+  size_t write_len = 0, read_len = 0;
+  int status;
+
+  if(count > I2C_ARBITER_MAX_TRANSFERS) {
+    fprintf(stderr, "arbiter: %d transfers, max %u\n", count, I2C_ARBITER_MAX_TRANSFERS);
+    return I2C_ERROR_FATAL;
+  }
+
+  memset(&request, '\0', sizeof(request));
+  request.type = I2C_ARBITER_TRANSFER;
+  request.count = count;
+  request.addr = i2c_addr;
+  request.deadline_us = deadline_us;
+  for(int i = 0; i < count; i++) {
+    request.lengths[i].write_len = transfers[i].write_len;
+    request.lengths[i].read_len = transfers[i].read_len;
+    if(write_len + transfers[i].write_len > sizeof(write_data) - sizeof(request) ||
+        read_len + transfers[i].read_len > sizeof(read_data) - sizeof(reply)) {
+      fprintf(stderr, "arbiter: transfer over %u bytes\n", I2C_ARBITER_MESSAGE_MAX);
+      return I2C_ERROR_FATAL;
+    }
+    memcpy(write_data + write_len, transfers[i].write, transfers[i].write_len);
+    write_len += transfers[i].write_len;
+    read_len += transfers[i].read_len;
+  }
+
+  last_bus_time[fd].valid = 0;
+  status = exchange(fd, &request, write_data, write_len, &reply, read_data, read_len);
+  if(status != I2C_OK) {
+    return status;
+  }
+
+  read_len = 0;
+  for(int i = 0; i < count; i++) {
+    memcpy(transfers[i].read, read_data + read_len, transfers[i].read_len);
+    read_len += transfers[i].read_len;
+  }
+  last_bus_time[fd].start.tv_sec = reply.bus_start_ns / 1000000000;
+  last_bus_time[fd].start.tv_nsec = reply.bus_start_ns % 1000000000;
+  last_bus_time[fd].end.tv_sec = reply.bus_end_ns / 1000000000;
+  last_bus_time[fd].end.tv_nsec = reply.bus_end_ns % 1000000000;
+  last_bus_time[fd].valid = 1;
+  return I2C_OK;
+}
+
+static void arbiter_lock(int fd, int locked) {
+  struct i2c_arbiter_request request;
+  struct i2c_arbiter_reply reply;
+  int status;
+
+  memset(&request, '\0', sizeof(request));
+  request.type = locked ? I2C_ARBITER_LOCK : I2C_ARBITER_UNLOCK;
+  /* a lock that misses the deadline leaves the caller's transfers to go out one by one, each with the same deadline,
+   * and a page read is one repeated start transfer that can't be split anyway
+   */
+  request.deadline_us = locked ? deadline_us : 0;
+  status = exchange(fd, &request, NULL, 0, &reply, NULL, 0);
+  if(status != I2C_OK && status != I2C_ERROR_TRANSIENT) {
+    fprintf(stderr, "arbiter: %s failed\n", locked ? "lock" : "unlock");
+    exit(1);
+  }
+}
+
+static int arbiter_bus_time(int fd, struct timespec *start, struct timespec *end) {
+  if(!last_bus_time[fd].valid) {
+    return -1;
+  }
+  *start = last_bus_time[fd].start;
+  *end = last_bus_time[fd].end;
+  return 0;
+}
+
+const struct i2c_transport i2c_arbiter_transport = {"arbiter", arbiter_open, arbiter_transfer, NULL, arbiter_lock, arbiter_bus_time};
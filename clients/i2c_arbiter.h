@@ -0,0 +1,48 @@
+#ifndef I2C_ARBITER_H
+#define I2C_ARBITER_H
+
+/* i2c-arbiter's protocol, one SOCK_SEQPACKET message each way per request
+ * request: struct i2c_arbiter_request, then the write bytes of every transfer in order
+ * reply: struct i2c_arbiter_reply, then the read bytes of every transfer in order
+ * a client has one request out at a time
+ */
+
+#define I2C_ARBITER_SOCKET "/run/i2c-arbiter.sock"
+
+#define I2C_ARBITER_TRANSFER 0
+#define I2C_ARBITER_LOCK 1   // the bus for this connection alone until I2C_ARBITER_UNLOCK or it closes
+#define I2C_ARBITER_UNLOCK 2
+
+// strict, a lower number always goes first
+#define I2C_ARBITER_PRIORITY_TIMING 0       // cross-timestamps: page4 reads and whatever else asks for it
+#define I2C_ARBITER_PRIORITY_NORMAL 1
+#define I2C_ARBITER_PRIORITY_HOUSEKEEPING 2 // kept out of the PPS window
+#define I2C_ARBITER_PRIORITIES 3
+
+// as many as read_i2c_pages sends at once
+#define I2C_ARBITER_MAX_TRANSFERS 8
+#define I2C_ARBITER_MESSAGE_MAX 1024
+
+struct i2c_arbiter_request {
+  uint8_t type;        // I2C_ARBITER_X
+  uint8_t priority;    // I2C_ARBITER_PRIORITY_X
+  uint8_t count;       // transfers
+  uint8_t reserved;
+  uint16_t addr;
+  uint16_t reserved2;
+  uint32_t deadline_us; // 0 for none, otherwise dropped with I2C_ERROR_TRANSIENT if the bus isn't free by then
+  struct {
+    uint16_t write_len;
+    uint16_t read_len;
+  } lengths[I2C_ARBITER_MAX_TRANSFERS];
+};
+
+struct i2c_arbiter_reply {
+  int32_t status;       // I2C_OK or I2C_ERROR_X
+  uint32_t queued_us;   // from the arbiter reading the request to the bus being free for it
+  // CLOCK_REALTIME around the transfer on the bus, for cross-timestamps without the socket round trip
+  int64_t bus_start_ns;
+  int64_t bus_end_ns;
+};
+
+#endif
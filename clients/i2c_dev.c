@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <linux/gpio.h>
+
+#include "i2c.h"
+
+// linux i2c-dev, /dev/i2c-N or /dev/i2c-N,recover=/dev/gpiochipM:scl:sda
+
+#define RECOVER_OPTION ",recover="
+// a bus clear is up to nine clocks, for the rest of a byte and its ack
+#define RECOVER_CLOCKS 9
+// half an scl period, 100kHz or slower
+#define RECOVER_HALF_PERIOD_US 5
+
+// some adapters (smbus only) can't do I2C_RDWR's repeated start
+static uint8_t rdwr[I2C_MAX_FDS];
+
+// gpio lines wired to the bus's SCL and SDA, for clocking a stuck slave free
+static struct {
+  char chip[64];
+  uint32_t scl, sda;
+} recover_lines[I2C_MAX_FDS];
+
+static int dev_write(int fd, const void *buffer, ssize_t len) {
+  ssize_t status;
+
+  status = write(fd, buffer, len);
+  if(status < 0) {
+    // EIO: is this from an interrupt on the stm32 side and the pi not supporting clock stretching?
+    // happens on roughly 1/200000 requests
+    perror("write to i2c failed");
+    return i2c_errno_class(errno);
+  }
+  if(status != len) {
+    fprintf(stderr,"write not %zu bytes: %zu\n", len, status);
+    return I2C_ERROR_TRANSIENT;
+  }
+  return I2C_OK;
+}
+
+static int dev_read(int fd, void *buffer, ssize_t len) {
+  ssize_t status;
+
+  status = read(fd, buffer, len);
+  if(status < 0) {
+    perror("read to i2c failed");
+    return i2c_errno_class(errno);
+  }
+  if(status != len) {
+    fprintf(stderr,"read not %zu bytes: %zu\n", len, status);
+    return I2C_ERROR_TRANSIENT;
+  }
+  return I2C_OK;
+}
+
+static int dev_transfer(int fd, uint16_t i2c_addr, const struct i2c_transfer *transfers, int count) {
+  struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+  struct i2c_rdwr_ioctl_data data;
+  int status, n = 0;
+
+  if(!rdwr[fd] || (count == 1 && (transfers[0].write_len == 0 || transfers[0].read_len == 0))) {
+    // a stop between every write and read, or a single message that doesn't need I2C_RDWR
+    for(int i = 0; i < count; i++) {
+      if(transfers[i].write_len && (status = dev_write(fd, transfers[i].write, transfers[i].write_len)) != I2C_OK) {
+        return status;
+      }
+      if(transfers[i].read_len && (status = dev_read(fd, transfers[i].read, transfers[i].read_len)) != I2C_OK) {
+        return status;
+      }
+    }
+    return I2C_OK;
+  }
+
+  for(int i = 0; i < count; i++) {
+    if(n + 2 > I2C_RDWR_IOCTL_MAX_MSGS) {
+      fprintf(stderr, "i2c transfer: more than %d messages\n", I2C_RDWR_IOCTL_MAX_MSGS);
+      return I2C_ERROR_FATAL;
+    }
+    if(transfers[i].write_len) {
+      msgs[n].addr = i2c_addr;
+      msgs[n].flags = 0;
+      msgs[n].len = transfers[i].write_len;
+      msgs[n].buf = (uint8_t *)transfers[i].write;
+      n++;
+    }
+    if(transfers[i].read_len) {
+      msgs[n].addr = i2c_addr;
+      msgs[n].flags = I2C_M_RD;
+      msgs[n].len = transfers[i].read_len;
+      msgs[n].buf = transfers[i].read;
+      n++;
+    }
+  }
+  data.msgs = msgs;
+  data.nmsgs = n;
+
+  status = ioctl(fd, I2C_RDWR, &data);
+  if(status < 0) {
+    perror("i2c transfer failed");
+    return i2c_errno_class(errno);
+  }
+  if(status != n) {
+    fprintf(stderr, "i2c transfer not %d messages: %d\n", n, status);
+    return I2C_ERROR_TRANSIENT;
+  }
+  return I2C_OK;
+}
+
+// scl and sda are open drain, 1 lets go of the line
+static void recover_set(int handle_fd, uint8_t scl, uint8_t sda) {
+  struct gpiohandle_data data;
+
+  memset(&data, '\0', sizeof(data));
+  data.values[0] = scl;
+  data.values[1] = sda;
+  if(ioctl(handle_fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data) < 0) {
+    perror("GPIOHANDLE_SET_LINE_VALUES_IOCTL");
+  }
+  usleep(RECOVER_HALF_PERIOD_US);
+}
+
+static uint8_t recover_sda(int handle_fd) {
+  struct gpiohandle_data data;
+
+  if(ioctl(handle_fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data) < 0) {
+    perror("GPIOHANDLE_GET_LINE_VALUES_IOCTL");
+    return 0;
+  }
+  return data.values[1];
+}
+
+/* a slave that lost count of the clocks (a reset or glitch mid-read) can hold SDA low, waiting to send the rest of its byte
+ * the adapter won't start a transfer on a busy bus, so SCL is clocked through the gpio lines until the slave lets go of
+ * SDA, up to nine times, and then a stop resets every slave's state.  i2c-dev has no way to do this through the adapter
+ * returns 0 without recover lines
+ */
+static int dev_recover(int fd, uint16_t i2c_addr) {
+  struct gpiohandle_request req;
+  int chip_fd, status;
+
+  if(recover_lines[fd].chip[0] == '\0') {
+    return 0;
+  }
+
+  chip_fd = open(recover_lines[fd].chip, O_RDONLY);
+  if(chip_fd < 0) {
+    perror(recover_lines[fd].chip);
+    return 0;
+  }
+  memset(&req, '\0', sizeof(req));
+  req.lineoffsets[0] = recover_lines[fd].scl;
+  req.lineoffsets[1] = recover_lines[fd].sda;
+  req.lines = 2;
+  req.flags = GPIOHANDLE_REQUEST_OUTPUT | GPIOHANDLE_REQUEST_OPEN_DRAIN;
+  req.default_values[0] = 1;
+  req.default_values[1] = 1;
+  strncpy(req.consumer_label, "i2c bus recovery", sizeof(req.consumer_label) - 1);
+  status = ioctl(chip_fd, GPIO_GET_LINEHANDLE_IOCTL, &req);
+  close(chip_fd);
+  if(status < 0) {
+    perror("GPIO_GET_LINEHANDLE_IOCTL");
+    return 0;
+  }
+
+  for(uint8_t i = 0; i < RECOVER_CLOCKS && !recover_sda(req.fd); i++) {
+    recover_set(req.fd, 0, 1);
+    recover_set(req.fd, 1, 1);
+  }
+  // stop: SDA goes low while SCL is low, then high while SCL is high
+  recover_set(req.fd, 0, 0);
+  recover_set(req.fd, 1, 0);
+  recover_set(req.fd, 1, 1);
+  close(req.fd);
+
+  return 1;
+}
+
+// the ",recover=/dev/gpiochipM:scl:sda" after the bus path, if there is one
+static void recover_option(int fd, const char *option) {
+  const char *chip = option + strlen(RECOVER_OPTION);
+  const char *scl = strchr(chip, ':');
+  char *sda;
+
+  if(scl == NULL || (size_t)(scl - chip) >= sizeof(recover_lines[fd].chip)) {
+    fprintf(stderr, "recover lines should be /dev/gpiochipN:scl:sda, got %s\n", chip);
+    exit(1);
+  }
+  recover_lines[fd].scl = strtoul(scl + 1, &sda, 10);
+  if(*sda != ':') {
+    fprintf(stderr, "recover lines should be /dev/gpiochipN:scl:sda, got %s\n", chip);
+    exit(1);
+  }
+  recover_lines[fd].sda = strtoul(sda + 1, NULL, 10);
+  memcpy(recover_lines[fd].chip, chip, scl - chip);
+  recover_lines[fd].chip[scl - chip] = '\0';
+}
+
+static int dev_open(const char *bus, uint16_t i2c_addr) {
+  const char *option = strstr(bus, RECOVER_OPTION);
+  char path[64];
+  unsigned long funcs;
+  int fd;
+
+  if(option == NULL) {
+    option = bus + strlen(bus);
+  }
+  if((size_t)(option - bus) >= sizeof(path)) {
+    fprintf(stderr, "bus path too long: %s\n", bus);
+    exit(1);
+  }
+  memcpy(path, bus, option - bus);
+  path[option - bus] = '\0';
+
+  fd = open(path, O_RDWR);
+  if (fd < 0) {
+    fprintf(stderr, "open %s failed: ", path);
+    perror(NULL);
+    exit(1);
+  }
+
+  if (fd >= I2C_MAX_FDS) {
+    fprintf(stderr, "%s: fd %d out of range\n", bus, fd);
+    exit(1);
+  }
+
+  if (ioctl(fd, I2C_SLAVE, i2c_addr) < 0) {
+    perror("ioctl i2c slave addr failed");
+    exit(1);
+  }
+
+  rdwr[fd] = ioctl(fd, I2C_FUNCS, &funcs) == 0 && (funcs & I2C_FUNC_I2C);
+  if(*option != '\0') {
+    recover_option(fd, option);
+  }
+
+  return fd;
+}
+
+const struct i2c_transport i2c_dev_transport = {NULL, dev_open, dev_transfer, dev_recover};
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "i2c.h"
+#include "i2c_registers.h"
+#include "i2c_latency.h"
+
+// every successful transfer_i2c_once, timed with CLOCK_MONOTONIC_RAW so an ntp slew doesn't show up as bus latency
+
+// since the start, and since the last i2c_latency_summary
+static struct i2c_latency_histogram totals[I2C_OPS], interval[I2C_OPS];
+static const char *op_names[I2C_OPS] = {"read", "page4", "write"};
+
+uint64_t i2c_latency_now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint8_t i2c_latency_op(const struct i2c_transfer *transfers, int count) {
+  const uint8_t *write = transfers[0].write;
+  uint8_t reads = 0;
+
+  if(transfers[0].write_len == 2 && transfers[0].read_len > 0 && write[0] == I2C_REGISTER_OFFSET_PAGE &&
+      write[1] == I2C_REGISTER_PAGE4) {
+    return I2C_OP_PAGE4;
+  }
+  for(int i = 0; i < count; i++) {
+    reads |= transfers[i].read_len > 0;
+  }
+  return reads ? I2C_OP_READ : I2C_OP_WRITE;
+}
+
+static uint16_t bucket(uint32_t ns) {
+  uint8_t msb, shift;
+
+  if(ns < I2C_LATENCY_SUB_BUCKETS) {
+    return ns;
+  }
+  msb = 31 - __builtin_clz(ns);
+  shift = msb - (I2C_LATENCY_SUB_BITS - 1);
+  // ns >> shift is in [SUB_BUCKETS/2, SUB_BUCKETS)
+  return I2C_LATENCY_SUB_BUCKETS + (msb - I2C_LATENCY_SUB_BITS) * I2C_LATENCY_SUB_BUCKETS / 2 +
+      (ns >> shift) - I2C_LATENCY_SUB_BUCKETS / 2;
+}
+
+// the highest ns that lands in bucket i
+static uint32_t bucket_top(uint16_t i) {
+  uint8_t shift;
+  uint32_t sub;
+
+  if(i < I2C_LATENCY_SUB_BUCKETS) {
+    return i;
+  }
+  shift = (i - I2C_LATENCY_SUB_BUCKETS) / (I2C_LATENCY_SUB_BUCKETS / 2) + 1;
+  sub = (i - I2C_LATENCY_SUB_BUCKETS) % (I2C_LATENCY_SUB_BUCKETS / 2) + I2C_LATENCY_SUB_BUCKETS / 2;
+  return ((uint64_t)(sub + 1) << shift) - 1;
+}
+
+static void add(struct i2c_latency_histogram *histogram, uint32_t ns) {
+  histogram->count++;
+  histogram->buckets[bucket(ns)]++;
+  if(ns > histogram->max_ns) {
+    histogram->max_ns = ns;
+  }
+}
+
+void i2c_latency_add(uint8_t op, uint64_t ns) {
+  if(op >= I2C_OPS) {
+    return;
+  }
+  if(ns > UINT32_MAX) {
+    ns = UINT32_MAX;
+  }
+  add(&totals[op], ns);
+  add(&interval[op], ns);
+}
+
+const struct i2c_latency_histogram *i2c_latency(uint8_t op) {
+  return op < I2C_OPS ? &totals[op] : NULL;
+}
+
+// in ns, the top of the bucket the percentile falls in, never past the max seen
+uint32_t i2c_latency_percentile(const struct i2c_latency_histogram *histogram, double percentile) {
+  uint64_t target = histogram->count * percentile / 100.0 + 0.5, seen = 0;
+
+  if(histogram->count == 0) {
+    return 0;
+  }
+  if(target < 1) {
+    target = 1;
+  }
+  for(uint16_t i = 0; i < I2C_LATENCY_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if(seen >= target) {
+      return bucket_top(i) < histogram->max_ns ? bucket_top(i) : histogram->max_ns;
+    }
+  }
+  return histogram->max_ns;
+}
+
+static void print_histogram(FILE *f, const char *format, const char *name, const struct i2c_latency_histogram *histogram) {
+  fprintf(f, format, name, histogram->count, i2c_latency_percentile(histogram, 50) / 1000.0,
+      i2c_latency_percentile(histogram, 90) / 1000.0, i2c_latency_percentile(histogram, 99) / 1000.0,
+      i2c_latency_percentile(histogram, 99.9) / 1000.0, histogram->max_ns / 1000.0);
+}
+
+// since the start, for a stats file: op count p50 p90 p99 p99.9 max, in us
+void i2c_latency_write(FILE *f) {
+  for(uint8_t op = 0; op < I2C_OPS; op++) {
+    print_histogram(f, "%s %u %.1f %.1f %.1f %.1f %.1f\n", op_names[op], &totals[op]);
+  }
+}
+
+// one line per op seen since the last summary, then starts the next interval
+void i2c_latency_summary(FILE *f, const char *prefix) {
+  for(uint8_t op = 0; op < I2C_OPS; op++) {
+    if(interval[op].count == 0) {
+      continue;
+    }
+    fprintf(f, "%s", prefix);
+    print_histogram(f, "i2c %s: %u, p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f us\n", op_names[op], &interval[op]);
+  }
+  memset(interval, '\0', sizeof(interval));
+}
@@ -0,0 +1,31 @@
+#ifndef I2C_LATENCY_H
+#define I2C_LATENCY_H
+
+// what a transfer was, each has its own histogram
+#define I2C_OP_READ 0  // page and register reads
+#define I2C_OP_PAGE4 1 // the page4 cross-timestamp read
+#define I2C_OP_WRITE 2 // page selects and register writes with nothing read back
+#define I2C_OPS 3
+
+/* log-linear buckets in ns, HdrHistogram style: exact below I2C_LATENCY_SUB_BUCKETS, then every power of two split
+ * into I2C_LATENCY_SUB_BUCKETS/2, so a percentile is within 1/16 (6%) of the real value, up to 4.3s
+ */
+#define I2C_LATENCY_SUB_BITS 5
+#define I2C_LATENCY_SUB_BUCKETS (1 << I2C_LATENCY_SUB_BITS)
+#define I2C_LATENCY_BUCKETS (I2C_LATENCY_SUB_BUCKETS + (32 - I2C_LATENCY_SUB_BITS) * I2C_LATENCY_SUB_BUCKETS / 2)
+
+struct i2c_latency_histogram {
+  uint32_t count;
+  uint32_t max_ns;
+  uint32_t buckets[I2C_LATENCY_BUCKETS];
+};
+
+uint64_t i2c_latency_now();
+uint8_t i2c_latency_op(const struct i2c_transfer *transfers, int count);
+void i2c_latency_add(uint8_t op, uint64_t ns);
+const struct i2c_latency_histogram *i2c_latency(uint8_t op);
+uint32_t i2c_latency_percentile(const struct i2c_latency_histogram *histogram, double percentile);
+void i2c_latency_write(FILE *f);
+void i2c_latency_summary(FILE *f, const char *prefix);
+
+#endif
@@ -2,56 +2,229 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <string.h>
 
 #include "i2c_registers.h"
 #include "i2c.h"
+#include "crc8.h"
 
-static float i2c_time = 0;
+// per board state, indexed by the board's fd
+static struct {
+  uint8_t protocol_version;
+  uint8_t max_page_size; // v3, the captures page's size
+  uint8_t capture_batch; // v3, captures in its ring
+  uint32_t last_sequence;
+} boards[I2C_MAX_FDS];
 
-float last_i2c_time() {
-  return i2c_time;
+// the captures page is max_page_size long: capture_batch captures, then capture_count, and page_offset as its last byte
+static int captures_fit(const struct i2c_registers_type_info *info) {
+  return info->max_page_size <= I2C_CLIENT_PAGE_SIZE_MAX && info->capture_batch > 0 &&
+      info->capture_batch * sizeof(struct i2c_capture) + sizeof(uint32_t) < info->max_page_size;
 }
 
-void get_i2c_structs(int fd, struct i2c_registers_type *i2c_registers, struct i2c_registers_type_page2 *i2c_registers_page2) {
-  uint8_t set_page[2];
-  struct timeval start,end;
-
-  gettimeofday(&start, NULL);
-  set_page[0] = I2C_REGISTER_OFFSET_PAGE;
-  set_page[1] = I2C_REGISTER_PAGE1;
-  lock_i2c(fd);
-  write_i2c(fd, set_page, sizeof(set_page));
-  read_i2c(fd, i2c_registers, sizeof(struct i2c_registers_type));
+/* call with the bus locked
+ * a v2 firmware answers the info page select with page1, so its page_offset won't match
+ * -1 when the probe failed on the bus, nothing is remembered so the next call probes again
+ */
+int i2c_protocol_version(int fd) {
+  struct i2c_registers_type_info info;
+  uint8_t set_page[2] = {I2C_REGISTER_OFFSET_PAGE, I2C_REGISTER_PAGE_INFO};
+  // separate write and read, the way a v2 firmware expects them
+  struct i2c_transfer transfers[] = {{set_page, sizeof(set_page), NULL, 0}, {NULL, 0, &info, sizeof(info)}};
 
-  if(i2c_registers->page_offset != I2C_REGISTER_PAGE1) {
-    printf("got wrong page offset: %u != %u\n", i2c_registers->page_offset, I2C_REGISTER_PAGE1);
+  if(fd < 0 || fd >= I2C_MAX_FDS) {
+    printf("fd %d out of range\n", fd);
     exit(1);
   }
 
-  if(i2c_registers->version != I2C_REGISTER_VERSION) { // TODO: handle compatability
-    printf("got unexpected version: %u != %u\n", i2c_registers->version, I2C_REGISTER_VERSION);
+  if(boards[fd].protocol_version != 0) {
+    return boards[fd].protocol_version;
+  }
+
+  if(try_transfer_i2c(fd, &transfers[0], 1) != I2C_OK || try_transfer_i2c(fd, &transfers[1], 1) != I2C_OK) {
+    return -1;
+  }
+
+  if(info.page_offset == I2C_REGISTER_PAGE_INFO && info.protocol_version >= I2C_PROTOCOL_VERSION &&
+      info.trailer_size == sizeof(struct i2c_page_trailer) && captures_fit(&info)) {
+    boards[fd].protocol_version = I2C_PROTOCOL_VERSION;
+    boards[fd].max_page_size = info.max_page_size;
+    boards[fd].capture_batch = info.capture_batch;
+  } else {
+    if(info.page_offset == I2C_REGISTER_PAGE_INFO && info.protocol_version >= I2C_PROTOCOL_VERSION) {
+      fprintf(stderr, "v%u firmware with %u byte pages and a batch of %u, reading it as v%u\n",
+          info.protocol_version, info.max_page_size, info.capture_batch, I2C_REGISTER_VERSION);
+    }
+    boards[fd].protocol_version = I2C_REGISTER_VERSION;
+  }
+
+  return boards[fd].protocol_version;
+}
+
+/* v3, the size of the board's captures page and its ring, which can differ from I2C_REGISTER_PAGE_SIZE_MAX and
+ * I2C_CAPTURE_BATCH in these headers, call after i2c_protocol_version
+ */
+void i2c_captures_layout(int fd, uint8_t *page_size, uint8_t *batch) {
+  *page_size = boards[fd].max_page_size;
+  *batch = boards[fd].capture_batch;
+}
+
+// v3: checks the page crc and that the sequence moved forward (an unchanged sequence means the page select was lost)
+static int check_page(int fd, uint8_t page, const uint8_t *data, uint8_t len) {
+  struct i2c_page_trailer trailer;
+
+  memcpy(&trailer, data + len, sizeof(trailer));
+
+  if(trailer.crc8 != crc8(0, data, len + sizeof(trailer) - 1)) {
+    fprintf(stderr, "page %u: bad crc\n", page);
+    i2c_count_fault(I2C_ERROR_CORRUPT);
+    return 0;
+  }
+  if(trailer.page != page || trailer.length != len) {
+    fprintf(stderr, "page %u: got page %u length %u\n", page, trailer.page, trailer.length);
+    i2c_count_fault(I2C_ERROR_CORRUPT);
+    return 0;
+  }
+  if(trailer.sequence == boards[fd].last_sequence) {
+    fprintf(stderr, "page %u: duplicate sequence %u\n", page, trailer.sequence);
+    i2c_count_fault(I2C_ERROR_CORRUPT);
+    return 0;
+  }
+
+  boards[fd].last_sequence = trailer.sequence;
+  return 1;
+}
+
+static void check_length(uint8_t page, uint8_t len) {
+  if(len > I2C_CLIENT_PAGE_SIZE_MAX) {
+    printf("page %u: length %u too long\n", page, len);
     exit(1);
   }
+}
+
+// call with the bus locked
+// 0 when buffer has the page, -1 when the bus or the page's checks failed every try (see i2c_faults)
+int read_i2c_page(int fd, uint8_t page, void *buffer, uint8_t len) {
+  uint8_t set_page[2];
+  uint8_t data[I2C_CLIENT_PAGE_SIZE_MAX + sizeof(struct i2c_page_trailer)];
+  int version = i2c_protocol_version(fd);
+
+  if(version < 0) {
+    return -1;
+  }
 
   set_page[0] = I2C_REGISTER_OFFSET_PAGE;
-  set_page[1] = I2C_REGISTER_PAGE2;
-  write_i2c(fd, set_page, sizeof(set_page));
-  read_i2c(fd, i2c_registers_page2, sizeof(struct i2c_registers_type_page2));
-  unlock_i2c(fd);
+  set_page[1] = page;
+
+  // v2 firmware keeps the separate write and read it was tested with
+  if(version < I2C_PROTOCOL_VERSION) {
+    struct i2c_transfer transfers[] = {{set_page, sizeof(set_page), NULL, 0}, {NULL, 0, buffer, len}};
+
+    return try_transfer_i2c(fd, &transfers[0], 1) == I2C_OK && try_transfer_i2c(fd, &transfers[1], 1) == I2C_OK ? 0 : -1;
+  }
+
+  check_length(page, len);
+
+  for(uint8_t tries = 0; tries < I2C_PAGE_RETRIES; tries++) {
+    struct i2c_transfer transfer = {set_page, sizeof(set_page), data, len + sizeof(struct i2c_page_trailer)};
 
-  if(i2c_registers_page2->page_offset != I2C_REGISTER_PAGE2) {
-    printf("got wrong page offset: %u != %u\n", i2c_registers_page2->page_offset, I2C_REGISTER_PAGE2);
+    // try_transfer_i2c already went through its own retries
+    if(try_transfer_i2c(fd, &transfer, 1) != I2C_OK) {
+      return -1;
+    }
+    if(check_page(fd, page, data, len)) {
+      memcpy(buffer, data, len);
+      return 0;
+    }
+  }
+
+  fprintf(stderr, "page %u: no valid read after %u tries\n", page, I2C_PAGE_RETRIES);
+  return -1;
+}
+
+// call with the bus locked, returns like read_i2c_page
+// v3: every page select and read in one I2C_RDWR, a page that fails its checks is read again on its own along with the pages after it
+int read_i2c_pages(int fd, uint8_t count, const uint8_t *pages, void * const *buffers, const uint8_t *lens) {
+  uint8_t set_page[I2C_BATCH_PAGES][2];
+  uint8_t data[I2C_BATCH_PAGES][I2C_CLIENT_PAGE_SIZE_MAX + sizeof(struct i2c_page_trailer)];
+  struct i2c_transfer transfers[I2C_BATCH_PAGES];
+  uint8_t i;
+  int version;
+
+  if(count > I2C_BATCH_PAGES) {
+    printf("%u pages in one read, max %u\n", count, I2C_BATCH_PAGES);
     exit(1);
   }
-  gettimeofday(&end, NULL);
 
-  end.tv_sec -= start.tv_sec;
-  if(end.tv_usec < start.tv_usec) {
-    end.tv_sec--;
-    end.tv_usec = end.tv_usec - start.tv_usec + 1000000;
-  } else {
-    end.tv_usec = end.tv_usec - start.tv_usec;
+  version = i2c_protocol_version(fd);
+  if(version < 0) {
+    return -1;
+  }
+  if(version < I2C_PROTOCOL_VERSION) {
+    for(i = 0; i < count; i++) {
+      if(read_i2c_page(fd, pages[i], buffers[i], lens[i]) < 0) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  for(i = 0; i < count; i++) {
+    check_length(pages[i], lens[i]);
+    set_page[i][0] = I2C_REGISTER_OFFSET_PAGE;
+    set_page[i][1] = pages[i];
+    transfers[i].write = set_page[i];
+    transfers[i].write_len = sizeof(set_page[i]);
+    transfers[i].read = data[i];
+    transfers[i].read_len = lens[i] + sizeof(struct i2c_page_trailer);
+  }
+  if(try_transfer_i2c(fd, transfers, count) != I2C_OK) {
+    return -1;
+  }
+
+  for(i = 0; i < count && check_page(fd, pages[i], data[i], lens[i]); i++) {
+    memcpy(buffers[i], data[i], lens[i]);
+  }
+  for(; i < count; i++) {
+    if(read_i2c_page(fd, pages[i], buffers[i], lens[i]) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* page1 and page2 with the bus locked for both, 0 on success
+ * -1 on a bus error, or when the pages kept coming back as the wrong page or layout, the caller keeps its state and tries later
+ */
+int get_i2c_structs(int fd, struct i2c_registers_type *i2c_registers, struct i2c_registers_type_page2 *i2c_registers_page2) {
+  static const uint8_t pages[] = {I2C_REGISTER_PAGE1, I2C_REGISTER_PAGE2};
+  static const uint8_t lens[] = {sizeof(struct i2c_registers_type), sizeof(struct i2c_registers_type_page2)};
+  void * const buffers[] = {i2c_registers, i2c_registers_page2};
+  uint8_t tries;
+  int status = -1;
+
+  for(tries = 0; tries < I2C_PAGE_RETRIES && status < 0; tries++) {
+    lock_i2c(fd);
+    status = read_i2c_pages(fd, sizeof(pages), pages, buffers, lens);
+    unlock_i2c(fd);
+    if(status < 0) {
+      return -1;
+    }
+
+    // a v2 firmware has no trailer to catch these, the page1 layout is the same in v2 and v3
+    if(i2c_registers->page_offset != I2C_REGISTER_PAGE1) {
+      fprintf(stderr, "got wrong page offset: %u != %u\n", i2c_registers->page_offset, I2C_REGISTER_PAGE1);
+      status = -1;
+    } else if(i2c_registers->version != I2C_REGISTER_VERSION) {
+      fprintf(stderr, "got unexpected version: %u != %u\n", i2c_registers->version, I2C_REGISTER_VERSION);
+      status = -1;
+    } else if(i2c_registers_page2->page_offset != I2C_REGISTER_PAGE2) {
+      fprintf(stderr, "got wrong page offset: %u != %u\n", i2c_registers_page2->page_offset, I2C_REGISTER_PAGE2);
+      status = -1;
+    }
+    if(status < 0) {
+      i2c_count_fault(I2C_ERROR_CORRUPT);
+    }
   }
-  i2c_time = end.tv_sec + end.tv_usec / 1000000.0;
+  return status;
 }
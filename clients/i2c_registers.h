@@ -1,83 +1,29 @@
 #ifndef I2C_REGISTERS_H
 #define I2C_REGISTERS_H
 
-#define I2C_ADDR 0x4
-#define EXPECTED_FREQ 48000000
-#define INPUT_CHANNELS 3
-
-// i2c interface
-#define I2C_REGISTER_OFFSET_PAGE 31
-#define I2C_REGISTER_PAGE1 0
-#define I2C_REGISTER_PAGE2 1
-#define I2C_REGISTER_PAGE3 2
-#define I2C_REGISTER_PAGE4 3
-#define I2C_REGISTER_VERSION 2
+// register layout shared with the firmware, see Inc/i2c_register_map.h
+#include "i2c_register_map.h"
 
-#define SAVE_STATUS_NONE 0
-#define SAVE_STATUS_OK 1
-#define SAVE_STATUS_ERASE_FAIL 2
-#define SAVE_STATUS_WRITE_FAIL 3
-
-struct i2c_registers_type {
-  uint32_t milliseconds_now;
-  uint32_t milliseconds_irq_ch1;
-  uint16_t tim3_at_irq[INPUT_CHANNELS];
-  uint16_t tim1_at_irq[INPUT_CHANNELS];
-  uint16_t tim3_at_cap[INPUT_CHANNELS];
-  uint16_t source_HZ_ch1;
-  uint8_t ch2_count;
-  uint8_t ch4_count;
-  uint8_t version;
-  uint8_t page_offset;
-};
+#define I2C_ADDR I2C_DEFAULT_ADDRESS // -a on the command line for boards moved with set-i2c-address
+#define EXPECTED_FREQ 48000000
+#define INPUT_CHANNELS I2C_INPUT_CHANNELS
 
-struct i2c_registers_type_page2 {
-  uint32_t last_adc_ms;
-  uint16_t internal_temp;
-  uint16_t internal_vref;
-  uint16_t external_temp;
-  uint16_t ts_cal1;     // internal_temp value at 30C+/-5C @3.3V+/-10mV
-  uint16_t ts_cal2;     // internal_temp value at 110C+/-5C @3.3V+/-10mV
-  uint16_t vrefint_cal; // internal_vref value at 30C+/-5C @3.3V+/-10mV
-  uint8_t reserved[15];
-  uint8_t page_offset;
-};
+// how many times a page read with a bad crc or a stale sequence is retried
+#define I2C_PAGE_RETRIES 3
+// pages read in one I2C_RDWR by read_i2c_pages, two messages each
+#define I2C_BATCH_PAGES 8
+/* the largest page the clients read, a v3 board with a larger max_page_size is used as v2
+ * firmware built with a bigger I2C_REGISTER_PAGE_SIZE_MAX than these headers has a longer captures page, see i2c_captures_layout
+ */
+#define I2C_CLIENT_PAGE_SIZE_MAX 128
 
 // write from tcxo_a to save
-#define I2C_PAGE3_WRITE_LENGTH 20
-struct i2c_registers_type_page3 {
-  /* tcxo_X variables are floats stored as:
-   * byte 1: negative sign (1 bit), exponent bits 7-1
-   * byte 2: exponent bit 0, mantissa bits 23-17
-   * byte 3: mantissa bits 16-8
-   * byte 4: mantissa bits 7-0
-   * they describe the expected frequency error in ppm:
-   * ppm = tcxo_a + tcxo_b * (F - tcxo_c) + tcxo_d * pow(F - tcxo_c, 2)
-   * where F is the temperature from the internal_temp sensor in Fahrenheit
-   */
-  uint32_t tcxo_a;
-  uint32_t tcxo_b;
-  uint32_t tcxo_c;
-  uint32_t tcxo_d;
-  uint8_t max_calibration_temp; // F
-  int8_t min_calibration_temp;  // F
-  uint8_t rmse_fit;             // ppb
-  uint8_t save;                 // 1=save new values to flash
-  uint8_t save_status;          // see SAVE_STATUS_X
-
-  uint8_t reserved[10];
-
-  uint8_t page_offset;
-};
-
-struct i2c_registers_type_page4 {
-  uint16_t tim3;
-  uint16_t tim1;
-  uint8_t reserved[27];
-  uint8_t page_offset;
-};
+#define I2C_PAGE3_WRITE_LENGTH (offsetof(struct i2c_registers_type_page3, save) + 1)
 
-void get_i2c_structs(int fd, struct i2c_registers_type *i2c_registers, struct i2c_registers_type_page2 *i2c_registers_page2);
-float last_i2c_time();
+int get_i2c_structs(int fd, struct i2c_registers_type *i2c_registers, struct i2c_registers_type_page2 *i2c_registers_page2);
+int i2c_protocol_version(int fd);
+void i2c_captures_layout(int fd, uint8_t *page_size, uint8_t *batch);
+int read_i2c_page(int fd, uint8_t page, void *buffer, uint8_t len);
+int read_i2c_pages(int fd, uint8_t count, const uint8_t *pages, void * const *buffers, const uint8_t *lens);
 
 #endif
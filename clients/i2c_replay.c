@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/file.h>
+
+#include "i2c.h"
+
+/* record:FILE:bus writes every transfer on bus to FILE, one line each:
+ *   seconds address w <hex or -> r <hex or ->
+ * or for a transfer that failed, with the I2C_ERROR_X class the bus gave (replay returns it again)
+ *   seconds address w <hex or -> e <class>
+ * replay:FILE hands the recorded reads back in order and exits at the first write that doesn't match the recording,
+ * so a client's bug or a board's odd answer can be rerun without the board
+ */
+
+#define LINE_MAX_BYTES 1024
+
+static FILE *record_file, *replay_file;
+static unsigned long replay_line;
+static const struct i2c_transport *inner[I2C_MAX_FDS];
+
+static int record_open(const char *path, uint16_t i2c_addr) {
+  const struct i2c_transport *transport;
+  const char *separator = strchr(path, ':'), *bus_path;
+  char *filename;
+  int fd;
+
+  if(separator == NULL) {
+    fprintf(stderr, "record:FILE:bus, no bus in %s\n", path);
+    exit(1);
+  }
+
+  // every bus a client opens goes to the same file
+  if(record_file == NULL) {
+    filename = strndup(path, separator - path);
+    record_file = fopen(filename, "a");
+    if(record_file == NULL) {
+      fprintf(stderr, "open %s failed: ", filename);
+      perror(NULL);
+      exit(1);
+    }
+    free(filename);
+  }
+
+  transport = i2c_find_transport(separator + 1, &bus_path);
+  fd = transport->open(bus_path, i2c_addr);
+  if(fd < 0 || fd >= I2C_MAX_FDS) {
+    fprintf(stderr, "%s: fd %d out of range\n", separator + 1, fd);
+    exit(1);
+  }
+  inner[fd] = transport;
+
+  return fd;
+}
+
+static void record_hex(const void *data, uint16_t len) {
+  if(len == 0) {
+    fputc('-', record_file);
+  }
+  for(uint16_t i = 0; i < len; i++) {
+    fprintf(record_file, "%02x", ((const uint8_t *)data)[i]);
+  }
+}
+
+static int record_transfer(int fd, uint16_t i2c_addr, const struct i2c_transfer *transfers, int count) {
+  struct timespec ts;
+  int status;
+
+  status = inner[fd]->transfer(fd, i2c_addr, transfers, count);
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  // a failed transfer is one line, the retry that follows it gets its own
+  for(int i = 0; i < (status == I2C_OK ? count : 1); i++) {
+    fprintf(record_file, "%ld.%06ld 0x%02x w ", (long)ts.tv_sec, ts.tv_nsec / 1000, i2c_addr);
+    record_hex(transfers[i].write, transfers[i].write_len);
+    if(status == I2C_OK) {
+      fputs(" r ", record_file);
+      record_hex(transfers[i].read, transfers[i].read_len);
+    } else {
+      fprintf(record_file, " e %d", status);
+    }
+    fputc('\n', record_file);
+  }
+  // a client killed mid poll loop still leaves a complete recording
+  fflush(record_file);
+
+  return status;
+}
+
+static int record_recover(int fd, uint16_t i2c_addr) {
+  return inner[fd]->recover != NULL && inner[fd]->recover(fd, i2c_addr);
+}
+
+static void record_lock(int fd, int locked) {
+  if(inner[fd]->lock == NULL) {
+    flock(fd, locked ? LOCK_EX : LOCK_UN);
+  } else {
+    inner[fd]->lock(fd, locked);
+  }
+}
+
+static int record_bus_time(int fd, struct timespec *start, struct timespec *end) {
+  return inner[fd]->bus_time != NULL ? inner[fd]->bus_time(fd, start, end) : -1;
+}
+
+static int replay_open(const char *path, uint16_t i2c_addr) {
+  int fd;
+
+  if(replay_file == NULL) {
+    replay_file = fopen(path, "r");
+    if(replay_file == NULL) {
+      fprintf(stderr, "open %s failed: ", path);
+      perror(NULL);
+      exit(1);
+    }
+  }
+
+  // only there to be locked and closed
+  fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    perror("open");
+    exit(1);
+  }
+
+  return fd;
+}
+
+// fills data with up to max bytes of hex, returns the count or -1 when it isn't hex
+static int parse_hex(const char *hex, uint8_t *data, uint16_t max) {
+  int len = 0;
+
+  if(strcmp(hex, "-") == 0) {
+    return 0;
+  }
+  while(hex[0] && hex[1]) {
+    unsigned int byte;
+
+    if(len == max || sscanf(hex, "%2x", &byte) != 1) {
+      return -1;
+    }
+    data[len++] = byte;
+    hex += 2;
+  }
+
+  return hex[0] ? -1 : len;
+}
+
+static int replay_transfer(int fd, uint16_t i2c_addr, const struct i2c_transfer *transfers, int count) {
+  char line[LINE_MAX_BYTES * 2 + 64], write_hex[LINE_MAX_BYTES * 2 + 1], read_hex[LINE_MAX_BYTES * 2 + 1], kind;
+  uint8_t write_data[LINE_MAX_BYTES];
+  unsigned int addr;
+  int write_len, read_len, error;
+
+  for(int i = 0; i < count; i++) {
+    if(fgets(line, sizeof(line), replay_file) == NULL) {
+      fprintf(stderr, "replay: recording ended after line %lu\n", replay_line);
+      exit(1);
+    }
+    replay_line++;
+
+    if(sscanf(line, "%*f %x w %2048s %c %2048s", &addr, write_hex, &kind, read_hex) != 4 || (kind != 'r' && kind != 'e')) {
+      fprintf(stderr, "replay: line %lu unreadable\n", replay_line);
+      exit(1);
+    }
+    write_len = parse_hex(write_hex, write_data, sizeof(write_data));
+    if(addr != i2c_addr || write_len != transfers[i].write_len ||
+        (write_len && memcmp(write_data, transfers[i].write, write_len) != 0)) {
+      fprintf(stderr, "replay: line %lu, recorded a write to 0x%02x, this one is to 0x%02x and differs\n",
+          replay_line, addr, i2c_addr);
+      exit(1);
+    }
+    if(kind == 'e') {
+      error = strtol(read_hex, NULL, 10);
+      return error > I2C_OK && error < I2C_ERROR_CLASSES ? error : I2C_ERROR_FATAL;
+    }
+    read_len = parse_hex(read_hex, transfers[i].read, transfers[i].read_len);
+    if(read_len != transfers[i].read_len) {
+      fprintf(stderr, "replay: line %lu has a %d byte read, %u asked for\n", replay_line, read_len, transfers[i].read_len);
+      exit(1);
+    }
+  }
+  return I2C_OK;
+}
+
+const struct i2c_transport i2c_record_transport = {"record", record_open, record_transfer, record_recover, record_lock, record_bus_time};
+const struct i2c_transport i2c_replay_transport = {"replay", replay_open, replay_transfer, NULL};
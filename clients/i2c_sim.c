@@ -0,0 +1,469 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+#include "i2c.h"
+#include "i2c_registers.h"
+#include "crc8.h"
+
+/* sim or sim:speed=N,ppm=X,fail=N,batch=N - boards modelled in the client itself, for trying out a client without hardware
+ * every address opened gets a board, they boot a little apart and count 48MHz cycles off by ppm
+ * ch1 (after the source_HZ_ch1 divider) and ch2 capture at the top of every second, ch4 half a second later
+ * speed runs the boards' clock that many times faster than the system clock, with data_ready's mock:period_ms
+ * a client gets through hours of seconds in a few minutes
+ * fail=N fails about one transfer in N, taking turns between a transient error, a nack and a stuck bus that
+ * stays stuck until the recovery
+ * batch=N models firmware built with a ring of N captures, its captures page is N*8+8 bytes and max_page_size says so,
+ * a batch above what the clients read has them fall back to v2
+ */
+
+#define SIM_MAX_BOARDS 8
+#define SIM_CPU_HZ 48000000.0
+#define SIM_IRQ_LATENCY_CYCLES 60
+#define SIM_BOOT_SPACING_S 0.37
+// per second: ch1, ch2 at the top of the second, ch4 at the half
+#define SIM_EDGES_PER_S 3
+
+static const double edge_phase[SIM_EDGES_PER_S] = {0.0, 0.0, 0.5};
+
+// same values as the firmware sim (sim/hal.c)
+#define SIM_ADC_EXTERNAL_TEMP 2048
+#define SIM_ADC_INTERNAL_TEMP 1750
+#define SIM_ADC_INTERNAL_VREF 1500
+#define SIM_TS_CAL1 1750
+#define SIM_TS_CAL2 1320
+#define SIM_VREFINT_CAL 1530
+
+struct sim_board {
+  uint8_t addr; // 0 for an unused slot
+  double boot;  // sim time the counters started
+  struct i2c_registers_type page1;
+  struct i2c_registers_type_page3 page3;
+  struct i2c_registers_type_info info;
+  struct i2c_registers_type_latch latch;
+  struct i2c_registers_type_stats stats;
+  uint8_t address_saving; // committed address, the board moves after the next info page read
+  uint8_t page;
+  uint8_t page_data[UINT8_MAX + sizeof(struct i2c_page_trailer)];
+  uint8_t page_size;
+  uint32_t sequence;
+};
+
+static struct sim_board boards[SIM_MAX_BOARDS];
+static double speed = 1.0, ppm = 0.0;
+static double real_start = 0.0, sim_start;
+static unsigned long fail_one_in = 0;
+static unsigned long capture_batch = I2C_CAPTURE_BATCH;
+static uint8_t next_fault = I2C_ERROR_TRANSIENT, bus_stuck = 0;
+
+static I2C_PAGE_ACCESS_TABLE(page1_access, I2C_PAGE1_FIELDS, I2C_REGISTER_PAGE_SIZE);
+static I2C_PAGE_ACCESS_TABLE(page3_access, I2C_PAGE3_FIELDS, I2C_REGISTER_PAGE_SIZE);
+static I2C_PAGE_ACCESS_TABLE(info_access, I2C_PAGE_INFO_FIELDS, I2C_REGISTER_PAGE_SIZE);
+static I2C_PAGE_ACCESS_TABLE(stats_access, I2C_PAGE_STATS_FIELDS, I2C_REGISTER_PAGE_SIZE);
+
+static double real_now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// the boards' idea of the system time, it starts out equal to it
+static double sim_now() {
+  return sim_start + (real_now() - real_start) * speed;
+}
+
+static uint64_t board_cycles(const struct sim_board *board, double t) {
+  return (t - board->boot) * SIM_CPU_HZ * (1.0 + ppm / 1000000.0);
+}
+
+// floor() for the positive times used here, without pulling libm into every i2c client
+static double whole_seconds(double t) {
+  return (uint64_t)t;
+}
+
+// edges since boot up to t, and the time of the newest one on each channel
+static uint32_t board_edges(const struct sim_board *board, double t, double *last) {
+  double first = whole_seconds(board->boot) + 1, seconds;
+  uint32_t count;
+
+  for(uint8_t i = 0; i < SIM_EDGES_PER_S; i++) {
+    last[i] = -1;
+  }
+  if(t < first) {
+    return 0;
+  }
+  seconds = whole_seconds(t - first);
+  count = seconds * SIM_EDGES_PER_S;
+  for(uint8_t i = 0; i < SIM_EDGES_PER_S; i++) {
+    if(first + seconds + edge_phase[i] <= t) {
+      last[i] = first + seconds + edge_phase[i];
+      count++;
+    } else if(seconds > 0) {
+      last[i] = first + seconds - 1 + edge_phase[i];
+    }
+  }
+
+  return count;
+}
+
+static void capture_at(const struct sim_board *board, double edge, uint16_t *tim3_at_cap, uint16_t *tim1_at_irq, uint16_t *tim3_at_irq) {
+  uint32_t cap = board_cycles(board, edge), irq = cap + SIM_IRQ_LATENCY_CYCLES;
+
+  *tim3_at_cap = cap & 0xffff;
+  *tim3_at_irq = irq & 0xffff;
+  *tim1_at_irq = irq >> 16;
+}
+
+// the page1 capture fields at time t
+static void update_page1(struct sim_board *board, double t) {
+  double last[SIM_EDGES_PER_S];
+  uint32_t count = board_edges(board, t, last);
+
+  for(uint8_t i = 0; i < I2C_INPUT_CHANNELS; i++) {
+    if(last[i] >= 0) {
+      capture_at(board, last[i], &board->page1.tim3_at_cap[i], &board->page1.tim1_at_irq[i], &board->page1.tim3_at_irq[i]);
+    }
+  }
+  if(last[0] >= 0) {
+    board->page1.milliseconds_irq_ch1 = board_cycles(board, last[0]) / 48000;
+  }
+  // every second has one edge on each channel
+  board->page1.ch2_count = (count + SIM_EDGES_PER_S - 2) / SIM_EDGES_PER_S;
+  board->page1.ch4_count = count / SIM_EDGES_PER_S;
+  board->page1.milliseconds_now = board_cycles(board, t) / 48000;
+}
+
+// the captures page for a ring of capture_batch: the ring, capture_count after it and page_offset as the last byte
+static void fill_captures(struct sim_board *board, double t, uint8_t *data) {
+  double last[SIM_EDGES_PER_S], first = whole_seconds(board->boot) + 1;
+  uint32_t count = board_edges(board, t, last);
+  struct i2c_capture *captures = (struct i2c_capture *)data;
+
+  memcpy(&captures[capture_batch], &count, sizeof(count));
+  for(uint32_t n = count > capture_batch ? count - capture_batch : 0; n < count; n++) {
+    struct i2c_capture *capture = &captures[n % capture_batch];
+    uint8_t channel = n % SIM_EDGES_PER_S;
+
+    capture_at(board, first + n / SIM_EDGES_PER_S + edge_phase[channel], &capture->tim3_at_cap, &capture->tim1_at_irq, &capture->tim3_at_irq);
+    capture->channel = channel;
+  }
+}
+
+static const uint8_t *page_access(uint8_t page) {
+  switch(page) {
+    case I2C_REGISTER_PAGE1: return page1_access;
+    case I2C_REGISTER_PAGE3: return page3_access;
+    case I2C_REGISTER_PAGE_INFO: return info_access;
+    case I2C_REGISTER_PAGE_STATS: return stats_access;
+  }
+  return NULL;
+}
+
+static void *page_storage(struct sim_board *board, uint8_t page) {
+  switch(page) {
+    case I2C_REGISTER_PAGE1: return &board->page1;
+    case I2C_REGISTER_PAGE3: return &board->page3;
+    case I2C_REGISTER_PAGE_INFO: return &board->info;
+    case I2C_REGISTER_PAGE_STATS: return &board->stats;
+  }
+  return NULL;
+}
+
+// the firmware's page select: latch the page and take a copy with its trailer
+static void select_page(struct sim_board *board, uint8_t number) {
+  double t = sim_now();
+  struct i2c_page_trailer trailer;
+  uint8_t *data = board->page_data;
+
+  if(number >= I2C_REGISTER_PAGES) {
+    number = I2C_REGISTER_PAGE1;
+  }
+  memset(data, '\0', sizeof(board->page_data));
+
+  switch(number) {
+    case I2C_REGISTER_PAGE1:
+      update_page1(board, t);
+      memcpy(data, &board->page1, sizeof(board->page1));
+      board->page_size = sizeof(board->page1);
+      break;
+    case I2C_REGISTER_PAGE2: {
+      struct i2c_registers_type_page2 *page2 = (struct i2c_registers_type_page2 *)data;
+
+      // the adc averages are updated once a second
+      page2->last_adc_ms = board_cycles(board, board->boot + whole_seconds(t - board->boot)) / 48000;
+      page2->internal_temp = SIM_ADC_INTERNAL_TEMP;
+      page2->internal_vref = SIM_ADC_INTERNAL_VREF;
+      page2->external_temp = SIM_ADC_EXTERNAL_TEMP;
+      page2->ts_cal1 = SIM_TS_CAL1;
+      page2->ts_cal2 = SIM_TS_CAL2;
+      page2->vrefint_cal = SIM_VREFINT_CAL;
+      page2->page_offset = I2C_REGISTER_PAGE2;
+      board->page_size = sizeof(*page2);
+      break;
+    }
+    case I2C_REGISTER_PAGE3:
+      memcpy(data, &board->page3, sizeof(board->page3));
+      board->page_size = sizeof(board->page3);
+      break;
+    case I2C_REGISTER_PAGE4: {
+      struct i2c_registers_type_page4 *page4 = (struct i2c_registers_type_page4 *)data;
+      uint32_t cycles = board_cycles(board, t);
+
+      page4->tim3 = cycles & 0xffff;
+      page4->tim1 = cycles >> 16;
+      page4->page_offset = I2C_REGISTER_PAGE4;
+      board->page_size = sizeof(*page4);
+      break;
+    }
+    case I2C_REGISTER_PAGE_INFO:
+      memcpy(data, &board->info, sizeof(board->info));
+      board->page_size = sizeof(board->info);
+      // the host has seen the busy status once, the config record is written now
+      if(board->address_saving) {
+        board->addr = board->info.i2c_address = board->address_saving;
+        board->info.i2c_address_status = I2C_ADDRESS_STATUS_OK;
+        board->address_saving = 0;
+      }
+      break;
+    case I2C_REGISTER_PAGE_CAPTURES:
+      fill_captures(board, t, data);
+      board->page_size = board->info.max_page_size;
+      data[board->page_size - 1] = I2C_REGISTER_PAGE_CAPTURES;
+      break;
+    case I2C_REGISTER_PAGE_LATCH:
+      memcpy(data, &board->latch, sizeof(board->latch));
+      board->page_size = sizeof(board->latch);
+      break;
+    case I2C_REGISTER_PAGE_STATS:
+      board->stats.uptime_s = t - board->boot;
+      memcpy(data, &board->stats, sizeof(board->stats));
+      board->page_size = sizeof(board->stats);
+      break;
+  }
+
+  board->page = number;
+  trailer.sequence = ++board->sequence;
+  trailer.page = number;
+  trailer.length = board->page_size;
+  trailer.version = I2C_PROTOCOL_VERSION;
+  memcpy(data + board->page_size, &trailer, sizeof(trailer));
+  data[board->page_size + sizeof(trailer) - 1] = crc8(0, data, board->page_size + sizeof(trailer) - 1);
+}
+
+// the general call latch, every board samples at the same moment
+static void latch_boards() {
+  double t = sim_now();
+
+  for(uint8_t i = 0; i < SIM_MAX_BOARDS; i++) {
+    struct sim_board *board = &boards[i];
+    uint32_t cycles;
+
+    if(board->addr == 0) {
+      continue;
+    }
+    update_page1(board, t);
+    cycles = board_cycles(board, t);
+    board->latch.tim3 = cycles & 0xffff;
+    board->latch.tim1 = cycles >> 16;
+    memcpy(board->latch.tim3_at_irq, board->page1.tim3_at_irq, sizeof(board->latch.tim3_at_irq));
+    memcpy(board->latch.tim1_at_irq, board->page1.tim1_at_irq, sizeof(board->latch.tim1_at_irq));
+    memcpy(board->latch.tim3_at_cap, board->page1.tim3_at_cap, sizeof(board->latch.tim3_at_cap));
+    board->latch.ch2_count = board->page1.ch2_count;
+    board->latch.ch4_count = board->page1.ch4_count;
+    board->latch.latch_count++;
+  }
+}
+
+static void write_field(struct sim_board *board, uint8_t position, uint8_t data) {
+  const uint8_t *access = page_access(board->page);
+  uint8_t *storage = page_storage(board, board->page);
+
+  if(access == NULL || position >= board->page_size) {
+    return;
+  }
+
+  if(access[position] == I2C_ACCESS_RW) {
+    storage[position] = data;
+  } else if(access[position] == I2C_ACCESS_ACTION && board->page == I2C_REGISTER_PAGE3) {
+    board->page3.save_status = data ? SAVE_STATUS_OK : board->page3.save_status;
+  } else if(access[position] == I2C_ACCESS_ACTION && board->page == I2C_REGISTER_PAGE_INFO) {
+    if(data != (uint8_t)~board->info.new_i2c_address) {
+      board->info.i2c_address_status = I2C_ADDRESS_STATUS_BAD_KEY;
+    } else if(board->info.new_i2c_address < I2C_ADDRESS_MIN || board->info.new_i2c_address > I2C_ADDRESS_MAX) {
+      board->info.i2c_address_status = I2C_ADDRESS_STATUS_INVALID;
+    } else {
+      board->address_saving = board->info.new_i2c_address;
+      board->info.i2c_address_status = I2C_ADDRESS_STATUS_BUSY;
+    }
+  }
+}
+
+static struct sim_board *find_board(uint16_t i2c_addr) {
+  for(uint8_t i = 0; i < SIM_MAX_BOARDS; i++) {
+    if(boards[i].addr != 0 && boards[i].addr == i2c_addr) {
+      return &boards[i];
+    }
+  }
+  return NULL;
+}
+
+static void add_board(uint16_t i2c_addr) {
+  struct sim_board *board = NULL;
+  uint8_t i;
+
+  for(i = 0; i < SIM_MAX_BOARDS && board == NULL; i++) {
+    if(boards[i].addr == 0) {
+      board = &boards[i];
+    }
+  }
+  if(board == NULL) {
+    fprintf(stderr, "sim: more than %u boards\n", SIM_MAX_BOARDS);
+    exit(1);
+  }
+
+  memset(board, '\0', sizeof(*board));
+  board->addr = i2c_addr;
+  board->boot = sim_start - i * SIM_BOOT_SPACING_S;
+
+  board->page1.source_HZ_ch1 = 50;
+  board->page1.version = I2C_REGISTER_VERSION;
+  board->page1.page_offset = I2C_REGISTER_PAGE1;
+  board->page3.page_offset = I2C_REGISTER_PAGE3;
+  board->info.protocol_version = I2C_PROTOCOL_VERSION;
+  board->info.max_page_size = capture_batch * sizeof(struct i2c_capture) + 8;
+  board->info.trailer_size = sizeof(struct i2c_page_trailer);
+  board->info.capture_batch = capture_batch;
+  board->info.reset_flags = I2C_RESET_POWER;
+  board->info.boot_state = I2C_BOOT_COLD;
+  board->info.capture_channels = I2C_CAPTURE_CHANNELS;
+  board->info.i2c_address = board->info.new_i2c_address = i2c_addr;
+  board->info.page_offset = I2C_REGISTER_PAGE_INFO;
+  board->latch.page_offset = I2C_REGISTER_PAGE_LATCH;
+  board->stats.internal_temp_min = board->stats.internal_temp_max = SIM_ADC_INTERNAL_TEMP;
+  board->stats.page_offset = I2C_REGISTER_PAGE_STATS;
+
+  select_page(board, I2C_REGISTER_PAGE1);
+}
+
+static void parse_options(const char *path) {
+  char *options = strdup(path), *option, *save = NULL;
+
+  for(option = strtok_r(options, ",", &save); option != NULL; option = strtok_r(NULL, ",", &save)) {
+    if(strncmp(option, "speed=", 6) == 0) {
+      speed = strtod(option + 6, NULL);
+    } else if(strncmp(option, "ppm=", 4) == 0) {
+      ppm = strtod(option + 4, NULL);
+    } else if(strncmp(option, "fail=", 5) == 0) {
+      fail_one_in = strtoul(option + 5, NULL, 10);
+    } else if(strncmp(option, "batch=", 6) == 0) {
+      capture_batch = strtoul(option + 6, NULL, 10);
+    } else {
+      fprintf(stderr, "sim: unknown option %s, options are speed=N,ppm=X,fail=N,batch=N\n", option);
+      exit(1);
+    }
+  }
+  if(speed <= 0) {
+    fprintf(stderr, "sim: speed has to be above 0\n");
+    exit(1);
+  }
+  // max_page_size is a byte and the page's length has to fit in it
+  if(capture_batch == 0 || capture_batch * sizeof(struct i2c_capture) + 8 > UINT8_MAX) {
+    fprintf(stderr, "sim: batch has to be 1 to %zu\n", (UINT8_MAX - 8) / sizeof(struct i2c_capture));
+    exit(1);
+  }
+  free(options);
+}
+
+static int sim_open(const char *path, uint16_t i2c_addr) {
+  int fd;
+
+  // the first open sets up the bus, later ones only add boards
+  if(real_start == 0.0) {
+    parse_options(path);
+    real_start = sim_start = real_now();
+  }
+  if(i2c_addr != 0 && find_board(i2c_addr) == NULL) {
+    add_board(i2c_addr);
+  }
+
+  // only there to be locked and closed
+  fd = open("/dev/null", O_RDONLY);
+  if(fd < 0) {
+    perror("open /dev/null");
+    exit(1);
+  }
+
+  return fd;
+}
+
+static int sim_fault() {
+  int fault;
+
+  if(bus_stuck) {
+    return I2C_ERROR_BUS;
+  }
+  if(fail_one_in == 0 || random() % fail_one_in != 0) {
+    return I2C_OK;
+  }
+
+  fault = next_fault;
+  next_fault = next_fault == I2C_ERROR_BUS ? I2C_ERROR_TRANSIENT : next_fault + 1;
+  bus_stuck = fault == I2C_ERROR_BUS;
+  return fault;
+}
+
+static int sim_transfer(int fd, uint16_t i2c_addr, const struct i2c_transfer *transfers, int count) {
+  struct sim_board *board;
+  const uint8_t *write;
+  int fault;
+
+  // faults hit before anything reaches the boards, so a retry sees the same state
+  if((fault = sim_fault()) != I2C_OK) {
+    fprintf(stderr, "sim: %s error\n", i2c_error_name(fault));
+    return fault;
+  }
+
+  for(int i = 0; i < count; i++) {
+    write = transfers[i].write;
+
+    if(i2c_addr == 0) {
+      if(transfers[i].write_len > 0 && write[0] == I2C_GENERAL_CALL_LATCH) {
+        latch_boards();
+      }
+      continue;
+    }
+
+    board = find_board(i2c_addr);
+    if(board == NULL) {
+      fprintf(stderr, "sim: no board at 0x%02x\n", i2c_addr);
+      return I2C_ERROR_NACK;
+    }
+
+    for(uint16_t j = 1; j < transfers[i].write_len; j++) {
+      uint8_t position = write[0] + j - 1;
+
+      if(position == I2C_REGISTER_OFFSET_PAGE) {
+        select_page(board, write[j]);
+      } else {
+        write_field(board, position, write[j]);
+      }
+    }
+    for(uint16_t j = 0; j < transfers[i].read_len; j++) {
+      ((uint8_t *)transfers[i].read)[j] = j < board->page_size + sizeof(struct i2c_page_trailer) ? board->page_data[j] : 0;
+    }
+  }
+  return I2C_OK;
+}
+
+static int sim_recover(int fd, uint16_t i2c_addr) {
+  bus_stuck = 0;
+  return 1;
+}
+
+const struct i2c_transport i2c_sim_transport = {"sim", sim_open, sim_transfer, sim_recover};
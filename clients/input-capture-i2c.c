@@ -5,27 +5,30 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
-#include <math.h>
 
 #include "i2c.h"
 #include "timespec.h"
 #include "i2c_registers.h"
 #include "adc_calc.h"
-#include "tcxo_calibration.h"
+#include "data_ready.h"
+#include "capture_calc.h"
+#include "i2c_latency.h"
 
 // current code assumptions: channel 1 never stops
 
-#define AVERAGING_CYCLES 65
 #define PPM_INVALID -1000000.0
-#define AIM_AFTER_MS 5
+// wait a little over a second for the data ready line before reading anyway
+#define DATA_READY_TIMEOUT_MS 1100
 #define TCXO_TEMPCOMP_TEMPFILE "/run/.tcxo"
 #define TCXO_TEMPCOMP_FILE "/run/tcxo"
-
-// status_flags bitfields
-#define STATUS_CH1_WRAPS       0b11
-#define STATUS_CH2_WRAPS     0b1100
-#define STATUS_CH3_WRAPS   0b110000
-#define STATUS_CH2_FAILED 0b1000000
+#define I2C_FAULTS_TEMPFILE "/run/.tcxo-i2c"
+#define I2C_FAULTS_FILE "/run/tcxo-i2c"
+#define I2C_LATENCY_TEMPFILE "/run/.tcxo-i2c-latency"
+#define I2C_LATENCY_FILE "/run/tcxo-i2c-latency"
+#define LATENCY_SUMMARY_S 60
+// after a failed read, try again after this, doubling for every failure in a row up to READ_RETRY_MAX_MS
+#define READ_RETRY_MS 50
+#define READ_RETRY_MAX_MS 800
 
 void print_ppm(float ppm) {
   if(ppm < 500 && ppm > -500) {
@@ -64,6 +67,60 @@ void write_tcxo_ppm(float ppm) {
   printf("%1.3f ", ppm);
 }
 
+// the i2c fault counters for monitoring, rewritten when one changes
+void write_i2c_faults() {
+  static struct i2c_fault_counts last;
+  static uint8_t written = 0;
+  const struct i2c_fault_counts *faults = i2c_faults();
+  FILE *f;
+
+  if(written && memcmp(last.errors, faults->errors, sizeof(last.errors)) == 0 && last.retries == faults->retries &&
+      last.recoveries == faults->recoveries && last.failed == faults->failed) {
+    return;
+  }
+
+  f = fopen(I2C_FAULTS_TEMPFILE, "w");
+  if(f == NULL) {
+    perror("fopen " I2C_FAULTS_TEMPFILE);
+    return;
+  }
+  fprintf(f, "transfers %u\nretries %u\nrecoveries %u\nfailed %u\n", faults->transfers, faults->retries, faults->recoveries, faults->failed);
+  for(uint8_t i = I2C_OK + 1; i < I2C_ERROR_CLASSES; i++) {
+    fprintf(f, "%s %u\n", i2c_error_name(i), faults->errors[i]);
+  }
+  fclose(f);
+  rename(I2C_FAULTS_TEMPFILE, I2C_FAULTS_FILE);
+
+  last = *faults;
+  written = 1;
+}
+
+// every LATENCY_SUMMARY_S, the transfer latencies of the last interval printed and the ones since the start written out
+void write_i2c_latency() {
+  static time_t next_summary = 0;
+  time_t now = time(NULL);
+  FILE *f;
+
+  if(next_summary == 0) {
+    next_summary = now + LATENCY_SUMMARY_S;
+  }
+  if(now < next_summary) {
+    return;
+  }
+  next_summary = now + LATENCY_SUMMARY_S;
+
+  i2c_latency_summary(stdout, "");
+  f = fopen(I2C_LATENCY_TEMPFILE, "w");
+  if(f == NULL) {
+    perror("fopen " I2C_LATENCY_TEMPFILE);
+    return;
+  }
+  fprintf(f, "# op count p50 p90 p99 p99.9 max, us\n");
+  i2c_latency_write(f);
+  fclose(f);
+  rename(I2C_LATENCY_TEMPFILE, I2C_LATENCY_FILE);
+}
+
 void add_offset_cycles(double added_offset_ns, struct timespec *cycles, uint16_t *first_cycle, uint16_t *last_cycle) {
   struct timespec *previous_cycle = NULL;
   uint16_t this_cycle_i;
@@ -98,28 +155,6 @@ float calc_ppm(struct timespec *end, struct timespec *start, uint16_t seconds) {
   return ppm;
 }
 
-// TODO: dealing with 2s and longer intervals
-uint8_t cycles_wrap(uint32_t *this_cycles, uint32_t previous_cycles, int32_t *diff, const struct i2c_registers_type *i2c_registers, uint8_t counter) {
-  uint8_t wrap = 0;
-  *diff = *this_cycles - previous_cycles - EXPECTED_FREQ;
-
-  if(i2c_registers->tim3_at_cap[counter] > i2c_registers->tim3_at_irq[counter]) {
-    if(*diff > 41535) { // allow for +/-500ppm
-      wrap = 1;
-      *this_cycles -= 65536;
-      *diff -= 65536;
-    }
-  } else if(i2c_registers->tim3_at_cap[counter] > 65300) { // check for wrap if it's close
-    if(*diff > 41535) { // allow for +/-500ppm
-      wrap = 2;
-      *this_cycles -= 65536;
-      *diff -= 65536;
-    }
-  }
-
-  return wrap;
-}
-
 uint16_t wrap_add(int16_t a, int16_t b, uint16_t modulus) {
   a = a + b;
   if(a < 0) {
@@ -146,27 +181,18 @@ float show_ppm(int16_t number_points, uint16_t last_cycle_index, uint16_t second
   return ppm;
 }
 
-uint32_t calculate_sleep_ms(uint32_t milliseconds_now, uint32_t milliseconds_irq) {
-  uint32_t sleep_ms = 1000 + AIM_AFTER_MS - (milliseconds_now - milliseconds_irq);
-  if(sleep_ms > 1000+AIM_AFTER_MS) {
-    sleep_ms = 1000+AIM_AFTER_MS;
-  } else if(sleep_ms < 1) {
-    sleep_ms = 1;
-  }
-  return sleep_ms;
-}
-
-// modifies this_cycles, wrap, and added_offset_ns
-int add_cycles(uint32_t *this_cycles, uint8_t *wrap, double *added_offset_ns, uint8_t has_history, const struct i2c_registers_type *i2c_registers) {
+// modifies this_cycles, wrap, and added_offset_ns (per second, averaged over a gap)
+// seconds: since the previous capture, 0 when that's too long ago to compare with
+int add_cycles(uint32_t *this_cycles, uint8_t *wrap, double *added_offset_ns, uint8_t has_history, const struct i2c_registers_type *i2c_registers, uint8_t seconds) {
   static uint32_t previous_cycles[INPUT_CHANNELS] = {0,0,0};
   int retval = 0;
 
   // we can check for wraps if we have history
-  if(has_history || (previous_cycles[0] > 0)) {
+  if(seconds > 0 && (has_history || (previous_cycles[0] > 0))) {
     int32_t diff[INPUT_CHANNELS];
     for(uint8_t i = 0; i < INPUT_CHANNELS; i++) {
-      wrap[i] = cycles_wrap(&this_cycles[i], previous_cycles[i], &diff[i], i2c_registers, i);
-      added_offset_ns[i] = diff[i] * 1000000000.0 / EXPECTED_FREQ;
+      wrap[i] = cycles_wrap(&this_cycles[i], previous_cycles[i], &diff[i], i2c_registers, i, seconds);
+      added_offset_ns[i] = diff[i] * 1000000000.0 / EXPECTED_FREQ / seconds;
     }
     retval = 1;
   }
@@ -178,77 +204,82 @@ int add_cycles(uint32_t *this_cycles, uint8_t *wrap, double *added_offset_ns, ui
   return retval;
 }
 
-// modifies this_cycles
-void combine_tim1_tim3(uint32_t *this_cycles, const struct i2c_registers_type *i2c_registers) {
-  for(uint8_t i = 0; i < INPUT_CHANNELS; i++) {
-    this_cycles[i] = ((uint32_t)i2c_registers->tim1_at_irq[i]) << 16;
-    this_cycles[i] += i2c_registers->tim3_at_cap[i];
+// without a data ready line, guess when the next data will be there and sleep until then
+// with one, wait for its edge plus extra_ms to stay clear of the other channels' edges
+void wait_for_data(int data_ready, uint32_t sleep_ms, uint32_t extra_ms) {
+  if(data_ready < 0) {
+    usleep(sleep_ms * 1000);
+    return;
   }
-}
-
-// modifies sleep_ms
-// at 500ppm, this estimates the next update within 0.5ms
-void adjust_sleep_ms(uint32_t *sleep_ms, const uint32_t *this_cycles) {
-  int32_t aiming_cycles = EXPECTED_FREQ / 1000 * AIM_AFTER_MS;
-  uint32_t estimated_cycles_after_sleep = this_cycles[0] + EXPECTED_FREQ + aiming_cycles;
-  int32_t negative_margin = aiming_cycles - EXPECTED_FREQ;
-
-  for(uint8_t i = 0; i < INPUT_CHANNELS; i++) {
-    uint32_t estimated_cycles = this_cycles[i] + EXPECTED_FREQ;
-    int32_t diff_cycles = estimated_cycles-estimated_cycles_after_sleep;
 
-    if(diff_cycles < negative_margin) { // if we're looking at the wrong edge, adjust it forward 1 second
-      diff_cycles += EXPECTED_FREQ;
-    }
-    if(abs(diff_cycles) < aiming_cycles) {
-      // if it's expected within the +/-AIM_AFTER_MS window, move the window forward
-      estimated_cycles_after_sleep += aiming_cycles;
-      *sleep_ms += AIM_AFTER_MS;
-      // TODO: should this restart the window calculation?
-    }
+  wait_data_ready(data_ready, DATA_READY_TIMEOUT_MS);
+  if(extra_ms > 0) {
+    usleep(extra_ms * 1000);
   }
 }
 
-// in ppb units
-double tempcomp() {
-  float temp_f = last_temp()*9.0/5.0+32.0;
-  return (TCXO_A + TCXO_B * (temp_f - TCXO_C) + TCXO_D * pow(temp_f - TCXO_C, 2)) * 1000.0;
-}
-
-int main() {
-  int fd;
+// [-b bus] [-a address], then optional argument: data ready line, "/dev/gpiochipN:offset" or "mock"
+int main(int argc, char **argv) {
+  const char *bus = I2C_DEFAULT_BUS;
+  uint16_t addr = I2C_ADDR;
+  int fd, data_ready = -1;
   struct timespec cycles[AVERAGING_CYCLES];
   uint16_t first_cycle_index = 0, last_cycle_index = 0;
   uint32_t last_timestamp = 0;
   struct i2c_registers_type i2c_registers;
   struct i2c_registers_type_page2 i2c_registers_page2;
+  uint32_t retry_ms = READ_RETRY_MS;
 
   memset(cycles, '\0', sizeof(cycles));
  
-  fd = open_i2c(I2C_ADDR); 
+  i2c_options(&argc, &argv, &bus, &addr);
+  fd = open_i2c(bus, addr);
+  if(argc > 1) {
+    data_ready = open_data_ready(argv[1]);
+  }
 
   printf("ts delay status sleepms cycles1 cycles2 cycles3 #pts ch1 ch2 ch3 ch2.c ch3.c t.offset tempcomp 64s_ppm 128s_ppm output ");
   adc_header();
   printf("\n");
   while(1) {
     double added_offset_ns[INPUT_CHANNELS];
-    uint32_t sleep_ms, this_cycles[INPUT_CHANNELS];
+    uint32_t sleep_ms, aimed_sleep_ms, this_cycles[INPUT_CHANNELS];
     uint8_t wrap[INPUT_CHANNELS] = {0,0,0};
     uint32_t status_flags;
     int16_t number_points;
     double tempcomp_now;
+    uint8_t seconds = 1;
 
-    get_i2c_structs(fd, &i2c_registers, &i2c_registers_page2);
+    // the averages and history stay as they are, the seconds this misses are bridged below
+    if(get_i2c_structs(fd, &i2c_registers, &i2c_registers_page2) < 0) {
+      printf("i2c read failed, next try in %u ms\n", retry_ms);
+      fflush(stdout);
+      write_i2c_faults();
+      usleep(retry_ms * 1000);
+      retry_ms = retry_ms * 2 > READ_RETRY_MAX_MS ? READ_RETRY_MAX_MS : retry_ms * 2;
+      continue;
+    }
+    retry_ms = READ_RETRY_MS;
+    write_i2c_faults();
+    write_i2c_latency();
     add_adc_data(&i2c_registers, &i2c_registers_page2);
 
-    // was there no new data?
+    // was there no new data? the next capture is bridged like any other gap
     if(i2c_registers.milliseconds_irq_ch1 == last_timestamp) {
       printf("no new data\n");
       fflush(stdout);
-      first_cycle_index = last_cycle_index = 0; // reset because we missed a cycle
-      usleep(995000);
+      wait_for_data(data_ready, 995, 0);
       continue;
     }
+    if(last_timestamp != 0) {
+      uint32_t gap_ms = i2c_registers.milliseconds_irq_ch1 - last_timestamp;
+
+      seconds = gap_seconds(gap_ms);
+      if(seconds == 0) {
+        printf("missed %u ms of captures, restarting the average\n", gap_ms);
+        first_cycle_index = last_cycle_index = 0;
+      }
+    }
     last_timestamp = i2c_registers.milliseconds_irq_ch1;
 
     // aim for 5ms after the event
@@ -256,14 +287,15 @@ int main() {
 
     combine_tim1_tim3(this_cycles, &i2c_registers);
 
-    if(!add_cycles(this_cycles, wrap, added_offset_ns, (last_cycle_index != first_cycle_index), &i2c_registers)) {
+    if(!add_cycles(this_cycles, wrap, added_offset_ns, (last_cycle_index != first_cycle_index), &i2c_registers, seconds)) {
       printf("first cycle, sleeping %d ms\n", sleep_ms);
       fflush(stdout);
-      usleep(sleep_ms * 1000);
+      wait_for_data(data_ready, sleep_ms, 0);
       continue;
     }
 
     // estimate position of ch2/ch3 and modify sleep_ms if they're within 2ms of polling
+    aimed_sleep_ms = sleep_ms;
     adjust_sleep_ms(&sleep_ms, this_cycles);
 
     status_flags = 0;
@@ -278,13 +310,18 @@ int main() {
       }
     }
 
-    tempcomp_now = tempcomp();
+    tempcomp_now = tempcomp(last_temp());
     added_offset_ns[0] -= tempcomp_now;
     added_offset_ns[1] -= tempcomp_now;
-    add_offset_cycles(added_offset_ns[0], cycles, &first_cycle_index, &last_cycle_index);
+    for(uint8_t i = 0; i < seconds; i++) {
+      add_offset_cycles(added_offset_ns[0], cycles, &first_cycle_index, &last_cycle_index);
+    }
+    if(seconds > 1) {
+      status_flags |= STATUS_GAP;
+    }
 
     number_points = wrap_sub(last_cycle_index, first_cycle_index, AVERAGING_CYCLES);
-    status_flags = status_flags | (wrap[0] & STATUS_CH1_WRAPS) | ((wrap[1] << 2) & STATUS_CH2_WRAPS) | ((wrap[3] << 4) & STATUS_CH3_WRAPS);
+    status_flags |= wrap_status(wrap);
 
     printf("%lu %2u %3x %4u %10u %10u %10u %2u ",
        time(NULL),
@@ -312,6 +349,6 @@ int main() {
     printf("\n");
     fflush(stdout);
 
-    usleep(sleep_ms * 1000);
+    wait_for_data(data_ready, sleep_ms, sleep_ms - aimed_sleep_ms);
   }
 }
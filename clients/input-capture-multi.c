@@ -0,0 +1,426 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "i2c.h"
+#include "i2c_registers.h"
+#include "adc_calc.h"
+#include "vref_calc.h"
+#include "data_ready.h"
+#include "capture_calc.h"
+#include "i2c_latency.h"
+
+/* input-capture-i2c for many boards in one process, each given as address[:data_ready_line][@bus]
+ * every board's next read goes on one timerfd, the boards come due a few ms after their own ch1 capture and the ones
+ * due within BATCH_MS of each other are read back to back in one wakeup, oldest capture first, so boards on a common
+ * PPS cost one wakeup a second between them and their reads follow each other on the bus instead of colliding
+ * per board this keeps the last cycles, 64s of ch1 offsets, and smoothed adc readings, no more
+ */
+
+#define MAX_BOARDS 32
+#define PPM_INVALID -1000000.0
+// wait a little over a second for the data ready line before reading anyway
+#define DATA_READY_TIMEOUT_MS 1100
+#define NO_DATA_WAIT_MS 995
+// after a failed read, try again after this, doubling for every failure in a row up to READ_RETRY_MAX_MS
+#define READ_RETRY_MS 50
+#define READ_RETRY_MAX_MS 800
+// a board is read up to this late to share a wakeup with the one due before it
+#define BATCH_MS 20
+// exponential averages in place of adc_calc's 60 sample temperature and vref_calc's 10 minute vref
+#define TEMP_SAMPLES 60
+#define VREF_SAMPLES 600
+#define STATS_S 60
+#define TCXO_TEMPCOMP_TEMPFILE "/run/.tcxo.%u"
+#define TCXO_TEMPCOMP_FILE "/run/tcxo.%u"
+// the epoll data of the timerfd, boards are their index
+#define TIMER_EVENT MAX_BOARDS
+
+struct board {
+  const char *bus;
+  int fd;
+  int data_ready;          // -1 without a line
+  uint16_t addr;
+  uint16_t retry_ms;
+  uint16_t extra_ms;       // after a data ready edge, to stay clear of the other channels' edges
+  uint8_t has_previous;
+  uint8_t points;          // seconds in offsets_ns, up to AVERAGING_CYCLES-1
+  uint8_t newest;          // index of the newest second in offsets_ns
+  uint32_t last_timestamp; // milliseconds_irq_ch1 of the last capture read
+  uint32_t last_adc;
+  uint32_t previous_cycles[INPUT_CHANNELS];
+  int32_t offsets_ns[AVERAGING_CYCLES - 1]; // ch1 against its expected frequency, tempcomp taken off
+  uint64_t due_us;         // CLOCK_MONOTONIC
+  float temp, vref;        // 0 until the first adc reading
+  float average_ppm;       // the first 64s ppm, the tcxo file is relative to it
+};
+
+static struct board boards[MAX_BOARDS];
+static uint8_t board_count = 0;
+static uint32_t wakeups = 0, reads = 0;
+
+static uint64_t now_us() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void add_offset(struct board *b, int32_t offset_ns) {
+  b->newest = (b->newest + 1) % (AVERAGING_CYCLES - 1);
+  b->offsets_ns[b->newest] = offset_ns;
+  if(b->points < AVERAGING_CYCLES - 1) {
+    b->points++;
+  }
+}
+
+static float board_ppm(const struct board *b, uint8_t seconds) {
+  int64_t sum_ns = 0;
+
+  if(b->points < seconds) {
+    return PPM_INVALID;
+  }
+  for(uint8_t i = 0; i < seconds; i++) {
+    sum_ns += b->offsets_ns[(b->newest + AVERAGING_CYCLES - 1 - i) % (AVERAGING_CYCLES - 1)];
+  }
+  return sum_ns / 1000.0 / seconds;
+}
+
+static void print_ppm(float ppm) {
+  if(ppm < 500 && ppm > -500) {
+    printf("%1.3f ", ppm);
+  } else {
+    printf("- ");
+  }
+}
+
+static void write_tcxo_ppm(struct board *b, uint8_t index, float ppm) {
+  char tempfile[32], file[32];
+  FILE *tcxo;
+
+  if(b->average_ppm <= PPM_INVALID) {
+    printf("- ");
+    b->average_ppm = ppm;
+    return;
+  }
+
+  ppm = ppm - b->average_ppm;
+  if(ppm > 10 || ppm < -10) {
+    printf("- ");
+    return;
+  }
+
+  snprintf(tempfile, sizeof(tempfile), TCXO_TEMPCOMP_TEMPFILE, index);
+  snprintf(file, sizeof(file), TCXO_TEMPCOMP_FILE, index);
+  tcxo = fopen(tempfile, "w");
+  if(tcxo == NULL) {
+    fprintf(stderr, "fopen %s: ", tempfile);
+    perror(NULL);
+    exit(1);
+  }
+  fprintf(tcxo, "%1.3f\n", ppm);
+  fclose(tcxo);
+  rename(tempfile, file);
+
+  printf("%1.3f ", ppm);
+}
+
+static void add_adc(struct board *b, const struct i2c_registers_type_page2 *page2) {
+  float vref;
+
+  if(page2->last_adc_ms == b->last_adc) {
+    return;
+  }
+  b->last_adc = page2->last_adc_ms;
+
+  vref = vref_sample(page2);
+  b->vref = b->vref == 0 ? vref : b->vref + (vref - b->vref) / VREF_SAMPLES;
+  if(b->temp == 0) {
+    b->temp = adc_internal_temp(page2, b->vref);
+  } else {
+    b->temp += (adc_internal_temp(page2, b->vref) - b->temp) / TEMP_SAMPLES;
+  }
+}
+
+// when to look next, sleep_ms from now or the data ready line's next edge
+static void schedule(struct board *b, uint64_t now, uint32_t sleep_ms, uint32_t extra_ms) {
+  if(b->data_ready < 0) {
+    b->due_us = now + sleep_ms * 1000ULL;
+  } else {
+    b->due_us = now + DATA_READY_TIMEOUT_MS * 1000ULL;
+    b->extra_ms = extra_ms;
+  }
+}
+
+// input-capture-i2c's loop body for one board, with the wait replaced by setting due_us
+static void read_board(struct board *b, uint8_t index) {
+  struct i2c_registers_type i2c_registers;
+  struct i2c_registers_type_page2 i2c_registers_page2;
+  double added_offset_ns[INPUT_CHANNELS];
+  uint32_t sleep_ms, aimed_sleep_ms, this_cycles[INPUT_CHANNELS], status_flags = 0;
+  uint8_t wrap[INPUT_CHANNELS] = {0,0,0}, seconds = 1;
+  double tempcomp_now;
+  uint64_t now;
+
+  reads++;
+  if(get_i2c_structs(b->fd, &i2c_registers, &i2c_registers_page2) < 0) {
+    printf("%u: i2c read failed, next try in %u ms\n", index, b->retry_ms);
+    b->due_us = now_us() + b->retry_ms * 1000ULL;
+    b->retry_ms = b->retry_ms * 2 > READ_RETRY_MAX_MS ? READ_RETRY_MAX_MS : b->retry_ms * 2;
+    return;
+  }
+  now = now_us();
+  b->retry_ms = READ_RETRY_MS;
+  add_adc(b, &i2c_registers_page2);
+
+  if(i2c_registers.milliseconds_irq_ch1 == b->last_timestamp) {
+    printf("%u: no new data\n", index);
+    schedule(b, now, NO_DATA_WAIT_MS, 0);
+    return;
+  }
+  if(b->last_timestamp != 0) {
+    uint32_t gap_ms = i2c_registers.milliseconds_irq_ch1 - b->last_timestamp;
+
+    seconds = gap_seconds(gap_ms);
+    if(seconds == 0) {
+      printf("%u: missed %u ms of captures, restarting the average\n", index, gap_ms);
+      b->points = 0;
+    }
+  }
+  b->last_timestamp = i2c_registers.milliseconds_irq_ch1;
+
+  sleep_ms = calculate_sleep_ms(i2c_registers.milliseconds_now, i2c_registers.milliseconds_irq_ch1);
+  combine_tim1_tim3(this_cycles, &i2c_registers);
+
+  if(seconds == 0 || !b->has_previous) {
+    memcpy(b->previous_cycles, this_cycles, sizeof(this_cycles));
+    b->has_previous = 1;
+    printf("%u: first cycle, sleeping %u ms\n", index, sleep_ms);
+    schedule(b, now, sleep_ms, 0);
+    return;
+  }
+  for(uint8_t i = 0; i < INPUT_CHANNELS; i++) {
+    int32_t diff;
+
+    wrap[i] = cycles_wrap(&this_cycles[i], b->previous_cycles[i], &diff, &i2c_registers, i, seconds);
+    added_offset_ns[i] = diff * 1000000000.0 / EXPECTED_FREQ / seconds;
+    b->previous_cycles[i] = this_cycles[i];
+  }
+
+  aimed_sleep_ms = sleep_ms;
+  adjust_sleep_ms(&sleep_ms, this_cycles);
+
+  if(added_offset_ns[1] > -10000 && added_offset_ns[1] < 10000) {
+    added_offset_ns[2] -= added_offset_ns[1];
+  } else {
+    status_flags |= STATUS_CH2_FAILED;
+    if(b->points > 0) {
+      b->points--;
+    }
+  }
+
+  tempcomp_now = tempcomp(b->temp);
+  added_offset_ns[0] -= tempcomp_now;
+  added_offset_ns[1] -= tempcomp_now;
+  for(uint8_t i = 0; i < seconds; i++) {
+    add_offset(b, added_offset_ns[0]);
+  }
+  if(seconds > 1) {
+    status_flags |= STATUS_GAP;
+  }
+  status_flags |= wrap_status(wrap);
+
+  printf("%lu %2u %2u %3x %4u %10u %2u ", time(NULL), index, i2c_registers.milliseconds_now - i2c_registers.milliseconds_irq_ch1,
+      status_flags, sleep_ms, this_cycles[0], b->points);
+  if(status_flags & STATUS_CH2_FAILED) {
+    printf("%3.0f %3.0f  -  ", added_offset_ns[0], added_offset_ns[1]);
+  } else {
+    printf("%3.0f %3.0f %3.0f ", added_offset_ns[0], added_offset_ns[1], added_offset_ns[2]);
+  }
+  printf("%3.0f ", tempcomp_now);
+  print_ppm(board_ppm(b, 32));
+  print_ppm(board_ppm(b, AVERAGING_CYCLES - 1));
+  write_tcxo_ppm(b, index, board_ppm(b, AVERAGING_CYCLES - 1));
+  printf("%.4f\n", b->temp * 9 / 5.0 + 32.0);
+
+  schedule(b, now, sleep_ms, sleep_ms - aimed_sleep_ms);
+}
+
+// the earliest board due, and the others due within BATCH_MS after it, are read on this wakeup
+static uint64_t next_wakeup() {
+  uint64_t first = UINT64_MAX, wakeup;
+
+  for(uint8_t i = 0; i < board_count; i++) {
+    first = boards[i].due_us < first ? boards[i].due_us : first;
+  }
+  wakeup = first;
+  for(uint8_t i = 0; i < board_count; i++) {
+    if(boards[i].due_us > wakeup && boards[i].due_us <= first + BATCH_MS * 1000) {
+      wakeup = boards[i].due_us;
+    }
+  }
+  return wakeup;
+}
+
+static void set_timer(int timer, uint64_t at_us) {
+  struct itimerspec at;
+
+  memset(&at, '\0', sizeof(at));
+  at.it_value.tv_sec = at_us / 1000000;
+  at.it_value.tv_nsec = (at_us % 1000000) * 1000;
+  if(at.it_value.tv_sec == 0 && at.it_value.tv_nsec == 0) {
+    at.it_value.tv_nsec = 1; // 0 would disarm it
+  }
+  if(timerfd_settime(timer, TFD_TIMER_ABSTIME, &at, NULL) < 0) {
+    perror("timerfd_settime");
+    exit(1);
+  }
+}
+
+// every board due by now, the one that's waited longest first
+static void read_due_boards() {
+  while(1) {
+    uint64_t now = now_us();
+    int8_t next = -1;
+
+    for(uint8_t i = 0; i < board_count; i++) {
+      if(boards[i].due_us <= now && (next < 0 || boards[i].due_us < boards[next].due_us)) {
+        next = i;
+      }
+    }
+    if(next < 0) {
+      break;
+    }
+    read_board(&boards[next], next);
+  }
+  fflush(stdout);
+}
+
+static void print_stats(uint64_t *last_cpu_us) {
+  const struct i2c_fault_counts *faults = i2c_faults();
+  struct timespec cpu;
+  uint64_t cpu_us;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+  cpu_us = cpu.tv_sec * 1000000ULL + cpu.tv_nsec / 1000;
+  printf("# %u boards, last %us: %u wakeups %u reads %.1f ms cpu, i2c retries %u failed %u\n", board_count, STATS_S,
+      wakeups, reads, (cpu_us - *last_cpu_us) / 1000.0, faults->retries, faults->failed);
+  i2c_latency_summary(stdout, "# ");
+  fflush(stdout);
+  *last_cpu_us = cpu_us;
+  wakeups = reads = 0;
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [-b bus] board...\n"
+      "  -b     bus for the boards that don't give their own (%s)\n"
+      "  board  address[:data_ready_line][@bus], for example 0x4, 0x5:/dev/gpiochip0:17 or 0x4:mock@sim:speed=10\n"
+      "board N's offset goes to /run/tcxo.N\n", name, I2C_DEFAULT_BUS);
+  exit(1);
+}
+
+static void parse_board(struct board *b, char *spec, const char *bus, const char *name) {
+  char *at = strchr(spec, '@'), *end;
+
+  if(at != NULL) {
+    *at = '\0';
+    bus = at + 1;
+  }
+  memset(b, '\0', sizeof(*b));
+  b->addr = strtoul(spec, &end, 0);
+  if(end == spec || (*end != '\0' && *end != ':')) {
+    usage(name);
+  }
+  b->data_ready = *end == ':' ? open_data_ready(end + 1) : -1;
+  b->bus = bus;
+  b->fd = open_i2c(bus, b->addr);
+  b->retry_ms = READ_RETRY_MS;
+  b->average_ppm = PPM_INVALID;
+}
+
+int main(int argc, char **argv) {
+  const char *bus = I2C_DEFAULT_BUS;
+  struct epoll_event event, events[MAX_BOARDS + 1];
+  uint64_t next_stats, last_cpu_us = 0;
+  int epoll, timer, opt;
+
+  while((opt = getopt(argc, argv, "b:")) != -1) {
+    switch(opt) {
+      case 'b': bus = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if(optind == argc || argc - optind > MAX_BOARDS) {
+    usage(argv[0]);
+  }
+
+  epoll = epoll_create1(0);
+  timer = timerfd_create(CLOCK_MONOTONIC, 0);
+  if(epoll < 0 || timer < 0) {
+    perror("epoll_create1/timerfd_create");
+    exit(1);
+  }
+  event.events = EPOLLIN;
+  event.data.u32 = TIMER_EVENT;
+  epoll_ctl(epoll, EPOLL_CTL_ADD, timer, &event);
+
+  for(; optind < argc; optind++, board_count++) {
+    struct board *b = &boards[board_count];
+
+    parse_board(b, argv[optind], bus, argv[0]);
+    printf("board %u: 0x%02x on %s%s\n", board_count, b->addr, b->bus, b->data_ready < 0 ? "" : " with data ready");
+    if(b->data_ready >= 0) {
+      event.events = EPOLLIN;
+      event.data.u32 = board_count;
+      if(epoll_ctl(epoll, EPOLL_CTL_ADD, b->data_ready, &event) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+      }
+    }
+  }
+
+  printf("ts board delay status sleepms cycles1 #pts ch1 ch2 ch3 tempcomp 32s_ppm 64s_ppm output int-temp\n");
+  next_stats = now_us() + STATS_S * 1000000ULL;
+  while(1) {
+    int count;
+
+    set_timer(timer, next_wakeup());
+    count = epoll_wait(epoll, events, MAX_BOARDS + 1, -1);
+    if(count < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      exit(1);
+    }
+    wakeups++;
+
+    for(int i = 0; i < count; i++) {
+      if(events[i].data.u32 == TIMER_EVENT) {
+        uint64_t expirations;
+
+        if(read(timer, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+          perror("read timerfd");
+          exit(1);
+        }
+      } else {
+        struct board *b = &boards[events[i].data.u32];
+
+        wait_data_ready(b->data_ready, 0);
+        b->due_us = now_us() + b->extra_ms * 1000ULL;
+      }
+    }
+    read_due_boards();
+
+    if(now_us() >= next_stats) {
+      print_stats(&last_cpu_us);
+      next_stats += STATS_S * 1000000ULL;
+    }
+  }
+}
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "i2c.h"
+#include "i2c_registers.h"
+
+// latch every board with one general call, then compare each board to the first one given
+
+#define MAX_BOARDS 16
+#define GENERAL_CALL_ADDR 0x0
+
+struct board {
+  uint16_t addr;
+  int fd;
+  struct i2c_registers_type_latch latch;
+  uint32_t last_cycles;
+  uint16_t last_latch_count;
+  uint8_t has_last;
+  double elapsed_cycles; // since the last latch, 0 if unknown
+};
+
+static uint32_t latch_cycles(const struct i2c_registers_type_latch *latch) {
+  return ((uint32_t)latch->tim1) << 16 | latch->tim3;
+}
+
+// cycles between the last capture on a channel and the latch
+static uint32_t capture_age_cycles(const struct i2c_registers_type_latch *latch, uint8_t channel) {
+  uint32_t capture = ((uint32_t)latch->tim1_at_irq[channel]) << 16 | latch->tim3_at_cap[channel];
+
+  if(latch->tim3_at_cap[channel] > latch->tim3_at_irq[channel]) { // tim3 wrapped between the capture and the irq
+    capture -= 65536;
+  }
+
+  return latch_cycles(latch) - capture;
+}
+
+static int send_latch(int fd) {
+  uint8_t command = I2C_GENERAL_CALL_LATCH;
+  struct i2c_transfer transfer = {&command, sizeof(command), NULL, 0};
+
+  return try_transfer_i2c(fd, &transfer, 1);
+}
+
+static void update_elapsed(struct board *b) {
+  uint32_t cycles = latch_cycles(&b->latch);
+
+  b->elapsed_cycles = 0;
+  // a board that missed a latch would compare over a different interval
+  if(b->has_last && b->latch.latch_count == (uint16_t)(b->last_latch_count + 1)) {
+    b->elapsed_cycles = (uint32_t)(cycles - b->last_cycles);
+  }
+
+  b->last_cycles = cycles;
+  b->last_latch_count = b->latch.latch_count;
+  b->has_last = 1;
+}
+
+int main(int argc, char **argv) {
+  struct board boards[MAX_BOARDS];
+  const char *bus = I2C_DEFAULT_BUS;
+  uint16_t unused_addr = I2C_ADDR;
+  uint8_t board_count;
+  int gc_fd;
+
+  // the boards' addresses are the arguments, -a isn't used
+  i2c_options(&argc, &argv, &bus, &unused_addr);
+  if(argc < 3 || argc > MAX_BOARDS + 1) {
+    printf("usage: %s [-b bus] reference_addr addr [addr...]\n", argv[0]);
+    exit(1);
+  }
+
+  memset(boards, '\0', sizeof(boards));
+  board_count = argc - 1;
+  for(uint8_t i = 0; i < board_count; i++) {
+    boards[i].addr = strtoul(argv[i+1], NULL, 0);
+    boards[i].fd = open_i2c(bus, boards[i].addr);
+  }
+  gc_fd = open_i2c(bus, GENERAL_CALL_ADDR);
+
+  printf("ts");
+  for(uint8_t i = 1; i < board_count; i++) {
+    printf(" %02x.ppm %02x.ch1ns %02x.ch2ns %02x.ch3ns", boards[i].addr, boards[i].addr, boards[i].addr, boards[i].addr);
+  }
+  printf("\n");
+
+  while(1) {
+    const struct board *ref = &boards[0];
+    uint8_t i = 0;
+
+    // the other board fds share the bus lock with gc_fd, so only lock it once
+    lock_i2c(gc_fd);
+    if(send_latch(gc_fd) != I2C_OK) {
+      unlock_i2c(gc_fd);
+      fprintf(stderr, "general call latch failed\n");
+      sleep(1);
+      continue;
+    }
+    for(i = 0; i < board_count; i++) {
+      if(read_i2c_page(boards[i].fd, I2C_REGISTER_PAGE_LATCH, &boards[i].latch, sizeof(boards[i].latch)) < 0) {
+        break;
+      }
+    }
+    unlock_i2c(gc_fd);
+    // the boards' latches have to be from the same general call, so a failed read skips the round
+    if(i < board_count) {
+      fprintf(stderr, "board %02x: latch page read failed\n", boards[i].addr);
+      sleep(1);
+      continue;
+    }
+
+    for(uint8_t i = 0; i < board_count; i++) {
+      if(boards[i].latch.page_offset != I2C_REGISTER_PAGE_LATCH) {
+        printf("board %02x has no latch page\n", boards[i].addr);
+        exit(1);
+      }
+      update_elapsed(&boards[i]);
+    }
+
+    printf("%lu", time(NULL));
+    for(uint8_t i = 1; i < board_count; i++) {
+      const struct board *b = &boards[i];
+
+      if(b->elapsed_cycles > 0 && ref->elapsed_cycles > 0) {
+        printf(" %.4f", (b->elapsed_cycles / ref->elapsed_cycles - 1.0) * 1000000.0);
+      } else {
+        printf(" -");
+      }
+
+      // how much later this board saw each input than the reference board did
+      for(uint8_t channel = 0; channel < INPUT_CHANNELS; channel++) {
+        double age_ns = capture_age_cycles(&b->latch, channel) * 1000000000.0 / EXPECTED_FREQ;
+        double ref_age_ns = capture_age_cycles(&ref->latch, channel) * 1000000000.0 / EXPECTED_FREQ;
+        printf(" %.0f", ref_age_ns - age_ns);
+      }
+    }
+    printf("\n");
+    fflush(stdout);
+
+    sleep(1);
+  }
+}
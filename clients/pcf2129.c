@@ -39,9 +39,12 @@
 char *freqs[] = {"32k", "16k", "8k", "4k", "2k", "1k", "1", "disable"};
 
 int main(int argc, char **argv) {
+  const char *bus = I2C_DEFAULT_BUS;
+  uint16_t addr = I2C_ADDR;
   int fd;
 
-  fd = open_i2c(I2C_ADDR); 
+  i2c_options(&argc, &argv, &bus, &addr);
+  fd = open_i2c(bus, addr);
 
   if(argc == 1) {
     printf("commands: getadj, setadj, gettcr, settcr, getclk, setclk, getpwr\n");
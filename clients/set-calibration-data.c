@@ -7,10 +7,10 @@
 #include "float.h"
 #include "i2c_registers.h"
 
-static char *save_status_names[] = {"none", "ok", "erase fail", "write fail"};
+static char *save_status_names[] = {"none", "ok", "erase fail", "write fail", "busy"};
 
 const char *save_status_str(uint8_t save_status) {
-  if(save_status <= SAVE_STATUS_WRITE_FAIL) {
+  if(save_status <= SAVE_STATUS_BUSY) {
     return save_status_names[save_status];
   }
 
@@ -19,9 +19,12 @@ const char *save_status_str(uint8_t save_status) {
 
 int main(int argc, char **argv) {
   struct i2c_registers_type_page3 page3;
+  const char *bus = I2C_DEFAULT_BUS;
+  uint16_t addr = I2C_ADDR;
   int fd;
 
-  fd = open_i2c(I2C_ADDR); 
+  i2c_options(&argc, &argv, &bus, &addr);
+  fd = open_i2c(bus, addr);
 
   if(argc == 1) {
     printf("commands: get, set\n");
@@ -29,13 +32,11 @@ int main(int argc, char **argv) {
   }
 
   if(strcmp(argv[1], "get") == 0) {
-    uint8_t set_page[2];
-
-    set_page[0] = I2C_REGISTER_OFFSET_PAGE;
-    set_page[1] = I2C_REGISTER_PAGE3;
     lock_i2c(fd);
-    write_i2c(fd, set_page, sizeof(set_page));
-    read_i2c(fd, &page3, sizeof(page3));
+    if(read_i2c_page(fd, I2C_REGISTER_PAGE3, &page3, sizeof(page3)) < 0) {
+      printf("page3 read failed\n");
+      exit(1);
+    }
     unlock_i2c(fd);
 
     printf("a = %g, b = %g, c = %g, d = %g\n", ntohf(page3.tcxo_a), ntohf(page3.tcxo_b), ntohf(page3.tcxo_c), ntohf(page3.tcxo_d));
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "i2c.h"
+#include "i2c_registers.h"
+
+// move a board to a new i2c address, the firmware saves it to flash and answers on it once the save is done
+
+#define SAVE_POLL_US 10000
+#define SAVE_POLL_TRIES 100
+
+static const char *address_status_names[] = {"none", "ok", "bad key", "invalid", "busy", "save failed"};
+
+static const char *address_status_str(uint8_t status) {
+  if(status <= I2C_ADDRESS_STATUS_SAVE_FAIL) {
+    return address_status_names[status];
+  }
+
+  return "??";
+}
+
+// call with the bus locked
+static void read_info(int fd, struct i2c_registers_type_info *info) {
+  int version;
+
+  version = i2c_protocol_version(fd);
+  if(version < 0) {
+    printf("firmware version probe failed\n");
+    exit(1);
+  }
+  if(version < I2C_PROTOCOL_VERSION) {
+    printf("firmware is v%d, it has no info page\n", version);
+    exit(1);
+  }
+  if(read_i2c_page(fd, I2C_REGISTER_PAGE_INFO, info, sizeof(*info)) < 0) {
+    printf("info page read failed\n");
+    exit(1);
+  }
+  // firmware from before the address was configurable leaves this 0
+  if(info->i2c_address == 0) {
+    printf("firmware has a fixed i2c address\n");
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+  struct i2c_registers_type_info info;
+  const char *bus = I2C_DEFAULT_BUS;
+  uint16_t addr = I2C_ADDR;
+  unsigned long new_addr;
+  uint8_t commit[3];
+  int fd;
+
+  i2c_options(&argc, &argv, &bus, &addr);
+  if(argc != 2) {
+    printf("usage: %s [-b bus] [-a current_address] new_address\n", argv[0]);
+    exit(1);
+  }
+  new_addr = strtoul(argv[1], NULL, 0);
+  if(new_addr < I2C_ADDRESS_MIN || new_addr > I2C_ADDRESS_MAX) {
+    printf("address 0x%lx is outside 0x%x-0x%x\n", new_addr, I2C_ADDRESS_MIN, I2C_ADDRESS_MAX);
+    exit(1);
+  }
+
+  fd = open_i2c(bus, addr);
+  lock_i2c(fd);
+  read_info(fd, &info);
+  if(info.i2c_address == new_addr) {
+    unlock_i2c(fd);
+    printf("already at 0x%lx\n", new_addr);
+    return 0;
+  }
+  // read_i2c_page left the info page selected, new_i2c_address and the commit key are next to each other
+  commit[0] = offsetof(struct i2c_registers_type_info, new_i2c_address);
+  commit[1] = new_addr;
+  commit[2] = ~new_addr;
+  write_i2c(fd, commit, sizeof(commit));
+  unlock_i2c(fd);
+
+  // the board stays on the old address until the config record is written, then stops answering there
+  for(int tries = 0; tries < SAVE_POLL_TRIES; tries++) {
+    int status;
+
+    usleep(SAVE_POLL_US);
+    lock_i2c(fd);
+    status = read_i2c_page(fd, I2C_REGISTER_PAGE_INFO, &info, sizeof(info));
+    unlock_i2c(fd);
+    if(status < 0 || info.i2c_address_status != I2C_ADDRESS_STATUS_BUSY) {
+      break;
+    }
+  }
+  close(fd);
+  if(info.i2c_address_status != I2C_ADDRESS_STATUS_BUSY && info.i2c_address_status != I2C_ADDRESS_STATUS_OK) {
+    printf("0x%x: %s\n", addr, address_status_str(info.i2c_address_status));
+    return 1;
+  }
+
+  fd = open_i2c(bus, new_addr);
+  lock_i2c(fd);
+  read_info(fd, &info);
+  unlock_i2c(fd);
+
+  printf("0x%x -> 0x%x: %s\n", addr, info.i2c_address, address_status_str(info.i2c_address_status));
+  return info.i2c_address == new_addr && info.i2c_address_status == I2C_ADDRESS_STATUS_OK ? 0 : 1;
+}
@@ -94,16 +94,14 @@ const char *iir_filter_names[] = {"off","2","4","8","16","16","16","16"};
 void read_calibration(int fd, struct calibration_data *c) {
   uint8_t calibration_0_25[26];
   uint8_t calibration_26_41[7]; // more data available here, but only 7 bytes are used
-  uint8_t reg;
+  const uint8_t regs[2] = {BME280_CALIBRATION_0_25, BME280_CALIBRATION_26_41};
+  const struct i2c_transfer transfers[2] = {
+    {&regs[0], 1, calibration_0_25, sizeof(calibration_0_25)},
+    {&regs[1], 1, calibration_26_41, sizeof(calibration_26_41)},
+  };
 
   lock_i2c(fd);
-  reg = BME280_CALIBRATION_0_25;
-  write_i2c(fd, &reg, 1);
-  read_i2c(fd, &calibration_0_25, sizeof(calibration_0_25));
-
-  reg = BME280_CALIBRATION_26_41;
-  write_i2c(fd, &reg, 1);
-  read_i2c(fd, &calibration_26_41, sizeof(calibration_26_41));
+  transfer_i2c(fd, transfers, 2);
   unlock_i2c(fd);
 
   c->T1 = calibration_0_25[0] | (calibration_0_25[1] << 8);
@@ -128,8 +126,7 @@ void read_raw_adc(int fd, struct raw_adc_data *r) {
   uint8_t reg = BME280_PRESSURE;
 
   lock_i2c(fd);
-  write_i2c(fd, &reg, 1);
-  read_i2c(fd, &d, sizeof(d));
+  write_read_i2c(fd, &reg, 1, &d, sizeof(d));
   unlock_i2c(fd);
 
   r->pressure = (d[2] >> 4) | (d[1] << 4) | (d[0] << 12);
@@ -194,9 +191,12 @@ float calc_humidity(const struct raw_adc_data *r, const struct calibration_data
 }
 
 int main(int argc, char **argv) {
+  const char *bus = I2C_DEFAULT_BUS;
+  uint16_t addr = I2C_ADDR;
   int fd;
 
-  fd = open_i2c(I2C_ADDR); 
+  i2c_options(&argc, &argv, &bus, &addr);
+  fd = open_i2c(bus, addr);
 
   if(argc == 1) {
     printf("commands: show, force, getcalib, data, raw, id, stream\n");
@@ -212,8 +212,7 @@ int main(int argc, char **argv) {
     uint8_t d[4];
     uint8_t reg = BME280_CTRL_HUMID;
     lock_i2c(fd);
-    write_i2c(fd, &reg, 1);
-    read_i2c(fd, &d, sizeof(d));
+    write_read_i2c(fd, &reg, 1, &d, sizeof(d));
     unlock_i2c(fd);
 
     printf("ctrl_humid = %x (h=%s)\n", d[0], oversample_names[d[0] & 0b111]);
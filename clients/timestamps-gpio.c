@@ -147,12 +147,13 @@ static void get_timestamps(int fd, struct i2c_registers_type *page1) {
   set_page[1] = I2C_REGISTER_PAGE1;
 
   lock_i2c(fd);
-  write_i2c(fd, set_page, sizeof(set_page));
-  read_i2c(fd, page1, sizeof(*page1));
+  write_read_i2c(fd, set_page, sizeof(set_page), page1, sizeof(*page1));
   unlock_i2c(fd);
 }
 
-int main() {
+int main(int argc, char **argv) {
+  const char *bus = I2C_DEFAULT_BUS;
+  uint16_t addr = I2C_ADDR;
   int fd;
   uint32_t last_ch2 = 0, last_ch4 = 0;
   uint8_t last_ch2_count = 0, last_ch4_count = 0;
@@ -164,7 +165,8 @@ int main() {
   }
   pinMode(TIMESTAMP_PIN,OUTPUT);
 
-  fd = open_i2c(I2C_ADDR); 
+  i2c_options(&argc, &argv, &bus, &addr);
+  fd = open_i2c(bus, addr);
 
   while(1) {
     uint32_t ch2, ch4;
@@ -12,11 +12,13 @@
 #include "i2c.h"
 #include "i2c_registers.h"
 #include "timespec.h"
+#include "i2c_latency.h"
 
-// 8 bits at 400khz = 20us to account for i2c address transmit
-#define REQUEST_LATENCY  0.000020
-// 32 bits at 400khz = 80us to account for data transmit over i2c
-#define RESPONSE_LATENCY 0.000080
+// page4 is latched when the page select arrives, the select and the read are one repeated-start message
+// 24 bits at 400khz = 60us to account for the address, register and page transmit
+#define REQUEST_LATENCY  0.000060
+// 40 bits at 400khz = 100us to account for the repeated start address and data transmit over i2c
+#define RESPONSE_LATENCY 0.000100
 
 static struct timespec i2c_start,i2c_end;
 
@@ -100,26 +102,33 @@ static float calculate_offset(float diff_start, float diff_end, float rtt) {
   return diff_start + rtt/2.0;  
 }
 
-static uint32_t get_i2c_tim(int fd, struct i2c_registers_type *page1) {
+// -1 when the bus failed, or when the page4 read only went through on a retry and its round trip time is no good
+static int get_i2c_tim(int fd, struct i2c_registers_type *page1, uint32_t *tim) {
   uint8_t set_page[2];
-  uint32_t tim;
+  struct i2c_transfer transfer = {set_page, sizeof(set_page), tim, sizeof(*tim)};
+  uint32_t retries = i2c_faults()->retries;
+  int status;
 
   set_page[0] = I2C_REGISTER_OFFSET_PAGE;
   set_page[1] = I2C_REGISTER_PAGE4;
   lock_i2c(fd);
-  write_i2c(fd, set_page, sizeof(set_page));
-
   clock_gettime(CLOCK_REALTIME, &i2c_start);
-  read_i2c(fd, &tim, sizeof(tim));
+  status = try_transfer_i2c(fd, &transfer, 1);
   clock_gettime(CLOCK_REALTIME, &i2c_end);
+  // through the arbiter, its clock reads bracket the bus and not the socket round trip
+  if(status == I2C_OK) {
+    i2c_bus_time(fd, &i2c_start, &i2c_end);
+  }
 
-  set_page[1] = I2C_REGISTER_PAGE1;
-  write_i2c(fd, set_page, sizeof(set_page));
-  read_i2c(fd, page1, sizeof(*page1));
+  if(status == I2C_OK && i2c_faults()->retries == retries) {
+    status = read_i2c_page(fd, I2C_REGISTER_PAGE1, page1, sizeof(*page1));
+  } else {
+    status = -1;
+  }
 
   unlock_i2c(fd);
 
-  return tim;
+  return status;
 }
 
 // 89s per 32 bit wrap
@@ -127,12 +136,21 @@ static uint32_t get_i2c_tim(int fd, struct i2c_registers_type *page1) {
 
 #define STATE_CH2_WRAP 0b1
 
-int main() {
+// after a failed read, soon enough to still catch this second's ch2
+#define RETRY_US 50000
+// the page4 and page1 transfer latencies go to stderr this often
+#define LATENCY_SUMMARY_S 60
+
+int main(int argc, char **argv) {
+  const char *bus = I2C_DEFAULT_BUS;
+  uint16_t addr = I2C_ADDR;
   int fd;
   uint32_t last_ch2 = 0;
   uint8_t last_ch2_count = 0;
+  time_t next_summary = time(NULL) + LATENCY_SUMMARY_S;
 
-  fd = open_i2c(I2C_ADDR); 
+  i2c_options(&argc, &argv, &bus, &addr);
+  fd = open_i2c(bus, addr);
 
   while(1) {
     uint32_t tim;
@@ -143,7 +161,11 @@ int main() {
     uint32_t states = 0;
     struct timespec i2c_rtt;
 
-    tim = get_i2c_tim(fd, &page1);
+    if(get_i2c_tim(fd, &page1, &tim) < 0) {
+      fprintf(stderr, "i2c read failed, trying again\n");
+      usleep(RETRY_US);
+      continue;
+    }
     ch2 = page1.tim3_at_cap[1] | ((uint32_t)page1.tim1_at_irq[1])<<16;
     if(ch2 == last_ch2) {
       fprintf(stderr,"ch2 unchanged count: %u->%u\n", last_ch2_count, page1.ch2_count);
@@ -210,6 +232,11 @@ int main() {
     last_ch2 = ch2;
     last_ch2_count = page1.ch2_count;
 
+    if(time(NULL) >= next_summary) {
+      i2c_latency_summary(stderr, "");
+      next_summary = time(NULL) + LATENCY_SUMMARY_S;
+    }
+
     usleep(sleep_time);
   }
 }
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+
+#include "uart_stream_format.h"
+#include "i2c_register_map.h"
+#include "crc8.h"
+#include "cobs.h"
+
+// read the firmware's binary capture stream (info page uart_stream = UART_STREAM_ON) from a serial port
+
+#define FRAME_BUFFER_SIZE 64
+
+#define CHANNELS I2C_CAPTURE_CHANNELS
+#define LATENCY_MAX 256     // cycles, anything longer counts in the last bucket
+#define LATENCY_REPORT_S 10
+
+/* -l: cycles from the edge being captured to the irq reading tim3, per channel
+ * the spread is the capture interrupt's entry jitter, the thing the ram resident handlers are there to keep small
+ */
+struct latency {
+  uint32_t counts[LATENCY_MAX];
+  uint32_t total;
+};
+
+static uint8_t latency_mode = 0;
+static struct latency latencies[CHANNELS];
+
+// the firmware runs the uart at UART_STREAM_BAUD unless it was built with another UART_BAUD
+static const struct {
+  unsigned long baud;
+  speed_t speed;
+} speeds[] = {
+  {115200, B115200}, {230400, B230400}, {460800, B460800}, {500000, B500000}, {921600, B921600},
+  {1000000, B1000000}, {1500000, B1500000}, {2000000, B2000000},
+};
+
+static speed_t baud_speed(unsigned long baud) {
+  for(size_t i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++) {
+    if(speeds[i].baud == baud) {
+      return speeds[i].speed;
+    }
+  }
+  fprintf(stderr, "unsupported baud rate %lu\n", baud);
+  exit(1);
+}
+
+static int open_uart(const char *path, speed_t speed) {
+  struct termios tio;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_NOCTTY);
+  if(fd < 0) {
+    perror("open");
+    exit(1);
+  }
+
+  // a pipe or file stands in for the port when testing, make uart-test uses a pty to take the tty path
+  if(!isatty(fd)) {
+    return fd;
+  }
+
+  if(tcgetattr(fd, &tio) < 0) {
+    perror("tcgetattr");
+    exit(1);
+  }
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cc[VMIN] = 1;
+  tio.c_cc[VTIME] = 0;
+  if(cfsetspeed(&tio, speed) < 0) {
+    perror("cfsetspeed");
+    exit(1);
+  }
+  // whatever came in before the port was set up goes, the pty test (make uart-test) starts once it's raw
+  tcflush(fd, TCIFLUSH);
+  if(tcsetattr(fd, TCSANOW, &tio) < 0) {
+    perror("tcsetattr");
+    exit(1);
+  }
+
+  return fd;
+}
+
+static double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// same 32 bit counter reconstruction as the i2c pages
+static uint32_t capture_cycles(const struct uart_stream_capture *capture) {
+  uint32_t cycles = ((uint32_t)capture->tim1_at_irq) << 16 | capture->tim3_at_cap;
+
+  if(capture->tim3_at_cap > capture->tim3_at_irq) { // tim3 wrapped between the capture and the irq
+    cycles -= 65536;
+  }
+  return cycles;
+}
+
+static void latency_add(const struct uart_stream_capture *capture) {
+  uint16_t cycles = capture->tim3_at_irq - capture->tim3_at_cap; // mod 65536, tim3 may have wrapped
+
+  if(capture->channel >= CHANNELS) {
+    return;
+  }
+  if(cycles >= LATENCY_MAX) {
+    cycles = LATENCY_MAX - 1;
+  }
+  latencies[capture->channel].counts[cycles]++;
+  latencies[capture->channel].total++;
+}
+
+// smallest latency that at least fraction of the captures are at or under
+static uint16_t latency_percentile(const struct latency *latency, double fraction) {
+  uint32_t seen = 0;
+
+  for(uint16_t i = 0; i < LATENCY_MAX; i++) {
+    seen += latency->counts[i];
+    if(seen > 0 && seen >= fraction * latency->total) {
+      return i;
+    }
+  }
+  return LATENCY_MAX - 1;
+}
+
+static void latency_report() {
+  for(uint8_t channel = 0; channel < CHANNELS; channel++) {
+    const struct latency *latency = &latencies[channel];
+
+    if(latency->total == 0) {
+      continue;
+    }
+    printf("%.3f ch%u latency n=%u min=%u p50=%u p99=%u max=%u cycles:", now(), channel + 1, latency->total,
+        latency_percentile(latency, 0), latency_percentile(latency, 0.5), latency_percentile(latency, 0.99),
+        latency_percentile(latency, 1));
+    for(uint16_t i = 0; i < LATENCY_MAX; i++) {
+      if(latency->counts[i]) {
+        printf(" %u%s=%u", i, i == LATENCY_MAX - 1 ? "+" : "", latency->counts[i]);
+      }
+    }
+    printf("\n");
+  }
+}
+
+static void print_message(const uint8_t *message, size_t length) {
+  static uint8_t has_sequence = 0, last_sequence;
+  static uint32_t last_capture_count;
+  const struct uart_stream_header *header = (const struct uart_stream_header *)message;
+
+  if(has_sequence && header->sequence != (uint8_t)(last_sequence + 1)) {
+    printf("lost %u messages\n", (uint8_t)(header->sequence - last_sequence - 1));
+  }
+  has_sequence = 1;
+  last_sequence = header->sequence;
+
+  if(header->type == UART_STREAM_CAPTURE && length == sizeof(struct uart_stream_capture)) {
+    struct uart_stream_capture capture;
+
+    memcpy(&capture, message, sizeof(capture));
+    // a warm restart resumes the count from the firmware's last snapshot, up to a tick or so behind
+    if(last_capture_count && (int32_t)(capture.capture_count - last_capture_count) <= 0) {
+      printf("capture count went back from %u to %u, the board restarted\n", last_capture_count, capture.capture_count);
+    } else if(last_capture_count && capture.capture_count != last_capture_count + 1) {
+      printf("lost %u captures\n", capture.capture_count - last_capture_count - 1);
+    }
+    last_capture_count = capture.capture_count;
+    if(latency_mode) {
+      latency_add(&capture);
+      return;
+    }
+    printf("%.3f capture ch%u %u %u\n", now(), capture.channel + 1, capture.capture_count, capture_cycles(&capture));
+  } else if(header->type == UART_STREAM_ADC && length == sizeof(struct uart_stream_adc)) {
+    struct uart_stream_adc adc;
+
+    if(latency_mode) {
+      return;
+    }
+    memcpy(&adc, message, sizeof(adc));
+    printf("%.3f adc %u %u %u %u dropped=%u\n", now(), adc.last_adc_ms, adc.internal_temp, adc.internal_vref, adc.external_temp, adc.tx_dropped);
+  } else {
+    printf("unknown message type %u length %zu\n", header->type, length);
+  }
+}
+
+static void handle_frame(const uint8_t *frame, size_t length) {
+  uint8_t message[FRAME_BUFFER_SIZE];
+  size_t message_length;
+
+  if(length == 0) {
+    return;
+  }
+
+  message_length = cobs_decode(frame, length, message);
+  if(message_length < sizeof(struct uart_stream_header) + 1) {
+    printf("bad frame\n");
+    return;
+  }
+  message_length--; // crc8
+  if(crc8(0, message, message_length) != message[message_length]) {
+    printf("bad crc\n");
+    return;
+  }
+
+  print_message(message, message_length);
+}
+
+int main(int argc, char **argv) {
+  uint8_t frame[FRAME_BUFFER_SIZE];
+  size_t frame_length = 0;
+  uint8_t overflow = 0;
+  double next_report;
+  speed_t speed = baud_speed(UART_STREAM_BAUD);
+  int fd, opt;
+
+  while((opt = getopt(argc, argv, "lb:")) != -1) {
+    switch(opt) {
+      case 'l':
+        latency_mode = 1;
+        break;
+      case 'b':
+        speed = baud_speed(strtoul(optarg, NULL, 0));
+        break;
+      default:
+        optind = argc; // fall through to the usage
+        break;
+    }
+  }
+  if(optind != argc - 1) {
+    printf("usage: %s [-l] [-b baud] /dev/ttyX\n"
+        "  -l  capture irq latency histograms every %us instead of every capture\n"
+        "  -b  the port's baud rate (%u), for firmware built with another UART_BAUD\n", argv[0], LATENCY_REPORT_S, UART_STREAM_BAUD);
+    exit(1);
+  }
+
+  fd = open_uart(argv[optind], speed);
+  next_report = now() + LATENCY_REPORT_S;
+
+  while(1) {
+    uint8_t buffer[256];
+    ssize_t len = read(fd, buffer, sizeof(buffer));
+
+    if(len < 0 && errno != EIO) {
+      perror("read");
+      exit(1);
+    }
+    if(len <= 0) { // end of a test file or pipe, or the other side of a pty (make uart-test) closed
+      if(latency_mode) {
+        latency_report();
+      }
+      exit(0);
+    }
+
+    for(ssize_t i = 0; i < len; i++) {
+      if(buffer[i] == 0) {
+        if(!overflow) {
+          handle_frame(frame, frame_length);
+        }
+        frame_length = 0;
+        overflow = 0;
+      } else if(frame_length < sizeof(frame)) {
+        frame[frame_length++] = buffer[i];
+      } else {
+        overflow = 1; // resync at the next 0x00
+      }
+    }
+    if(latency_mode && now() >= next_report) {
+      latency_report();
+      next_report += LATENCY_REPORT_S;
+    }
+    fflush(stdout);
+  }
+}
@@ -29,6 +29,14 @@ static void add_vref_minute() {
   last_vref_value = avg_f(vrefs_minute, vref_minute_index+1);
 }
 
+// one reading, unaveraged
+float vref_sample(const struct i2c_registers_type_page2 *i2c_registers_page2) {
+  float expected = i2c_registers_page2->vrefint_cal/4096.0*3.3;
+  float actual = i2c_registers_page2->internal_vref/4096.0*3.3;
+
+  return expected/actual*3.3;
+}
+
 void add_vref_data(const struct i2c_registers_type_page2 *i2c_registers_page2) {
   if(vref_index < (AVERAGE_SAMPLES-1)) {
     vref_index++;
@@ -37,10 +45,7 @@ void add_vref_data(const struct i2c_registers_type_page2 *i2c_registers_page2) {
     vref_index = 0;
   }
 
-  float expected = i2c_registers_page2->vrefint_cal/4096.0*3.3;
-  float actual = i2c_registers_page2->internal_vref/4096.0*3.3;
-
-  vrefs[vref_index] = expected/actual*3.3;
+  vrefs[vref_index] = vref_sample(i2c_registers_page2);
 
   if(vref_minute_index < 0)
     last_vref_value = avg_f(vrefs, vref_index+1);
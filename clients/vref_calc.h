@@ -3,5 +3,6 @@
 
 void add_vref_data(const struct i2c_registers_type_page2 *i2c_registers_page2);
 float last_vref();
+float vref_sample(const struct i2c_registers_type_page2 *i2c_registers_page2);
 
 #endif
@@ -0,0 +1,982 @@
+#include "stm32f0xx_hal.h"
+#include "main.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "sim.h"
+#include "stm32f0xx_it.h"
+#include "uart_stream_format.h"
+
+/* peripheral models behind the fake HAL, all on one 48MHz cycle clock
+ * interrupts only run when time moves: on a register read, a flash stall, a handler body or WFI
+ */
+
+// a peripheral register read, the counters move on between the firmware's reads
+#define REG_READ_CYCLES 2
+// cortex-m0 exception entry and return
+#define IRQ_ENTRY_CYCLES 16
+#define IRQ_EXIT_CYCLES 12
+// input synchronizer and edge detector in front of the capture register
+#define CAPTURE_SYNC_CYCLES 3
+// TIM1 counts TIM3's update event (TRGO), which lands a couple of cycles after TIM3 wraps
+#define TRGO_CYCLES 2
+// STM32F030 datasheet tERASE and tPROG
+#define FLASH_ERASE_CYCLES (SIM_HZ / 1000 * 20)
+#define FLASH_PROGRAM_CYCLES (SIM_HZ / 1000000 * 50)
+// 239.5 + 12.5 adc clocks at 14MHz
+#define ADC_CONVERSION_CYCLES (SIM_HZ / 1000000 * 18)
+#define SYSTICK_CYCLES (SIM_HZ / 1000)
+#define UART_BYTE_CYCLES (SIM_HZ / UART_STREAM_BAUD * 10)
+
+#define FLASH_SIZE (16*1024)
+#define FLASH_PAGE_SIZE 1024
+#define SYSTEM_MEMORY 0x1ffff000UL
+#define SYSTEM_MEMORY_SIZE 4096
+
+#define PRIORITY_THREAD 4
+#define EVENT_SLOTS 32
+#define EDGE_HISTORY 16
+
+// from the link line, the same addresses as the linker script
+extern const uint8_t start_rwflash[];
+extern const uint8_t end_rwflash[];
+
+// the handles main.c and the CubeMX init functions would set up
+GPIO_TypeDef sim_gpioa;
+static TIM_TypeDef sim_tim1, sim_tim3, sim_tim14;
+// TXDR only holds 8 bits, this is the sim's mark for an empty one so it can see the firmware's writes
+#define I2C_TXDR_EMPTY 0x100
+
+I2C_TypeDef sim_i2c1 = { // as i2c1_init leaves it
+  .CR1 = I2C_CR1_PE | I2C_CR1_GCEN,
+  .OAR1 = I2C_OAR1_OA1EN | (SIM_I2C_OWN_ADDRESS << 1),
+  .ISR = I2C_ISR_TXE,
+  .TXDR = I2C_TXDR_EMPTY
+};
+static USART_TypeDef sim_usart1;
+static DMA_Channel_TypeDef sim_dma_ch2;
+
+TIM_HandleTypeDef htim1 = {.Instance = &sim_tim1};
+TIM_HandleTypeDef htim3 = {.Instance = &sim_tim3};
+TIM_HandleTypeDef htim14 = {.Instance = &sim_tim14};
+I2C_HandleTypeDef hi2c1 = {.Instance = &sim_i2c1, .Init = {.OwnAddress1 = SIM_I2C_OWN_ADDRESS << 1}};
+ADC_HandleTypeDef hadc;
+UART_HandleTypeDef huart1;
+DMA_HandleTypeDef hdma_usart1_tx = {.Instance = &sim_dma_ch2, .Parent = &huart1};
+UART_HandleTypeDef huart1 = {
+  .Instance = &sim_usart1,
+  .hdmatx = &hdma_usart1_tx,
+  .gState = HAL_UART_STATE_READY
+};
+
+__IO uint32_t uwTick;
+
+uint64_t sim_cycles = 0;
+struct sim_irq_stats sim_irq_stats[SIM_IRQS];
+uint32_t sim_data_ready_toggles = 0;
+uint32_t sim_i2c_stretch_cycles = 0;
+void (*sim_irq_hook)(enum sim_irq irq) = NULL;
+
+static const struct {
+  uint8_t priority; // same as the HAL_NVIC_SetPriority calls
+  IRQn_Type irqn;
+  void (*handler)(void);
+} irqs[SIM_IRQS] = {
+  [SIM_IRQ_SYSTICK] = {3, SysTick_IRQn, SysTick_Handler},
+  [SIM_IRQ_TIM3] = {0, TIM3_IRQn, TIM3_IRQHandler},
+  [SIM_IRQ_TIM14] = {0, TIM14_IRQn, TIM14_IRQHandler},
+  [SIM_IRQ_I2C1] = {2, I2C1_IRQn, I2C1_IRQHandler},
+  [SIM_IRQ_TIM1] = {2, TIM1_BRK_UP_TRG_COM_IRQn, TIM1_BRK_UP_TRG_COM_IRQHandler},
+  [SIM_IRQ_DMA] = {3, DMA1_Channel2_3_IRQn, DMA1_Channel2_3_IRQHandler},
+  [SIM_IRQ_ADC] = {3, ADC1_IRQn, ADC1_IRQHandler},
+  [SIM_IRQ_USART1] = {3, USART1_IRQn, USART1_IRQHandler},
+};
+
+// the MspInit functions enable every irq the firmware uses
+NVIC_Type sim_nvic;
+static uint32_t nvic_enabled = 0xffffffff;
+
+// around the RAMFUNC code, from sim/ramfunc.ld
+extern const uint8_t sim_ramfunc_start[];
+extern const uint8_t sim_ramfunc_end[];
+
+// code the firmware puts in ram, it keeps running during a flash operation
+static uint8_t in_ram(const void *code) {
+  return (const uint8_t *)code >= sim_ramfunc_start && (const uint8_t *)code < sim_ramfunc_end;
+}
+
+// rough guesses at -Os, replace with measured numbers when there are some
+uint32_t sim_irq_body_cycles[SIM_IRQS] = {
+  [SIM_IRQ_SYSTICK] = 30,
+  [SIM_IRQ_TIM3] = 120,
+  [SIM_IRQ_TIM14] = 100,
+  [SIM_IRQ_I2C1] = 150,
+  [SIM_IRQ_TIM1] = 80,
+  [SIM_IRQ_DMA] = 80,
+  [SIM_IRQ_ADC] = 60,
+  [SIM_IRQ_USART1] = 60,
+};
+
+static uint32_t pending = 0; // bit per sim_irq
+static uint64_t pending_since[SIM_IRQS];
+static uint8_t active_priority = PRIORITY_THREAD;
+static uint8_t primask = 0;
+static uint32_t deferred = 0; // pending irqs already counted as waiting on flash
+static uint64_t flash_busy_until = 0; // end of the running flash operation
+static uint8_t core_stalled = 0;      // fetching from flash during the operation, nothing runs until its end
+
+static uint32_t i2c_txdr_at_irq; // TXDR when the i2c irq was taken, to tell a flush from a load
+static void i2c_clears();
+static void i2c_irq_return();
+
+static struct {
+  uint64_t at;
+  sim_event_fn fn;
+  uint32_t arg;
+  uint8_t used;
+} events[EVENT_SLOTS];
+
+void sim_schedule(uint64_t at, sim_event_fn fn, uint32_t arg) {
+  for(uint8_t i = 0; i < EVENT_SLOTS; i++) {
+    if(!events[i].used) {
+      events[i].at = at;
+      events[i].fn = fn;
+      events[i].arg = arg;
+      events[i].used = 1;
+      return;
+    }
+  }
+  fprintf(stderr, "sim: out of event slots\n");
+  exit(1);
+}
+
+static int8_t next_event_slot() {
+  int8_t next = -1;
+
+  for(uint8_t i = 0; i < EVENT_SLOTS; i++) {
+    if(events[i].used && (next < 0 || events[i].at < events[next].at)) {
+      next = i;
+    }
+  }
+  return next;
+}
+
+uint64_t sim_next_event() {
+  int8_t next = next_event_slot();
+
+  return next < 0 ? UINT64_MAX : events[next].at;
+}
+
+// runs the earliest event, the caller has moved sim_cycles up to it
+static void run_next_event() {
+  int8_t next = next_event_slot();
+
+  events[next].used = 0;
+  events[next].fn(events[next].arg);
+}
+
+void sim_pend(enum sim_irq irq) {
+  if(!(pending & (1 << irq))) {
+    pending |= 1 << irq;
+    pending_since[irq] = sim_cycles;
+  }
+}
+
+// highest priority pending irq that would preempt what's running now, -1 if none
+static int8_t runnable_irq() {
+  int8_t best = -1;
+
+  for(uint8_t irq = 0; irq < SIM_IRQS; irq++) {
+    if(!(pending & (1 << irq)) || irqs[irq].priority >= active_priority) {
+      continue;
+    }
+    if(irqs[irq].irqn >= 0 && !(nvic_enabled & (1 << irqs[irq].irqn))) {
+      if(sim_cycles < flash_busy_until && !(deferred & (1 << irq))) {
+        deferred |= 1 << irq;
+        sim_irq_stats[irq].deferred++;
+      }
+      continue;
+    }
+    if(best < 0 || irqs[irq].priority < irqs[best].priority) {
+      best = irq;
+    }
+  }
+  return best;
+}
+
+static void stall_core();
+
+static void run_irq(uint8_t irq) {
+  uint8_t preempted = active_priority;
+  uint32_t data_ready = sim_gpioa.ODR & DATA_READY_Pin;
+  uint32_t latency;
+
+  pending &= ~(1 << irq);
+  deferred &= ~(1 << irq);
+  active_priority = irqs[irq].priority;
+
+  sim_advance(IRQ_ENTRY_CYCLES);
+  // the vector comes from the ram table, but the first fetch of a handler in flash stalls the core
+  if(sim_cycles < flash_busy_until && !in_ram(irqs[irq].handler)) {
+    sim_irq_stats[irq].deferred++;
+    stall_core();
+  }
+  latency = sim_cycles - pending_since[irq];
+  sim_irq_stats[irq].count++;
+  sim_irq_stats[irq].total_latency += latency;
+  if(latency > sim_irq_stats[irq].max_latency) {
+    sim_irq_stats[irq].max_latency = latency;
+  }
+
+  if(irq == SIM_IRQ_I2C1) {
+    i2c_txdr_at_irq = sim_i2c1.TXDR;
+  }
+  irqs[irq].handler();
+  if(irq == SIM_IRQ_I2C1) {
+    i2c_irq_return();
+  }
+  sim_advance(sim_irq_body_cycles[irq]);
+
+  if((sim_gpioa.ODR & DATA_READY_Pin) != data_ready) {
+    sim_data_ready_toggles++;
+  }
+  if(sim_irq_hook != NULL) {
+    sim_irq_hook(irq);
+  }
+
+  sim_advance(IRQ_EXIT_CYCLES);
+  active_priority = preempted;
+}
+
+static void take_irqs() {
+  int8_t irq;
+
+  if(core_stalled) {
+    return;
+  }
+  nvic_enabled = (nvic_enabled | sim_nvic.ISER[0]) & ~sim_nvic.ICER[0];
+  sim_nvic.ISER[0] = 0;
+  sim_nvic.ICER[0] = 0;
+  i2c_clears();
+  while(!primask && (irq = runnable_irq()) >= 0) {
+    run_irq(irq);
+  }
+}
+
+// the running code takes cycles, anything that preempts it pushes its end out
+void sim_advance(uint32_t cycles) {
+  uint64_t remaining = cycles;
+
+  take_irqs();
+  while(1) {
+    uint64_t next = sim_next_event();
+
+    if(next > sim_cycles + remaining) {
+      sim_cycles += remaining;
+      return;
+    }
+    if(next > sim_cycles) {
+      remaining -= next - sim_cycles;
+      sim_cycles = next;
+    }
+    run_next_event();
+    take_irqs();
+  }
+}
+
+void __disable_irq() {
+  primask = 1;
+}
+
+void __enable_irq() {
+  primask = 0;
+  take_irqs();
+}
+
+uint32_t __get_PRIMASK() {
+  return primask;
+}
+
+void __set_PRIMASK(uint32_t value) {
+  primask = value;
+  take_irqs();
+}
+
+// wakes on a pending irq even with primask set, the irq runs once primask is cleared
+void __WFI() {
+  while(runnable_irq() < 0) {
+    uint64_t next = sim_next_event();
+
+    if(next == UINT64_MAX) {
+      fprintf(stderr, "sim: WFI with nothing left to wake it\n");
+      exit(1);
+    }
+    if(next > sim_cycles) {
+      sim_cycles = next;
+    }
+    run_next_event();
+  }
+}
+
+// only HardFault_Handler resets, and nothing in the sim faults
+void NVIC_SystemReset() {
+  fprintf(stderr, "sim: reset\n");
+  exit(1);
+}
+
+static void systick_event(uint32_t arg) {
+  sim_pend(SIM_IRQ_SYSTICK);
+  sim_schedule(sim_cycles + SYSTICK_CYCLES, systick_event, 0);
+}
+
+/* TIM3 free runs at the cpu clock, TIM1 is its slave and counts its wraps
+ * the firmware reads them one after the other, so a TIM3 wrap between the reads is possible
+ * TIM14 counts on the same clock from whenever it's started, and holds its count while stopped
+ */
+static uint8_t tim1_started = 0, tim3_started = 0, tim14_started = 0;
+static uint64_t tim3_origin, tim14_origin;
+static uint16_t tim14_stopped_at;
+// 32 bit TIM1:TIM3 counter at each capture, TIM3 channels 1-4 then TIM14
+static uint32_t edge_history[5][EDGE_HISTORY];
+static uint8_t edge_history_next[5];
+
+static uint8_t edge_slot(uint8_t channel) {
+  return channel == SIM_EDGE_TIM14 ? 4 : channel - 1;
+}
+
+static uint16_t counter_at(const TIM_TypeDef *tim, uint64_t at) {
+  uint64_t elapsed;
+
+  if(tim == &sim_tim14) {
+    return tim14_started ? (at - tim14_origin) & 0xffff : tim14_stopped_at;
+  }
+  if(!tim3_started) {
+    return 0;
+  }
+  elapsed = at - tim3_origin;
+  if(tim == &sim_tim3) {
+    return elapsed & 0xffff;
+  }
+  if(!tim1_started || elapsed < TRGO_CYCLES) {
+    return 0;
+  }
+  return ((elapsed - TRGO_CYCLES) >> 16) & 0xffff;
+}
+
+uint16_t sim_tim_counter(TIM_TypeDef *tim) {
+  sim_advance(REG_READ_CYCLES);
+  return counter_at(tim, sim_cycles);
+}
+
+// the SR bits are rc_w0, writing a 1 leaves them alone
+void sim_tim_clear(TIM_TypeDef *tim, uint32_t flags) {
+  tim->SR &= ~flags;
+}
+
+// TIM1's update event, when the 32 bit TIM1:TIM3 count wraps
+static void tim1_wrap_event(uint32_t arg) {
+  sim_tim1.SR |= TIM_FLAG_UPDATE;
+  if(sim_tim1.DIER & TIM_IT_UPDATE) {
+    sim_pend(SIM_IRQ_TIM1);
+  }
+  sim_schedule(sim_cycles + (1ULL << 32), tim1_wrap_event, 0);
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Start(TIM_HandleTypeDef *htim) {
+  if(htim->Instance == &sim_tim3) {
+    tim3_started = 1;
+    tim3_origin = sim_cycles;
+    sim_schedule(tim3_origin + (1ULL << 32) + TRGO_CYCLES, tim1_wrap_event, 0);
+  } else if(htim->Instance == &sim_tim1) {
+    tim1_started = 1;
+  }
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef *htim) {
+  htim->Instance->DIER |= TIM_IT_UPDATE;
+  return HAL_TIM_Base_Start(htim);
+}
+
+HAL_StatusTypeDef HAL_TIM_IC_Start_IT(TIM_HandleTypeDef *htim, uint32_t Channel) {
+  htim->Instance->DIER |= TIM_IT_CC1 << (Channel / 4);
+  if(htim->Instance == &sim_tim14 && !tim14_started) { // the HAL sets CEN here, TIM3 gets it from HAL_TIM_Base_Start
+    tim14_started = 1;
+    tim14_origin = sim_cycles - tim14_stopped_at;
+  }
+  return HAL_OK;
+}
+
+// clears CEN once no channel is left on, only TIM14 is ever stopped
+HAL_StatusTypeDef HAL_TIM_IC_Stop_IT(TIM_HandleTypeDef *htim, uint32_t Channel) {
+  htim->Instance->DIER &= ~(TIM_IT_CC1 << (Channel / 4));
+  if(htim->Instance == &sim_tim14 && tim14_started) {
+    tim14_stopped_at = counter_at(&sim_tim14, sim_cycles);
+    tim14_started = 0;
+  }
+  return HAL_OK;
+}
+
+// only the update part, the captures go through timer_irq
+static void capture_event(uint32_t channel) {
+  uint8_t tim14 = channel == SIM_EDGE_TIM14, slot = edge_slot(channel);
+  TIM_TypeDef *tim = tim14 ? &sim_tim14 : &sim_tim3;
+  uint32_t flag = TIM_FLAG_CC1 << (tim14 ? 0 : channel - 1);
+  __IO uint32_t *ccr = &tim->CCR1 + (tim14 ? 0 : channel - 1);
+
+  if(!tim3_started || (tim14 && !tim14_started) || !(tim->DIER & flag)) {
+    return;
+  }
+  if(tim->SR & flag) { // the last capture wasn't read
+    tim->SR |= flag << 8;
+  }
+  tim->SR |= flag;
+  *ccr = counter_at(tim, sim_cycles);
+
+  edge_history[slot][edge_history_next[slot]] = sim_cycles - tim3_origin;
+  edge_history_next[slot] = (edge_history_next[slot] + 1) % EDGE_HISTORY;
+
+  sim_pend(tim14 ? SIM_IRQ_TIM14 : SIM_IRQ_TIM3);
+}
+
+void sim_edge(uint8_t channel) {
+  sim_schedule(sim_cycles + CAPTURE_SYNC_CYCLES, capture_event, channel);
+}
+
+uint8_t sim_capture_matches(uint8_t channel, uint32_t cycles) {
+  for(uint8_t i = 0; i < EDGE_HISTORY; i++) {
+    if(edge_history[edge_slot(channel)][i] == cycles) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* i2c: the master's bus steps set the slave's ISR flags, and I2C1 is raised for the ones CR1 enables
+ * a step the slave isn't ready for (the address or the last byte not taken yet, nothing to send) stretches the clock until it is
+ * the firmware reads RXDR at every RXNE, the sim can't see a plain register read so the byte counts as read when the irq returns
+ */
+#define I2C_STEP_ADDR_WRITE 0
+#define I2C_STEP_WRITE 1
+#define I2C_STEP_ADDR_READ 2
+#define I2C_STEP_READ 3
+#define I2C_STEP_STOP 4
+#define I2C_STEP_NONE 5
+
+static uint32_t i2c_bit_cycles = SIM_HZ / 100000;
+
+static struct {
+  uint8_t busy;
+  uint8_t addr;
+  const uint8_t *write;
+  uint8_t write_len;
+  uint8_t *read;
+  uint8_t read_len;
+  uint8_t position;
+  uint8_t step;    // the next bus step
+  sim_i2c_done_fn done;
+} master;
+
+void sim_i2c_speed(uint32_t hz) {
+  i2c_bit_cycles = SIM_HZ / hz;
+}
+
+uint8_t sim_i2c_busy() {
+  return master.busy;
+}
+
+static void i2c_update_irq() {
+  uint32_t isr = sim_i2c1.ISR, cr1 = sim_i2c1.CR1;
+
+  if(((isr & I2C_ISR_TXIS) && (cr1 & I2C_CR1_TXIE)) ||
+      ((isr & I2C_ISR_RXNE) && (cr1 & I2C_CR1_RXIE)) ||
+      ((isr & I2C_ISR_ADDR) && (cr1 & I2C_CR1_ADDRIE)) ||
+      ((isr & I2C_ISR_NACKF) && (cr1 & I2C_CR1_NACKIE)) ||
+      ((isr & I2C_ISR_STOPF) && (cr1 & I2C_CR1_STOPIE)) ||
+      ((isr & (I2C_ISR_BERR | I2C_ISR_ARLO | I2C_ISR_OVR)) && (cr1 & I2C_CR1_ERRIE))) {
+    sim_pend(SIM_IRQ_I2C1);
+  }
+}
+
+// a read wants its next byte once the address is cleared and TXDR is empty
+static void i2c_tx_request() {
+  if((sim_i2c1.ISR & I2C_ISR_DIR) && !(sim_i2c1.ISR & I2C_ISR_ADDR) && sim_i2c1.TXDR == I2C_TXDR_EMPTY) {
+    sim_i2c1.ISR |= I2C_ISR_TXIS;
+  }
+}
+
+// the flags the firmware wrote to ICR, picked up before any irq can run and at the i2c irq's return
+static void i2c_clears() {
+  if(sim_i2c1.ICR) {
+    sim_i2c1.ISR &= ~sim_i2c1.ICR;
+    sim_i2c1.ICR = 0;
+    i2c_tx_request();
+  }
+}
+
+/* TXE is clear while a byte is loaded, so the firmware setting it means a flush
+ * unless TXDR was empty when the irq was taken and the byte is one it loaded since
+ */
+static void i2c_irq_return() {
+  if((sim_i2c1.ISR & I2C_ISR_TXE) && i2c_txdr_at_irq != I2C_TXDR_EMPTY && sim_i2c1.TXDR == i2c_txdr_at_irq) {
+    sim_i2c1.TXDR = I2C_TXDR_EMPTY;
+    sim_i2c1.ISR &= ~I2C_ISR_TXIS;
+  }
+  i2c_clears();
+  sim_i2c1.ISR &= ~I2C_ISR_RXNE;
+  if(sim_i2c1.TXDR != I2C_TXDR_EMPTY) {
+    sim_i2c1.ISR &= ~(I2C_ISR_TXE | I2C_ISR_TXIS);
+  }
+  i2c_update_irq();
+}
+
+static void i2c_step_event(uint32_t step);
+
+static void i2c_done_event(uint32_t status) {
+  master.busy = 0;
+  master.done(status);
+}
+
+// start, address and ack
+static void schedule_step(uint8_t step) {
+  sim_schedule(sim_cycles + 9 * i2c_bit_cycles, i2c_step_event, step);
+}
+
+static void i2c_finish(uint8_t status) {
+  master.step = I2C_STEP_NONE;
+  sim_schedule(sim_cycles + i2c_bit_cycles, i2c_done_event, status);
+}
+
+void sim_i2c_transfer(uint8_t addr, const uint8_t *write, uint8_t write_len, uint8_t *read, uint8_t read_len, sim_i2c_done_fn done) {
+  if(master.busy) {
+    fprintf(stderr, "sim: i2c transfer started while one is running\n");
+    exit(1);
+  }
+  master.busy = 1;
+  master.addr = addr;
+  master.write = write;
+  master.write_len = write_len;
+  master.read = read;
+  master.read_len = read_len;
+  master.position = 0;
+  master.done = done;
+  schedule_step(write_len ? I2C_STEP_ADDR_WRITE : I2C_STEP_ADDR_READ);
+}
+
+static void i2c_next_step() {
+  if(master.step == I2C_STEP_ADDR_WRITE || master.step == I2C_STEP_WRITE) {
+    if(master.position < master.write_len) {
+      schedule_step(I2C_STEP_WRITE);
+    } else if(master.read_len) { // repeated start
+      master.position = 0;
+      schedule_step(I2C_STEP_ADDR_READ);
+    } else {
+      schedule_step(I2C_STEP_STOP);
+    }
+  } else {
+    schedule_step(master.position < master.read_len ? I2C_STEP_READ : I2C_STEP_STOP);
+  }
+}
+
+// the byte is held with the clock stretched, try again a bit later
+static void i2c_stretch() {
+  sim_i2c_stretch_cycles += i2c_bit_cycles;
+  sim_schedule(sim_cycles + i2c_bit_cycles, i2c_step_event, master.step);
+}
+
+static uint8_t i2c_addressed() {
+  if(!(sim_i2c1.CR1 & I2C_CR1_PE)) {
+    return 0;
+  }
+  if(master.addr == 0) { // general call, write only
+    return (sim_i2c1.CR1 & I2C_CR1_GCEN) && master.step == I2C_STEP_ADDR_WRITE;
+  }
+  return (sim_i2c1.OAR1 & I2C_OAR1_OA1EN) && master.addr == ((sim_i2c1.OAR1 >> 1) & 0x7f);
+}
+
+static void i2c_step_event(uint32_t step) {
+  master.step = step;
+
+  // the clock is held from the address ack until ADDR is cleared
+  if(sim_i2c1.ISR & I2C_ISR_ADDR) {
+    i2c_stretch();
+    return;
+  }
+
+  switch(master.step) {
+    case I2C_STEP_ADDR_WRITE:
+    case I2C_STEP_ADDR_READ:
+      if(!i2c_addressed()) {
+        i2c_finish(SIM_I2C_NACK);
+        return;
+      }
+      sim_i2c1.ISR &= ~(I2C_ISR_DIR | I2C_ISR_ADDCODE);
+      sim_i2c1.ISR |= I2C_ISR_ADDR | (master.addr << 17) | (master.step == I2C_STEP_ADDR_READ ? I2C_ISR_DIR : 0);
+      break;
+    case I2C_STEP_WRITE:
+      if(sim_i2c1.ISR & I2C_ISR_RXNE) {
+        i2c_stretch();
+        return;
+      }
+      sim_i2c1.RXDR = master.write[master.position++];
+      sim_i2c1.ISR |= I2C_ISR_RXNE;
+      break;
+    case I2C_STEP_READ:
+      if(sim_i2c1.TXDR == I2C_TXDR_EMPTY) {
+        sim_i2c1.ISR |= I2C_ISR_TXIS;
+        i2c_update_irq();
+        i2c_stretch();
+        return;
+      }
+      master.read[master.position++] = sim_i2c1.TXDR;
+      // the next byte is asked for as this one goes out, so one is left loaded after the master nacks the last
+      sim_i2c1.TXDR = I2C_TXDR_EMPTY;
+      sim_i2c1.ISR |= I2C_ISR_TXE | I2C_ISR_TXIS;
+      if(master.position == master.read_len) {
+        sim_i2c1.ISR |= I2C_ISR_NACKF;
+      }
+      break;
+    case I2C_STEP_STOP:
+      sim_i2c1.ISR = (sim_i2c1.ISR & ~(I2C_ISR_DIR | I2C_ISR_TXIS)) | I2C_ISR_STOPF;
+      i2c_update_irq();
+      i2c_finish(SIM_I2C_OK);
+      return;
+    default:
+      return;
+  }
+  i2c_update_irq();
+  i2c_next_step();
+}
+
+// uart tx goes to a file descriptor when the dma transfer completes
+static int uart_fd = -1;
+static const uint8_t *uart_tx_data;
+static uint8_t dma_tx_complete = 0;
+
+void sim_set_uart_output(int fd) {
+  uart_fd = fd;
+}
+
+static void uart_tx_done_event(uint32_t length) {
+  if(uart_fd >= 0 && write(uart_fd, uart_tx_data, length) != (ssize_t)length) {
+    perror("sim: uart output");
+    exit(1);
+  }
+  hdma_usart1_tx.Instance->CNDTR = 0;
+  dma_tx_complete = 1;
+  sim_pend(SIM_IRQ_DMA);
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size) {
+  if(huart->gState != HAL_UART_STATE_READY) {
+    return HAL_BUSY;
+  }
+  huart->gState = HAL_UART_STATE_BUSY_TX;
+  huart->hdmatx->Instance->CNDTR = Size;
+  uart_tx_data = pData;
+  sim_schedule(sim_cycles + Size * UART_BYTE_CYCLES, uart_tx_done_event, Size);
+  return HAL_OK;
+}
+
+// nothing is ever received
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size) {
+  return HAL_OK;
+}
+
+void HAL_UART_IRQHandler(UART_HandleTypeDef *huart) {
+}
+
+// the real hal goes through the uart tc interrupt, the callback is the same
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma) {
+  UART_HandleTypeDef *huart = hdma->Parent;
+
+  if(hdma == huart->hdmatx && dma_tx_complete) {
+    dma_tx_complete = 0;
+    huart->gState = HAL_UART_STATE_READY;
+    HAL_UART_TxCpltCallback(huart);
+  }
+}
+
+// adc: a sequence of three conversions, values from sim_set_adc
+static uint16_t adc_values[3] = {2048, 1750, 1500};
+static uint8_t adc_next;
+static uint8_t adc_running = 0;
+static uint8_t adc_eoc = 0;
+static uint32_t adc_dr;
+
+void sim_set_adc(uint16_t external_temp, uint16_t internal_temp, uint16_t internal_vref) {
+  adc_values[0] = external_temp;
+  adc_values[1] = internal_temp;
+  adc_values[2] = internal_vref;
+}
+
+static void adc_conversion_event(uint32_t arg) {
+  if(!adc_running) {
+    return;
+  }
+  adc_dr = adc_values[adc_next++];
+  adc_eoc = 1;
+  if(adc_next < 3) {
+    sim_schedule(sim_cycles + ADC_CONVERSION_CYCLES, adc_conversion_event, 0);
+  } else {
+    adc_running = 0;
+  }
+  sim_pend(SIM_IRQ_ADC);
+}
+
+HAL_StatusTypeDef HAL_ADCEx_Calibration_Start(ADC_HandleTypeDef *hadc) {
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_Start_IT(ADC_HandleTypeDef *hadc) {
+  if(adc_running) {
+    return HAL_BUSY;
+  }
+  adc_running = 1;
+  adc_next = 0;
+  sim_schedule(sim_cycles + ADC_CONVERSION_CYCLES, adc_conversion_event, 0);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_Stop(ADC_HandleTypeDef *hadc) {
+  adc_running = 0;
+  return HAL_OK;
+}
+
+uint32_t HAL_ADC_GetValue(ADC_HandleTypeDef *hadc) {
+  adc_eoc = 0;
+  return adc_dr;
+}
+
+void HAL_ADC_IRQHandler(ADC_HandleTypeDef *hadc) {
+  if(adc_eoc) {
+    HAL_ADC_ConvCpltCallback(hadc);
+  }
+}
+
+/* flash: mapped at its real address, rwflash is the only part that's erased or programmed
+ * the firmware writes the registers and stores the half-word straight into the mapping, the model catches up on
+ * both at its next FLASH-> access: the unlock keys, an erase started with STRT, and a half-word store found by
+ * comparing the mapping with flash_copy.  the operation runs to the end there, flash_stall has what runs meanwhile
+ */
+// SR is write 1 to clear, this reserved bit is the sim's mark for an SR the firmware hasn't written
+#define FLASH_SR_UNWRITTEN (1UL << 31)
+
+static FLASH_TypeDef sim_flash_registers = {.SR = FLASH_SR_UNWRITTEN, .CR = FLASH_CR_LOCK};
+static uint32_t flash_status = 0; // EOP and the error bits
+static uint8_t flash_key1 = 0;    // KEY1 was the last KEYR write
+static uint8_t flash_copy[FLASH_SIZE]; // the mapping after the last operation
+static const char *flash_file_name; // sim_start's, for a power cut
+static uint32_t flash_operations = 0;
+uint32_t sim_power_cut = 0;
+
+// a torn erase leaves part of the page erased, a torn program leaves the cell as it was
+static uint8_t power_cut() {
+  return sim_power_cut != 0 && ++flash_operations == sim_power_cut;
+}
+
+// rwflash goes to the flash file the way the power cut left it, the next run starts from it like after a reset
+static void power_fail() {
+  printf("power cut at flash operation %u\n", flash_operations);
+  sim_stop(flash_file_name);
+  exit(0);
+}
+
+// until the flash operation is done, the peripherals carry on and their irqs stay pending
+static void stall_core() {
+  core_stalled = 1;
+  sim_advance(flash_busy_until - sim_cycles);
+  core_stalled = 0;
+}
+
+/* started from ram, the code waits on BSY there and the RAMFUNC irqs preempt it
+ * started from flash, the next fetch stalls the core for the whole operation
+ */
+static void flash_stall(uint32_t cycles, const void *started_by) {
+  flash_busy_until = sim_cycles + cycles;
+  if(in_ram(started_by)) {
+    sim_advance(cycles);
+  } else {
+    stall_core();
+  }
+  flash_busy_until = 0;
+  take_irqs();
+}
+
+static uint8_t in_rwflash(uint32_t address, uint32_t length) {
+  return address >= (uintptr_t)start_rwflash && address + length <= (uintptr_t)end_rwflash;
+}
+
+static void flash_fault(const char *what) {
+  fprintf(stderr, "sim: %s\n", what);
+  exit(1);
+}
+
+// the page AR is in
+static void flash_erase(uint32_t address, const void *started_by) {
+  uint8_t *page = (uint8_t *)(uintptr_t)(address & ~(FLASH_PAGE_SIZE - 1));
+
+  if(!in_rwflash((uintptr_t)page, FLASH_PAGE_SIZE)) {
+    flash_fault("flash erase outside rwflash");
+  }
+  if(power_cut()) {
+    memset(page, 0xff, FLASH_PAGE_SIZE / 2);
+    power_fail();
+  }
+  flash_stall(FLASH_ERASE_CYCLES, started_by);
+  memset(page, 0xff, FLASH_PAGE_SIZE);
+  flash_status |= FLASH_SR_EOP;
+}
+
+// programming a half-word that isn't erased is a PGERR, the cell keeps its value
+static void flash_program(uint32_t offset, const void *started_by) {
+  uint16_t *cell = (uint16_t *)(uintptr_t)(FLASH_BASE + offset);
+  uint16_t data = *cell, erased;
+
+  memcpy(&erased, &flash_copy[offset], sizeof(erased));
+  *cell = erased;
+  if(sim_flash_registers.CR != FLASH_CR_PG) {
+    flash_fault("flash store without PG");
+  }
+  if(!in_rwflash(FLASH_BASE + offset, 2)) {
+    flash_fault("flash program outside rwflash");
+  }
+  if(power_cut()) {
+    power_fail();
+  }
+  flash_stall(FLASH_PROGRAM_CYCLES, started_by);
+  if(erased != 0xffff) {
+    flash_status |= FLASH_SR_PGERR;
+    return;
+  }
+  *cell = data;
+  flash_status |= FLASH_SR_EOP;
+}
+
+FLASH_TypeDef *sim_flash() {
+  FLASH_TypeDef *registers = &sim_flash_registers;
+  const void *caller = __builtin_return_address(0);
+  const uint8_t *mapped = (const uint8_t *)FLASH_BASE;
+
+  if(registers->KEYR == FLASH_KEY1 && !flash_key1) {
+    flash_key1 = 1;
+  } else if(registers->KEYR == FLASH_KEY2 && flash_key1) {
+    flash_key1 = 0;
+    registers->CR &= ~FLASH_CR_LOCK;
+  } else if(registers->KEYR != 0) {
+    flash_fault("wrong flash key sequence, the flash interface is locked until a reset");
+  }
+  registers->KEYR = 0;
+
+  if(!(registers->SR & FLASH_SR_UNWRITTEN)) {
+    flash_status &= ~registers->SR;
+  }
+
+  // LOCK can only be set, and the rest of CR can't be written while it is
+  if(registers->CR & FLASH_CR_LOCK) {
+    registers->CR = FLASH_CR_LOCK;
+  }
+  for(uint32_t offset = 0; offset < FLASH_SIZE; offset += 2) {
+    if(memcmp(&mapped[offset], &flash_copy[offset], 2) != 0) {
+      flash_program(offset, caller);
+      break;
+    }
+  }
+  if(registers->CR == (FLASH_CR_PER | FLASH_CR_STRT)) {
+    registers->CR = FLASH_CR_PER;
+    flash_erase(registers->AR, caller);
+  }
+  memcpy(flash_copy, mapped, FLASH_SIZE);
+
+  registers->SR = flash_status | FLASH_SR_UNWRITTEN;
+  sim_advance(REG_READ_CYCLES);
+  return registers;
+}
+
+static void *map_fixed(uintptr_t address, size_t length) {
+  void *mapped = mmap((void *)address, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+  if(mapped != (void *)address) {
+    fprintf(stderr, "sim: can't map %#lx, build with -no-pie\n", (unsigned long)address);
+    exit(1);
+  }
+  return mapped;
+}
+
+// flash and the system memory calibration values at their real addresses, then start SysTick
+void sim_start(const char *flash_file) {
+  uint8_t *system_memory = map_fixed(SYSTEM_MEMORY, SYSTEM_MEMORY_SIZE);
+  uint16_t ts_cal1 = 1750, ts_cal2 = 1320, vrefint_cal = 1530;
+
+  flash_file_name = flash_file;
+  map_fixed(FLASH_BASE, FLASH_SIZE);
+  memset((void *)(uintptr_t)start_rwflash, 0xff, end_rwflash - start_rwflash);
+  if(flash_file != NULL) {
+    int fd = open(flash_file, O_RDONLY);
+
+    if(fd >= 0) {
+      if(read(fd, (void *)(uintptr_t)start_rwflash, end_rwflash - start_rwflash) < 0) {
+        perror("sim: read flash file");
+        exit(1);
+      }
+      close(fd);
+    }
+  }
+
+  memcpy(flash_copy, (const void *)FLASH_BASE, FLASH_SIZE);
+
+  memcpy(system_memory + 0x7b8, &ts_cal1, sizeof(ts_cal1));
+  memcpy(system_memory + 0x7ba, &vrefint_cal, sizeof(vrefint_cal));
+  memcpy(system_memory + 0x7c2, &ts_cal2, sizeof(ts_cal2));
+
+  sim_schedule(SYSTICK_CYCLES, systick_event, 0);
+}
+
+// keep rwflash for the next run
+void sim_stop(const char *flash_file) {
+  int fd;
+
+  if(flash_file == NULL) {
+    return;
+  }
+  fd = open(flash_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    perror("sim: open flash file");
+    exit(1);
+  }
+  if(write(fd, start_rwflash, end_rwflash - start_rwflash) < 0) {
+    perror("sim: write flash file");
+    exit(1);
+  }
+  close(fd);
+}
+
+// newlib has these, glibc doesn't
+char *utoa(unsigned value, char *str, int base) {
+  char digits[33];
+  uint8_t length = 0;
+
+  do {
+    digits[length++] = "0123456789abcdefghijklmnopqrstuvwxyz"[value % base];
+    value /= base;
+  } while(value);
+  for(uint8_t i = 0; i < length; i++) {
+    str[i] = digits[length - 1 - i];
+  }
+  str[length] = '\0';
+  return str;
+}
+
+char *itoa(int value, char *str, int base) {
+  if(value < 0 && base == 10) {
+    str[0] = '-';
+    utoa(-(unsigned)value, str + 1, base);
+    return str;
+  }
+  return utoa(value, str, base);
+}
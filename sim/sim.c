@@ -0,0 +1,605 @@
+#define _GNU_SOURCE // posix_openpt and ptsname for --stream-pty
+#include "stm32f0xx_hal.h"
+#include "main.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+
+#include "sim.h"
+#include "timer.h"
+#include "i2c_slave.h"
+#include "flash.h"
+#include "stats.h"
+#include "uart.h"
+#include "events.h"
+#include "crc8.h"
+#include "warm.h"
+#include "uart_stream_format.h"
+
+// runs the firmware's main loop against the models in hal.c, with scripted input edges and an i2c master
+
+// a main loop pass that finds nothing to do
+#define MAIN_PASS_CYCLES 200
+
+struct source {
+  uint8_t channel; // TIM3 channel or SIM_EDGE_TIM14
+  double hz;
+  double next;     // cycles
+  uint32_t edges;
+  uint32_t captures; // checked, the source's index is its capture channel
+};
+
+static struct source sources[] = {
+  {1, 50.0},
+  {2, 1.0},
+  {4, 1.0},
+  {SIM_EDGE_TIM14, 0},
+};
+#define SOURCES (sizeof(sources) / sizeof(sources[0]))
+_Static_assert(SOURCES == I2C_CAPTURE_CHANNELS, "a source per capture channel");
+
+static double ppm = 0;
+static uint32_t jitter = 0; // +/- cycles on every edge
+static uint8_t quiet = 0;
+
+// edges from --edges, one "<microseconds> <channel>" per line
+static FILE *edges_file = NULL;
+static uint32_t file_edges = 0;
+
+static uint32_t capture_errors = 0;
+static uint32_t captures_checked = 0;
+static uint32_t checked_count = 0; // captures page capture_count already checked
+static uint32_t crc_errors = 0;
+static uint32_t i2c_nacks = 0;
+static uint32_t pages_read = 0;
+static uint32_t ms_errors = 0;
+static uint8_t flash_records_at_start = 0; // bit per record index, what flash_start found in the log
+
+static double edge_jitter() {
+  if(jitter == 0) {
+    return 0;
+  }
+  return (double)(rand() % (2 * jitter + 1)) - jitter;
+}
+
+static void source_edge(uint32_t index) {
+  struct source *s = &sources[index];
+
+  sim_edge(s->channel);
+  s->edges++;
+  s->next += SIM_HZ / s->hz * (1.0 - ppm / 1000000.0);
+  sim_schedule(s->next + edge_jitter(), source_edge, index);
+}
+
+static void file_edge(uint32_t channel);
+
+static void next_file_edge() {
+  double us;
+  unsigned channel;
+
+  if(fscanf(edges_file, "%lf %u", &us, &channel) != 2) {
+    return;
+  }
+  if((channel < 1 || channel > 4) && channel != SIM_EDGE_TIM14) {
+    fprintf(stderr, "edges: bad channel %u\n", channel);
+    exit(1);
+  }
+  sim_schedule(us * (SIM_HZ / 1000000.0), file_edge, channel);
+}
+
+static void file_edge(uint32_t channel) {
+  sim_edge(channel);
+  file_edges++;
+  next_file_edge();
+}
+
+// every capture the irq adds has to reconstruct to the cycle it was captured at, same math as the clients
+static void check_captures(enum sim_irq irq) {
+  static const uint8_t edge_channels[I2C_CAPTURE_CHANNELS] = {1, 2, 4, SIM_EDGE_TIM14};
+  uint32_t count = i2c_registers_captures.capture_count;
+
+  if(irq != SIM_IRQ_TIM3 && irq != SIM_IRQ_TIM14) {
+    return;
+  }
+  if(count - checked_count > I2C_CAPTURE_BATCH) {
+    checked_count = count - I2C_CAPTURE_BATCH;
+  }
+  while(checked_count != count) {
+    const struct i2c_capture *capture = &i2c_registers_captures.captures[checked_count % I2C_CAPTURE_BATCH];
+    uint32_t cycles = ((uint32_t)capture->tim1_at_irq) << 16 | capture->tim3_at_cap;
+
+    checked_count++;
+    if(capture->tim3_at_cap > capture->tim3_at_irq) {
+      cycles -= 65536;
+    }
+    captures_checked++;
+    if(capture->channel >= I2C_CAPTURE_CHANNELS || !sim_capture_matches(edge_channels[capture->channel], cycles)) {
+      capture_errors++;
+      printf("%.6f capture %u ch%u reconstructed as %u, tim1=%u tim3 cap=%u irq=%u\n", sim_cycles / (double)SIM_HZ,
+          checked_count, capture->channel + 1, cycles, capture->tim1_at_irq, capture->tim3_at_cap, capture->tim3_at_irq);
+    } else {
+      sources[capture->channel].captures++;
+    }
+  }
+}
+
+/* the host side: a queue of i2c operations run one at a time, like a client on the pi */
+#define OP_WRITE 0
+#define OP_READ_PAGE 1
+#define OP_LATCH 2
+#define OP_SET_ADDR 3 // poll the info page until the address is saved, the ops after it go to value
+#define HOST_OPS 16
+
+struct host_op {
+  uint8_t type;
+  uint8_t page;  // OP_READ_PAGE
+  uint8_t reg;   // OP_WRITE
+  uint8_t value; // OP_WRITE, OP_SET_ADDR
+};
+
+static struct host_op ops[HOST_OPS];
+static uint8_t ops_head = 0, ops_tail = 0;
+static uint8_t write_buffer[2];
+static uint8_t read_buffer[I2C_REGISTER_PAGE_SIZE_MAX + sizeof(struct i2c_page_trailer)];
+static uint8_t host_addr = SIM_I2C_OWN_ADDRESS;
+
+static const uint8_t page_sizes[I2C_REGISTER_PAGES] = {
+#define PAGE_SIZE(page, type, fields, size) [page] = sizeof(struct type),
+  I2C_PAGES(PAGE_SIZE)
+#undef PAGE_SIZE
+};
+
+static void host_start();
+
+static void print_page(uint8_t page, const uint8_t *read_buffer) {
+  const struct i2c_page_trailer *trailer = (const struct i2c_page_trailer *)(read_buffer + page_sizes[page]);
+  double now = sim_cycles / (double)SIM_HZ;
+
+  pages_read++;
+  if(trailer->page != page || trailer->length != page_sizes[page] || crc8(0, read_buffer, page_sizes[page] + sizeof(*trailer) - 1) != trailer->crc8) {
+    crc_errors++;
+    printf("%.6f page %u bad trailer\n", now, page);
+    return;
+  }
+  if(page == I2C_REGISTER_PAGE1) {
+    const struct i2c_registers_type *p = (const struct i2c_registers_type *)read_buffer;
+    uint32_t count = ((uint32_t)p->tim1_at_irq[0] << 16) | p->tim3_at_irq[0];
+
+    // the ms fields are the extended TIM1:TIM3 count / 48000, so ms_irq is within a ms of the count it came with
+    if((uint32_t)(count - p->milliseconds_irq_ch1 * (SIM_HZ / 1000)) >= SIM_HZ / 1000 ||
+        (int32_t)(p->milliseconds_now - p->milliseconds_irq_ch1) < 0) {
+      ms_errors++;
+      printf("%.6f page1 ms=%u ms_irq=%u don't match ch1 %u:%u\n", now,
+          p->milliseconds_now, p->milliseconds_irq_ch1, p->tim1_at_irq[0], p->tim3_at_irq[0]);
+    }
+  }
+  if(quiet) {
+    return;
+  }
+
+  if(page == I2C_REGISTER_PAGE1) {
+    const struct i2c_registers_type *p = (const struct i2c_registers_type *)read_buffer;
+
+    printf("%.6f page1 ms=%u ms_irq=%u ch1 %u:%u@%u ch2 %u:%u@%u ch4 %u:%u@%u counts %u %u\n", now,
+        p->milliseconds_now, p->milliseconds_irq_ch1,
+        p->tim1_at_irq[0], p->tim3_at_cap[0], p->tim3_at_irq[0],
+        p->tim1_at_irq[1], p->tim3_at_cap[1], p->tim3_at_irq[1],
+        p->tim1_at_irq[2], p->tim3_at_cap[2], p->tim3_at_irq[2],
+        p->ch2_count, p->ch4_count);
+  } else {
+    printf("%.6f page %u", now, page);
+    for(uint8_t i = 0; i < page_sizes[page]; i++) {
+      printf(" %02x", read_buffer[i]);
+    }
+    printf("\n");
+  }
+}
+
+static void host_retry_event(uint32_t arg) {
+  host_start();
+}
+
+static void host_done(uint8_t status) {
+  const struct host_op *op = &ops[ops_tail];
+  const struct i2c_registers_type_info *info = (const struct i2c_registers_type_info *)read_buffer;
+
+  if(op->type == OP_SET_ADDR) {
+    // a nack means the board has already moved
+    if(status == SIM_I2C_OK && info->i2c_address_status == I2C_ADDRESS_STATUS_BUSY) {
+      sim_schedule(sim_cycles + SIM_HZ / 1000, host_retry_event, 0);
+      return;
+    }
+    host_addr = op->value;
+  } else if(status != SIM_I2C_OK) {
+    i2c_nacks++;
+    printf("%.6f i2c nack\n", sim_cycles / (double)SIM_HZ);
+  } else if(op->type == OP_READ_PAGE) {
+    print_page(op->page, read_buffer);
+  }
+
+  ops_tail = (ops_tail + 1) % HOST_OPS;
+  host_start();
+}
+
+static void host_start() {
+  const struct host_op *op = &ops[ops_tail];
+
+  if(ops_tail == ops_head || sim_i2c_busy()) {
+    return;
+  }
+
+  switch(op->type) {
+    case OP_WRITE:
+      write_buffer[0] = op->reg;
+      write_buffer[1] = op->value;
+      sim_i2c_transfer(host_addr, write_buffer, 2, NULL, 0, host_done);
+      break;
+    case OP_READ_PAGE: // page select and read with a repeated start, like read_i2c_page
+      write_buffer[0] = I2C_REGISTER_OFFSET_PAGE;
+      write_buffer[1] = op->page;
+      sim_i2c_transfer(host_addr, write_buffer, 2, read_buffer, page_sizes[op->page] + sizeof(struct i2c_page_trailer), host_done);
+      break;
+    case OP_LATCH:
+      write_buffer[0] = I2C_GENERAL_CALL_LATCH;
+      sim_i2c_transfer(0, write_buffer, 1, NULL, 0, host_done);
+      break;
+    case OP_SET_ADDR: // like set-i2c-address, the board stays on the old address until the config record is written
+      write_buffer[0] = I2C_REGISTER_OFFSET_PAGE;
+      write_buffer[1] = I2C_REGISTER_PAGE_INFO;
+      sim_i2c_transfer(host_addr, write_buffer, 2, read_buffer, page_sizes[I2C_REGISTER_PAGE_INFO] + sizeof(struct i2c_page_trailer), host_done);
+      break;
+  }
+}
+
+static void host_push(uint8_t type, uint8_t page, uint8_t reg, uint8_t value) {
+  uint8_t next = (ops_head + 1) % HOST_OPS;
+
+  if(next == ops_tail) {
+    printf("%.6f host queue full, i2c is falling behind\n", sim_cycles / (double)SIM_HZ);
+    return;
+  }
+  ops[ops_head].type = type;
+  ops[ops_head].page = page;
+  ops[ops_head].reg = reg;
+  ops[ops_head].value = value;
+  ops_head = next;
+  host_start();
+}
+
+static uint64_t poll_cycles = 0, latch_cycles = 0;
+static int poll_page = I2C_REGISTER_PAGE1;
+
+static void poll_event(uint32_t arg) {
+  host_push(OP_READ_PAGE, poll_page, 0, 0);
+  sim_schedule(sim_cycles + poll_cycles, poll_event, 0);
+}
+
+static void latch_event(uint32_t arg) {
+  host_push(OP_LATCH, 0, 0, 0);
+  host_push(OP_READ_PAGE, I2C_REGISTER_PAGE_LATCH, 0, 0);
+  sim_schedule(sim_cycles + latch_cycles, latch_event, 0);
+}
+
+// page3's save action, same as set-calibration-data after it has written the values
+static void save_event(uint32_t arg) {
+  host_push(OP_WRITE, 0, I2C_REGISTER_OFFSET_PAGE, I2C_REGISTER_PAGE3);
+  host_push(OP_WRITE, 0, offsetof(struct i2c_registers_type_page3, save), 1);
+}
+
+static void stream_event(uint32_t arg) {
+  host_push(OP_WRITE, 0, I2C_REGISTER_OFFSET_PAGE, I2C_REGISTER_PAGE_INFO);
+  host_push(OP_WRITE, 0, offsetof(struct i2c_registers_type_info, uart_stream), UART_STREAM_ON);
+}
+
+// stage and commit a new address, the board switches once it's saved to flash
+static void address_event(uint32_t address) {
+  host_push(OP_WRITE, 0, I2C_REGISTER_OFFSET_PAGE, I2C_REGISTER_PAGE_INFO);
+  host_push(OP_WRITE, 0, offsetof(struct i2c_registers_type_info, new_i2c_address), address);
+  host_push(OP_WRITE, 0, offsetof(struct i2c_registers_type_info, i2c_address_commit), ~address);
+  host_push(OP_SET_ADDR, 0, 0, address);
+}
+
+// the host turns the PA4 input on, its captures only start at the next tick
+static void tim14_event(uint32_t arg) {
+  host_push(OP_WRITE, 0, I2C_REGISTER_OFFSET_PAGE, I2C_REGISTER_PAGE_INFO);
+  host_push(OP_WRITE, 0, offsetof(struct i2c_registers_type_info, extra_inputs), I2C_EXTRA_INPUT_TIM14);
+}
+
+/* --stream-pty: the uart goes out a pty, so a reader on the other side (clients/uart-stream) takes its tty path
+ * the run starts once the reader has the pty open, and the pty only goes away once it has read everything
+ */
+#define PTY_WAIT_MS 10000
+
+static int open_stream_pty(const char *link) {
+  struct pollfd fd = {.events = POLLOUT};
+  struct termios tio;
+
+  fd.fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if(fd.fd < 0 || grantpt(fd.fd) < 0 || unlockpt(fd.fd) < 0) {
+    perror("posix_openpt");
+    exit(1);
+  }
+  // the master only reports a hangup once the other side has been opened and closed
+  close(open(ptsname(fd.fd), O_RDWR | O_NOCTTY));
+  unlink(link);
+  if(symlink(ptsname(fd.fd), link) < 0) {
+    perror("symlink");
+    exit(1);
+  }
+
+  // until the reader has it open and in raw mode, uart-stream flushes stale input before that
+  for(uint32_t waited_ms = 0; (poll(&fd, 1, 0) == 1 && (fd.revents & POLLHUP)) || (tcgetattr(fd.fd, &tio) == 0 && (tio.c_lflag & ICANON)); waited_ms += 10) {
+    if(waited_ms >= PTY_WAIT_MS) {
+      fprintf(stderr, "sim: nothing opened %s\n", link);
+      exit(1);
+    }
+    usleep(10000);
+  }
+  return fd.fd;
+}
+
+static void close_stream_pty(int fd, const char *link) {
+  int reader = open(ptsname(fd), O_RDWR | O_NOCTTY);
+  int unread;
+
+  for(uint32_t waited_ms = 0; waited_ms < PTY_WAIT_MS && ioctl(reader, FIONREAD, &unread) == 0 && unread > 0; waited_ms += 10) {
+    usleep(10000);
+  }
+  close(reader);
+  close(fd);
+  unlink(link);
+}
+
+static void report(double seconds) {
+  static const char *irq_names[SIM_IRQS] = {"SysTick", "TIM3", "TIM14", "I2C1", "TIM1", "DMA1_Ch2_3", "ADC", "USART1"};
+
+  printf("simulated %.3f s, %llu cycles\n", seconds, (unsigned long long)sim_cycles);
+  for(uint8_t i = 0; i < SOURCES; i++) {
+    printf("ch%u %.3f Hz: %u edges, %u captures checked\n", sources[i].channel, sources[i].hz, sources[i].edges, sources[i].captures);
+  }
+  if(edges_file != NULL) {
+    printf("edges file: %u edges\n", file_edges);
+  }
+  printf("captures %u checked %u wrong %u, missed edges %u, data ready toggles %u\n",
+      i2c_registers_captures.capture_count, captures_checked, capture_errors, timer_missed_edges, sim_data_ready_toggles);
+  printf("i2c pages read %u bad %u, ms mismatches %u, nacks %u, clock stretched %.1f us\n",
+      pages_read, crc_errors, ms_errors, i2c_nacks, sim_i2c_stretch_cycles * 1000000.0 / SIM_HZ);
+  printf("uart tx dropped %u, save status %u\n", uart_tx_dropped, i2c_registers_page3.save_status);
+  printf("flash records loaded at start %x, i2c address 0x%02x\n", flash_records_at_start, i2c_registers_info.i2c_address);
+  printf("%-10s %8s %12s %12s %8s\n", "irq", "count", "max latency", "avg latency", "deferred");
+  for(uint8_t i = 0; i < SIM_IRQS; i++) {
+    const struct sim_irq_stats *s = &sim_irq_stats[i];
+
+    printf("%-10s %8u %12u %12.1f %8u\n", irq_names[i], s->count, s->max_latency,
+        s->count ? s->total_latency / (double)s->count : 0.0, s->deferred);
+  }
+}
+
+// the .noinit snapshot, as if the run before this one ended in a watchdog reset
+static void load_warm(const char *warm_file) {
+  FILE *f = fopen(warm_file, "rb");
+
+  if(f == NULL) { // first run, a cold boot
+    warm_start(I2C_RESET_POWER);
+    return;
+  }
+  if(fread(&warm_state, sizeof(warm_state), 1, f) != 1) {
+    memset(&warm_state, '\0', sizeof(warm_state));
+  }
+  fclose(f);
+  warm_start(I2C_RESET_IWDG);
+}
+
+static void save_warm(const char *warm_file) {
+  FILE *f = fopen(warm_file, "wb");
+
+  if(f == NULL || fwrite(&warm_state, sizeof(warm_state), 1, f) != 1) {
+    perror("warm file");
+    exit(1);
+  }
+  fclose(f);
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [options]\n"
+      "  --seconds S      simulated run time (10)\n"
+      "  --ch1 HZ         channel 1 edge rate (50), 0 is off\n"
+      "  --ch2 HZ         channel 2 edge rate (1)\n"
+      "  --ch4 HZ         channel 4 edge rate (1)\n"
+      "  --tim14 HZ       PA4 edge rate (0), turns the TIM14 input on over i2c\n"
+      "  --ppm PPM        input frequency error against the 48MHz clock\n"
+      "  --jitter CYCLES  +/- random cycles on every edge\n"
+      "  --seed N         jitter random seed\n"
+      "  --edges FILE     extra edges, \"<microseconds> <channel>\" per line in time order, channel 14 is PA4\n"
+      "  --poll MS        read a page every MS (1000), 0 is off\n"
+      "  --page N         page to poll (0 = page1)\n"
+      "  --latch MS       general call latch and latch page read every MS\n"
+      "  --save S         page3 save at S seconds\n"
+      "  --stream FILE    turn the uart stream on, the uart output goes to FILE\n"
+      "  --stream-pty LINK  the same out a pty linked at LINK, the run waits for a reader to open it\n"
+      "  --flash FILE     rwflash contents, loaded at start and written at the end\n"
+      "  --power-cut N    the power fails on the Nth flash erase or program, --flash keeps what it left\n"
+      "  --warm FILE      warm restart state, loaded at start as after a watchdog reset and written at the end\n"
+      "  --adc E,T,V      external temp, internal temp and vref adc values\n"
+      "  --i2c-hz HZ      i2c clock (100000)\n"
+      "  --i2c-addr ADDR  move the board to this address over i2c at the start, saved with --flash\n"
+      "  --quiet          only the summary\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  static const struct option options[] = {
+    {"seconds", required_argument, NULL, 's'},
+    {"ch1", required_argument, NULL, '1'},
+    {"ch2", required_argument, NULL, '2'},
+    {"ch4", required_argument, NULL, '4'},
+    {"tim14", required_argument, NULL, 't'},
+    {"ppm", required_argument, NULL, 'p'},
+    {"jitter", required_argument, NULL, 'j'},
+    {"seed", required_argument, NULL, 'r'},
+    {"edges", required_argument, NULL, 'e'},
+    {"poll", required_argument, NULL, 'P'},
+    {"page", required_argument, NULL, 'g'},
+    {"latch", required_argument, NULL, 'l'},
+    {"save", required_argument, NULL, 'S'},
+    {"stream", required_argument, NULL, 'u'},
+    {"stream-pty", required_argument, NULL, 'T'},
+    {"flash", required_argument, NULL, 'f'},
+    {"power-cut", required_argument, NULL, 'c'},
+    {"warm", required_argument, NULL, 'w'},
+    {"adc", required_argument, NULL, 'a'},
+    {"i2c-hz", required_argument, NULL, 'i'},
+    {"i2c-addr", required_argument, NULL, 'A'},
+    {"quiet", no_argument, NULL, 'q'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  double seconds = 10, save_s = -1, poll_ms = 1000, latch_ms = 0;
+  const char *flash_file = NULL, *stream_file = NULL, *stream_link = NULL, *warm_file = NULL;
+  unsigned adc_e, adc_t, adc_v, i2c_addr = 0;
+  uint64_t end;
+  uint8_t flash_queued, silent_inputs = 0;
+  int opt, stream_pty = -1;
+
+  while((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch(opt) {
+      case 's': seconds = atof(optarg); break;
+      case '1': sources[0].hz = atof(optarg); break;
+      case '2': sources[1].hz = atof(optarg); break;
+      case '4': sources[2].hz = atof(optarg); break;
+      case 't': sources[3].hz = atof(optarg); break;
+      case 'p': ppm = atof(optarg); break;
+      case 'j': jitter = strtoul(optarg, NULL, 0); break;
+      case 'r': srand(strtoul(optarg, NULL, 0)); break;
+      case 'e':
+        edges_file = fopen(optarg, "r");
+        if(edges_file == NULL) {
+          perror("fopen");
+          exit(1);
+        }
+        break;
+      case 'P': poll_ms = atof(optarg); break;
+      case 'g': poll_page = strtoul(optarg, NULL, 0) % I2C_REGISTER_PAGES; break;
+      case 'l': latch_ms = atof(optarg); break;
+      case 'S': save_s = atof(optarg); break;
+      case 'u': stream_file = optarg; break;
+      case 'T': stream_link = optarg; break;
+      case 'f': flash_file = optarg; break;
+      case 'c': sim_power_cut = strtoul(optarg, NULL, 0); break;
+      case 'w': warm_file = optarg; break;
+      case 'a':
+        if(sscanf(optarg, "%u,%u,%u", &adc_e, &adc_t, &adc_v) != 3) {
+          usage(argv[0]);
+        }
+        sim_set_adc(adc_e, adc_t, adc_v);
+        break;
+      case 'i': sim_i2c_speed(strtoul(optarg, NULL, 0)); break;
+      case 'A': i2c_addr = strtoul(optarg, NULL, 0); break;
+      case 'q': quiet = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if(stream_file != NULL) {
+    int fd = open(stream_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if(fd < 0) {
+      perror("open");
+      exit(1);
+    }
+    sim_set_uart_output(fd);
+  }
+  if(stream_link != NULL) {
+    stream_pty = open_stream_pty(stream_link);
+    sim_set_uart_output(stream_pty);
+  }
+
+  sim_start(flash_file);
+  sim_irq_hook = check_captures;
+
+  // the same order as main()
+  if(warm_file != NULL) {
+    load_warm(warm_file);
+  } else {
+    warm_start(I2C_RESET_POWER);
+  }
+  timer_start();
+  checked_count = i2c_registers_captures.capture_count;
+  flash_start();
+  for(uint8_t i = 0; i < FLASH_RECORDS; i++) {
+    flash_records_at_start |= flash_loaded(i) << i;
+  }
+  i2c_slave_start();
+  stats_start();
+  host_addr = i2c_registers_info.i2c_address; // the host already knows where it moved the board last run
+
+  for(uint8_t i = 0; i < SOURCES; i++) {
+    if(sources[i].hz > 0) {
+      // different phases, and off the SysTick grid
+      sources[i].next = sim_cycles + SIM_HZ / sources[i].hz / (i + 2) + 1009 * (i + 1);
+      sim_schedule(sources[i].next, source_edge, i);
+    }
+  }
+  if(edges_file != NULL) {
+    next_file_edge();
+  }
+  if(poll_ms > 0) {
+    poll_cycles = poll_ms * (SIM_HZ / 1000);
+    sim_schedule(sim_cycles + poll_cycles, poll_event, 0);
+  }
+  if(latch_ms > 0) {
+    latch_cycles = latch_ms * (SIM_HZ / 1000);
+    sim_schedule(sim_cycles + latch_cycles, latch_event, 0);
+  }
+  if(save_s >= 0) {
+    sim_schedule(save_s * SIM_HZ, save_event, 0);
+  }
+  if(stream_file != NULL || stream_link != NULL) {
+    sim_schedule(sim_cycles, stream_event, 0);
+  }
+  if(i2c_addr != 0 && i2c_addr != host_addr) {
+    sim_schedule(sim_cycles, address_event, i2c_addr);
+  }
+  if(sources[3].hz > 0) {
+    sim_schedule(sim_cycles, tim14_event, 0);
+  }
+
+  end = seconds * SIM_HZ;
+  while(sim_cycles < end) {
+    event_dispatch();
+    sim_advance(MAIN_PASS_CYCLES);
+    event_wait();
+  }
+
+  sim_stop(flash_file);
+  if(warm_file != NULL) {
+    save_warm(warm_file);
+  }
+  if(stream_pty >= 0) {
+    close_stream_pty(stream_pty, stream_link);
+  }
+  report(seconds);
+
+  // every queued record should have been written by now, a save queues several at once
+  flash_queued = flash_poll();
+  if(flash_queued) {
+    printf("flash records still queued at the end\n");
+  }
+
+  // an input that got edges and never captured one is off or lost its interrupt, channel 1 keeps every source_HZ_ch1th edge
+  for(uint8_t i = 0; i < SOURCES; i++) {
+    if(sources[i].edges >= (i == 0 ? i2c_registers.source_HZ_ch1 : 1) && sources[i].captures == 0) {
+      printf("ch%u: %u edges and no captures\n", sources[i].channel, sources[i].edges);
+      silent_inputs++;
+    }
+  }
+
+  return (capture_errors || crc_errors || ms_errors || flash_queued || silent_inputs) ? 1 : 0;
+}
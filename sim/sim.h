@@ -0,0 +1,70 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+// between the peripheral models in hal.c and the test driver in sim.c
+
+#define SIM_HZ 48000000
+
+// interrupts in NVIC order: priority, then exception number
+enum sim_irq {
+  SIM_IRQ_SYSTICK, // priority 3
+  SIM_IRQ_TIM3,    // priority 0
+  SIM_IRQ_TIM14,   // priority 0
+  SIM_IRQ_I2C1,    // priority 2
+  SIM_IRQ_TIM1,    // priority 2
+  SIM_IRQ_DMA,     // priority 3
+  SIM_IRQ_ADC,     // priority 3
+  SIM_IRQ_USART1,  // priority 3
+  SIM_IRQS
+};
+
+struct sim_irq_stats {
+  uint32_t count;
+  uint32_t max_latency;    // cycles from pending to the handler starting
+  uint64_t total_latency;
+  uint32_t deferred;       // times it waited for a flash operation, masked in the nvic or stalled on a fetch from flash
+};
+
+extern uint64_t sim_cycles;
+extern struct sim_irq_stats sim_irq_stats[SIM_IRQS];
+extern uint32_t sim_data_ready_toggles;
+extern uint32_t sim_i2c_stretch_cycles;
+
+// cycles an assumed handler body takes, on top of the register reads that advance time themselves
+extern uint32_t sim_irq_body_cycles[SIM_IRQS];
+
+typedef void (*sim_event_fn)(uint32_t arg);
+
+void sim_start(const char *flash_file);
+void sim_stop(const char *flash_file);
+// the power fails on this flash erase or program (counting from 1), the run ends there, 0 is never
+extern uint32_t sim_power_cut;
+void sim_schedule(uint64_t at, sim_event_fn fn, uint32_t arg);
+void sim_pend(enum sim_irq irq);
+void sim_advance(uint32_t cycles);
+uint64_t sim_next_event();
+
+// called after every interrupt handler returns
+extern void (*sim_irq_hook)(enum sim_irq irq);
+
+// input capture edge on TIM3 channel 1-4, or SIM_EDGE_TIM14 for TIM14 channel 1
+#define SIM_EDGE_TIM14 14
+void sim_edge(uint8_t channel);
+// 1 if cycles (tim1 << 16 | ccr) is when one of the channel's recent edges was captured
+uint8_t sim_capture_matches(uint8_t channel, uint32_t cycles);
+
+void sim_set_adc(uint16_t external_temp, uint16_t internal_temp, uint16_t internal_vref);
+void sim_set_uart_output(int fd);
+
+// in-process i2c master, the transfer runs on the sim clock and calls done() after the stop
+#define SIM_I2C_OWN_ADDRESS 0x04 // before i2c_slave_start, MX_I2C1_Init's OwnAddress1 is the 8 bit form
+#define SIM_I2C_OK 0
+#define SIM_I2C_NACK 1
+typedef void (*sim_i2c_done_fn)(uint8_t status);
+void sim_i2c_speed(uint32_t hz);
+uint8_t sim_i2c_busy();
+void sim_i2c_transfer(uint8_t addr, const uint8_t *write, uint8_t write_len, uint8_t *read, uint8_t read_len, sim_i2c_done_fn done);
+
+#endif
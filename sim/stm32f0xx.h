@@ -0,0 +1 @@
+/* empty, the sim HAL header has the register types */
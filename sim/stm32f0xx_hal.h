@@ -0,0 +1,286 @@
+#ifndef SIM_STM32F0XX_HAL_H
+#define SIM_STM32F0XX_HAL_H
+
+/* stand-in for the STM32F0 HAL when the firmware sources are built for the host (make sim)
+ * only what Src/ uses is here, the peripherals behind it are modelled in sim/hal.c
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define __IO volatile
+
+typedef enum {
+  HAL_OK = 0,
+  HAL_ERROR = 1,
+  HAL_BUSY = 2,
+  HAL_TIMEOUT = 3
+} HAL_StatusTypeDef;
+
+typedef enum {RESET = 0, SET = !RESET} FlagStatus, ITStatus;
+
+// cortex-m0 core
+void __disable_irq();
+void __enable_irq();
+uint32_t __get_PRIMASK();
+void __set_PRIMASK(uint32_t primask);
+void __WFI();
+void NVIC_SystemReset();
+
+// the irqs the firmware uses, same numbers as stm32f030x6.h
+typedef enum {
+  SysTick_IRQn = -1,
+  DMA1_Channel2_3_IRQn = 10,
+  ADC1_IRQn = 12,
+  TIM1_BRK_UP_TRG_COM_IRQn = 13,
+  TIM3_IRQn = 16,
+  TIM14_IRQn = 19,
+  I2C1_IRQn = 23,
+  USART1_IRQn = 27
+} IRQn_Type;
+
+// nvic enables, sim/hal.c takes the ISER and ICER writes before it next looks for an irq to run
+typedef struct {
+  __IO uint32_t ISER[1];
+  __IO uint32_t ICER[1];
+} NVIC_Type;
+
+extern NVIC_Type sim_nvic;
+#define NVIC (&sim_nvic)
+
+uint32_t HAL_GetTick(void);
+void HAL_IncTick(void);
+void HAL_SYSTICK_IRQHandler(void);
+extern __IO uint32_t uwTick;
+
+// gpio, only the output data register is modelled
+typedef struct {
+  __IO uint32_t ODR;
+} GPIO_TypeDef;
+
+extern GPIO_TypeDef sim_gpioa;
+#define GPIOA (&sim_gpioa)
+#define GPIO_PIN_5 ((uint16_t)0x0020)
+
+// timers, register reads that take bus cycles go through sim_tim_counter
+typedef struct {
+  __IO uint32_t SR;
+  __IO uint32_t DIER;
+  __IO uint32_t CCR1;
+  __IO uint32_t CCR2;
+  __IO uint32_t CCR3;
+  __IO uint32_t CCR4;
+} TIM_TypeDef;
+
+typedef enum {
+  HAL_TIM_ACTIVE_CHANNEL_1 = 0x01,
+  HAL_TIM_ACTIVE_CHANNEL_2 = 0x02,
+  HAL_TIM_ACTIVE_CHANNEL_3 = 0x04,
+  HAL_TIM_ACTIVE_CHANNEL_4 = 0x08,
+  HAL_TIM_ACTIVE_CHANNEL_CLEARED = 0x00
+} HAL_TIM_ActiveChannel;
+
+typedef struct {
+  TIM_TypeDef *Instance;
+  HAL_TIM_ActiveChannel Channel;
+} TIM_HandleTypeDef;
+
+#define TIM_CHANNEL_1 0x00
+#define TIM_CHANNEL_2 0x04
+#define TIM_CHANNEL_3 0x08
+#define TIM_CHANNEL_4 0x0C
+
+// same bits as TIMx_SR and TIMx_DIER
+#define TIM_FLAG_UPDATE (1 << 0)
+#define TIM_FLAG_CC1 (1 << 1)
+#define TIM_FLAG_CC2 (1 << 2)
+#define TIM_FLAG_CC3 (1 << 3)
+#define TIM_FLAG_CC4 (1 << 4)
+#define TIM_FLAG_CC1OF (1 << 9)
+#define TIM_FLAG_CC2OF (1 << 10)
+#define TIM_FLAG_CC3OF (1 << 11)
+#define TIM_FLAG_CC4OF (1 << 12)
+#define TIM_IT_UPDATE TIM_FLAG_UPDATE
+#define TIM_IT_CC1 TIM_FLAG_CC1
+#define TIM_IT_CC2 TIM_FLAG_CC2
+#define TIM_IT_CC3 TIM_FLAG_CC3
+#define TIM_IT_CC4 TIM_FLAG_CC4
+
+uint16_t sim_tim_counter(TIM_TypeDef *tim);
+void sim_tim_clear(TIM_TypeDef *tim, uint32_t flags);
+
+#define __HAL_TIM_GET_COUNTER(__HANDLE__) sim_tim_counter((__HANDLE__)->Instance)
+#define __HAL_TIM_GET_FLAG(__HANDLE__, __FLAG__) (((__HANDLE__)->Instance->SR & (__FLAG__)) == (__FLAG__))
+#define __HAL_TIM_GET_IT_SOURCE(__HANDLE__, __IT__) ((((__HANDLE__)->Instance->DIER & (__IT__)) == (__IT__)) ? SET : RESET)
+#define __HAL_TIM_CLEAR_FLAG(__HANDLE__, __FLAG__) sim_tim_clear((__HANDLE__)->Instance, (__FLAG__))
+#define __HAL_TIM_CLEAR_IT(__HANDLE__, __IT__) sim_tim_clear((__HANDLE__)->Instance, (__IT__))
+
+HAL_StatusTypeDef HAL_TIM_Base_Start(TIM_HandleTypeDef *htim);
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef *htim);
+HAL_StatusTypeDef HAL_TIM_IC_Start_IT(TIM_HandleTypeDef *htim, uint32_t Channel);
+HAL_StatusTypeDef HAL_TIM_IC_Stop_IT(TIM_HandleTypeDef *htim, uint32_t Channel);
+void HAL_TIM_IRQHandler(TIM_HandleTypeDef *htim);
+void HAL_TIM_IC_CaptureCallback(TIM_HandleTypeDef *htim);
+
+// i2c slave, sim.c's master drives the registers through sim/hal.c, which takes the firmware's flag writes at the irq's return
+typedef struct {
+  __IO uint32_t CR1;
+  __IO uint32_t OAR1;
+  __IO uint32_t ISR;
+  __IO uint32_t ICR;
+  __IO uint32_t RXDR;
+  __IO uint32_t TXDR;
+} I2C_TypeDef;
+
+extern I2C_TypeDef sim_i2c1;
+#define I2C1 (&sim_i2c1)
+
+typedef struct {
+  uint32_t OwnAddress1;
+} I2C_InitTypeDef;
+
+typedef struct {
+  I2C_TypeDef *Instance;
+  I2C_InitTypeDef Init;
+} I2C_HandleTypeDef;
+
+// only for the generated code in stm32f0xx_it.c, which never runs: i2c_slave_irq takes the flags itself
+void HAL_I2C_EV_IRQHandler(I2C_HandleTypeDef *hi2c);
+void HAL_I2C_ER_IRQHandler(I2C_HandleTypeDef *hi2c);
+
+#define I2C_DIRECTION_TRANSMIT 0x00
+#define I2C_DIRECTION_RECEIVE 0x01
+#define I2C_OAR1_OA1EN (1 << 15)
+#define I2C_CR1_PE (1 << 0)
+#define I2C_CR1_TXIE (1 << 1)
+#define I2C_CR1_RXIE (1 << 2)
+#define I2C_CR1_ADDRIE (1 << 3)
+#define I2C_CR1_NACKIE (1 << 4)
+#define I2C_CR1_STOPIE (1 << 5)
+#define I2C_CR1_ERRIE (1 << 7)
+#define I2C_CR1_GCEN (1 << 19)
+#define I2C_ISR_TXE (1 << 0)
+#define I2C_ISR_TXIS (1 << 1)
+#define I2C_ISR_RXNE (1 << 2)
+#define I2C_ISR_ADDR (1 << 3)
+#define I2C_ISR_NACKF (1 << 4)
+#define I2C_ISR_STOPF (1 << 5)
+#define I2C_ISR_BERR (1 << 8)
+#define I2C_ISR_ARLO (1 << 9)
+#define I2C_ISR_OVR (1 << 10)
+#define I2C_ISR_DIR (1 << 16)
+#define I2C_ISR_ADDCODE (0x7f << 17)
+#define I2C_IT_TXI I2C_CR1_TXIE
+#define I2C_IT_RXI I2C_CR1_RXIE
+#define I2C_IT_ADDRI I2C_CR1_ADDRIE
+#define I2C_IT_NACKI I2C_CR1_NACKIE
+#define I2C_IT_STOPI I2C_CR1_STOPIE
+#define I2C_IT_ERRI I2C_CR1_ERRIE
+#define I2C_FLAG_TXE I2C_ISR_TXE
+#define I2C_FLAG_TXIS I2C_ISR_TXIS
+#define I2C_FLAG_RXNE I2C_ISR_RXNE
+#define I2C_FLAG_ADDR I2C_ISR_ADDR
+#define I2C_FLAG_AF I2C_ISR_NACKF
+#define I2C_FLAG_STOPF I2C_ISR_STOPF
+#define I2C_FLAG_BERR I2C_ISR_BERR
+#define I2C_FLAG_ARLO I2C_ISR_ARLO
+#define I2C_FLAG_OVR I2C_ISR_OVR
+
+// as the HAL has them: TXE is flushed through ISR, the rest are cleared through ICR
+#define __HAL_I2C_ENABLE_IT(__HANDLE__, __INTERRUPT__) ((__HANDLE__)->Instance->CR1 |= (__INTERRUPT__))
+#define __HAL_I2C_CLEAR_FLAG(__HANDLE__, __FLAG__) (((__FLAG__) == I2C_FLAG_TXE) ? ((__HANDLE__)->Instance->ISR |= (__FLAG__)) \
+                                                                               : ((__HANDLE__)->Instance->ICR = (__FLAG__)))
+#define I2C_GET_ADDR_MATCH(__HANDLE__) (((__HANDLE__)->Instance->ISR & I2C_ISR_ADDCODE) >> 16U)
+#define I2C_GET_DIR(__HANDLE__) (((__HANDLE__)->Instance->ISR & I2C_ISR_DIR) >> 16U)
+
+// dma, only the remaining transfer count is read
+typedef struct {
+  __IO uint32_t CNDTR;
+} DMA_Channel_TypeDef;
+
+typedef struct {
+  DMA_Channel_TypeDef *Instance;
+  void *Parent;
+} DMA_HandleTypeDef;
+
+#define __HAL_DMA_GET_COUNTER(__HANDLE__) ((__HANDLE__)->Instance->CNDTR)
+
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma);
+
+// uart
+typedef struct {
+  __IO uint32_t ISR;
+  __IO uint32_t ICR;
+  __IO uint32_t CR1;
+} USART_TypeDef;
+
+#define UART_CLEAR_OREF (1U << 3)
+#define __HAL_UART_GET_FLAG(__HANDLE__, __FLAG__) (((__HANDLE__)->Instance->ISR & (__FLAG__)) == (__FLAG__))
+#define __HAL_UART_CLEAR_FLAG(__HANDLE__, __FLAG__) ((__HANDLE__)->Instance->ICR = (__FLAG__))
+
+typedef enum {
+  HAL_UART_STATE_READY = 0x20,
+  HAL_UART_STATE_BUSY_TX = 0x21
+} HAL_UART_StateTypeDef;
+
+typedef struct {
+  USART_TypeDef *Instance;
+  DMA_HandleTypeDef *hdmatx;
+  __IO HAL_UART_StateTypeDef gState;
+} UART_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+void HAL_UART_IRQHandler(UART_HandleTypeDef *huart);
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart);
+
+// adc, the conversion values are set with sim_set_adc
+typedef struct {
+  void *Instance;
+} ADC_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_ADCEx_Calibration_Start(ADC_HandleTypeDef *hadc);
+HAL_StatusTypeDef HAL_ADC_Start_IT(ADC_HandleTypeDef *hadc);
+HAL_StatusTypeDef HAL_ADC_Stop(ADC_HandleTypeDef *hadc);
+uint32_t HAL_ADC_GetValue(ADC_HandleTypeDef *hadc);
+void HAL_ADC_IRQHandler(ADC_HandleTypeDef *hadc);
+void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef *hadc);
+
+// flash, mapped at the real addresses by sim/hal.c so the firmware's address arithmetic holds
+#define FLASH_BASE 0x08000000UL
+
+/* the flash interface, every FLASH-> access goes through sim_flash, which acts on the register writes and
+ * half-word stores into rwflash the firmware made since its last access
+ */
+typedef struct {
+  __IO uint32_t ACR;
+  __IO uint32_t KEYR;
+  __IO uint32_t OPTKEYR;
+  __IO uint32_t SR;
+  __IO uint32_t CR;
+  __IO uint32_t AR;
+} FLASH_TypeDef;
+
+FLASH_TypeDef *sim_flash();
+#define FLASH (sim_flash())
+
+#define FLASH_KEY1 0x45670123U
+#define FLASH_KEY2 0xCDEF89ABU
+#define FLASH_SR_BSY (1 << 0)
+#define FLASH_SR_PGERR (1 << 2)
+#define FLASH_SR_WRPRTERR (1 << 4)
+#define FLASH_SR_EOP (1 << 5)
+#define FLASH_CR_PG (1 << 0)
+#define FLASH_CR_PER (1 << 1)
+#define FLASH_CR_STRT (1 << 6)
+#define FLASH_CR_LOCK (1 << 7)
+
+#define __HAL_SYSCFG_REMAPMEMORY_SRAM()
+
+// newlib extensions the firmware uses
+char *utoa(unsigned value, char *str, int base);
+char *itoa(int value, char *str, int base);
+
+#endif